@@ -11,11 +11,16 @@
 #include "Reporting.h"
 #include "Protocol.h"
 
+#include <atomic>
+#include <memory>
 #include <string>
 
 namespace facebook {
 namespace wdt {
 
+class ClientSocket;
+class DeltaSignatures;
+
 /// struct representing file level data shared between blocks
 struct SourceMetaData {
   /// full filepath
@@ -33,10 +38,21 @@ struct SourceMetaData {
   int64_t seqId;
   /// size of the entire source
   int64_t size;
+  /// bytes of the file queued to be sent: not the chunks received by a
+  /// previous transfer, nor the holes of sparse files. -1 if not known
+  int64_t sendSize{-1};
   /// file allocation status in the receiver side
   FileAllocationStatus allocationStatus;
   /// if there is a size mismatch, this is the previous sequence id
   int64_t prevSeqId;
+  /// Compressibility of the file, sampled by the first compressed chunk and
+  /// shared by all the blocks of the file
+  mutable std::atomic<int> compressibility{0};
+  /// signatures of the receiver's copy of the file if the file is sent as a
+  /// delta, null otherwise
+  std::shared_ptr<const DeltaSignatures> deltaSignatures;
+  /// whether only the data extents of the file are queued
+  bool sparse{false};
 };
 
 class ByteSource {
@@ -78,6 +94,36 @@ class ByteSource {
    */
   virtual char *read(int64_t &size) = 0;
 
+  /// @return true iff the source can send its data with sendTo()
+  virtual bool supportsDirectSend() const {
+    return false;
+  }
+
+  /**
+   * Sends the next chunk of data from the source to the socket using
+   * ClientSocket::sendFile, i.e without going through read(). Like read(),
+   * this advances the source.
+   *
+   * @param socket    socket to send the data on
+   * @param maxBytes  maximum number of bytes to send
+   * @param checksum  if not null, crc32c of sent data is accumulated here
+   *
+   * @return          number of bytes sent, -1 on failure. Use hasError() to
+   *                  find out whether a short send was caused by the source
+   */
+  virtual int64_t sendTo(ClientSocket & /* unused */, int64_t /* unused */,
+                         int32_t * /* unused */) {
+    return -1;
+  }
+
+  /**
+   * @return    a new, not opened, source of the same block, used to send a
+   *            second copy of it. Null if the source can't be copied
+   */
+  virtual std::unique_ptr<ByteSource> clone() const {
+    return nullptr;
+  }
+
   /// open the source for reading
   virtual ErrorCode open() = 0;
 
@@ -7,12 +7,15 @@
  * of patent rights can be found in the PATENTS file in the same directory.
  */
 #include "ClientSocket.h"
+#include <wdt/WdtConfig.h>
 #include "SocketUtils.h"
 #include "WdtOptions.h"
+#include <folly/Checksum.h>
 #include <glog/logging.h>
 #include <sys/socket.h>
 #include <poll.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 namespace facebook {
 namespace wdt {
@@ -152,6 +155,15 @@ ErrorCode ClientSocket::connect() {
   }
   SocketUtils::setReadTimeout(fd_);
   SocketUtils::setWriteTimeout(fd_);
+  const auto &options = WdtOptions::get();
+  if (options.enable_io_uring) {
+    ioUring_.reset(new IoUring(std::max(1, options.io_uring_batch_buffers),
+                               options.buffer_size, abortChecker_));
+    if (!ioUring_->isValid() || !ioUring_->setSocket(fd_)) {
+      LOG(WARNING) << "io_uring can not be used for " << port_;
+      ioUring_.reset();
+    }
+  }
   return OK;
 }
 
@@ -174,7 +186,52 @@ int ClientSocket::write(const char *buf, int nbyte, bool tryFull) {
                                           tryFull);
 }
 
+bool ClientSocket::canSendFile() const {
+  if (ioUring_ && ioUring_->isValid()) {
+    return true;
+  }
+#ifdef HAS_SENDFILE
+  return WdtOptions::get().enable_zero_copy_send;
+#else
+  return false;
+#endif
+}
+
+int64_t ClientSocket::sendFile(int fileFd, int64_t offset, int64_t nbyte,
+                               int32_t *checksum) {
+  if (ioUring_ && ioUring_->isValid()) {
+    return ioUring_->readAndSend(fileFd, offset, nbyte, checksum);
+  }
+  if (checksum == nullptr) {
+    return SocketUtils::sendFileWithAbortCheck(fd_, fileFd, offset, nbyte,
+                                               abortChecker_);
+  }
+  // not checksummed from a mapping of the file, which would crash the
+  // process if the file got truncated
+  if ((int64_t)checksumBuffer_.size() < nbyte) {
+    checksumBuffer_.resize(nbyte);
+  }
+  int64_t numRead = ::pread(fileFd, checksumBuffer_.data(), nbyte, offset);
+  if (numRead < 0) {
+    PLOG(ERROR) << "pread failed for fd " << fileFd;
+    return -1;
+  }
+  if (numRead == 0) {
+    // file got shorter, the caller checks its size
+    return 0;
+  }
+  int64_t sent = SocketUtils::sendFileWithAbortCheck(fd_, fileFd, offset,
+                                                     numRead, abortChecker_);
+  if (sent > 0) {
+    *checksum =
+        folly::crc32c((const uint8_t *)checksumBuffer_.data(), sent, *checksum);
+  }
+  return sent;
+}
+
 void ClientSocket::close() {
+  // the ring holds a reference to the socket
+  ioUring_.reset();
   if (fd_ >= 0) {
     VLOG(1) << "Closing socket : " << fd_;
     if (::close(fd_) < 0) {
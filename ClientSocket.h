@@ -13,8 +13,12 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include "ErrorCodes.h"
+#include "IoUring.h"
 #include "WdtBase.h"
 
+#include <memory>
+#include <vector>
+
 namespace facebook {
 namespace wdt {
 class ClientSocket {
@@ -26,6 +30,20 @@ class ClientSocket {
   virtual int read(char *buf, int nbyte, bool tryFull = true);
   /// tries to write nbyte data and periodically checks for abort
   virtual int write(const char *buf, int nbyte, bool tryFull = true);
+  /// @return   whether sendFile() can be used
+  bool canSendFile() const;
+  /**
+   * Sends nbyte bytes of fileFd starting at offset, either with sendfile(2)
+   * or with the io_uring engine. Periodically checks for abort.
+   *
+   * @param checksum      if not null, crc32c of sent data is accumulated here.
+   *                      With sendfile(2) the data is read again for it, a
+   *                      change in between fails the receiver's checksum
+   *
+   * @return              number of bytes sent, -1 on error
+   */
+  virtual int64_t sendFile(int fileFd, int64_t offset, int64_t nbyte,
+                           int32_t *checksum = nullptr);
   virtual void close();
   int getFd() const;
   std::string getPort() const;
@@ -38,6 +56,10 @@ class ClientSocket {
   int fd_;
   struct addrinfo sa_;
   WdtBase::IAbortChecker const *abortChecker_;
+  /// io_uring engine for the connection, null if not enabled
+  std::unique_ptr<IoUring> ioUring_;
+  /// data read to be checksummed when sent with sendfile(2)
+  std::vector<char> checksumBuffer_;
 };
 }
 }  // namespace facebook::wdt
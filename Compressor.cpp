@@ -0,0 +1,159 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include "Compressor.h"
+#include "ErrorCodes.h"
+
+#include <glog/logging.h>
+#include <limits>
+#ifdef HAS_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAS_LZ4
+#include <lz4.h>
+#endif
+
+namespace facebook {
+namespace wdt {
+
+const double Compressor::kMaxCompressedRatio = 0.9;
+
+bool Compressor::parseCodec(const std::string &name, CompressionCodec &codec) {
+  if (name.empty() || name == "none") {
+    codec = NO_COMPRESSION;
+  } else if (name == "lz4") {
+    codec = LZ4_COMPRESSION;
+  } else if (name == "zlib") {
+    codec = ZLIB_COMPRESSION;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+const char *Compressor::getCodecName(CompressionCodec codec) {
+  switch (codec) {
+    case NO_COMPRESSION:
+      return "none";
+    case LZ4_COMPRESSION:
+      return "lz4";
+    case ZLIB_COMPRESSION:
+      return "zlib";
+  }
+  return "unknown";
+}
+
+bool Compressor::isSupported(CompressionCodec codec) {
+  switch (codec) {
+    case NO_COMPRESSION:
+      return true;
+    case LZ4_COMPRESSION:
+#ifdef HAS_LZ4
+      return true;
+#else
+      return false;
+#endif
+    case ZLIB_COMPRESSION:
+#ifdef HAS_ZLIB
+      return true;
+#else
+      return false;
+#endif
+  }
+  return false;
+}
+
+Compressor::Compressor(CompressionCodec codec) : codec_(codec) {
+  WDT_CHECK(codec_ != NO_COMPRESSION && isSupported(codec_))
+      << "Unsupported codec " << codec_;
+}
+
+char *Compressor::getBuffer(int64_t size) {
+  if (size > bufferSize_) {
+    buffer_.reset(new char[size]);
+    bufferSize_ = size;
+  }
+  return buffer_.get();
+}
+
+const char *Compressor::compress(const char *src, int64_t size,
+                                 int64_t &compressedSize) {
+  // chunks are at most one buffer, the libraries use int/uLong sizes
+  WDT_CHECK(size <= std::numeric_limits<int32_t>::max()) << size;
+  switch (codec_) {
+#ifdef HAS_LZ4
+    case LZ4_COMPRESSION: {
+      const int bound = LZ4_compressBound(size);
+      char *dest = getBuffer(bound);
+      int res = LZ4_compress_default(src, dest, size, bound);
+      if (res <= 0) {
+        LOG(ERROR) << "lz4 compression of " << size << " bytes failed " << res;
+        return nullptr;
+      }
+      compressedSize = res;
+      return dest;
+    }
+#endif
+#ifdef HAS_ZLIB
+    case ZLIB_COMPRESSION: {
+      uLongf destLen = compressBound(size);
+      char *dest = getBuffer(destLen);
+      int res = compress2((Bytef *)dest, &destLen, (const Bytef *)src, size,
+                          Z_BEST_SPEED);
+      if (res != Z_OK) {
+        LOG(ERROR) << "zlib compression of " << size << " bytes failed "
+                   << res;
+        return nullptr;
+      }
+      compressedSize = destLen;
+      return dest;
+    }
+#endif
+    default:
+      break;
+  }
+  LOG(ERROR) << "Unsupported codec " << codec_;
+  return nullptr;
+}
+
+char *Compressor::decompress(const char *src, int64_t size,
+                             int64_t rawSize) {
+  WDT_CHECK(rawSize <= std::numeric_limits<int32_t>::max()) << rawSize;
+  char *dest = getBuffer(rawSize);
+  switch (codec_) {
+#ifdef HAS_LZ4
+    case LZ4_COMPRESSION: {
+      int res = LZ4_decompress_safe(src, dest, size, rawSize);
+      if (res != rawSize) {
+        LOG(ERROR) << "lz4 decompression failed " << res << " " << rawSize;
+        return nullptr;
+      }
+      return dest;
+    }
+#endif
+#ifdef HAS_ZLIB
+    case ZLIB_COMPRESSION: {
+      uLongf destLen = rawSize;
+      int res =
+          uncompress((Bytef *)dest, &destLen, (const Bytef *)src, size);
+      if (res != Z_OK || (int64_t)destLen != rawSize) {
+        LOG(ERROR) << "zlib decompression failed " << res << " " << destLen
+                   << " " << rawSize;
+        return nullptr;
+      }
+      return dest;
+    }
+#endif
+    default:
+      break;
+  }
+  LOG(ERROR) << "Unsupported codec " << codec_;
+  return nullptr;
+}
+}
+}
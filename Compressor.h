@@ -0,0 +1,96 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include "Protocol.h"
+
+#include <memory>
+#include <string>
+
+namespace facebook {
+namespace wdt {
+
+/// compressibility of a file, as sampled by adaptive compression
+enum Compressibility {
+  COMPRESSIBILITY_UNKNOWN,
+  COMPRESSIBLE,
+  INCOMPRESSIBLE,
+};
+
+/**
+ * Compresses and decompresses chunks of blocks with one of the codecs wdt is
+ * built with (zlib, lz4). Not thread safe, each thread uses its own instance.
+ */
+class Compressor {
+ public:
+  /**
+   * Parses a codec name as given to -compression
+   *
+   * @param name    lz4 or zlib. Empty string or "none" means no compression
+   * @param codec   set to the parsed codec
+   *
+   * @return        false if the name is not known
+   */
+  static bool parseCodec(const std::string &name, CompressionCodec &codec);
+
+  /// @return   printable name of the codec
+  static const char *getCodecName(CompressionCodec codec);
+
+  /// @return   whether the codec is available in this build
+  static bool isSupported(CompressionCodec codec);
+
+  /**
+   * Chunks which compress to more than this ratio of their size are
+   * considered incompressible by adaptive compression
+   */
+  static const double kMaxCompressedRatio;
+
+  /// @param codec    codec to use, must be supported
+  explicit Compressor(CompressionCodec codec);
+
+  /// @return   codec used by this compressor
+  CompressionCodec getCodec() const {
+    return codec_;
+  }
+
+  /**
+   * Compresses a chunk
+   *
+   * @param src             data to compress
+   * @param size            size of the data
+   * @param compressedSize  set to the size of the compressed data
+   *
+   * @return                compressed data, valid till the next call,
+   *                        nullptr on failure
+   */
+  const char *compress(const char *src, int64_t size, int64_t &compressedSize);
+
+  /**
+   * Decompresses a chunk
+   *
+   * @param src       compressed data
+   * @param size      size of the compressed data
+   * @param rawSize   expected size of the decompressed data
+   *
+   * @return          decompressed data of rawSize bytes, valid till the next
+   *                  call, nullptr if the data is corrupt
+   */
+  char *decompress(const char *src, int64_t size, int64_t rawSize);
+
+ private:
+  /// grows the output buffer to at least size bytes
+  char *getBuffer(int64_t size);
+
+  const CompressionCodec codec_;
+  /// output of the last call
+  std::unique_ptr<char[]> buffer_;
+  int64_t bufferSize_{0};
+};
+}
+}
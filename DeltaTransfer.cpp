@@ -0,0 +1,281 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include "DeltaTransfer.h"
+#include "ErrorCodes.h"
+
+#include <folly/Checksum.h>
+#include <glog/logging.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <memory>
+
+namespace facebook {
+namespace wdt {
+
+DeltaSignatures::DeltaSignatures(int64_t fileSize, int64_t blockSize)
+    : fileSize_(fileSize), blockSize_(blockSize) {
+  WDT_CHECK(blockSize_ > 0);
+  const int64_t numBlocks = fileSize_ / blockSize_;
+  signatures_.resize(numBlocks);
+  received_.resize(numBlocks, false);
+  filter_.resize((1 << 16) / 64, 0);
+}
+
+bool DeltaSignatures::addEntry(const FileSignatures &entry) {
+  const int64_t numBlocks = signatures_.size();
+  const int64_t numSignatures = entry.signatures.size();
+  if (entry.fileSize != fileSize_ || entry.blockSize != blockSize_ ||
+      entry.firstBlock + numSignatures > numBlocks) {
+    LOG(ERROR) << "Inconsistent signatures for " << entry.fileName << " "
+               << entry.fileSize << " " << entry.blockSize << " "
+               << entry.firstBlock << " " << numSignatures << ", expected "
+               << fileSize_ << " " << blockSize_ << " " << numBlocks;
+    return false;
+  }
+  for (int64_t i = 0; i < numSignatures; i++) {
+    const int64_t blockIndex = entry.firstBlock + i;
+    if (received_[blockIndex]) {
+      continue;
+    }
+    const BlockSignature &signature = entry.signatures[i];
+    signatures_[blockIndex] = signature;
+    received_[blockIndex] = true;
+    numReceived_++;
+    weakIndex_.emplace(signature.weak, blockIndex);
+    const uint32_t slot = filterSlot(signature.weak);
+    filter_[slot / 64] |= (1ULL << (slot % 64));
+  }
+  return true;
+}
+
+int64_t DeltaSignatures::findBlock(uint32_t weak, const char *data) const {
+  const uint32_t slot = filterSlot(weak);
+  if (!(filter_[slot / 64] & (1ULL << (slot % 64)))) {
+    return -1;
+  }
+  auto range = weakIndex_.equal_range(weak);
+  if (range.first == range.second) {
+    return -1;
+  }
+  const uint32_t strong = folly::crc32c((const uint8_t *)data, blockSize_, 0);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (signatures_[it->second].strong == strong) {
+      return it->second;
+    }
+  }
+  return -1;
+}
+
+/// computes the signatures of one file, @return false on read error
+static bool computeForFile(const std::string &fullPath,
+                           const std::string &relPath, int64_t fileSize,
+                           int64_t blockSize, int64_t maxEntryLen,
+                           std::vector<FileSignatures> &entries) {
+  const int64_t maxSignatures =
+      (maxEntryLen - 2 - (int64_t)relPath.size() - 4 * 10) /
+      Protocol::kBlockSignatureLen;
+  if (maxSignatures <= 0) {
+    LOG(WARNING) << "Name too long to send signatures of " << relPath;
+    return true;
+  }
+  int fd = open(fullPath.c_str(), O_RDONLY);
+  if (fd < 0) {
+    PLOG(ERROR) << "Unable to open " << fullPath;
+    return false;
+  }
+  std::unique_ptr<char[]> buf(new char[blockSize]);
+  const int64_t numBlocks = fileSize / blockSize;
+  RollingChecksum rolling;
+  bool success = true;
+  for (int64_t blockIndex = 0; blockIndex < numBlocks; blockIndex++) {
+    if (blockIndex % maxSignatures == 0) {
+      FileSignatures entry;
+      entry.fileName = relPath;
+      entry.fileSize = fileSize;
+      entry.blockSize = blockSize;
+      entry.firstBlock = blockIndex;
+      entries.emplace_back(std::move(entry));
+    }
+    int64_t numRead = 0;
+    while (numRead < blockSize) {
+      ssize_t n = pread(fd, buf.get() + numRead, blockSize - numRead,
+                        blockIndex * blockSize + numRead);
+      if (n <= 0) {
+        PLOG(ERROR) << "Unable to read " << fullPath << " " << n;
+        success = false;
+        break;
+      }
+      numRead += n;
+    }
+    if (!success) {
+      break;
+    }
+    BlockSignature signature;
+    rolling.reset(buf.get(), blockSize);
+    signature.weak = rolling.get();
+    signature.strong = folly::crc32c((const uint8_t *)buf.get(), blockSize, 0);
+    entries.back().signatures.push_back(signature);
+  }
+  close(fd);
+  if (!success) {
+    // drop the partial signatures of this file
+    while (!entries.empty() && entries.back().fileName == relPath) {
+      entries.pop_back();
+    }
+  }
+  return success;
+}
+
+/// @return   whether relPath, received from the sender, stays under the root
+///           dir and is not one of wdt's own files
+static bool isSignableRelPath(const std::string &relPath) {
+  if (relPath.empty() || relPath[0] == '/') {
+    return false;
+  }
+  size_t start = 0;
+  while (start <= relPath.size()) {
+    size_t end = relPath.find('/', start);
+    if (end == std::string::npos) {
+      end = relPath.size();
+    }
+    const std::string component = relPath.substr(start, end - start);
+    // skips .., wdt's own files (transfer log) and the basis files
+    if (component == ".." || component.compare(0, 4, ".wdt") == 0) {
+      return false;
+    }
+    start = end + 1;
+  }
+  const size_t suffixLen = strlen(kDeltaBasisSuffix);
+  return !(relPath.size() > suffixLen &&
+           relPath.compare(relPath.size() - suffixLen, suffixLen,
+                           kDeltaBasisSuffix) == 0);
+}
+
+void DeltaSignatures::computeForFiles(const std::string &rootDir,
+                                      const std::vector<std::string> &relPaths,
+                                      int64_t blockSize, int64_t maxEntryLen,
+                                      std::vector<FileSignatures> &entries) {
+  WDT_CHECK(blockSize > 0);
+  std::string rootDirPath = rootDir;
+  if (rootDirPath.empty() || rootDirPath.back() != '/') {
+    rootDirPath.push_back('/');
+  }
+  for (const auto &relPath : relPaths) {
+    if (!isSignableRelPath(relPath)) {
+      LOG(WARNING) << "Not signing " << relPath;
+      continue;
+    }
+    const std::string fullPath = rootDirPath + relPath;
+    struct stat fileStat;
+    if (lstat(fullPath.c_str(), &fileStat) != 0) {
+      // most files do not exist yet
+      if (errno != ENOENT && errno != ENOTDIR) {
+        PLOG(ERROR) << "stat failed on path " << fullPath;
+      }
+      continue;
+    }
+    if (S_ISREG(fileStat.st_mode) && fileStat.st_size >= blockSize) {
+      computeForFile(fullPath, relPath, fileStat.st_size, blockSize,
+                     maxEntryLen, entries);
+    }
+  }
+}
+
+DeltaEncoder::DeltaEncoder(int64_t maxLiteral) : maxLiteral_(maxLiteral) {
+  WDT_CHECK(maxLiteral_ > 0);
+}
+
+void DeltaEncoder::reset(const DeltaSignatures *signatures) {
+  signatures_ = signatures;
+  blockSize_ = signatures_->getBlockSize();
+  inSize_ = pos_ = literalStart_ = 0;
+  rollingValid_ = false;
+  copiedBytes_ = 0;
+}
+
+void DeltaEncoder::emitLiteral(int64_t end) {
+  while (literalStart_ < end) {
+    const int64_t length = std::min(end - literalStart_, maxLiteral_);
+    if (outSize_ + Protocol::kDeltaOpHeaderLength + length >
+        (int64_t)out_.size()) {
+      out_.resize(2 * (outSize_ + Protocol::kDeltaOpHeaderLength + length));
+    }
+    Protocol::encodeDeltaOp(out_.data(), outSize_, Protocol::kDeltaLiteralOp,
+                            0, length);
+    memcpy(out_.data() + outSize_, in_.data() + literalStart_, length);
+    outSize_ += length;
+    literalStart_ += length;
+  }
+}
+
+void DeltaEncoder::emitCopy(int64_t blockIndex) {
+  if (outSize_ + Protocol::kDeltaOpHeaderLength > (int64_t)out_.size()) {
+    out_.resize(2 * (outSize_ + Protocol::kDeltaOpHeaderLength));
+  }
+  Protocol::encodeDeltaOp(out_.data(), outSize_, Protocol::kDeltaCopyOp,
+                          blockIndex * blockSize_, blockSize_);
+  copiedBytes_ += blockSize_;
+}
+
+const char *DeltaEncoder::encode(const char *data, int64_t size, bool last,
+                                 int64_t &outSize) {
+  WDT_CHECK(signatures_);
+  // drop the bytes already encoded
+  if (literalStart_ > 0) {
+    memmove(in_.data(), in_.data() + literalStart_, inSize_ - literalStart_);
+    inSize_ -= literalStart_;
+    pos_ -= literalStart_;
+    literalStart_ = 0;
+  }
+  if (inSize_ + size > (int64_t)in_.size()) {
+    in_.resize(inSize_ + size);
+  }
+  memcpy(in_.data() + inSize_, data, size);
+  inSize_ += size;
+  outSize_ = 0;
+  const char *in = in_.data();
+  while (pos_ + blockSize_ <= inSize_) {
+    if (!rollingValid_) {
+      rolling_.reset(in + pos_, blockSize_);
+      rollingValid_ = true;
+    }
+    const int64_t blockIndex =
+        signatures_->findBlock(rolling_.get(), in + pos_);
+    if (blockIndex >= 0) {
+      emitLiteral(pos_);
+      emitCopy(blockIndex);
+      pos_ += blockSize_;
+      literalStart_ = pos_;
+      rollingValid_ = false;
+      continue;
+    }
+    if (pos_ + blockSize_ < inSize_) {
+      rolling_.roll(in[pos_], in[pos_ + blockSize_]);
+    } else {
+      // next byte is not there yet
+      rollingValid_ = false;
+    }
+    pos_++;
+    if (pos_ - literalStart_ >= maxLiteral_) {
+      emitLiteral(pos_);
+    }
+  }
+  if (last) {
+    emitLiteral(inSize_);
+    inSize_ = pos_ = literalStart_ = 0;
+    rollingValid_ = false;
+  }
+  outSize = outSize_;
+  return out_.data();
+}
+}
+}
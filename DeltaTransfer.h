@@ -0,0 +1,193 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include "Protocol.h"
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/// suffix of the copy of an existing file the receiver keeps while the file
+/// is received as a delta
+const char *const kDeltaBasisSuffix = ".wdtdelta";
+
+/// file in the receiver's root dir listing the basis files, so that the ones
+/// left by a crash are removed by the next receiver
+const char *const kDeltaBasisListName = ".wdt.delta";
+
+/**
+ * rsync style rolling checksum of a window of bytes: the sum of the bytes and
+ * the sum of the prefix sums, each modulo 2^16. The window can be moved
+ * forward by one byte in constant time.
+ */
+class RollingChecksum {
+ public:
+  /// computes the checksum of the len bytes at data
+  void reset(const char *data, int64_t len) {
+    a_ = b_ = 0;
+    len_ = len;
+    for (int64_t i = 0; i < len; i++) {
+      a_ += (uint8_t)data[i];
+      b_ += a_;
+    }
+  }
+
+  /// moves the window by one byte, out leaves the window and in enters it
+  void roll(uint8_t out, uint8_t in) {
+    a_ += in - out;
+    b_ += a_ - len_ * out;
+  }
+
+  /// @return     checksum of the current window
+  uint32_t get() const {
+    return (a_ & 0xffff) | (b_ << 16);
+  }
+
+ private:
+  uint32_t a_{0};
+  uint32_t b_{0};
+  uint32_t len_{0};
+};
+
+/**
+ * Signatures of the blocks of one file existing on the receiver, as used by
+ * the sender to look up blocks it can ask the receiver to copy instead of
+ * sending them. Only full size blocks are indexed. Built once when the
+ * signatures are received, read only afterwards.
+ */
+class DeltaSignatures {
+ public:
+  /**
+   * @param fileSize    size of the file on the receiver
+   * @param blockSize   size of the blocks
+   */
+  DeltaSignatures(int64_t fileSize, int64_t blockSize);
+
+  /**
+   * Adds the signatures of an entry received from the receiver
+   *
+   * @return      false if the entry does not belong to the same file version
+   */
+  bool addEntry(const FileSignatures &entry);
+
+  /// @return     whether the signatures of all the full blocks were received
+  bool isComplete() const {
+    return numReceived_ == (int64_t)signatures_.size();
+  }
+
+  /// @return     size of the blocks
+  int64_t getBlockSize() const {
+    return blockSize_;
+  }
+
+  /**
+   * Looks up a block of the receiver's file with the same content as the
+   * blockSize bytes at data
+   *
+   * @param weak    rolling checksum of the bytes
+   * @param data    the bytes, only read if a block has the same weak checksum
+   *
+   * @return        index of the block, -1 if there is none
+   */
+  int64_t findBlock(uint32_t weak, const char *data) const;
+
+  /**
+   * Computes the signatures of the files the sender announced which exist
+   * under rootDir as regular files at least one block long. The others are
+   * skipped. The signatures of a file are split in entries of at most
+   * maxEntryLen bytes once encoded.
+   */
+  static void computeForFiles(const std::string &rootDir,
+                              const std::vector<std::string> &relPaths,
+                              int64_t blockSize, int64_t maxEntryLen,
+                              std::vector<FileSignatures> &entries);
+
+ private:
+  /// @return     slot of weak in the filter
+  static uint32_t filterSlot(uint32_t weak) {
+    return (weak ^ (weak >> 16)) & 0xffff;
+  }
+
+  const int64_t fileSize_;
+  const int64_t blockSize_;
+  /// signatures by block index
+  std::vector<BlockSignature> signatures_;
+  std::vector<bool> received_;
+  int64_t numReceived_{0};
+  /// block indexes by weak checksum
+  std::unordered_multimap<uint32_t, int64_t> weakIndex_;
+  /// bitmap of the filter slots of the weak checksums, checked before the
+  /// hash table as most windows do not match anything
+  std::vector<uint64_t> filter_;
+};
+
+/**
+ * Encodes the data of a block as delta ops (see Protocol::encodeDeltaOp):
+ * windows matching a block of the receiver's copy of the file become copy ops
+ * and the rest is sent as literals. Matches are searched at every byte
+ * offset. Not thread safe, each sender thread uses its own instance.
+ */
+class DeltaEncoder {
+ public:
+  /// @param maxLiteral   max length of a literal op
+  explicit DeltaEncoder(int64_t maxLiteral);
+
+  /// starts encoding a new block against signatures
+  void reset(const DeltaSignatures *signatures);
+
+  /**
+   * Encodes the next bytes of the block. Bytes which may still be part of a
+   * match are kept till the next call.
+   *
+   * @param data      next bytes of the block
+   * @param size      number of bytes
+   * @param last      whether these are the last bytes of the block
+   * @param outSize   set to the size of the encoded ops
+   *
+   * @return          encoded ops, valid till the next call
+   */
+  const char *encode(const char *data, int64_t size, bool last,
+                     int64_t &outSize);
+
+  /// @return     number of bytes encoded as copy ops since reset
+  int64_t getCopiedBytes() const {
+    return copiedBytes_;
+  }
+
+ private:
+  /// appends a literal op for the bytes from literalStart_ to end
+  void emitLiteral(int64_t end);
+
+  /// appends a copy op for a block of the receiver's file
+  void emitCopy(int64_t blockIndex);
+
+  const int64_t maxLiteral_;
+  const DeltaSignatures *signatures_{nullptr};
+  int64_t blockSize_{0};
+  /// bytes received and not yet encoded, starting at literalStart_
+  std::vector<char> in_;
+  int64_t inSize_{0};
+  /// start of the current window in in_
+  int64_t pos_{0};
+  /// start of the bytes not yet covered by an op
+  int64_t literalStart_{0};
+  /// whether rolling_ is the checksum of the window at pos_
+  bool rollingValid_{false};
+  RollingChecksum rolling_;
+  /// encoded ops
+  std::vector<char> out_;
+  int64_t outSize_{0};
+  int64_t copiedBytes_{0};
+};
+}
+}
@@ -0,0 +1,54 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include "DirectIo.h"
+#include "ErrorCodes.h"
+
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <stdlib.h>
+
+namespace facebook {
+namespace wdt {
+
+bool setDirectIo(int fd, bool enable) {
+#ifdef O_DIRECT
+  int flags = fcntl(fd, F_GETFL);
+  if (flags < 0) {
+    PLOG(ERROR) << "fcntl(F_GETFL) failed for fd " << fd;
+    return false;
+  }
+  int newFlags = enable ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+  if (newFlags == flags) {
+    return true;
+  }
+  if (fcntl(fd, F_SETFL, newFlags) != 0) {
+    PLOG(WARNING) << "unable to " << (enable ? "set" : "clear")
+                  << " O_DIRECT for fd " << fd;
+    return false;
+  }
+  return true;
+#else
+  return !enable;
+#endif
+}
+
+AlignedBuffer::AlignedBuffer(int64_t size) {
+  size_ = ((size + kDirectIoAlignment - 1) / kDirectIoAlignment) *
+          kDirectIoAlignment;
+  void *data = nullptr;
+  int ret = posix_memalign(&data, kDirectIoAlignment, size_);
+  WDT_CHECK(ret == 0) << "unable to allocate aligned buffer of size " << size_;
+  data_ = (char *)data;
+}
+
+AlignedBuffer::~AlignedBuffer() {
+  free(data_);
+}
+}
+}
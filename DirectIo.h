@@ -0,0 +1,65 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <stdint.h>
+
+namespace facebook {
+namespace wdt {
+
+/// alignment of file offsets, sizes and memory buffers for O_DIRECT i/o
+const int64_t kDirectIoAlignment = 4096;
+
+/// @return   whether value is a multiple of kDirectIoAlignment
+inline bool isDirectIoAligned(int64_t value) {
+  return (value % kDirectIoAlignment) == 0;
+}
+
+/**
+ * Turns O_DIRECT on or off for an open file. Used to switch to buffered i/o
+ * for the unaligned tail of a file.
+ *
+ * @param fd        file descriptor
+ * @param enable    whether to turn direct i/o on or off
+ *
+ * @return          whether the mode could be changed, not all file systems
+ *                  (and platforms) support O_DIRECT
+ */
+bool setDirectIo(int fd, bool enable);
+
+/**
+ * Memory buffer usable for direct i/o. Threads keep one of these as
+ * thread-local, so buffers are allocated once per thread.
+ */
+class AlignedBuffer {
+ public:
+  /// @param size   size of the buffer, rounded up to kDirectIoAlignment
+  explicit AlignedBuffer(int64_t size);
+
+  ~AlignedBuffer();
+
+  AlignedBuffer(const AlignedBuffer &) = delete;
+  AlignedBuffer &operator=(const AlignedBuffer &) = delete;
+
+  /// @return   start of the buffer, aligned to kDirectIoAlignment
+  char *data() const {
+    return data_;
+  }
+
+  /// @return   size of the buffer
+  int64_t size() const {
+    return size_;
+  }
+
+ private:
+  char *data_{nullptr};
+  int64_t size_{0};
+};
+}
+}
@@ -11,22 +11,66 @@
 #include "Protocol.h"
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
+#ifdef HAS_INOTIFY
+#include <sys/inotify.h>
+#endif
+#ifdef HAS_FIEMAP
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
 #include <set>
+#include <unordered_set>
 #include <algorithm>
 #include <utility>
 
 #include <folly/Memory.h>
-#include <regex>
 namespace facebook {
 namespace wdt {
+/// @return   whether fewer blocks are allocated than the size needs
+static bool mayHaveHoles(const struct stat &fileStat) {
+  return fileStat.st_blocks * 512 < fileStat.st_size;
+}
+
+/// @return   number of shards of the source queue
+static int getNumSourceShards(const WdtOptions &options) {
+  return options.shard_source_queue ? std::max(1, options.num_ports) : 1;
+}
+
+/// @return   modification time of a file in ns
+static int64_t getMtimeNanos(const struct stat &fileStat) {
+#ifdef __APPLE__
+  const struct timespec &mtime = fileStat.st_mtimespec;
+#else
+  const struct timespec &mtime = fileStat.st_mtim;
+#endif
+  return mtime.tv_sec * 1000000000LL + mtime.tv_nsec;
+}
+
+/// @return   rootDir with a trailing '/'
+static std::string getRootDir(const std::string &rootDir) {
+  CHECK(!rootDir.empty());
+  return (rootDir.back() == '/') ? rootDir : rootDir + '/';
+}
+
 DirectorySourceQueue::DirectorySourceQueue(const std::string &rootDir)
-    : rootDir_(rootDir), options_(WdtOptions::get()) {
-  CHECK(!rootDir_.empty());
-  if (rootDir_.back() != '/') {
-    rootDir_.push_back('/');
-  }
+    : rootDir_(getRootDir(rootDir)),
+      files_(rootDir_),
+      sources_(getNumSourceShards(WdtOptions::get()), &files_,
+               WdtOptions::get().physical_block_order),
+      options_(WdtOptions::get()) {
   fileSourceBufferSize_ = options_.buffer_size;
+  maxQueuedBlocks_ = options_.max_queued_blocks;
+  maxQueuedBytes_ = options_.max_queued_mbytes * 1024 * 1024;
+  numConsumers_ = std::max(1, options_.num_ports);
+  throughputs_.reset(new std::atomic<int64_t>[numConsumers_]);
+  for (int i = 0; i < numConsumers_; i++) {
+    throughputs_[i] = 0;
+  }
 };
 
 void DirectorySourceQueue::setIncludePattern(
@@ -62,10 +106,43 @@ void DirectorySourceQueue::setFollowSymlinks(const bool followSymlinks) {
   followSymlinks_ = followSymlinks;
 }
 
+void DirectorySourceQueue::setDestination(const std::string &destination) {
+  destination_ = destination;
+}
+
+void DirectorySourceQueue::setDeltaSignatures(
+    const std::vector<FileSignatures> &fileSignatures) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  WDT_CHECK_EQ(0, numBlocksDequeued_.load());
+  std::unordered_set<std::string> invalidFiles;
+  for (const auto &entry : fileSignatures) {
+    auto &signatures = deltaSignatures_[entry.fileName];
+    if (!signatures) {
+      signatures = std::make_shared<DeltaSignatures>(entry.fileSize,
+                                                     entry.blockSize);
+    }
+    if (!signatures->addEntry(entry)) {
+      invalidFiles.insert(entry.fileName);
+    }
+  }
+  for (auto it = deltaSignatures_.begin(); it != deltaSignatures_.end();) {
+    if (!it->second->isComplete() ||
+        invalidFiles.find(it->first) != invalidFiles.end()) {
+      LOG(WARNING) << "Incomplete signatures for " << it->first
+                   << ", sending it entirely";
+      it = deltaSignatures_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  LOG(INFO) << "Received signatures of " << deltaSignatures_.size()
+            << " files existing on the receiver";
+}
+
 void DirectorySourceQueue::setPreviouslyReceivedChunks(
     std::vector<FileChunksInfo> &previouslyTransferredChunks) {
   std::unique_lock<std::mutex> lock(mutex_);
-  WDT_CHECK_EQ(0, numBlocksDequeued_);
+  WDT_CHECK_EQ(0, numBlocksDequeued_.load());
   // reset all the queue variables
   nextSeqId_ = 0;
   totalFileSize_ = 0;
@@ -76,24 +153,33 @@ void DirectorySourceQueue::setPreviouslyReceivedChunks(
     previouslyTransferredChunks_.insert(
         std::make_pair(chunkInfo.getFileName(), std::move(chunkInfo)));
   }
-  // clear current content of the queue. For some reason, priority_queue does
-  // not have a clear method
-  while (!sourceQueue_.empty()) {
-    sourceQueue_.pop();
+  // clear current content of the queue
+  std::vector<QueuedBlocks> queuedBlocks;
+  sources_.popAll(queuedBlocks);
+  queuedBlocks.clear();
+  struct DiscoveredFileInfo {
+    std::string fullPath;
+    std::string relPath;
+    int64_t size;
+    bool sparse;
+  };
+  std::vector<DiscoveredFileInfo> discoveredFileInfo;
+  discoveredFileInfo.reserve(files_.getNumFiles());
+  for (int64_t file = 0; file < files_.getNumFiles(); file++) {
+    discoveredFileInfo.push_back({files_.getFullPath(file),
+                                  files_.getRelPath(file),
+                                  files_.getSize(file), files_.isSparse(file)});
   }
-  std::vector<SourceMetaData *> discoveredFileInfo = std::move(sharedFileData_);
+  files_.clear();
+  sparseHoles_.clear();
   // recreate the queue
-  for (const auto fileInfo : discoveredFileInfo) {
-    createIntoQueue(fileInfo->fullPath, fileInfo->relPath, fileInfo->size,
-                    true);
-    delete fileInfo;
+  for (const auto &fileInfo : discoveredFileInfo) {
+    createIntoQueue(fileInfo.fullPath, fileInfo.relPath, fileInfo.size, true,
+                    fileInfo.sparse);
   }
 }
 
 DirectorySourceQueue::~DirectorySourceQueue() {
-  for (SourceMetaData *fileData : sharedFileData_) {
-    delete fileData;
-  }
 }
 
 std::thread DirectorySourceQueue::buildQueueAsynchronously() {
@@ -119,19 +205,30 @@ bool DirectorySourceQueue::buildQueueSynchronously() {
               << fileInfo_.size();
     res = enqueueFiles();
   } else {
+    if (options_.continuous_sync) {
+      startWatching();
+    }
     res = explore();
   }
   {
     std::lock_guard<std::mutex> lock(mutex_);
-    initFinished_ = true;
-    // TODO: comment why
-    if (sourceQueue_.empty()) {
-      conditionNotEmpty_.notify_all();
-    }
+    explored_ = true;
+    conditionExplored_.notify_all();
   }
   directoryTime_ = durationSeconds(Clock::now() - startTime);
   VLOG(1) << "finished initialization of DirectorySourceQueue in "
           << directoryTime_;
+  if (inotifyFd_ >= 0) {
+    res &= watch();
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    initFinished_ = true;
+    // wakes up the consumers waiting for sources, there won't be more
+    if (sources_.empty()) {
+      conditionNotEmpty_.notify_all();
+    }
+  }
   return res;
 }
 
@@ -140,160 +237,758 @@ bool DirectorySourceQueue::explore() {
             << " include_pattern : " << includePattern_
             << " exclude_pattern : " << excludePattern_
             << " prune_dir_pattern : " << pruneDirPattern_;
+  includeFilter_ = PathFilter(includePattern_);
+  excludeFilter_ = PathFilter(excludePattern_);
+  pruneDirFilter_ = PathFilter(pruneDirPattern_);
+  VLOG(1) << "Matchers: include " << includeFilter_.getMatcherName()
+          << " exclude " << excludeFilter_.getMatcherName() << " prune_dir "
+          << pruneDirFilter_.getMatcherName();
+  numWalkers_ = std::max(1, options_.num_discovery_threads);
+  walkerQueues_.reset(new WalkerQueue[numWalkers_]);
+  if (!options_.discovery_manifest.empty()) {
+    manifest_ = DiscoveryManifest::open(options_.discovery_manifest,
+                                        getDiscoveryFingerprint());
+    manifestWriter_.reset(new DiscoveryManifestWriter());
+  }
+  std::deque<std::unique_ptr<DiscoveredDir>> todoList;
+  todoList.emplace_back(new DiscoveredDir());
+  walkerQueues_[0].dirs.push_back(todoList.front().get());
+  numDirsToList_ = 1;
+  std::vector<std::thread> walkers;
+  for (int i = 0; i < numWalkers_; i++) {
+    walkers.emplace_back(&DirectorySourceQueue::walkDirectories, this, i);
+  }
+  // directories are listed in any order, their files are added in the order
+  // of a breadth first traversal
   bool hasError = false;
-  std::set<std::string> visited;
-  std::regex includeRegex(includePattern_);
-  std::regex excludeRegex(excludePattern_);
-  std::regex pruneDirRegex(pruneDirPattern_);
-  std::deque<std::string> todoList;
-  todoList.push_back("");
   while (!todoList.empty()) {
-    // would be nice to do those 2 in 1 call...
-    auto relativePath = todoList.front();
+    std::unique_ptr<DiscoveredDir> dir = std::move(todoList.front());
     todoList.pop_front();
-    const std::string fullPath = rootDir_ + relativePath;
-    VLOG(1) << "Processing directory " << fullPath;
-    DIR *dirPtr = opendir(fullPath.c_str());
-    if (!dirPtr) {
-      PLOG(ERROR) << "Error opening dir " << fullPath;
-      failedDirectories_.emplace_back(fullPath);
-      hasError = true;
-      continue;
+    bool listed;
+    {
+      std::lock_guard<std::mutex> lock(discoveredMutex_);
+      listed = dir->listed;
     }
-    // http://elliotth.blogspot.com/2012/10/how-not-to-use-readdirr3.html
-    // tl;dr readdir is actually better than readdir_r ! (because of the
-    // nastyness of calculating correctly buffer size and race conditions there)
-    struct dirent *dirEntryRes = nullptr;
-    while (true) {
-      errno = 0;  // yes that's right
-      dirEntryRes = readdir(dirPtr);
-      if (!dirEntryRes) {
-        if (errno) {
-          PLOG(ERROR) << "Error reading dir " << fullPath;
-          // closedir always called
-          hasError = true;
-        } else {
-          VLOG(2) << "Done with " << fullPath;
-          // finished reading dir
+    if (!listed) {
+      if (maxQueuedBlocks_ > 0) {
+        // the discovery threads can't wait for this directory's files
+        std::lock_guard<std::mutex> lock(walkMutex_);
+        exploreWaiting_ = true;
+        conditionFilesAdded_.notify_all();
+      }
+      {
+        std::unique_lock<std::mutex> lock(discoveredMutex_);
+        while (!dir->listed) {
+          conditionDirListed_.wait(lock);
         }
-        break;
       }
-      const auto dType = dirEntryRes->d_type;
-      VLOG(2) << "Found entry " << dirEntryRes->d_name << " type "
-              << (int)dType;
-      if (dirEntryRes->d_name[0] == '.') {
-        if (dirEntryRes->d_name[1] == '\0' ||
-            (dirEntryRes->d_name[1] == '.' && dirEntryRes->d_name[2] == '\0')) {
-          VLOG(3) << "Skipping entry : " << dirEntryRes->d_name;
+      if (maxQueuedBlocks_ > 0) {
+        std::lock_guard<std::mutex> lock(walkMutex_);
+        exploreWaiting_ = false;
+      }
+    }
+    const bool duplicate = followSymlinks_ && isDuplicateDirectory(*dir);
+    const int64_t numFiles = dir->files.size();
+    if (duplicate) {
+      // already added through the path reached first
+      dir->files.clear();
+    }
+    if (dir->openFailed) {
+      failedDirectories_.emplace_back(rootDir_ + dir->relPath);
+      hasFailures_ = true;
+    }
+    hasError |= dir->hasError;
+    if (manifestWriter_ && !duplicate) {
+      // directories not fully listed are listed again next time
+      const int64_t mtime = dir->hasError ? -1 : dir->mtime;
+      if (dir->relPath.empty()) {
+        manifestWriter_->setRoot(mtime, dir->inode);
+      } else {
+        manifestWriter_->addDirectory(dir->relPath, mtime, dir->inode);
+      }
+    }
+    for (const auto &file : dir->files) {
+      if (inotifyFd_ >= 0) {
+        syncedFiles_[file.relPath] = {file.size, file.mtime, file.inode};
+      }
+      if (manifestWriter_) {
+        manifestWriter_->addFile(file.relPath, file.size, file.mtime,
+                                 file.inode);
+        if (!file.changed) {
+          numUnchangedFiles_++;
           continue;
         }
       }
-      // Following code is a bit ugly trying to save stat() call for directories
-      // yet still work for xfs which returns DT_UNKNOWN for everything
-      // would be simpler to always stat()
-
-      // if we reach DT_DIR and DT_REG directly:
-      bool isDir = (dType == DT_DIR);
-      bool isLink = (dType == DT_LNK);
-      bool keepEntry = (isDir || dType == DT_REG || dType == DT_UNKNOWN);
-      if (followSymlinks_) {
-        keepEntry |= isLink;
+      const std::string fullPath =
+          file.fullPath.empty() ? rootDir_ + file.relPath : file.fullPath;
+      createIntoQueue(fullPath, file.relPath, file.size, false,
+                      file.mayBeSparse);
+    }
+    if (maxQueuedBlocks_ > 0 && numFiles > 0) {
+      std::lock_guard<std::mutex> lock(walkMutex_);
+      const bool wasFull = numFilesToAdd_ >= maxQueuedBlocks_;
+      numFilesToAdd_ -= numFiles;
+      if (wasFull && numFilesToAdd_ < maxQueuedBlocks_) {
+        conditionFilesAdded_.notify_all();
+      }
+    }
+    // sub directories of duplicates are still owned here till listed
+    for (auto &subDir : dir->subDirs) {
+      todoList.push_back(std::move(subDir));
+    }
+  }
+  for (auto &walker : walkers) {
+    walker.join();
+  }
+  walkerQueues_.reset();
+  if (manifestWriter_) {
+    newManifestPath_ = options_.discovery_manifest + ".new";
+    if (!manifestWriter_->write(newManifestPath_,
+                                getDiscoveryFingerprint())) {
+      newManifestPath_.clear();
+    }
+    manifestWriter_.reset();
+    manifest_.reset();
+    LOG(INFO) << "Unchanged files not queued: " << numUnchangedFiles_;
+  }
+  LOG(INFO) << "Number of files explored: " << numEntries_
+            << ", directory entries: " << numDirEntries_
+            << ", discovery threads: " << numWalkers_
+            << ", errors: " << std::boolalpha << hasError;
+  return !hasError;
+}
+
+void DirectorySourceQueue::walkDirectories(int walkerIndex) {
+  while (true) {
+    waitToListDirectory();
+    DiscoveredDir *dir = getDirectoryToList(walkerIndex);
+    if (!dir) {
+      break;
+    }
+    bool duplicate;
+    {
+      std::lock_guard<std::mutex> lock(discoveredMutex_);
+      duplicate = dir->duplicate;
+    }
+    if (!duplicate) {
+      listDirectory(*dir);
+    }
+    if (maxQueuedBlocks_ > 0) {
+      std::lock_guard<std::mutex> lock(walkMutex_);
+      numFilesToAdd_ += dir->files.size();
+    }
+    // sub directories must be queued before the directory is accounted as
+    // listed, otherwise the other threads could exit early
+    addDirectoriesToList(walkerIndex, *dir);
+    {
+      std::lock_guard<std::mutex> lock(discoveredMutex_);
+      dir->listed = true;
+    }
+    conditionDirListed_.notify_one();
+    std::lock_guard<std::mutex> lock(walkMutex_);
+    if (--numDirsToList_ == 0) {
+      conditionDirsToList_.notify_all();
+    }
+  }
+  VLOG(1) << "Discovery thread " << walkerIndex << " done";
+}
+
+DirectorySourceQueue::DiscoveredDir *DirectorySourceQueue::getDirectoryToList(
+    int walkerIndex) {
+  while (true) {
+    {
+      WalkerQueue &own = walkerQueues_[walkerIndex];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.dirs.empty()) {
+        // depth first in the own queue keeps the queues short
+        DiscoveredDir *dir = own.dirs.back();
+        own.dirs.pop_back();
+        return dir;
+      }
+    }
+    for (int i = 1; i < numWalkers_; i++) {
+      WalkerQueue &victim = walkerQueues_[(walkerIndex + i) % numWalkers_];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.dirs.empty()) {
+        // the oldest directories are the closest to the root, and likely to
+        // have the largest sub trees
+        DiscoveredDir *dir = victim.dirs.front();
+        victim.dirs.pop_front();
+        return dir;
       }
-      if (!keepEntry) {
-        VLOG(3) << "Ignoring entry type " << (int)(dType);
+    }
+    std::unique_lock<std::mutex> lock(walkMutex_);
+    if (numDirsToList_ == 0) {
+      return nullptr;
+    }
+    // directories queued after the checks above notify under walkMutex_, so
+    // they can't be missed
+    numIdleWalkers_++;
+    conditionDirsToList_.wait(lock);
+    numIdleWalkers_--;
+  }
+}
+
+void DirectorySourceQueue::waitToListDirectory() {
+  if (maxQueuedBlocks_ <= 0) {
+    return;
+  }
+  std::unique_lock<std::mutex> lock(walkMutex_);
+  while (numFilesToAdd_ >= maxQueuedBlocks_ && !exploreWaiting_ &&
+         !discoveryUnblocked_) {
+    conditionFilesAdded_.wait(lock);
+  }
+}
+
+void DirectorySourceQueue::addDirectoriesToList(int walkerIndex,
+                                                DiscoveredDir &dir) {
+  if (dir.subDirs.empty()) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lock(walkMutex_);
+    numDirsToList_ += dir.subDirs.size();
+  }
+  {
+    WalkerQueue &own = walkerQueues_[walkerIndex];
+    std::lock_guard<std::mutex> lock(own.mutex);
+    for (auto &subDir : dir.subDirs) {
+      own.dirs.push_back(subDir.get());
+    }
+  }
+  std::lock_guard<std::mutex> lock(walkMutex_);
+  if (numIdleWalkers_ > 0) {
+    conditionDirsToList_.notify_all();
+  }
+}
+
+void DirectorySourceQueue::listDirectory(DiscoveredDir &dir) {
+  const std::string fullPath = rootDir_ + dir.relPath;
+  VLOG(1) << "Processing directory " << fullPath;
+  // entries are stat'ed relative to the directory's fd, so that the kernel
+  // doesn't walk the full path again for each of them
+  int dirFd = open(fullPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DIR *dirPtr = (dirFd >= 0) ? fdopendir(dirFd) : nullptr;
+  if (!dirPtr) {
+    PLOG(ERROR) << "Error opening dir " << fullPath;
+    if (dirFd >= 0) {
+      close(dirFd);
+    }
+    dir.openFailed = true;
+    dir.hasError = true;
+    return;
+  }
+  if (followSymlinks_) {
+    struct stat dirStat;
+    if (fstat(dirFd, &dirStat) != 0) {
+      PLOG(ERROR) << "fstat() failed on dir " << fullPath;
+      dir.hasError = true;
+      closedir(dirPtr);
+      return;
+    }
+    dir.fileId = std::make_pair((uint64_t)dirStat.st_dev,
+                                (uint64_t)dirStat.st_ino);
+    if (std::find(dir.ancestors.begin(), dir.ancestors.end(), dir.fileId) !=
+        dir.ancestors.end()) {
+      // symlink loop, reported as a duplicate when the queue is built
+      VLOG(1) << "Not listing " << fullPath << " again, symlink loop";
+      closedir(dirPtr);
+      return;
+    }
+  }
+  if (inotifyFd_ >= 0) {
+    // before reading the entries, so that files closed meanwhile aren't
+    // missed
+    addWatch(dir);
+  }
+  // entries of the directory in the discovery manifest
+  std::pair<int64_t, int64_t> manifestEntries(0, 0);
+  if (manifestWriter_) {
+    struct stat dirStat;
+    if (fstat(dirFd, &dirStat) != 0) {
+      PLOG(ERROR) << "fstat() failed on dir " << fullPath;
+      dir.hasError = true;
+    } else {
+      dir.mtime = getMtimeNanos(dirStat);
+      dir.inode = dirStat.st_ino;
+      if (listDirectoryFromManifest(dir)) {
+        closedir(dirPtr);
+        return;
+      }
+    }
+    if (manifest_) {
+      manifestEntries = manifest_->getDirectoryEntries(dir.relPath);
+    }
+  }
+  // relative path of the current entry, the directory's path is kept and
+  // only the name changes
+  std::string newRelativePath = dir.relPath;
+  const size_t dirPathLength = newRelativePath.size();
+  // full path of a symlink target
+  std::string resolvedPath;
+  // http://elliotth.blogspot.com/2012/10/how-not-to-use-readdirr3.html
+  // tl;dr readdir is actually better than readdir_r ! (because of the
+  // nastyness of calculating correctly buffer size and race conditions there)
+  // readdir gets the entries in batches with getdents64
+  struct dirent *dirEntryRes = nullptr;
+  int64_t numDirEntries = 0;
+  while (true) {
+    errno = 0;  // yes that's right
+    dirEntryRes = readdir(dirPtr);
+    if (!dirEntryRes) {
+      if (errno) {
+        PLOG(ERROR) << "Error reading dir " << fullPath;
+        // closedir always called
+        dir.hasError = true;
+      } else {
+        VLOG(2) << "Done with " << fullPath;
+        // finished reading dir
+      }
+      break;
+    }
+    const char *name = dirEntryRes->d_name;
+    const auto dType = dirEntryRes->d_type;
+    VLOG(2) << "Found entry " << name << " type " << (int)dType;
+    if (name[0] == '.') {
+      if (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')) {
+        VLOG(3) << "Skipping entry : " << name;
         continue;
       }
-      std::string newRelativePath =
-          relativePath + std::string(dirEntryRes->d_name);
-      std::string newFullPath = rootDir_ + newRelativePath;
-      if (!isDir) {
-        // DT_REG, DT_LNK or DT_UNKNOWN cases
-        struct stat fileStat;
-        // Use stat since we can also have symlinks
-        if (stat(newFullPath.c_str(), &fileStat) != 0) {
-          PLOG(ERROR) << "stat() failed on path " << newFullPath;
-          hasError = true;
-          continue;
-        }
+    }
+    numDirEntries++;
+    // Following code is a bit ugly trying to save stat() call for directories
+    // yet still work for xfs which returns DT_UNKNOWN for everything
+    // would be simpler to always stat()
 
-        if (followSymlinks_) {
-          std::string pathToResolve = newFullPath;
-          if (dType == DT_UNKNOWN) {
-            // Use lstat because we are checking the file itself
-            // and not what it points to (if it is a link)
-            struct stat linkStat;
-            if (lstat(pathToResolve.c_str(), &linkStat) != 0) {
-              PLOG(ERROR) << "lstat() failed on path " << pathToResolve;
-              hasError = true;
-              continue;
-            }
-            if (S_ISLNK(linkStat.st_mode)) {
-              // Let's resolve it below
-              isLink = true;
-            }
-          }
-          if (isLink) {
-            // Use realpath() as it resolves to a nice canonicalized
-            // full path we can used for the stat() call later,
-            // readlink could still give us a relative path
-            // and making sure the output buffer is sized appropriately
-            // can be ugly
-            char *resolvedPath = realpath(pathToResolve.c_str(), nullptr);
-            if (!resolvedPath) {
-              hasError = true;
-              PLOG(ERROR) << "Couldn't resolve " << pathToResolve.c_str();
-              continue;
-            }
-            newFullPath.assign(resolvedPath);
-            free(resolvedPath);
-            VLOG(2) << "Resolved symlink " << dirEntryRes->d_name << " to "
-                    << newFullPath;
-          }
-        }
+    // if we reach DT_DIR and DT_REG directly:
+    bool isDir = (dType == DT_DIR);
+    bool isLink = (dType == DT_LNK);
+    bool keepEntry = (isDir || dType == DT_REG || dType == DT_UNKNOWN);
+    if (followSymlinks_) {
+      keepEntry |= isLink;
+    }
+    if (!keepEntry) {
+      VLOG(3) << "Ignoring entry type " << (int)(dType);
+      continue;
+    }
+    newRelativePath.resize(dirPathLength);
+    newRelativePath.append(name);
+    resolvedPath.clear();
+    if (!isDir) {
+      // DT_REG, DT_LNK or DT_UNKNOWN cases
+      struct stat fileStat;
+      // Follow symlinks like stat
+      if (fstatat(dirFd, name, &fileStat, 0) != 0) {
+        PLOG(ERROR) << "fstatat() failed on path " << rootDir_
+                    << newRelativePath;
+        dir.hasError = true;
+        continue;
+      }
 
-        // could dcheck that if DT_REG we better be !isDir
-        isDir = S_ISDIR(fileStat.st_mode);
-        // if we were DT_UNKNOWN this could still be a symlink, block device
-        // etc... (xfs)
-        if (S_ISREG(fileStat.st_mode)) {
-          VLOG(2) << "Found file " << newFullPath << " of size "
-                  << fileStat.st_size;
-          if (!excludePattern_.empty() &&
-              std::regex_match(newRelativePath, excludeRegex)) {
+      if (followSymlinks_) {
+        if (dType == DT_UNKNOWN) {
+          // Don't follow because we are checking the file itself
+          // and not what it points to (if it is a link)
+          struct stat linkStat;
+          if (fstatat(dirFd, name, &linkStat, AT_SYMLINK_NOFOLLOW) != 0) {
+            PLOG(ERROR) << "fstatat() failed on path " << rootDir_
+                        << newRelativePath;
+            dir.hasError = true;
             continue;
           }
-          if (!includePattern_.empty() &&
-              !std::regex_match(newRelativePath, includeRegex)) {
+          if (S_ISLNK(linkStat.st_mode)) {
+            // Let's resolve it below
+            isLink = true;
+          }
+        }
+        if (isLink) {
+          // Use realpath() as it resolves to a nice canonicalized
+          // full path we can used for the stat() call later,
+          // readlink could still give us a relative path
+          // and making sure the output buffer is sized appropriately
+          // can be ugly
+          const std::string pathToResolve = rootDir_ + newRelativePath;
+          char *res = realpath(pathToResolve.c_str(), nullptr);
+          if (!res) {
+            dir.hasError = true;
+            PLOG(ERROR) << "Couldn't resolve " << pathToResolve;
             continue;
           }
-          createIntoQueue(newFullPath, newRelativePath, fileStat.st_size,
-                          false);
+          resolvedPath.assign(res);
+          free(res);
+          VLOG(2) << "Resolved symlink " << name << " to " << resolvedPath;
+        }
+      }
+
+      // could dcheck that if DT_REG we better be !isDir
+      isDir = S_ISDIR(fileStat.st_mode);
+      // if we were DT_UNKNOWN this could still be a symlink, block device
+      // etc... (xfs)
+      if (S_ISREG(fileStat.st_mode)) {
+        VLOG(2) << "Found file " << newRelativePath << " of size "
+                << fileStat.st_size;
+        if (!isFileIncluded(newRelativePath)) {
           continue;
         }
+        DiscoveredFile file;
+        file.fullPath = resolvedPath;
+        file.relPath = newRelativePath;
+        file.size = fileStat.st_size;
+        file.mayBeSparse = mayHaveHoles(fileStat);
+        file.mtime = getMtimeNanos(fileStat);
+        file.inode = fileStat.st_ino;
+        if (manifest_) {
+          const DiscoveryManifest::ManifestRecord *record =
+              manifest_->find(manifestEntries, newRelativePath);
+          file.changed = !record ||
+                         (record->flags & DiscoveryManifest::kDirectory) ||
+                         record->size != file.size ||
+                         record->mtime != file.mtime ||
+                         record->inode != file.inode;
+        }
+        dir.files.emplace_back(std::move(file));
+        continue;
       }
-      if (isDir) {
+    }
+    if (isDir) {
+      newRelativePath.push_back('/');
+      if (pruneDirPattern_.empty() ||
+          !pruneDirFilter_.matches(newRelativePath)) {
+        VLOG(2) << "Adding " << newRelativePath;
+        std::unique_ptr<DiscoveredDir> subDir(new DiscoveredDir());
+        subDir->relPath = newRelativePath;
         if (followSymlinks_) {
-          if (visited.find(newFullPath) != visited.end()) {
-            LOG(ERROR) << "Attempted to visit directory twice: " << newFullPath;
-            hasError = true;
-            continue;
-          }
-          // TODO: consider custom hashing ignoring common prefix
-          visited.insert(newFullPath);
+          // duplicates are resolved in the order of the traversal, only
+          // loops are detected while listing
+          subDir->ancestors = dir.ancestors;
+          subDir->ancestors.push_back(dir.fileId);
         }
-        newRelativePath.push_back('/');
-        if (pruneDirPattern_.empty() ||
-            !std::regex_match(newRelativePath, pruneDirRegex)) {
-          VLOG(2) << "Adding " << newRelativePath;
-          todoList.push_back(std::move(newRelativePath));
+        dir.subDirs.emplace_back(std::move(subDir));
+      }
+    }
+  }
+  // also closes dirFd
+  closedir(dirPtr);
+  numDirEntries_ += numDirEntries;
+}
+
+bool DirectorySourceQueue::isDuplicateDirectory(DiscoveredDir &dir) {
+  bool duplicate;
+  {
+    std::lock_guard<std::mutex> lock(discoveredMutex_);
+    duplicate = dir.duplicate;
+  }
+  // fileId is not known if the directory couldn't be opened
+  if (!duplicate && dir.fileId.second != 0 &&
+      !visited_.insert(dir.fileId).second) {
+    LOG(ERROR) << "Attempted to visit directory twice: " << rootDir_
+               << dir.relPath;
+    dir.hasError = true;
+    duplicate = true;
+  }
+  if (!duplicate) {
+    if (dir.watchDescriptor >= 0) {
+      std::lock_guard<std::mutex> lock(watchMutex_);
+      watchedDirs_[dir.watchDescriptor] = dir.relPath;
+    }
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(discoveredMutex_);
+  for (auto &subDir : dir.subDirs) {
+    subDir->duplicate = true;
+  }
+  return true;
+}
+
+bool DirectorySourceQueue::isFileIncluded(const std::string &relPath) const {
+  if (!excludePattern_.empty() && excludeFilter_.matches(relPath)) {
+    return false;
+  }
+  return includePattern_.empty() || includeFilter_.matches(relPath);
+}
+
+void DirectorySourceQueue::startWatching() {
+#ifdef HAS_INOTIFY
+  inotifyFd_ = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+  if (inotifyFd_ < 0) {
+    PLOG(ERROR) << "inotify_init1() failed, not watching " << rootDir_;
+  }
+#else
+  LOG(ERROR) << "continuous_sync needs inotify, not watching " << rootDir_;
+#endif
+}
+
+void DirectorySourceQueue::addWatch(DiscoveredDir &dir) {
+#ifdef HAS_INOTIFY
+  const std::string fullPath = rootDir_ + dir.relPath;
+  // files are queued once closed or renamed into place (and while being
+  // written with sync_modified_files_millis), directories as soon as they
+  // are created
+  uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR;
+  if (options_.sync_modified_files_millis > 0) {
+    mask |= IN_MODIFY;
+  }
+  if (!followSymlinks_) {
+    mask |= IN_DONT_FOLLOW;
+  }
+  const int wd = inotify_add_watch(inotifyFd_, fullPath.c_str(), mask);
+  if (wd < 0) {
+    // most likely fs.inotify.max_user_watches
+    PLOG(ERROR) << "inotify_add_watch() failed for " << fullPath
+                << ", new files in it won't be sent";
+    return;
+  }
+  dir.watchDescriptor = wd;
+  if (followSymlinks_) {
+    // the same directory may be listed by several paths
+    return;
+  }
+  std::lock_guard<std::mutex> lock(watchMutex_);
+  watchedDirs_[wd] = dir.relPath;
+#endif
+}
+
+bool DirectorySourceQueue::watch() {
+#ifdef HAS_INOTIFY
+  LOG(INFO) << "Watching " << rootDir_ << " for new files, "
+            << watchedDirs_.size() << " directories";
+  // poll timeout, how late stopWatching() can be noticed
+  const int kPollMillis = 100;
+  const size_t kEventsBufferSize = 64 * 1024;
+  std::unique_ptr<struct inotify_event[]> events(
+      new struct inotify_event[kEventsBufferSize /
+                               sizeof(struct inotify_event)]);
+  char *buf = reinterpret_cast<char *>(events.get());
+  const auto modifiedDelay =
+      std::chrono::milliseconds(options_.sync_modified_files_millis);
+  // files being written, by when what was appended is queued
+  std::unordered_map<std::string, Clock::time_point> modifiedFiles;
+  bool success = true;
+  while (!stopWatching_) {
+    if (!modifiedFiles.empty()) {
+      const auto now = Clock::now();
+      for (auto it = modifiedFiles.begin(); it != modifiedFiles.end();) {
+        if (it->second > now) {
+          ++it;
+          continue;
+        }
+        syncFile(it->first);
+        it = modifiedFiles.erase(it);
+      }
+    }
+    struct pollfd pollFd = {inotifyFd_, POLLIN, 0};
+    const int res = poll(&pollFd, 1, kPollMillis);
+    if (res < 0 && errno != EINTR) {
+      PLOG(ERROR) << "poll() failed on the inotify fd";
+      success = false;
+      break;
+    }
+    if (res <= 0) {
+      continue;
+    }
+    const ssize_t length = read(inotifyFd_, buf, kEventsBufferSize);
+    if (length < 0) {
+      if (errno == EAGAIN || errno == EINTR) {
+        continue;
+      }
+      PLOG(ERROR) << "read() failed on the inotify fd";
+      success = false;
+      break;
+    }
+    for (ssize_t off = 0; off < length;) {
+      const struct inotify_event *event =
+          reinterpret_cast<const struct inotify_event *>(buf + off);
+      off += sizeof(struct inotify_event) + event->len;
+      if (event->mask & IN_Q_OVERFLOW) {
+        LOG(WARNING) << "inotify events lost, scanning " << rootDir_;
+        syncDirectory("");
+        continue;
+      }
+      std::string relPath;
+      {
+        std::lock_guard<std::mutex> lock(watchMutex_);
+        auto it = watchedDirs_.find(event->wd);
+        if (it == watchedDirs_.end()) {
+          continue;
+        }
+        if (event->mask & IN_IGNORED) {
+          // the directory was removed or moved away
+          watchedDirs_.erase(it);
+          continue;
+        }
+        relPath = it->second;
+      }
+      relPath.append(event->name);
+      if (event->mask & IN_ISDIR) {
+        relPath.push_back('/');
+        if (pruneDirPattern_.empty() || !pruneDirFilter_.matches(relPath)) {
+          syncDirectory(relPath);
         }
+      } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+        modifiedFiles.erase(relPath);
+        syncFile(relPath);
+      } else if (event->mask & IN_MODIFY) {
+        // not on every write, a file written continuously is still synced
+        // every sync_modified_files_millis
+        modifiedFiles.emplace(relPath, Clock::now() + modifiedDelay);
       }
     }
-    closedir(dirPtr);
   }
-  LOG(INFO) << "Number of files explored: " << numEntries_
-            << ", errors: " << std::boolalpha << hasError;
-  return !hasError;
+  // what was written before stopping is still sent
+  for (const auto &modifiedFile : modifiedFiles) {
+    syncFile(modifiedFile.first);
+  }
+  close(inotifyFd_);
+  inotifyFd_ = -1;
+  LOG(INFO) << "Stopped watching " << rootDir_;
+  return success;
+#else
+  return false;
+#endif
+}
+
+void DirectorySourceQueue::syncDirectory(const std::string &dirRelPath) {
+  if (dirRelPath.empty()) {
+    // listing everything again
+    visited_.clear();
+  }
+  std::deque<std::unique_ptr<DiscoveredDir>> todoList;
+  todoList.emplace_back(new DiscoveredDir());
+  todoList.back()->relPath = dirRelPath;
+  while (!todoList.empty()) {
+    std::unique_ptr<DiscoveredDir> dir = std::move(todoList.front());
+    todoList.pop_front();
+    listDirectory(*dir);
+    if (followSymlinks_ && isDuplicateDirectory(*dir)) {
+      continue;
+    }
+    for (const auto &file : dir->files) {
+      syncFile(file);
+    }
+    for (auto &subDir : dir->subDirs) {
+      todoList.push_back(std::move(subDir));
+    }
+  }
+}
+
+void DirectorySourceQueue::syncFile(const std::string &relPath) {
+  if (!isFileIncluded(relPath)) {
+    return;
+  }
+  const std::string fullPath = rootDir_ + relPath;
+  struct stat fileStat;
+  if (stat(fullPath.c_str(), &fileStat) != 0) {
+    if (errno != ENOENT) {
+      PLOG(ERROR) << "stat() failed on path " << fullPath;
+    }
+    // already removed
+    return;
+  }
+  if (!S_ISREG(fileStat.st_mode)) {
+    return;
+  }
+  DiscoveredFile file;
+  file.relPath = relPath;
+  file.size = fileStat.st_size;
+  file.mayBeSparse = mayHaveHoles(fileStat);
+  file.mtime = getMtimeNanos(fileStat);
+  file.inode = fileStat.st_ino;
+  syncFile(file);
+}
+
+void DirectorySourceQueue::syncFile(const DiscoveredFile &file) {
+  int64_t startOffset = 0;
+  auto it = syncedFiles_.find(file.relPath);
+  if (it != syncedFiles_.end()) {
+    const SyncedFile &synced = it->second;
+    if (synced.size == file.size && synced.mtime == file.mtime &&
+        synced.inode == file.inode) {
+      // found both by listing and by an event
+      return;
+    }
+    if (synced.inode == file.inode && synced.size < file.size) {
+      // appended to
+      startOffset = synced.size;
+    }
+  }
+  syncedFiles_[file.relPath] = {file.size, file.mtime, file.inode};
+  VLOG(1) << "Syncing " << file.relPath << " from " << startOffset << " to "
+          << file.size;
+  const std::string fullPath =
+      file.fullPath.empty() ? rootDir_ + file.relPath : file.fullPath;
+  createIntoQueue(fullPath, file.relPath, file.size, false, file.mayBeSparse,
+                  startOffset);
+}
+
+void DirectorySourceQueue::stopWatching() {
+  stopWatching_ = true;
+}
+
+bool DirectorySourceQueue::listDirectoryFromManifest(DiscoveredDir &dir) {
+  // symlinks can point out of the tree, their targets aren't checked
+  if (!options_.manifest_trust_dir_mtime || !manifest_ || followSymlinks_ ||
+      dir.hasError ||
+      !manifest_->isDirectoryUnchanged(dir.relPath, dir.mtime, dir.inode)) {
+    return false;
+  }
+  // the manifest only has the entries kept by the same patterns
+  const auto entries = manifest_->getDirectoryEntries(dir.relPath);
+  for (int64_t i = entries.first; i < entries.second; i++) {
+    const DiscoveryManifest::ManifestRecord &record = manifest_->getRecord(i);
+    if (record.flags & DiscoveryManifest::kDirectory) {
+      std::unique_ptr<DiscoveredDir> subDir(new DiscoveredDir());
+      subDir->relPath = manifest_->getRelPath(record);
+      dir.subDirs.emplace_back(std::move(subDir));
+      continue;
+    }
+    DiscoveredFile file;
+    file.relPath = manifest_->getRelPath(record);
+    file.size = record.size;
+    file.mayBeSparse = false;
+    file.mtime = record.mtime;
+    file.inode = record.inode;
+    file.changed = false;
+    dir.files.emplace_back(std::move(file));
+  }
+  VLOG(2) << "Directory " << dir.relPath << " unchanged, "
+          << entries.second - entries.first << " entries from the manifest";
+  numDirEntries_ += entries.second - entries.first;
+  return true;
+}
+
+uint64_t DirectorySourceQueue::getDiscoveryFingerprint() const {
+  // FNV-1a
+  uint64_t hash = 14695981039346656037ULL;
+  auto addBytes = [&hash](const std::string &str) {
+    for (unsigned char c : str) {
+      hash = (hash ^ c) * 1099511628211ULL;
+    }
+    // separator, so that moving characters between fields changes the hash
+    hash = (hash ^ 0xff) * 1099511628211ULL;
+  };
+  addBytes(rootDir_);
+  addBytes(includePattern_);
+  addBytes(excludePattern_);
+  addBytes(pruneDirPattern_);
+  addBytes(followSymlinks_ ? "1" : "0");
+  // files unchanged since the transfer to another receiver weren't sent here
+  addBytes(destination_);
+  return hash;
+}
+
+bool DirectorySourceQueue::commitManifest() {
+  if (newManifestPath_.empty()) {
+    return false;
+  }
+  if (rename(newManifestPath_.c_str(),
+             options_.discovery_manifest.c_str()) != 0) {
+    PLOG(ERROR) << "Unable to rename " << newManifestPath_ << " to "
+                << options_.discovery_manifest;
+    return false;
+  }
+  LOG(INFO) << "Committed discovery manifest " << options_.discovery_manifest;
+  newManifestPath_.clear();
+  return true;
 }
 
 void DirectorySourceQueue::smartNotify(int32_t addedSource) {
@@ -308,21 +1003,27 @@ void DirectorySourceQueue::smartNotify(int32_t addedSource) {
 
 void DirectorySourceQueue::returnToQueue(
     std::vector<std::unique_ptr<ByteSource>> &sources) {
-  int returnedCount = 0;
+  std::vector<std::unique_ptr<ByteSource>> retries;
   std::unique_lock<std::mutex> lock(mutex_);
   for (auto &source : sources) {
-    const int64_t retries = source->getTransferStats().getFailedAttempts();
-    if (retries >= options_.max_transfer_retries) {
-      LOG(ERROR) << source->getIdentifier() << " failed after " << retries
+    const int64_t numRetries = source->getTransferStats().getFailedAttempts();
+    if (numRetries >= options_.max_transfer_retries) {
+      LOG(ERROR) << source->getIdentifier() << " failed after " << numRetries
                  << " number of tries.";
       failedSourceStats_.emplace_back(std::move(source->getTransferStats()));
+      hasFailures_ = true;
     } else {
-      sourceQueue_.push(std::move(source));
-      returnedCount++;
+      retries.emplace_back(std::move(source));
     }
-    WDT_CHECK_GT(numBlocksDequeued_, 0);
+    WDT_CHECK_GT(numBlocksDequeued_.load(), 0);
     numBlocksDequeued_--;
   }
+  const int returnedCount = retries.size();
+  std::vector<QueuedBlocks> entries(returnedCount);
+  for (int i = 0; i < returnedCount; i++) {
+    entries[i].source = std::move(retries[i]);
+  }
+  sources_.push(entries);
   lock.unlock();
   smartNotify(returnedCount);
 }
@@ -333,10 +1034,225 @@ void DirectorySourceQueue::returnToQueue(std::unique_ptr<ByteSource> &source) {
   returnToQueue(sources);
 }
 
+/**
+ * Looks up the data extents of a file with SEEK_DATA/SEEK_HOLE
+ *
+ * @return    false if the file has no holes or they can't be found
+ */
+static bool getDataExtents(const std::string &fullPath, int64_t fileSize,
+                           std::vector<Interval> &extents) {
+#ifdef HAS_SEEK_DATA
+  int fd = open(fullPath.c_str(), O_RDONLY);
+  if (fd < 0) {
+    PLOG(ERROR) << "Unable to open " << fullPath;
+    return false;
+  }
+  int64_t offset = 0;
+  int64_t dataSize = 0;
+  bool success = true;
+  while (offset < fileSize) {
+    off_t dataStart = lseek(fd, offset, SEEK_DATA);
+    if (dataStart < 0) {
+      // ENXIO: no data past offset
+      if (errno != ENXIO) {
+        PLOG(ERROR) << "SEEK_DATA failed for " << fullPath;
+        success = false;
+      }
+      break;
+    }
+    if (dataStart >= fileSize) {
+      break;
+    }
+    off_t holeStart = lseek(fd, dataStart, SEEK_HOLE);
+    if (holeStart < 0) {
+      PLOG(ERROR) << "SEEK_HOLE failed for " << fullPath;
+      success = false;
+      break;
+    }
+    const int64_t dataEnd = std::min<int64_t>(holeStart, fileSize);
+    extents.emplace_back(dataStart, dataEnd);
+    dataSize += dataEnd - dataStart;
+    offset = dataEnd;
+  }
+  close(fd);
+  if (!success || dataSize == fileSize) {
+    extents.clear();
+    return false;
+  }
+  VLOG(1) << fullPath << " is sparse, " << dataSize << " bytes of data in "
+          << extents.size() << " extents";
+  return true;
+#else
+  return false;
+#endif
+}
+
+namespace {
+/// locations of the blocks whose place on disk isn't known are past any
+/// byte address, ordered by inode
+const uint64_t kUnmappedLocation = 1ULL << 62;
+
+/// extent of a file on disk
+struct PhysicalExtent {
+  int64_t logical;
+  int64_t length;
+  /// byte address on the device
+  uint64_t physical;
+};
+}
+
+/**
+ * Finds where the blocks of a file are on disk with FIEMAP, falling back to
+ * the inode number when the extents can't be mapped (filesystem without
+ * FIEMAP, delayed allocation, inline data)
+ */
+class BlockLocator {
+ public:
+  explicit BlockLocator(const std::string &fullPath);
+
+  /// @return   location of the block at offset, offsets must not decrease
+  ///           from one call to the next
+  uint64_t getLocation(int64_t offset);
+
+  /**
+   * @return    number of blocks from offset, at most maxBlocks, which are
+   *            contiguous on disk with the one at offset
+   */
+  int64_t getRunLength(int64_t offset, int64_t blockSize, int64_t maxBlocks);
+
+ private:
+  std::vector<PhysicalExtent> extents_;
+  /// first extent which may contain the next offset looked up
+  size_t index_{0};
+  uint64_t inode_{0};
+};
+
+BlockLocator::BlockLocator(const std::string &fullPath) {
+  int fd = open(fullPath.c_str(), O_RDONLY);
+  if (fd < 0) {
+    PLOG(ERROR) << "Unable to open " << fullPath;
+    return;
+  }
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) == 0) {
+    inode_ = fileStat.st_ino;
+  }
+#ifdef HAS_FIEMAP
+  // extents are read kNumExtents at a time
+  const int kNumExtents = 64;
+  std::vector<char> buf(sizeof(struct fiemap) +
+                        kNumExtents * sizeof(struct fiemap_extent));
+  struct fiemap *map = reinterpret_cast<struct fiemap *>(buf.data());
+  uint64_t start = 0;
+  bool last = false;
+  while (!last) {
+    memset(map, 0, buf.size());
+    map->fm_start = start;
+    map->fm_length = FIEMAP_MAX_OFFSET - start;
+    map->fm_extent_count = kNumExtents;
+    if (ioctl(fd, FS_IOC_FIEMAP, map) != 0) {
+      VLOG(1) << "FIEMAP failed for " << fullPath << ": "
+              << strerrorStr(errno) << ", ordering it by inode";
+      extents_.clear();
+      break;
+    }
+    if (map->fm_mapped_extents == 0) {
+      break;
+    }
+    for (uint32_t i = 0; i < map->fm_mapped_extents; i++) {
+      const struct fiemap_extent &extent = map->fm_extents[i];
+      last = extent.fe_flags & FIEMAP_EXTENT_LAST;
+      start = extent.fe_logical + extent.fe_length;
+      if (extent.fe_flags &
+          (FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DATA_INLINE |
+           FIEMAP_EXTENT_NOT_ALIGNED)) {
+        continue;
+      }
+      extents_.push_back({static_cast<int64_t>(extent.fe_logical),
+                          static_cast<int64_t>(extent.fe_length),
+                          extent.fe_physical});
+    }
+  }
+#endif
+  close(fd);
+}
+
+uint64_t BlockLocator::getLocation(int64_t offset) {
+  while (index_ < extents_.size() &&
+         extents_[index_].logical + extents_[index_].length <= offset) {
+    index_++;
+  }
+  if (index_ == extents_.size() || extents_[index_].logical > offset) {
+    return kUnmappedLocation + inode_;
+  }
+  const PhysicalExtent &extent = extents_[index_];
+  return extent.physical + (offset - extent.logical);
+}
+
+int64_t BlockLocator::getRunLength(int64_t offset, int64_t blockSize,
+                                   int64_t maxBlocks) {
+  const uint64_t location = getLocation(offset);
+  const bool mapped = location < kUnmappedLocation;
+  int64_t numBlocks = 1;
+  while (numBlocks < maxBlocks) {
+    const uint64_t next = getLocation(offset + numBlocks * blockSize);
+    if (next != (mapped ? location + numBlocks * blockSize : location)) {
+      break;
+    }
+    numBlocks++;
+  }
+  return numBlocks;
+}
+
+/// @return   parts of the sorted intervals a which are also in b
+static std::vector<Interval> intersectIntervals(
+    const std::vector<Interval> &a, const std::vector<Interval> &b) {
+  std::vector<Interval> res;
+  size_t i = 0, j = 0;
+  while (i < a.size() && j < b.size()) {
+    const int64_t start = std::max(a[i].start_, b[j].start_);
+    const int64_t end = std::min(a[i].end_, b[j].end_);
+    if (start < end) {
+      res.emplace_back(start, end);
+    }
+    if (a[i].end_ < b[j].end_) {
+      i++;
+    } else {
+      j++;
+    }
+  }
+  return res;
+}
+
+/// @return   parts of the sorted intervals a which are not in b
+static std::vector<Interval> subtractIntervals(
+    const std::vector<Interval> &a, const std::vector<Interval> &b) {
+  std::vector<Interval> res;
+  size_t j = 0;
+  for (const auto &interval : a) {
+    int64_t start = interval.start_;
+    while (j < b.size() && b[j].end_ <= start) {
+      j++;
+    }
+    for (size_t k = j; k < b.size() && b[k].start_ < interval.end_; k++) {
+      if (b[k].start_ > start) {
+        res.emplace_back(start, b[k].start_);
+      }
+      start = std::max(start, b[k].end_);
+    }
+    if (start < interval.end_) {
+      res.emplace_back(start, interval.end_);
+    }
+  }
+  return res;
+}
+
 void DirectorySourceQueue::createIntoQueue(const std::string &fullPath,
                                            const std::string &relPath,
                                            const int64_t fileSize,
-                                           bool alreadyLocked) {
+                                           bool alreadyLocked,
+                                           bool mayBeSparse,
+                                           int64_t startOffset) {
   // TODO: currently we are treating small files(size less than blocksize) as
   // blocks. Also, we transfer file name in the header for all the blocks for a
   // large file. This can be optimized as follows -
@@ -346,6 +1262,10 @@ void DirectorySourceQueue::createIntoQueue(const std::string &fullPath,
   // b) if filesize > blocksize, we can use send filename only in the first
   // block and use a shorter header for subsequent blocks. Also, we can remove
   // block size once negotiated, since blocksize is sort of fixed.
+  if (!alreadyLocked) {
+    // before looking at the file, discovery I/O also waits for the senders
+    waitForQueueRoom();
+  }
   int64_t blockSizeBytes = options_.block_size_mbytes * 1024 * 1024;
   bool enableBlockTransfer = blockSizeBytes > 0;
   if (!enableBlockTransfer) {
@@ -354,11 +1274,23 @@ void DirectorySourceQueue::createIntoQueue(const std::string &fullPath,
   // if block transfer is disabled, treating fileSize as block size. This
   // ensures that we create a single block
   auto blockSize = enableBlockTransfer ? blockSizeBytes : fileSize;
-  int blockCount = 0;
+  std::vector<Interval> dataExtents;
+  // the receiver recreates sparse files, the range appended to a file
+  // already synced is sent as a regular file so that it is only extended
+  bool sparse = mayBeSparse && startOffset == 0 &&
+                options_.enable_sparse_files &&
+                getDataExtents(fullPath, fileSize, dataExtents);
+  std::unique_ptr<BlockLocator> locator;
+  if (options_.physical_block_order) {
+    locator.reset(new BlockLocator(fullPath));
+  }
   std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
   if (!alreadyLocked) {
     lock.lock();
   }
+  if (sparseFilesDisabled_) {
+    sparse = false;
+  }
 
   std::vector<Interval> remainingChunks;
   int64_t seqId;
@@ -367,7 +1299,7 @@ void DirectorySourceQueue::createIntoQueue(const std::string &fullPath,
   auto it = previouslyTransferredChunks_.find(relPath);
   if (it == previouslyTransferredChunks_.end()) {
     // No previously transferred chunks
-    remainingChunks.emplace_back(0, fileSize);
+    remainingChunks.emplace_back(startOffset, fileSize);
     seqId = nextSeqId_++;
     allocationStatus = NOT_EXISTS;
   } else if (it->second.getFileSize() != fileSize) {
@@ -389,44 +1321,123 @@ void DirectorySourceQueue::createIntoQueue(const std::string &fullPath,
     seqId = fileChunksInfo.getSeqId();
     allocationStatus = EXISTS_CORRECT_SIZE;
   }
+  std::vector<Interval> holes;
+  if (sparse) {
+    // holes are not sent, the receiver leaves them unallocated
+    holes = subtractIntervals(remainingChunks, dataExtents);
+    remainingChunks = intersectIntervals(remainingChunks, dataExtents);
+    if (remainingChunks.empty()) {
+      if (allocationStatus == EXISTS_CORRECT_SIZE) {
+        LOG(INFO) << relPath << " completely sent in previous transfer";
+        return;
+      }
+      // no data at all, an empty block still creates the file
+      remainingChunks.emplace_back(0, 0);
+    }
+  }
 
-  SourceMetaData *metadata = new SourceMetaData();
-  metadata->fullPath = fullPath;
-  metadata->relPath = relPath;
-  metadata->seqId = seqId;
-  metadata->size = fileSize;
-  metadata->allocationStatus = allocationStatus;
-  metadata->prevSeqId = prevSeqId;
-
-  sharedFileData_.emplace_back(metadata);
-
-  for (const auto &chunk : remainingChunks) {
-    int64_t offset = chunk.start_;
-    int64_t remainingBytes = chunk.size();
-    do {
-      const int64_t size = std::min<int64_t>(remainingBytes, blockSize);
-      std::unique_ptr<ByteSource> source = folly::make_unique<FileByteSource>(
-          metadata, size, offset, fileSourceBufferSize_);
-      sourceQueue_.push(std::move(source));
-      remainingBytes -= size;
-      offset += size;
-      blockCount++;
-    } while (remainingBytes > 0);
-    totalFileSize_ += chunk.size();
+  const int64_t file = files_.addFile(fullPath, relPath, fileSize, seqId,
+                                      prevSeqId, allocationStatus, sparse);
+
+  if (!holes.empty()) {
+    sparseHoles_.emplace_back(file, std::move(holes));
   }
+  const int64_t blockCount =
+      queueChunks(file, remainingChunks, blockSize, locator.get());
   numEntries_++;
-  numBlocks_ += blockCount;
   if (!alreadyLocked) {
     lock.unlock();
   }
   smartNotify(blockCount);
 }
 
+int64_t DirectorySourceQueue::queueChunks(int64_t file,
+                                          const std::vector<Interval> &chunks,
+                                          int64_t blockSize,
+                                          BlockLocator *locator) {
+  // the full blocks of a chunk are queued as one entry (one per run of
+  // blocks contiguous on disk with physical_block_order), sources are only
+  // created when they are popped
+  std::vector<QueuedBlocks> blocks;
+  int64_t blockCount = 0;
+  for (const auto &chunk : chunks) {
+    files_.addSendSize(file, chunk.size());
+    const int64_t numFullBlocks = (blockSize > 0) ? chunk.size() / blockSize
+                                                  : 0;
+    const int64_t tailSize = chunk.size() - numFullBlocks * blockSize;
+    for (int64_t firstBlock = 0; firstBlock < numFullBlocks;) {
+      const int64_t offset = chunk.start_ + firstBlock * blockSize;
+      int64_t numBlocks = numFullBlocks - firstBlock;
+      blocks.emplace_back();
+      QueuedBlocks &fullBlocks = blocks.back();
+      if (locator) {
+        fullBlocks.location = locator->getLocation(offset);
+        numBlocks = locator->getRunLength(offset, blockSize, numBlocks);
+      }
+      fullBlocks.file = file;
+      fullBlocks.offset = offset;
+      fullBlocks.blockSize = blockSize;
+      fullBlocks.numBlocks = numBlocks;
+      blockCount += numBlocks;
+      firstBlock += numBlocks;
+    }
+    if (tailSize > 0 || numFullBlocks == 0) {
+      // an empty chunk still makes an empty block
+      blocks.emplace_back();
+      QueuedBlocks &tail = blocks.back();
+      tail.file = file;
+      tail.offset = chunk.start_ + numFullBlocks * blockSize;
+      tail.blockSize = tailSize;
+      if (locator) {
+        tail.location = locator->getLocation(tail.offset);
+      }
+      blockCount++;
+    }
+    totalFileSize_ += chunk.size();
+  }
+  sources_.push(blocks);
+  numBlocks_ += blockCount;
+  return blockCount;
+}
+
+void DirectorySourceQueue::disableSparseFiles() {
+  int64_t blockCount = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (sparseFilesDisabled_) {
+      return;
+    }
+    sparseFilesDisabled_ = true;
+    const int64_t blockSizeBytes = options_.block_size_mbytes * 1024 * 1024;
+    for (const auto &fileHoles : sparseHoles_) {
+      const int64_t file = fileHoles.first;
+      const int64_t blockSize =
+          (blockSizeBytes > 0) ? blockSizeBytes : files_.getSize(file);
+      blockCount += queueChunks(file, fileHoles.second, blockSize, nullptr);
+    }
+    LOG_IF(INFO, !sparseHoles_.empty())
+        << "Receiver does not support sparse files, queued the holes of "
+        << sparseHoles_.size() << " files";
+    sparseHoles_.clear();
+  }
+  smartNotify(blockCount);
+}
+
 std::vector<TransferStats> &DirectorySourceQueue::getFailedSourceStats() {
-  while (!sourceQueue_.empty()) {
-    failedSourceStats_.emplace_back(
-        std::move(sourceQueue_.top()->getTransferStats()));
-    sourceQueue_.pop();
+  std::vector<QueuedBlocks> queuedBlocks;
+  sources_.popAll(queuedBlocks);
+  for (auto &blocks : queuedBlocks) {
+    if (blocks.source) {
+      failedSourceStats_.emplace_back(
+          std::move(blocks.source->getTransferStats()));
+      continue;
+    }
+    const std::string relPath = files_.getRelPath(blocks.file);
+    for (int64_t i = 0; i < blocks.numBlocks; i++) {
+      TransferStats stats;
+      stats.setId(relPath);
+      failedSourceStats_.emplace_back(std::move(stats));
+    }
   }
   return failedSourceStats_;
 }
@@ -435,10 +1446,50 @@ std::vector<std::string> &DirectorySourceQueue::getFailedDirectories() {
   return failedDirectories_;
 }
 
+void DirectorySourceQueue::unblockDiscovery() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    discoveryUnblocked_ = true;
+    conditionQueueRoom_.notify_all();
+  }
+  std::lock_guard<std::mutex> lock(walkMutex_);
+  conditionFilesAdded_.notify_all();
+}
+
+bool DirectorySourceQueue::isQueueFull(int divisor) const {
+  return (maxQueuedBlocks_ > 0 &&
+          sources_.size() * divisor >= maxQueuedBlocks_) ||
+         (maxQueuedBytes_ > 0 &&
+          sources_.getNumBytes() * divisor >= maxQueuedBytes_);
+}
+
+void DirectorySourceQueue::waitForQueueRoom() {
+  if (!isQueueFull(1) || discoveryUnblocked_) {
+    return;
+  }
+  VLOG(1) << "Queue is full, discovery waits for blocks to be sent";
+  std::unique_lock<std::mutex> lock(mutex_);
+  // set before checking the queue, consumers check it after popping
+  waitingForRoom_ = true;
+  while (isQueueFull(2) && !discoveryUnblocked_) {
+    conditionQueueRoom_.wait(lock);
+  }
+  waitingForRoom_ = false;
+}
+
+void DirectorySourceQueue::notifyQueueRoom() {
+  if (waitingForRoom_ && !isQueueFull(2)) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    conditionQueueRoom_.notify_one();
+  }
+}
+
 bool DirectorySourceQueue::enqueueFiles() {
   for (const auto &info : fileInfo_) {
     const std::string fullPath = rootDir_ + info.first;
     int64_t filesize;
+    // files given with their size are not looked at before being read
+    bool mayBeSparse = false;
     if (info.second < 0) {
       struct stat fileStat;
       if (stat(fullPath.c_str(), &fileStat) != 0) {
@@ -446,17 +1497,19 @@ bool DirectorySourceQueue::enqueueFiles() {
         return false;
       }
       filesize = fileStat.st_size;
+      mayBeSparse = mayHaveHoles(fileStat);
     } else {
       filesize = info.second;
     }
-    createIntoQueue(fullPath, info.first, filesize, false);
+    createIntoQueue(fullPath, info.first, filesize, false, mayBeSparse);
+    numDirEntries_++;
   }
   return true;
 }
 
 bool DirectorySourceQueue::finished() const {
   std::lock_guard<std::mutex> lock(mutex_);
-  return initFinished_ && sourceQueue_.empty();
+  return initFinished_ && sources_.empty();
 }
 
 int64_t DirectorySourceQueue::getCount() const {
@@ -484,43 +1537,186 @@ bool DirectorySourceQueue::fileDiscoveryFinished() const {
   return initFinished_;
 }
 
+bool DirectorySourceQueue::getDiscoveredFiles(
+    int64_t timeoutMillis, std::vector<std::string> &relPaths) const {
+  std::unique_lock<std::mutex> lock(mutex_);
+  // a bounded queue only gets more files once blocks are sent
+  if (maxQueuedBlocks_ <= 0 && maxQueuedBytes_ <= 0 &&
+      !conditionExplored_.wait_for(
+          lock, std::chrono::milliseconds(timeoutMillis),
+          [this] { return explored_; })) {
+    return false;
+  }
+  const int64_t numFiles = files_.getNumFiles();
+  relPaths.clear();
+  relPaths.reserve(numFiles);
+  for (int64_t file = 0; file < numFiles; file++) {
+    relPaths.emplace_back(files_.getRelPath(file));
+  }
+  return true;
+}
+
+void DirectorySourceQueue::getSmallSources(
+    int consumer, int64_t maxFileSize, int64_t maxTotalSize, int64_t maxCount,
+    std::vector<std::unique_ptr<ByteSource>> &sources) {
+  int64_t totalSize = 0;
+  std::vector<QueuedBlocks> files;
+  sources_.popWhile(consumer, maxCount, [&](const QueuedBlocks &blocks) {
+    const int64_t size = blocks.getSize();
+    const int64_t fileSize = blocks.source
+                                 ? blocks.source->getMetaData().size
+                                 : files_.getSize(blocks.file);
+    if (blocks.numBlocks != 1 || blocks.getOffset() != 0 ||
+        size != fileSize || size > maxFileSize ||
+        totalSize + size > maxTotalSize) {
+      return false;
+    }
+    totalSize += size;
+    return true;
+  }, files);
+  for (auto &file : files) {
+    sources.emplace_back(makeSource(file));
+  }
+  numBlocksDequeued_ += files.size();
+  if (!files.empty()) {
+    notifyQueueRoom();
+  }
+}
+
+std::unique_ptr<ByteSource> DirectorySourceQueue::makeSource(
+    QueuedBlocks &block) {
+  if (block.source) {
+    return std::move(block.source);
+  }
+  // deltaSignatures_ is not modified once blocks are dequeued
+  std::shared_ptr<SourceMetaData> metadata =
+      files_.getMetaData(block.file, [this](SourceMetaData &data) {
+        if (data.allocationStatus == NOT_EXISTS && !deltaSignatures_.empty()) {
+          auto signaturesIt = deltaSignatures_.find(data.relPath);
+          if (signaturesIt != deltaSignatures_.end()) {
+            data.deltaSignatures = signaturesIt->second;
+          }
+        }
+      });
+  return folly::make_unique<FileByteSource>(
+      std::move(metadata), block.blockSize, block.offset,
+      fileSourceBufferSize_);
+}
+
+void DirectorySourceQueue::setThroughput(int consumer,
+                                         int64_t bytesPerSecond) {
+  throughputs_[consumer % numConsumers_] = bytesPerSecond;
+}
+
+int64_t DirectorySourceQueue::getThroughput(int consumer) const {
+  return throughputs_[consumer % numConsumers_].load();
+}
+
+void DirectorySourceQueue::splitTailBlock(int consumer, QueuedBlocks &block) {
+  const int64_t minSize = options_.min_split_block_kbytes * 1024;
+  if (minSize <= 0 || block.blockSize < 2 * minSize) {
+    return;
+  }
+  // share of the bytes left proportional to the throughput of the consumer,
+  // an even share while throughputs are not known
+  const int64_t bytesLeft = sources_.getNumBytes() + block.blockSize;
+  int64_t totalThroughput = 0;
+  for (int i = 0; i < numConsumers_; i++) {
+    totalThroughput += throughputs_[i].load();
+  }
+  const int64_t throughput = getThroughput(consumer);
+  int64_t share = bytesLeft / numConsumers_;
+  if (throughput > 0 && totalThroughput > 0) {
+    share = bytesLeft * ((double)throughput / totalThroughput);
+  }
+  if (share >= block.blockSize) {
+    return;
+  }
+  // offsets stay aligned for O_DIRECT reads
+  share = std::max(share, minSize);
+  share = (share + kDirectIoAlignment - 1) / kDirectIoAlignment *
+          kDirectIoAlignment;
+  if (share >= block.blockSize) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  // while discovery goes on the queue is no indication of the bytes left
+  if (!initFinished_) {
+    return;
+  }
+  // blocks of files with signatures are delta encoded, those aren't split
+  if (!deltaSignatures_.empty() &&
+      deltaSignatures_.find(files_.getRelPath(block.file)) !=
+          deltaSignatures_.end()) {
+    return;
+  }
+  QueuedBlocks rest;
+  rest.file = block.file;
+  rest.offset = block.offset + share;
+  rest.blockSize = block.blockSize - share;
+  rest.location = block.location;
+  block.blockSize = share;
+  VLOG(1) << "split block of " << files_.getRelPath(block.file) << " at "
+          << rest.offset << ", " << rest.blockSize << " bytes queued again";
+  numBlocks_++;
+  sources_.push(std::move(rest));
+}
+
 std::unique_ptr<ByteSource> DirectorySourceQueue::getNextSource(
     ErrorCode &status) {
-  std::unique_ptr<ByteSource> source;
+  return getNextSource(0, status);
+}
+
+std::unique_ptr<ByteSource> DirectorySourceQueue::getNextSource(
+    int consumer, ErrorCode &status) {
+  bool timedOut;
+  return getNextSource(consumer, status, -1, timedOut);
+}
+std::unique_ptr<ByteSource> DirectorySourceQueue::getNextSource(
+    int consumer, ErrorCode &status, int timeoutMillis, bool &timedOut) {
+  timedOut = false;
+  const auto deadline = Clock::now() + std::chrono::milliseconds(timeoutMillis);
+  QueuedBlocks block;
   while (true) {
-    std::unique_lock<std::mutex> lock(mutex_);
-    while (sourceQueue_.empty() && !initFinished_) {
-      conditionNotEmpty_.wait(lock);
-    }
-    if (!failedSourceStats_.empty() || !failedDirectories_.empty()) {
-      status = ERROR;
-    } else {
-      status = OK;
-    }
-    if (sourceQueue_.empty()) {
-      return nullptr;
+    if (!sources_.pop(consumer, block)) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (sources_.empty() && !initFinished_) {
+        if (timeoutMillis < 0) {
+          conditionNotEmpty_.wait(lock);
+        } else if (conditionNotEmpty_.wait_until(lock, deadline) ==
+                       std::cv_status::timeout &&
+                   sources_.empty() && !initFinished_) {
+          timedOut = true;
+          status = hasFailures_ ? ERROR : OK;
+          return nullptr;
+        }
+      }
+      if (sources_.empty()) {
+        status = hasFailures_ ? ERROR : OK;
+        return nullptr;
+      }
+      // sources were added (or are being moved between shards)
+      continue;
     }
-    // using const_cast since priority_queue returns a const reference
-    source = std::move(
-        const_cast<std::unique_ptr<ByteSource> &>(sourceQueue_.top()));
-    sourceQueue_.pop();
-    if (sourceQueue_.empty() && initFinished_) {
-      conditionNotEmpty_.notify_all();
+    notifyQueueRoom();
+    if (!block.source && options_.split_tail_blocks) {
+      splitTailBlock(consumer, block);
     }
-    lock.unlock();
+    std::unique_ptr<ByteSource> source = makeSource(block);
+    status = hasFailures_ ? ERROR : OK;
     VLOG(1) << "got next source " << rootDir_ + source->getIdentifier()
             << " size " << source->getSize();
     // try to open the source
     if (source->open() == OK) {
-      lock.lock();
       numBlocksDequeued_++;
       return source;
     }
     source->close();
     // we need to lock again as we will be adding element to failedSourceStats
     // vector
-    lock.lock();
+    std::lock_guard<std::mutex> lock(mutex_);
     failedSourceStats_.emplace_back(std::move(source->getTransferStats()));
+    hasFailures_ = true;
   }
 }
 }
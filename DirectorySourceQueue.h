@@ -9,11 +9,13 @@
 #pragma once
 
 #include <algorithm>
+#include <atomic>
 #include <condition_variable>
+#include <deque>
 #include <dirent.h>
 #include <glog/logging.h>
 #include <mutex>
-#include <queue>
+#include <set>
 #include <string>
 #include <thread>
 #include <utility>
@@ -23,6 +25,11 @@
 #include "WdtOptions.h"
 #include "FileByteSource.h"
 #include "Protocol.h"
+#include "DeltaTransfer.h"
+#include "PathFilter.h"
+#include "DiscoveryManifest.h"
+#include "FileArena.h"
+#include "SourceShards.h"
 
 namespace facebook {
 namespace wdt {
@@ -30,6 +37,8 @@ namespace wdt {
 /// filename-filesize pair. Negative filesize denotes the entire file.
 typedef std::pair<std::string, int64_t> FileInfo;
 
+class BlockLocator;
+
 /**
  * SourceQueue that returns all the regular files under a given directory
  * (recursively) as individual FileByteSource objects, sorted by decreasing
@@ -80,6 +89,22 @@ class DirectorySourceQueue : public SourceQueue {
   /// @return true if all the files have been discovered, false otherwise
   bool fileDiscoveryFinished() const;
 
+  /**
+   * Waits for the files under root dir to be discovered, not counting the
+   * ones found later while watching (continuous_sync). With a bounded queue
+   * discovery waits for blocks to be sent, so this does not wait and only
+   * gets the files discovered so far.
+   *
+   * @param timeoutMillis   max time to wait
+   * @param relPaths        set to the paths of the files, relative to root
+   *                        dir
+   *
+   * @return                false if discovery did not finish in time,
+   *                        relPaths is then not set
+   */
+  bool getDiscoveredFiles(int64_t timeoutMillis,
+                          std::vector<std::string> &relPaths) const;
+
   /**
    * @param status  this variable is set to the status of the transfer
    *
@@ -87,6 +112,66 @@ class DirectorySourceQueue : public SourceQueue {
    */
   virtual std::unique_ptr<ByteSource> getNextSource(ErrorCode &status) override;
 
+  /**
+   * Same as getNextSource(status), for a given consumer. With
+   * shard_source_queue, each consumer first pops from its own shard of the
+   * queue
+   *
+   * @param consumer  index of the consumer (sender thread)
+   * @param status    this variable is set to the status of the transfer
+   *
+   * @return next FileByteSource to consume or nullptr when finished
+   */
+  std::unique_ptr<ByteSource> getNextSource(int consumer, ErrorCode &status);
+
+  /**
+   * Same as getNextSource(consumer, status), but waits at most timeoutMillis
+   * for a source to be queued while discovery goes on (continuous_sync)
+   *
+   * @param consumer        index of the consumer (sender thread)
+   * @param status          this variable is set to the status of the
+   *                        transfer
+   * @param timeoutMillis   max time to wait, < 0 to wait till a source is
+   *                        queued or discovery finishes
+   * @param timedOut        set to whether the wait timed out
+   *
+   * @return next FileByteSource to consume or nullptr when finished or
+   *         timed out
+   */
+  std::unique_ptr<ByteSource> getNextSource(int consumer, ErrorCode &status,
+                                            int timeoutMillis,
+                                            bool &timedOut);
+
+  /**
+   * Non blocking, moves complete files (single block sources) of at most
+   * maxFileSize bytes from the head of the queue to sources, as long as their
+   * total size stays within maxTotalSize. Since the queue is ordered by
+   * decreasing size, this is meant to be called once a small file has been
+   * returned by getNextSource(). Unlike getNextSource(), the sources are not
+   * opened.
+   *
+   * @param consumer      index of the consumer, as for getNextSource()
+   * @param maxFileSize   max size of a file
+   * @param maxTotalSize  max total size of the returned files
+   * @param maxCount      max number of files to return
+   * @param sources       files are appended here
+   */
+  void getSmallSources(int consumer, int64_t maxFileSize,
+                       int64_t maxTotalSize, int64_t maxCount,
+                       std::vector<std::unique_ptr<ByteSource>> &sources);
+
+  /**
+   * Sets the current throughput of a consumer, used to split the last blocks
+   * in shares the consumers send in about the same time (split_tail_blocks)
+   *
+   * @param consumer          index of the consumer (sender thread)
+   * @param bytesPerSecond    throughput of the consumer
+   */
+  void setThroughput(int consumer, int64_t bytesPerSecond);
+
+  /// @return   throughput of a consumer, 0 if not known yet
+  int64_t getThroughput(int consumer) const;
+
   /// @return         total number of files processed/enqueued
   virtual int64_t getCount() const override;
 
@@ -142,6 +227,14 @@ class DirectorySourceQueue : public SourceQueue {
    */
   void setFollowSymlinks(const bool followSymlinks);
 
+  /**
+   * Sets where the files are sent to, a discovery manifest is only used for
+   * the destination it was written for
+   *
+   * @param destination           receiver host and directory, as known
+   */
+  void setDestination(const std::string &destination);
+
   /**
    * sets chunks which were sent in some previous transfer
    *
@@ -150,6 +243,24 @@ class DirectorySourceQueue : public SourceQueue {
   void setPreviouslyReceivedChunks(
       std::vector<FileChunksInfo> &previouslyTransferredChunks);
 
+  /**
+   * sets signatures of the files existing on the receiver. Files not sent in
+   * a previous transfer which have complete signatures are sent as deltas.
+   * Must be called before setPreviouslyReceivedChunks, which recreates the
+   * queue
+   *
+   * @param fileSignatures    signatures received from the receiver
+   */
+  void setDeltaSignatures(const std::vector<FileSignatures> &fileSignatures);
+
+  /**
+   * Called when the receiver does not support sparse files, which would keep
+   * the previous content of its files where the holes are. The files
+   * discovered from now on are sent entirely, and the holes of the sparse
+   * files already queued are queued as well (read as zeros).
+   */
+  void disableSparseFiles();
+
   /**
    * returns sources to the queue, checks for fail/retries, doesn't increment
    * numentries
@@ -178,6 +289,28 @@ class DirectorySourceQueue : public SourceQueue {
   /// @return   returns list of directories which could not be opened
   std::vector<std::string> &getFailedDirectories();
 
+  /**
+   * Replaces the discovery_manifest by the one written at the end of
+   * discovery. To be called once all the discovered files are sent, so that
+   * the next transfer doesn't skip files which weren't
+   *
+   * @return    false if the manifest could not be replaced
+   */
+  bool commitManifest();
+
+  /**
+   * Stops discovery from waiting for the queue to drain (max_queued_blocks,
+   * max_queued_mbytes). Called once the consumers are done, so that
+   * discovery can finish
+   */
+  void unblockDiscovery();
+
+  /**
+   * Stops watching the directory with continuous_sync. The files already
+   * queued are still sent, and the queue then finishes
+   */
+  void stopWatching();
+
   virtual ~DirectorySourceQueue();
 
   /// Returns the time it took to traverse the directory tree
@@ -185,14 +318,161 @@ class DirectorySourceQueue : public SourceQueue {
     return directoryTime_;
   }
 
+  /// Returns the number of directory entries looked at per second while
+  /// traversing the directory tree
+  double getDirectoryThroughput() const {
+    return directoryTime_ > 0 ? numDirEntries_ / directoryTime_ : 0;
+  }
+
  private:
+  /// regular file found while listing a directory
+  struct DiscoveredFile {
+    /// full path of the symlink target, empty if it's rootDir_ + relPath
+    std::string fullPath;
+    /// path relative to root dir
+    std::string relPath;
+    int64_t size;
+    bool mayBeSparse;
+    /// modification time (ns) and inode
+    int64_t mtime{0};
+    uint64_t inode{0};
+    /// false if the file is the same as in the discovery manifest
+    bool changed{true};
+  };
+
   /**
-   * Traverse rootDir_ to gather files and sizes to enqueue
+   * Directory listed by the discovery threads. Its files are added to the
+   * queue once all the directories before it (in breadth first order) are, so
+   * that seq-ids do not depend on the number of threads or their timing.
+   */
+  struct DiscoveredDir {
+    /// path relative to root dir, with a trailing / (empty for root dir)
+    std::string relPath;
+    /// files in readdir order
+    std::vector<DiscoveredFile> files;
+    /// sub directories in readdir order, pruned ones excluded
+    std::vector<std::unique_ptr<DiscoveredDir>> subDirs;
+    /// whether the directory could not be opened
+    bool openFailed{false};
+    bool hasError{false};
+    /// set once listed, protected by discoveredMutex_
+    bool listed{false};
+    /// modification time (ns) and inode, only set with discovery_manifest
+    int64_t mtime{0};
+    uint64_t inode{0};
+    /// device and inode of the directory, only set when following symlinks
+    std::pair<uint64_t, uint64_t> fileId{0, 0};
+    /// fileId of the parent directories, only set when following symlinks
+    std::vector<std::pair<uint64_t, uint64_t>> ancestors;
+    /**
+     * set when an earlier directory of the traversal is the same directory
+     * (or one of its parents is), its sub directories are not listed then.
+     * Protected by discoveredMutex_
+     */
+    bool duplicate{false};
+    /// inotify watch descriptor with continuous_sync, -1 otherwise
+    int watchDescriptor{-1};
+  };
+
+  /// pending directories of a discovery thread, others steal from the front
+  struct WalkerQueue {
+    std::mutex mutex;
+    std::deque<DiscoveredDir *> dirs;
+  };
+
+  /**
+   * Traverse rootDir_ to gather files and sizes to enqueue. Directories are
+   * listed by num_discovery_threads threads, this thread adds their files to
+   * the queue in order
    *
    * @return                true on success, false on error
    */
   bool explore();
 
+  /// main loop of a discovery thread, lists directories till there are none
+  /// left in any of the walker queues
+  void walkDirectories(int walkerIndex);
+
+  /**
+   * Gets a directory to list, first from the back of the walker's own queue
+   * and then from the front of the others'. Waits while other threads may
+   * still find new directories.
+   *
+   * @return      nullptr once all the directories are listed
+   */
+  DiscoveredDir *getDirectoryToList(int walkerIndex);
+
+  /// adds the sub directories of a listed directory to a walker's queue
+  void addDirectoriesToList(int walkerIndex, DiscoveredDir &dir);
+
+  /// waits while max_queued_blocks listed files are waiting to be added to
+  /// the queue, unless explore() waits for a directory to be listed
+  void waitToListDirectory();
+
+  /// reads the entries of a directory, filling its files and sub directories
+  void listDirectory(DiscoveredDir &dir);
+
+  /**
+   * When following symlinks, the same directory can be reached by several
+   * paths. Only the first one in the order of the traversal is kept, so
+   * that seqIds don't depend on which discovery thread lists it first. Must
+   * be called in that order by the thread building the queue.
+   *
+   * @param dir   listed directory
+   *
+   * @return      whether the directory was already reached by another path,
+   *              its sub directories are marked as duplicates too then
+   */
+  bool isDuplicateDirectory(DiscoveredDir &dir);
+
+  /**
+   * Fills the files and sub directories of a directory from the discovery
+   * manifest, with manifest_trust_dir_mtime
+   *
+   * @return    false if the directory changed since the manifest
+   */
+  bool listDirectoryFromManifest(DiscoveredDir &dir);
+
+  /// @return   whether a file is kept by the include and exclude patterns
+  bool isFileIncluded(const std::string &relPath) const;
+
+  /// starts watching the directories listed from now on, continuous_sync
+  void startWatching();
+
+  /**
+   * adds an inotify watch on a directory being listed. When following
+   * symlinks, the watch is only mapped to the directory's path by
+   * isDuplicateDirectory(), for the path kept
+   */
+  void addWatch(DiscoveredDir &dir);
+
+  /**
+   * Queues the files closed or moved into the watched directories, and what
+   * is appended to the files being written, till stopWatching() is called
+   *
+   * @return    false on error
+   */
+  bool watch();
+
+  /// lists a directory and its sub directories found while watching, and
+  /// queues their new files
+  void syncDirectory(const std::string &dirRelPath);
+
+  /// stats a file found while watching and queues what wasn't sent of it
+  void syncFile(const std::string &relPath);
+
+  /**
+   * Queues what wasn't already sent of a file while watching. Files are
+   * expected to only be appended to, or replaced: data appended since the
+   * last time is queued alone, otherwise the whole file is
+   */
+  void syncFile(const DiscoveredFile &file);
+
+  /// @return   fingerprint of the options changing which files are found and
+  ///           of the destination, a discovery manifest can only be used
+  ///           with the same ones
+  uint64_t getDiscoveryFingerprint() const;
+
   /**
    * Stat the input files and populate queue
    * @return                true on success, false on error
@@ -208,9 +488,64 @@ class DirectorySourceQueue : public SourceQueue {
    * @param fileSize             size of the file
    * @param alreadyLocked        whether lock has already been acquired by the
    *                             calling method
+   * @param mayBeSparse          whether the file may have holes, its data
+   *                             extents are then looked up
+   * @param startOffset          offset from which to send the file, the
+   *                             receiver already has the data before it.
+   *                             Not sent as sparse then
    */
   void createIntoQueue(const std::string &fullPath, const std::string &relPath,
-                       const int64_t fileSize, bool alreadyLocked);
+                       const int64_t fileSize, bool alreadyLocked,
+                       bool mayBeSparse, int64_t startOffset = 0);
+
+  /**
+   * queues the blocks of chunks of a file and counts them in the bytes of
+   * the file to send. Must be called with mutex_ held
+   *
+   * @param file        index of the file in files_
+   * @param chunks      ranges of the file to send
+   * @param blockSize   size of the blocks, 0 for a single block per chunk
+   * @param locator     if not null, orders the blocks by disk location
+   *
+   * @return            number of blocks queued
+   */
+  int64_t queueChunks(int64_t file, const std::vector<Interval> &chunks,
+                      int64_t blockSize, BlockLocator *locator);
+
+  /**
+   * @param divisor   fraction of the limits to check
+   *
+   * @return          whether more than 1/divisor of max_queued_blocks or of
+   *                  max_queued_mbytes is queued
+   */
+  bool isQueueFull(int divisor) const;
+
+  /// waits once the queue is full till it is half empty
+  void waitForQueueRoom();
+
+  /// wakes up discovery if it waits for room in the queue and there is
+  void notifyQueueRoom();
+
+  /**
+   * Turns a block popped from the queue into a source, creating the metadata
+   * of its file if no other source uses it
+   *
+   * @param block     single block entry popped from sources_
+   *
+   * @return          the source
+   */
+  std::unique_ptr<ByteSource> makeSource(QueuedBlocks &block);
+
+  /**
+   * Once discovery is over, splits a popped block larger than the share of
+   * the bytes left the consumer should send (split_tail_blocks): the rest of
+   * the block is queued again. Blocks of files delta encoded against the
+   * receiver's signatures are not split
+   *
+   * @param consumer  index of the consumer
+   * @param block     single block entry popped from sources_, not a retry
+   */
+  void splitTailBlock(int consumer, QueuedBlocks &block);
 
   /**
    * when adding multiple files, we have the option of using notify_one multiple
@@ -242,10 +577,11 @@ class DirectorySourceQueue : public SourceQueue {
   /// List of files to enqueue instead of recursing over rootDir_.
   std::vector<FileInfo> fileInfo_;
 
-  /// protects initCalled_/initFinished_/sourceQueue_
+  /// protects initCalled_/initFinished_ and the additions to files_ and
+  /// sources_
   mutable std::mutex mutex_;
 
-  /// condition variable indicating sourceQueue_ is not empty
+  /// condition variable indicating sources_ is not empty
   mutable std::condition_variable conditionNotEmpty_;
 
   /// Indicates whether init() has been called to prevent multiple calls
@@ -254,38 +590,29 @@ class DirectorySourceQueue : public SourceQueue {
   /// Indicates whether call to init() has finished
   bool initFinished_{false};
 
-  struct SourceComparator {
-    bool operator()(const std::unique_ptr<ByteSource> &source1,
-                    const std::unique_ptr<ByteSource> &source2) {
-      auto retryCount1 = source1->getTransferStats().getFailedAttempts();
-      auto retryCount2 = source2->getTransferStats().getFailedAttempts();
-      if (retryCount1 != retryCount2) {
-        return retryCount1 > retryCount2;
-      }
-      if (source1->getSize() != source2->getSize()) {
-        return source1->getSize() < source2->getSize();
-      }
-      if (source1->getOffset() != source2->getOffset()) {
-        return source1->getOffset() > source2->getOffset();
-      }
-      return source1->getIdentifier() > source2->getIdentifier();
-    }
-  };
+  /// whether the files under root dir have been discovered, set before
+  /// watching them with continuous_sync
+  bool explored_{false};
+
+  /// signaled once explored_ is set
+  mutable std::condition_variable conditionExplored_;
+
+  /// files queued, their metadata only exists while their blocks are sent
+  FileArena files_;
 
   /**
-   * priority queue of sources. Sources are first ordered by increasing
-   * failedAttempts, then by decreasing size. If sizes are equal(always for
-   * blocks), sources are ordered by offset. This way, we ensure that all the
-   * threads in the receiver side are not writing to the same file at the same
-   * time.
+   * blocks to send, ordered by SourceComparator. Blocks are added with
+   * mutex_ held, so that consumers waiting on conditionNotEmpty_ don't miss
+   * them, but are popped without it
    */
-  std::priority_queue<std::unique_ptr<ByteSource>,
-                      std::vector<std::unique_ptr<ByteSource>>,
-                      SourceComparator> sourceQueue_;
+  SourceShards sources_;
 
   /// Transfer stats for sources which are not transferred
   std::vector<TransferStats> failedSourceStats_;
 
+  /// whether failedSourceStats_ or failedDirectories_ is not empty
+  std::atomic<bool> hasFailures_{false};
+
   /// directories which could not be opened
   std::vector<std::string> failedDirectories_;
 
@@ -304,23 +631,121 @@ class DirectorySourceQueue : public SourceQueue {
   int64_t totalFileSize_{0};
 
   /// Number of blocks dequeued
-  int64_t numBlocksDequeued_{0};
+  std::atomic<int64_t> numBlocksDequeued_{0};
+
+  /// throughput of each consumer in bytes/sec, num_ports entries
+  std::unique_ptr<std::atomic<int64_t>[]> throughputs_;
+  int numConsumers_{1};
+
+  /// max number of blocks and of bytes queued, unbounded if <= 0
+  int64_t maxQueuedBlocks_{0};
+  int64_t maxQueuedBytes_{0};
+
+  /// whether discovery waits on conditionQueueRoom_
+  std::atomic<bool> waitingForRoom_{false};
+
+  /// condition variable indicating blocks were popped from a full queue
+  std::condition_variable conditionQueueRoom_;
+
+  /// set once discovery must not wait for the queue to drain anymore
+  std::atomic<bool> discoveryUnblocked_{false};
 
   /// Whether to follow symlinks or not
   bool followSymlinks_{false};
 
-  /// shared file data. this are used during transfer to add blocks
-  /// contribution
-  std::vector<SourceMetaData *> sharedFileData_;
+  /// where the files are sent to, part of the discovery fingerprint
+  std::string destination_;
 
   /// A map from relative file name to previously received chunks
   std::unordered_map<std::string, FileChunksInfo> previouslyTransferredChunks_;
 
+  /// A map from relative file name to signatures of the receiver's copy
+  std::unordered_map<std::string, std::shared_ptr<DeltaSignatures>>
+      deltaSignatures_;
+
+  /// set by disableSparseFiles()
+  bool sparseFilesDisabled_{false};
+  /// holes not queued of the sparse files, by index of the file in files_,
+  /// in case the receiver turns out not to support them
+  std::vector<std::pair<int64_t, std::vector<Interval>>> sparseHoles_;
+
   const WdtOptions &options_;
 
   /// Stores the time difference between the start and the end of the
   /// traversal of directory
   double directoryTime_{0};
+
+  /// number of directory entries looked at during discovery
+  std::atomic<int64_t> numDirEntries_{0};
+
+  /// manifest of the previous transfer, set before the discovery threads
+  /// start, null without discovery_manifest or if there is none
+  std::unique_ptr<DiscoveryManifest> manifest_;
+
+  /// entries found by this discovery, only used by explore()
+  std::unique_ptr<DiscoveryManifestWriter> manifestWriter_;
+
+  /// manifest written at the end of discovery, empty if none
+  std::string newManifestPath_;
+
+  /// number of files not queued since they are unchanged
+  int64_t numUnchangedFiles_{0};
+
+  /// compiled patterns, set before the discovery threads start
+  PathFilter includeFilter_;
+  PathFilter excludeFilter_;
+  PathFilter pruneDirFilter_;
+
+  /// queues of directories to list, one per discovery thread
+  std::unique_ptr<WalkerQueue[]> walkerQueues_;
+  int numWalkers_{0};
+
+  /// number of directories queued and not yet listed
+  int64_t numDirsToList_{0};
+  /// number of discovery threads waiting for directories
+  int numIdleWalkers_{0};
+  /// number of listed files not yet added to the queue, only counted with
+  /// max_queued_blocks
+  int64_t numFilesToAdd_{0};
+  /// whether explore() waits for a directory to be listed
+  bool exploreWaiting_{false};
+  /// protects numDirsToList_, numIdleWalkers_, numFilesToAdd_ and
+  /// exploreWaiting_
+  std::mutex walkMutex_;
+  /// condition variable indicating directories were queued or that all of
+  /// them are listed
+  std::condition_variable conditionDirsToList_;
+  /// condition variable indicating listed files were added to the queue,
+  /// that explore() waits for a directory or that discovery is unblocked
+  std::condition_variable conditionFilesAdded_;
+
+  /// protects the listed flag of directories
+  std::mutex discoveredMutex_;
+  /// condition variable indicating a directory was listed
+  std::condition_variable conditionDirListed_;
+
+  /// what was queued of a file with continuous_sync
+  struct SyncedFile {
+    int64_t size;
+    int64_t mtime;
+    uint64_t inode;
+  };
+
+  /// inotify instance with continuous_sync, -1 otherwise
+  int inotifyFd_{-1};
+  /// relative paths of the watched directories by watch descriptor
+  std::unordered_map<int, std::string> watchedDirs_;
+  /// protects watchedDirs_, directories are watched by the discovery threads
+  std::mutex watchMutex_;
+  /// files queued so far by relative path, only used by the thread building
+  /// the queue
+  std::unordered_map<std::string, SyncedFile> syncedFiles_;
+  /// set by stopWatching()
+  std::atomic<bool> stopWatching_{false};
+
+  /// fileId of the directories visited when following symlinks, only used by
+  /// the thread building the queue
+  std::set<std::pair<uint64_t, uint64_t>> visited_;
 };
 }
 }
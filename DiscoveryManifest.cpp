@@ -0,0 +1,316 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include "DiscoveryManifest.h"
+
+#include <algorithm>
+#include <cstring>
+#include <errno.h>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace facebook {
+namespace wdt {
+
+namespace {
+const char kManifestMagic[8] = {'W', 'D', 'T', 'M', 'N', 'F', 'S', 'T'};
+const uint32_t kManifestVersion = 1;
+
+struct ManifestHeader {
+  char magic[8];
+  uint32_t version;
+  /// sizeof(ManifestRecord), in case the layout changes
+  uint32_t recordSize;
+  uint64_t fingerprint;
+  int64_t numRecords;
+  int64_t stringsLength;
+  int64_t rootMtime;
+  uint64_t rootInode;
+};
+
+/// @return   length of the parent directory part of a relative path,
+///           including its trailing '/'
+int64_t getParentLength(const char *path, int64_t length) {
+  int64_t end = length;
+  if (end > 0 && path[end - 1] == '/') {
+    // directories end with '/'
+    end--;
+  }
+  while (end > 0 && path[end - 1] != '/') {
+    end--;
+  }
+  return end;
+}
+
+/// compares 2 byte strings like std::string::compare
+int compareBytes(const char *str1, int64_t length1, const char *str2,
+                 int64_t length2) {
+  const int res = memcmp(str1, str2, std::min(length1, length2));
+  if (res != 0) {
+    return res;
+  }
+  return (length1 < length2) ? -1 : (length1 > length2 ? 1 : 0);
+}
+
+/// writes all of buf, @return false on error
+bool writeFully(int fd, const void *buf, int64_t length) {
+  const char *ptr = static_cast<const char *>(buf);
+  while (length > 0) {
+    const ssize_t written = ::write(fd, ptr, length);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    ptr += written;
+    length -= written;
+  }
+  return true;
+}
+}
+
+const uint32_t DiscoveryManifest::kDirectory;
+
+std::unique_ptr<DiscoveryManifest> DiscoveryManifest::open(
+    const std::string &path, uint64_t fingerprint) {
+  int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (errno == ENOENT) {
+      LOG(INFO) << "No discovery manifest " << path << ", full discovery";
+    } else {
+      PLOG(ERROR) << "Unable to open discovery manifest " << path;
+    }
+    return nullptr;
+  }
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) != 0) {
+    PLOG(ERROR) << "fstat failed for " << path;
+    ::close(fd);
+    return nullptr;
+  }
+  const int64_t length = fileStat.st_size;
+  if (length < (int64_t)sizeof(ManifestHeader)) {
+    LOG(ERROR) << "Discovery manifest " << path << " is truncated";
+    ::close(fd);
+    return nullptr;
+  }
+  void *map = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  // the mapping stays valid once the fd is closed
+  ::close(fd);
+  if (map == MAP_FAILED) {
+    PLOG(ERROR) << "mmap failed for " << path;
+    return nullptr;
+  }
+  std::unique_ptr<DiscoveryManifest> manifest(new DiscoveryManifest());
+  manifest->map_ = map;
+  manifest->mapLength_ = length;
+  const ManifestHeader *header = static_cast<const ManifestHeader *>(map);
+  if (memcmp(header->magic, kManifestMagic, sizeof(kManifestMagic)) != 0 ||
+      header->version != kManifestVersion ||
+      header->recordSize != sizeof(ManifestRecord)) {
+    LOG(ERROR) << path << " is not a discovery manifest of this version";
+    return nullptr;
+  }
+  if (header->fingerprint != fingerprint) {
+    LOG(WARNING) << "Discovery manifest " << path
+                 << " was written with other discovery options or for another "
+                 << "destination, ignoring it";
+    return nullptr;
+  }
+  const int64_t numRecords = header->numRecords;
+  const int64_t stringsLength = header->stringsLength;
+  if (numRecords < 0 || stringsLength < 0 ||
+      numRecords > (length - (int64_t)sizeof(ManifestHeader)) /
+                       (int64_t)sizeof(ManifestRecord) ||
+      (int64_t)sizeof(ManifestHeader) +
+              numRecords * (int64_t)sizeof(ManifestRecord) + stringsLength !=
+          length) {
+    LOG(ERROR) << "Discovery manifest " << path << " is corrupted";
+    return nullptr;
+  }
+  const char *start = static_cast<const char *>(map);
+  manifest->records_ =
+      reinterpret_cast<const ManifestRecord *>(start + sizeof(ManifestHeader));
+  manifest->numRecords_ = numRecords;
+  manifest->strings_ = start + sizeof(ManifestHeader) +
+                       numRecords * sizeof(ManifestRecord);
+  manifest->rootMtime_ = header->rootMtime;
+  manifest->rootInode_ = header->rootInode;
+  for (int64_t i = 0; i < numRecords; i++) {
+    const ManifestRecord &record = manifest->records_[i];
+    if (record.pathOffset > (uint64_t)stringsLength ||
+        record.pathLength > stringsLength - record.pathOffset) {
+      LOG(ERROR) << "Discovery manifest " << path << " is corrupted";
+      return nullptr;
+    }
+  }
+  LOG(INFO) << "Using discovery manifest " << path << " of " << numRecords
+            << " entries";
+  return manifest;
+}
+
+DiscoveryManifest::~DiscoveryManifest() {
+  if (map_ && munmap(map_, mapLength_) != 0) {
+    PLOG(ERROR) << "munmap failed for the discovery manifest";
+  }
+}
+
+int DiscoveryManifest::compareParent(const ManifestRecord &record,
+                                     const std::string &parent) const {
+  const char *path = strings_ + record.pathOffset;
+  return compareBytes(path, getParentLength(path, record.pathLength),
+                      parent.data(), parent.size());
+}
+
+std::pair<int64_t, int64_t> DiscoveryManifest::getDirectoryEntries(
+    const std::string &dirRelPath) const {
+  const ManifestRecord *end = records_ + numRecords_;
+  const ManifestRecord *first = std::lower_bound(
+      records_, end, dirRelPath,
+      [this](const ManifestRecord &record, const std::string &parent) {
+        return compareParent(record, parent) < 0;
+      });
+  const ManifestRecord *last = std::upper_bound(
+      first, end, dirRelPath,
+      [this](const std::string &parent, const ManifestRecord &record) {
+        return compareParent(record, parent) > 0;
+      });
+  return std::make_pair(first - records_, last - records_);
+}
+
+const DiscoveryManifest::ManifestRecord *DiscoveryManifest::find(
+    const std::pair<int64_t, int64_t> &entries,
+    const std::string &relPath) const {
+  // the entries of a directory all have the same parent, ordering them by
+  // name is ordering them by path
+  const ManifestRecord *end = records_ + entries.second;
+  const ManifestRecord *record = std::lower_bound(
+      records_ + entries.first, end, relPath,
+      [this](const ManifestRecord &entry, const std::string &path) {
+        return compareBytes(strings_ + entry.pathOffset, entry.pathLength,
+                            path.data(), path.size()) < 0;
+      });
+  if (record == end || record->pathLength != relPath.size() ||
+      memcmp(strings_ + record->pathOffset, relPath.data(),
+             relPath.size()) != 0) {
+    return nullptr;
+  }
+  return record;
+}
+
+bool DiscoveryManifest::isDirectoryUnchanged(const std::string &dirRelPath,
+                                             int64_t mtime,
+                                             uint64_t inode) const {
+  if (dirRelPath.empty()) {
+    return rootMtime_ == mtime && rootInode_ == inode;
+  }
+  const std::string parent(
+      dirRelPath, 0, getParentLength(dirRelPath.data(), dirRelPath.size()));
+  const ManifestRecord *record =
+      find(getDirectoryEntries(parent), dirRelPath);
+  return record && (record->flags & kDirectory) && record->mtime == mtime &&
+         record->inode == inode;
+}
+
+void DiscoveryManifestWriter::setRoot(int64_t mtime, uint64_t inode) {
+  rootMtime_ = mtime;
+  rootInode_ = inode;
+}
+
+void DiscoveryManifestWriter::addDirectory(const std::string &relPath,
+                                           int64_t mtime, uint64_t inode) {
+  addRecord(relPath, DiscoveryManifest::kDirectory, 0, mtime, inode);
+}
+
+void DiscoveryManifestWriter::addFile(const std::string &relPath,
+                                      int64_t size, int64_t mtime,
+                                      uint64_t inode) {
+  addRecord(relPath, 0, size, mtime, inode);
+}
+
+void DiscoveryManifestWriter::addRecord(const std::string &relPath,
+                                        uint32_t flags, int64_t size,
+                                        int64_t mtime, uint64_t inode) {
+  DiscoveryManifest::ManifestRecord record;
+  record.pathOffset = strings_.size();
+  record.pathLength = relPath.size();
+  record.flags = flags;
+  record.size = size;
+  record.mtime = mtime;
+  record.inode = inode;
+  records_.push_back(record);
+  strings_.append(relPath);
+}
+
+bool DiscoveryManifestWriter::write(const std::string &path,
+                                    uint64_t fingerprint) {
+  const char *strings = strings_.data();
+  // grouped by parent directory, then by name
+  std::sort(records_.begin(), records_.end(),
+            [strings](const DiscoveryManifest::ManifestRecord &record1,
+                      const DiscoveryManifest::ManifestRecord &record2) {
+              const char *path1 = strings + record1.pathOffset;
+              const char *path2 = strings + record2.pathOffset;
+              const int64_t parentLength1 =
+                  getParentLength(path1, record1.pathLength);
+              const int64_t parentLength2 =
+                  getParentLength(path2, record2.pathLength);
+              const int res = compareBytes(path1, parentLength1, path2,
+                                           parentLength2);
+              if (res != 0) {
+                return res < 0;
+              }
+              return compareBytes(path1 + parentLength1,
+                                  record1.pathLength - parentLength1,
+                                  path2 + parentLength2,
+                                  record2.pathLength - parentLength2) < 0;
+            });
+  ManifestHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kManifestMagic, sizeof(kManifestMagic));
+  header.version = kManifestVersion;
+  header.recordSize = sizeof(DiscoveryManifest::ManifestRecord);
+  header.fingerprint = fingerprint;
+  header.numRecords = records_.size();
+  header.stringsLength = strings_.size();
+  header.rootMtime = rootMtime_;
+  header.rootInode = rootInode_;
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                  0644);
+  if (fd < 0) {
+    PLOG(ERROR) << "Unable to create discovery manifest " << path;
+    return false;
+  }
+  bool success =
+      writeFully(fd, &header, sizeof(header)) &&
+      writeFully(fd, records_.data(),
+                 records_.size() *
+                     sizeof(DiscoveryManifest::ManifestRecord)) &&
+      writeFully(fd, strings_.data(), strings_.size());
+  if (!success) {
+    PLOG(ERROR) << "Unable to write discovery manifest " << path;
+  } else if (fsync(fd) != 0) {
+    PLOG(ERROR) << "fsync failed for discovery manifest " << path;
+    success = false;
+  }
+  if (::close(fd) != 0) {
+    PLOG(ERROR) << "close failed for discovery manifest " << path;
+    success = false;
+  }
+  if (success) {
+    LOG(INFO) << "Wrote discovery manifest " << path << " of "
+              << records_.size() << " entries";
+  }
+  return success;
+}
+}
+}
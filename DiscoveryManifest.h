@@ -0,0 +1,188 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Manifest of the files and directories found by a discovery, so that the
+ * next discovery of the same tree only queues the files which changed since
+ * and can reuse the listing of directories which didn't change.
+ *
+ * On disk (native endianness, the manifest is a local cache):
+ *  - ManifestHeader
+ *  - ManifestRecord array, grouped by parent directory and sorted by name
+ *    in each group. The entries of a directory are thus contiguous and are
+ *    found with a binary search
+ *  - the relative paths, directories ending with '/'
+ * The file is memory mapped and used as is.
+ */
+class DiscoveryManifest {
+ public:
+  /// an entry of the manifest
+  struct ManifestRecord {
+    /// offset of the relative path in the strings
+    uint64_t pathOffset;
+    uint32_t pathLength;
+    /// kDirectory
+    uint32_t flags;
+    /// size of a file, 0 for a directory
+    int64_t size;
+    /// modification time in ns
+    int64_t mtime;
+    uint64_t inode;
+  };
+
+  static const uint32_t kDirectory = 1;
+
+  /**
+   * Maps a manifest
+   *
+   * @param path          path of the manifest
+   * @param fingerprint   fingerprint of the discovery options, a manifest
+   *                      written with other options is not used
+   *
+   * @return              the manifest, nullptr if it doesn't exist or can't
+   *                      be used
+   */
+  static std::unique_ptr<DiscoveryManifest> open(const std::string &path,
+                                                 uint64_t fingerprint);
+
+  ~DiscoveryManifest();
+
+  /// @return   modification time of the root directory
+  int64_t getRootMtime() const {
+    return rootMtime_;
+  }
+
+  /// @return   inode of the root directory
+  uint64_t getRootInode() const {
+    return rootInode_;
+  }
+
+  /**
+   * @param dirRelPath    relative path of a directory, ending with '/' or
+   *                      empty for the root directory
+   * @param mtime         current modification time of the directory
+   * @param inode         current inode of the directory
+   *
+   * @return              whether the directory is in the manifest with the
+   *                      same mtime and inode, so it has the same entries
+   */
+  bool isDirectoryUnchanged(const std::string &dirRelPath, int64_t mtime,
+                            uint64_t inode) const;
+
+  /**
+   * @param dirRelPath    relative path of a directory, ending with '/' or
+   *                      empty for the root directory
+   *
+   * @return              range [first, last) of the entries of the
+   *                      directory, empty if it is not in the manifest
+   */
+  std::pair<int64_t, int64_t> getDirectoryEntries(
+      const std::string &dirRelPath) const;
+
+  /**
+   * Looks up an entry of a directory
+   *
+   * @param entries   entries of the directory, @see getDirectoryEntries()
+   * @param relPath   relative path of the entry, ending with '/' for a
+   *                  directory
+   *
+   * @return          the entry, nullptr if it is not in the manifest
+   */
+  const ManifestRecord *find(const std::pair<int64_t, int64_t> &entries,
+                             const std::string &relPath) const;
+
+  /// @return   an entry
+  const ManifestRecord &getRecord(int64_t index) const {
+    return records_[index];
+  }
+
+  /// @return   relative path of an entry
+  std::string getRelPath(const ManifestRecord &record) const {
+    return std::string(strings_ + record.pathOffset, record.pathLength);
+  }
+
+  /// @return   number of entries
+  int64_t getNumRecords() const {
+    return numRecords_;
+  }
+
+ private:
+  DiscoveryManifest() {
+  }
+
+  /// @return   <0, 0 or >0 comparing the parent directory of an entry
+  ///           with the given one
+  int compareParent(const ManifestRecord &record,
+                    const std::string &parent) const;
+
+  /// start and length of the mapping
+  void *map_{nullptr};
+  int64_t mapLength_{0};
+
+  const ManifestRecord *records_{nullptr};
+  int64_t numRecords_{0};
+  const char *strings_{nullptr};
+  int64_t rootMtime_{0};
+  uint64_t rootInode_{0};
+};
+
+/**
+ * Collects the entries of a discovery and writes them as a manifest. Not
+ * thread safe.
+ */
+class DiscoveryManifestWriter {
+ public:
+  /// adds the root directory
+  void setRoot(int64_t mtime, uint64_t inode);
+
+  /// adds a directory, relPath ending with '/'
+  void addDirectory(const std::string &relPath, int64_t mtime,
+                    uint64_t inode);
+
+  /// adds a file
+  void addFile(const std::string &relPath, int64_t size, int64_t mtime,
+               uint64_t inode);
+
+  /// @return   number of entries added
+  int64_t getNumRecords() const {
+    return records_.size();
+  }
+
+  /**
+   * Writes the manifest
+   *
+   * @param path          path of the manifest
+   * @param fingerprint   fingerprint of the discovery options
+   *
+   * @return              true on success
+   */
+  bool write(const std::string &path, uint64_t fingerprint);
+
+ private:
+  void addRecord(const std::string &relPath, uint32_t flags, int64_t size,
+                 int64_t mtime, uint64_t inode);
+
+  std::vector<DiscoveryManifest::ManifestRecord> records_;
+  /// relative paths of the records
+  std::string strings_;
+  int64_t rootMtime_{0};
+  uint64_t rootInode_{0};
+};
+}
+}
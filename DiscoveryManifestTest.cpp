@@ -0,0 +1,114 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include "DiscoveryManifest.h"
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <fstream>
+#include <stdlib.h>
+#include <unistd.h>
+using namespace std;
+namespace facebook {
+namespace wdt {
+
+class DiscoveryManifestTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    char path[] = "/tmp/wdt_manifest_test.XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_GE(fd, 0);
+    close(fd);
+    path_ = path;
+  }
+
+  void TearDown() override {
+    unlink(path_.c_str());
+  }
+
+  /// writes a manifest of a small tree, added out of order
+  void writeManifest(uint64_t fingerprint) {
+    DiscoveryManifestWriter writer;
+    writer.setRoot(100, 1);
+    writer.addFile("b/y", 20, 200, 6);
+    writer.addDirectory("b/", 110, 3);
+    writer.addFile("z", 30, 300, 7);
+    writer.addDirectory("a/", 120, 2);
+    writer.addFile("a/x", 10, 100, 4);
+    writer.addDirectory("a/c/", 130, 5);
+    writer.addFile("a/c/w", 40, 400, 8);
+    EXPECT_EQ(7, writer.getNumRecords());
+    ASSERT_TRUE(writer.write(path_, fingerprint));
+  }
+
+  string path_;
+};
+
+TEST_F(DiscoveryManifestTest, RoundTrip) {
+  writeManifest(42);
+  unique_ptr<DiscoveryManifest> manifest = DiscoveryManifest::open(path_, 42);
+  ASSERT_TRUE(manifest != nullptr);
+  EXPECT_EQ(7, manifest->getNumRecords());
+  EXPECT_EQ(100, manifest->getRootMtime());
+  EXPECT_EQ(1, manifest->getRootInode());
+
+  auto entries = manifest->getDirectoryEntries("");
+  vector<string> relPaths;
+  for (int64_t i = entries.first; i < entries.second; i++) {
+    relPaths.push_back(manifest->getRelPath(manifest->getRecord(i)));
+  }
+  EXPECT_EQ((vector<string>{"a/", "b/", "z"}), relPaths);
+  entries = manifest->getDirectoryEntries("a/");
+  EXPECT_EQ(2, entries.second - entries.first);
+  entries = manifest->getDirectoryEntries("missing/");
+  EXPECT_EQ(entries.first, entries.second);
+
+  const auto *record = manifest->find(manifest->getDirectoryEntries("a/c/"),
+                                      "a/c/w");
+  ASSERT_TRUE(record != nullptr);
+  EXPECT_EQ(40, record->size);
+  EXPECT_EQ(400, record->mtime);
+  EXPECT_EQ(8, record->inode);
+  EXPECT_EQ(0, record->flags & DiscoveryManifest::kDirectory);
+  EXPECT_TRUE(manifest->find(manifest->getDirectoryEntries("a/"), "a/c/w") ==
+              nullptr);
+  EXPECT_TRUE(manifest->find(manifest->getDirectoryEntries(""), "y") ==
+              nullptr);
+
+  EXPECT_TRUE(manifest->isDirectoryUnchanged("", 100, 1));
+  EXPECT_FALSE(manifest->isDirectoryUnchanged("", 101, 1));
+  EXPECT_TRUE(manifest->isDirectoryUnchanged("a/c/", 130, 5));
+  EXPECT_FALSE(manifest->isDirectoryUnchanged("a/c/", 130, 9));
+  EXPECT_FALSE(manifest->isDirectoryUnchanged("d/", 130, 5));
+}
+
+TEST_F(DiscoveryManifestTest, Unusable) {
+  writeManifest(42);
+  // written with other discovery options
+  EXPECT_TRUE(DiscoveryManifest::open(path_, 43) == nullptr);
+  EXPECT_TRUE(DiscoveryManifest::open(path_ + ".missing", 42) == nullptr);
+  // truncated
+  ASSERT_EQ(0, truncate(path_.c_str(), 100));
+  EXPECT_TRUE(DiscoveryManifest::open(path_, 42) == nullptr);
+  {
+    ofstream out(path_, ios::trunc);
+    out << "not a manifest, long enough to hold a header of a manifest";
+  }
+  EXPECT_TRUE(DiscoveryManifest::open(path_, 42) == nullptr);
+}
+}
+}
+
+int main(int argc, char *argv[]) {
+  FLAGS_logtostderr = true;
+  testing::InitGoogleTest(&argc, argv);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  int ret = RUN_ALL_TESTS();
+  return ret;
+}
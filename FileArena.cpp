@@ -0,0 +1,269 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include "FileArena.h"
+#include "ErrorCodes.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace facebook {
+namespace wdt {
+
+const FileArena::StringOffset FileArena::kNoString;
+const int64_t FileArena::kMaxChunks;
+const int64_t FileArena::kStringChunkBits;
+const int64_t FileArena::kNumMetadataLocks;
+
+template <typename T>
+void FileArena::ChunkedArray<T>::reserve(int64_t index) {
+  const int64_t chunk = index >> kChunkBits;
+  WDT_CHECK_LT(chunk, kMaxChunks);
+  if (!chunks_[chunk]) {
+    chunks_[chunk].reset(new T[1 << kChunkBits]);
+  }
+}
+
+FileArena::FileArena(const std::string &rootDir)
+    : rootDir_(rootDir),
+      stringChunks_(new std::unique_ptr<char[]>[kMaxChunks]) {
+}
+
+FileArena::~FileArena() {
+  clear();
+}
+
+int64_t FileArena::addFile(const std::string &fullPath,
+                           const std::string &relPath, int64_t size,
+                           int64_t seqId, int64_t prevSeqId,
+                           FileAllocationStatus allocationStatus,
+                           bool sparse) {
+  const size_t slash = relPath.rfind('/');
+  const size_t dirLength = (slash == std::string::npos) ? 0 : slash + 1;
+  const int64_t file = numFiles_;
+  records_.reserve(file);
+  FileRecord &record = records_[file];
+  record.size = size;
+  record.sendSize = 0;
+  record.seqId = seqId;
+  record.prevSeqId = prevSeqId;
+  record.dir = addDirectory(relPath, dirLength);
+  record.name = addString(relPath.data() + dirLength,
+                          relPath.size() - dirLength);
+  // symlinks followed are the only files not under the root directory
+  const bool underRoot = fullPath.size() == rootDir_.size() + relPath.size() &&
+                         fullPath.compare(0, rootDir_.size(), rootDir_) == 0 &&
+                         fullPath.compare(rootDir_.size(), std::string::npos,
+                                          relPath) == 0;
+  record.fullPath =
+      underRoot ? kNoString : addString(fullPath.data(), fullPath.size());
+  record.allocationStatus = allocationStatus;
+  record.sparse = sparse;
+  record.metadata.reset();
+  numFiles_++;
+  return file;
+}
+
+FileArena::StringOffset FileArena::addString(const char *str,
+                                             int64_t length) {
+  const int64_t chunkSize = 1LL << kStringChunkBits;
+  // varint length prefix, a single byte for names shorter than 128 bytes
+  int64_t prefixLength = 1;
+  for (int64_t l = length; l >= 0x80; l >>= 7) {
+    prefixLength++;
+  }
+  const int64_t totalLength = prefixLength + length;
+  int64_t chunk = numStringChunks_ - 1;
+  if (totalLength > chunkSize) {
+    // too long for a chunk, gets its own
+    chunk = numStringChunks_++;
+    WDT_CHECK_LT(chunk, kMaxChunks);
+    stringChunks_[chunk].reset(new char[totalLength]);
+    // the next string starts a new chunk
+    stringChunkEnd_ = chunkSize;
+  } else if (chunk < 0 || stringChunkEnd_ + totalLength > chunkSize) {
+    chunk = numStringChunks_++;
+    WDT_CHECK_LT(chunk, kMaxChunks);
+    stringChunks_[chunk].reset(new char[chunkSize]);
+    stringChunkEnd_ = 0;
+  }
+  const int64_t start = (totalLength > chunkSize) ? 0 : stringChunkEnd_;
+  char *dest = stringChunks_[chunk].get() + start;
+  for (int64_t l = length; l >= 0x80; l >>= 7) {
+    *dest++ = static_cast<char>((l & 0x7f) | 0x80);
+  }
+  *dest++ = static_cast<char>(length >> (7 * (prefixLength - 1)));
+  memcpy(dest, str, length);
+  if (totalLength <= chunkSize) {
+    stringChunkEnd_ += totalLength;
+  }
+  return (static_cast<StringOffset>(chunk) << kStringChunkBits) + start;
+}
+
+const char *FileArena::getString(StringOffset offset, int64_t &length) const {
+  const char *str = stringChunks_[offset >> kStringChunkBits].get() +
+                    (offset & ((1ULL << kStringChunkBits) - 1));
+  length = 0;
+  int shift = 0;
+  uint8_t byte;
+  do {
+    byte = static_cast<uint8_t>(*str++);
+    length |= static_cast<int64_t>(byte & 0x7f) << shift;
+    shift += 7;
+  } while (byte & 0x80);
+  return str;
+}
+
+int32_t FileArena::addDirectory(const std::string &relPath, size_t length) {
+  if (lastDirectoryIndex_ >= 0 && lastDirectory_.size() == length &&
+      relPath.compare(0, length, lastDirectory_) == 0) {
+    return lastDirectoryIndex_;
+  }
+  lastDirectory_.assign(relPath, 0, length);
+  auto it = directoryIndexes_.find(lastDirectory_);
+  if (it != directoryIndexes_.end()) {
+    lastDirectoryIndex_ = it->second;
+    return lastDirectoryIndex_;
+  }
+  const int32_t dir = numDirectories_;
+  directories_.reserve(dir);
+  directories_[dir] = addString(relPath.data(), length);
+  directoryIndexes_.emplace(lastDirectory_, dir);
+  numDirectories_++;
+  lastDirectoryIndex_ = dir;
+  return dir;
+}
+
+std::string FileArena::getRelPath(int64_t file) const {
+  const FileRecord &record = getRecord(file);
+  int64_t dirLength, nameLength;
+  const char *dir = getString(directories_[record.dir], dirLength);
+  const char *name = getString(record.name, nameLength);
+  std::string relPath;
+  relPath.reserve(dirLength + nameLength);
+  relPath.append(dir, dirLength);
+  relPath.append(name, nameLength);
+  return relPath;
+}
+
+std::string FileArena::getFullPath(int64_t file) const {
+  const FileRecord &record = getRecord(file);
+  if (record.fullPath != kNoString) {
+    int64_t length;
+    const char *fullPath = getString(record.fullPath, length);
+    return std::string(fullPath, length);
+  }
+  return rootDir_ + getRelPath(file);
+}
+
+/// compares 2 byte strings like std::string::compare
+static int compareBytes(const char *str1, int64_t length1, const char *str2,
+                        int64_t length2) {
+  const int res = memcmp(str1, str2, std::min(length1, length2));
+  if (res != 0) {
+    return res;
+  }
+  return (length1 < length2) ? -1 : (length1 > length2 ? 1 : 0);
+}
+
+int FileArena::compareRelPaths(int64_t file1, int64_t file2) const {
+  const FileRecord &record1 = getRecord(file1);
+  const FileRecord &record2 = getRecord(file2);
+  // the relative path of each file is made of 2 segments, directory and name
+  const char *segments1[2], *segments2[2];
+  int64_t lengths1[2], lengths2[2];
+  segments1[1] = getString(record1.name, lengths1[1]);
+  segments2[1] = getString(record2.name, lengths2[1]);
+  if (record1.dir == record2.dir) {
+    return compareBytes(segments1[1], lengths1[1], segments2[1], lengths2[1]);
+  }
+  segments1[0] = getString(directories_[record1.dir], lengths1[0]);
+  segments2[0] = getString(directories_[record2.dir], lengths2[0]);
+  int i = 0, j = 0;
+  while (i < 2 && j < 2) {
+    const int64_t length = std::min(lengths1[i], lengths2[j]);
+    const int res = memcmp(segments1[i], segments2[j], length);
+    if (res != 0) {
+      return res;
+    }
+    segments1[i] += length;
+    lengths1[i] -= length;
+    segments2[j] += length;
+    lengths2[j] -= length;
+    if (lengths1[i] == 0) {
+      i++;
+    }
+    if (lengths2[j] == 0) {
+      j++;
+    }
+  }
+  // skipping the empty segments left
+  while (i < 2 && lengths1[i] == 0) {
+    i++;
+  }
+  while (j < 2 && lengths2[j] == 0) {
+    j++;
+  }
+  return (i < 2) - (j < 2);
+}
+
+std::shared_ptr<SourceMetaData> FileArena::getMetaData(
+    int64_t file, const std::function<void(SourceMetaData &)> &init) {
+  std::lock_guard<std::mutex> lock(
+      metadataMutexes_[file % kNumMetadataLocks]);
+  FileRecord &record = records_[file];
+  std::shared_ptr<SourceMetaData> metadata = record.metadata.lock();
+  if (metadata) {
+    return metadata;
+  }
+  metadata.reset(new SourceMetaData(), [this, file](SourceMetaData *data) {
+    releaseMetaData(file, data);
+  });
+  metadata->fullPath = getFullPath(file);
+  metadata->relPath = getRelPath(file);
+  metadata->seqId = record.seqId;
+  metadata->size = record.size;
+  metadata->sendSize = record.sendSize;
+  metadata->allocationStatus =
+      static_cast<FileAllocationStatus>(record.allocationStatus);
+  metadata->prevSeqId = record.prevSeqId;
+  metadata->sparse = record.sparse;
+  init(*metadata);
+  record.metadata = metadata;
+  return metadata;
+}
+
+void FileArena::releaseMetaData(int64_t file, SourceMetaData *metadata) {
+  {
+    std::lock_guard<std::mutex> lock(
+        metadataMutexes_[file % kNumMetadataLocks]);
+    FileRecord &record = records_[file];
+    // another source may have created new metadata in the meantime
+    if (record.metadata.expired()) {
+      record.metadata.reset();
+    }
+  }
+  delete metadata;
+}
+
+void FileArena::clear() {
+  records_.clear();
+  numFiles_ = 0;
+  for (int64_t i = 0; i < numStringChunks_; i++) {
+    stringChunks_[i].reset();
+  }
+  numStringChunks_ = 0;
+  stringChunkEnd_ = 0;
+  directories_.clear();
+  numDirectories_ = 0;
+  directoryIndexes_.clear();
+  lastDirectory_.clear();
+  lastDirectoryIndex_ = -1;
+}
+}
+}
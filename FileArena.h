@@ -0,0 +1,194 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include "ByteSource.h"
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Compact storage of the files queued by DirectorySourceQueue, so that the
+ * memory of a transfer grows with the number of files being sent and not
+ * with the number of discovered files or blocks:
+ *  - directories are interned, a file only stores its directory index and
+ *    its name. Strings are packed in large chunks
+ *  - the SourceMetaData of a file is only created when one of its blocks is
+ *    dequeued, and freed once all the sources using it are destroyed
+ * Files are added by one thread at a time. Added files can be read by any
+ * thread at the same time, once they were handed to it through a lock (the
+ * queue's). Sources using the metadata must be destroyed before the arena.
+ */
+class FileArena {
+ public:
+  /// @param rootDir    root directory, ending with '/'
+  explicit FileArena(const std::string &rootDir);
+
+  ~FileArena();
+
+  /**
+   * Adds a file
+   *
+   * @param fullPath          full path of the file
+   * @param relPath           path relative to the root directory
+   * @param size              size of the file
+   * @param seqId             sequence id of the file
+   * @param prevSeqId         previous sequence id if the size changed
+   * @param allocationStatus  allocation status on the receiver
+   * @param sparse            whether only data extents are queued
+   *
+   * @return                  index of the file
+   */
+  int64_t addFile(const std::string &fullPath, const std::string &relPath,
+                  int64_t size, int64_t seqId, int64_t prevSeqId,
+                  FileAllocationStatus allocationStatus, bool sparse);
+
+  /// @return   number of files added
+  int64_t getNumFiles() const {
+    return numFiles_;
+  }
+
+  /// @return   size of a file
+  int64_t getSize(int64_t file) const {
+    return getRecord(file).size;
+  }
+
+  /// @return   whether only the data extents of a file are queued
+  bool isSparse(int64_t file) const {
+    return getRecord(file).sparse;
+  }
+
+  /// counts bytes of a file queued to be sent, before its metadata is used
+  void addSendSize(int64_t file, int64_t bytes) {
+    records_[file].sendSize += bytes;
+  }
+
+  /// @return   path of a file relative to the root directory
+  std::string getRelPath(int64_t file) const;
+
+  /// @return   full path of a file
+  std::string getFullPath(int64_t file) const;
+
+  /// @return   <0, 0 or >0 like strcmp for the relative paths of 2 files
+  int compareRelPaths(int64_t file1, int64_t file2) const;
+
+  /**
+   * Gets the metadata of a file, shared by all its sources alive
+   *
+   * @param file    index of the file
+   * @param init    called to complete the metadata when it is created
+   *
+   * @return        metadata of the file
+   */
+  std::shared_ptr<SourceMetaData> getMetaData(
+      int64_t file, const std::function<void(SourceMetaData &)> &init);
+
+  /// removes all the files, no metadata must be in use
+  void clear();
+
+ private:
+  /// offset of a string in the arena, kNoString for none
+  typedef uint64_t StringOffset;
+  static const StringOffset kNoString = ~0ULL;
+
+  struct FileRecord {
+    int64_t size;
+    /// bytes of the file queued to be sent
+    int64_t sendSize;
+    int64_t seqId;
+    int64_t prevSeqId;
+    /// name of the file, without its directory
+    StringOffset name;
+    /// full path if it isn't rootDir + relPath (symlinks)
+    StringOffset fullPath;
+    int32_t dir;
+    uint8_t allocationStatus;
+    bool sparse;
+    /// metadata of the file while sources use it
+    std::weak_ptr<SourceMetaData> metadata;
+  };
+
+  /// max number of chunks of an array or of strings. Chunk tables are never
+  /// reallocated, so elements can be read while others are added
+  static const int64_t kMaxChunks = 1 << 14;
+  /// bytes per chunk of strings, so up to 64GB of strings
+  static const int64_t kStringChunkBits = 22;
+  /// number of locks protecting the metadata of the files
+  static const int64_t kNumMetadataLocks = 64;
+
+  /// array of up to 1G elements allocated 64K elements at a time
+  template <typename T>
+  class ChunkedArray {
+   public:
+    ChunkedArray() : chunks_(new std::unique_ptr<T[]>[kMaxChunks]) {
+    }
+
+    T &operator[](int64_t index) const {
+      return chunks_[index >> kChunkBits][index & ((1 << kChunkBits) - 1)];
+    }
+
+    /// allocates the chunk of index if needed
+    void reserve(int64_t index);
+
+    void clear() {
+      for (int64_t i = 0; i < kMaxChunks && chunks_[i]; i++) {
+        chunks_[i].reset();
+      }
+    }
+
+   private:
+    static const int64_t kChunkBits = 16;
+    std::unique_ptr<std::unique_ptr<T[]>[]> chunks_;
+  };
+
+  const FileRecord &getRecord(int64_t file) const {
+    return records_[file];
+  }
+
+  /// copies a string into the arena
+  StringOffset addString(const char *str, int64_t length);
+
+  /// @return   a string of the arena, length is set to its length
+  const char *getString(StringOffset offset, int64_t &length) const;
+
+  /// interns the directory part (up to the last '/') of a relative path
+  int32_t addDirectory(const std::string &relPath, size_t length);
+
+  /// called when the last source using the metadata of a file is destroyed
+  void releaseMetaData(int64_t file, SourceMetaData *metadata);
+
+  const std::string rootDir_;
+
+  ChunkedArray<FileRecord> records_;
+  int64_t numFiles_{0};
+
+  std::unique_ptr<std::unique_ptr<char[]>[]> stringChunks_;
+  int64_t numStringChunks_{0};
+  /// end of the strings in the last chunk
+  int64_t stringChunkEnd_{0};
+
+  /// directories (relative paths ending with '/') by index
+  ChunkedArray<StringOffset> directories_;
+  int32_t numDirectories_{0};
+  /// index of the directories, only used to add files
+  std::unordered_map<std::string, int32_t> directoryIndexes_;
+  /// last directory added to, files are mostly added a directory at a time
+  std::string lastDirectory_;
+  int32_t lastDirectoryIndex_{-1};
+
+  std::mutex metadataMutexes_[kNumMetadataLocks];
+};
+}
+}
@@ -0,0 +1,76 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include "FileArena.h"
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+using namespace std;
+namespace facebook {
+namespace wdt {
+
+class FileArenaTest : public testing::Test {
+ protected:
+  FileArenaTest() : files_("/root/") {
+  }
+
+  FileArena files_;
+};
+
+TEST_F(FileArenaTest, SharedMetaData) {
+  const int64_t file =
+      files_.addFile("/root/a/b", "a/b", 10, 3, 0, NOT_EXISTS, false);
+  int numInits = 0;
+  auto init = [&numInits](SourceMetaData &) { numInits++; };
+  shared_ptr<SourceMetaData> metadata = files_.getMetaData(file, init);
+  EXPECT_EQ("/root/a/b", metadata->fullPath);
+  EXPECT_EQ("a/b", metadata->relPath);
+  EXPECT_EQ(3, metadata->seqId);
+  EXPECT_EQ(10, metadata->size);
+  // shared while a source uses it
+  EXPECT_EQ(metadata, files_.getMetaData(file, init));
+  EXPECT_EQ(1, numInits);
+  metadata.reset();
+  // created again once released
+  EXPECT_EQ("a/b", files_.getMetaData(file, init)->relPath);
+  EXPECT_EQ(2, numInits);
+}
+
+TEST_F(FileArenaTest, RelPathOrder) {
+  vector<string> relPaths = {"a", "a/b", "a/bc", "ab", "a/b/c", "b", "",
+                             "a/", "a/a/a", "aa/a", string(200, 'x'),
+                             // longer than a chunk of strings
+                             "y/" + string(5 << 20, 'y')};
+  vector<int64_t> indexes;
+  for (const auto &relPath : relPaths) {
+    indexes.push_back(
+        files_.addFile("/root/" + relPath, relPath, 0, 0, 0, NOT_EXISTS,
+                       false));
+  }
+  for (size_t i = 0; i < relPaths.size(); i++) {
+    EXPECT_EQ(relPaths[i], files_.getRelPath(indexes[i]));
+    EXPECT_EQ("/root/" + relPaths[i], files_.getFullPath(indexes[i]));
+    for (size_t j = 0; j < relPaths.size(); j++) {
+      const int expected = relPaths[i].compare(relPaths[j]);
+      const int res = files_.compareRelPaths(indexes[i], indexes[j]);
+      EXPECT_EQ(expected < 0, res < 0) << relPaths[i] << " " << relPaths[j];
+      EXPECT_EQ(expected > 0, res > 0) << relPaths[i] << " " << relPaths[j];
+    }
+  }
+}
+}
+}
+
+int main(int argc, char *argv[]) {
+  FLAGS_logtostderr = true;
+  testing::InitGoogleTest(&argc, argv);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  int ret = RUN_ALL_TESTS();
+  return ret;
+}
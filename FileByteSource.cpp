@@ -7,6 +7,9 @@
  * of patent rights can be found in the PATENTS file in the same directory.
  */
 #include "FileByteSource.h"
+#include <wdt/WdtConfig.h>
+#include "ClientSocket.h"
+#include "SourceFdCache.h"
 #include "WdtOptions.h"
 
 #include <algorithm>
@@ -18,11 +21,18 @@
 namespace facebook {
 namespace wdt {
 
-folly::ThreadLocalPtr<FileByteSource::Buffer> FileByteSource::buffer_;
+folly::ThreadLocalPtr<AlignedBuffer> FileByteSource::buffer_;
+folly::ThreadLocalPtr<ReadAheadPipeline> FileByteSource::readAhead_;
+#ifdef HAS_POSIX_FADVISE
+const int FileByteSource::kDropCacheAdvice = POSIX_FADV_DONTNEED;
+#else
+const int FileByteSource::kDropCacheAdvice = 0;
+#endif
 
-FileByteSource::FileByteSource(SourceMetaData *metadata, int64_t size,
-                               int64_t offset, int64_t bufferSize)
-    : metadata_(metadata),
+FileByteSource::FileByteSource(std::shared_ptr<SourceMetaData> metadata,
+                               int64_t size, int64_t offset,
+                               int64_t bufferSize)
+    : metadata_(std::move(metadata)),
       size_(size),
       offset_(offset),
       bytesRead_(0),
@@ -35,42 +45,151 @@ ErrorCode FileByteSource::open() {
   this->close();
 
   ErrorCode errCode = OK;
-  if (!buffer_ || bufferSize_ > buffer_->size_) {
-    buffer_.reset(new Buffer(bufferSize_));
+  if (!buffer_ || bufferSize_ > buffer_->size()) {
+    buffer_.reset(new AlignedBuffer(bufferSize_));
   }
+  const auto &options = WdtOptions::get();
   const std::string &fullPath = metadata_->fullPath;
-  START_PERF_TIMER
-  fd_ = ::open(fullPath.c_str(), O_RDONLY);
+  failed_ = false;
+  if (options.sender_fd_cache_size > 0 && !options.enable_direct_io &&
+      size_ < metadata_->size) {
+    // block of a bigger file, the fd is shared with the other blocks. The
+    // O_DIRECT flag would be shared too, so direct i/o does not use it
+    int64_t fileSize;
+    fd_ = SourceFdCache::get().open(*metadata_, fileSize);
+    cachedFd_ = (fd_ >= 0);
+    if (cachedFd_ && fileSize < offset_ + size_) {
+      // the size change was logged once when the file was opened, the fd
+      // stays cached so that the other blocks fail here too without reading
+      VLOG(1) << "file " << fullPath << " is shorter than block end "
+              << (offset_ + size_) << ", size " << fileSize;
+      this->close();
+    }
+  } else {
+    START_PERF_TIMER
+    fd_ = ::open(fullPath.c_str(), O_RDONLY);
+    if (fd_ < 0) {
+      PLOG(ERROR) << "error opening file " << fullPath;
+    } else {
+      RECORD_PERF_RESULT(PerfStatReport::FILE_OPEN)
+    }
+  }
   if (fd_ < 0) {
     errCode = BYTE_SOURCE_READ_ERROR;
-    PLOG(ERROR) << "error opening file " << fullPath;
   } else {
-    RECORD_PERF_RESULT(PerfStatReport::FILE_OPEN)
-    if (offset_ > 0) {
-      START_PERF_TIMER
-      if (lseek(fd_, offset_, SEEK_SET) < 0) {
-        errCode = BYTE_SOURCE_READ_ERROR;
-        PLOG(ERROR) << "error seeking file " << fullPath;
-      } else {
-        RECORD_PERF_RESULT(PerfStatReport::FILE_SEEK)
-      }
+    // reads use pread, no need to seek to the block
+    if (options.enable_direct_io &&
+        isDirectIoAligned(offset_) && size_ >= kDirectIoAlignment) {
+      // bypass the page cache, falls back to buffered reads if the file
+      // system does not support it
+      directIo_ = setDirectIo(fd_, true);
+    }
+#ifdef HAS_POSIX_FADVISE
+    if (options.drop_page_cache && !directIo_) {
+      // the whole block is going to be read once, sequentially
+      adviseBlock(POSIX_FADV_SEQUENTIAL);
+      adviseBlock(POSIX_FADV_WILLNEED);
+      dropPageCache_ = true;
     }
+#endif
   }
   transferStats_.setErrorCode(errCode);
   return errCode;
 }
 
+void FileByteSource::adviseBlock(int advice) {
+#ifdef HAS_POSIX_FADVISE
+  START_PERF_TIMER
+  int ret = posix_fadvise(fd_, offset_, size_, advice);
+  if (ret != 0) {
+    errno = ret;
+    PLOG(WARNING) << "posix_fadvise " << advice << " failed for "
+                  << metadata_->fullPath;
+    return;
+  }
+  RECORD_PERF_RESULT(PerfStatReport::FILE_FADVISE)
+#endif
+}
+
+void FileByteSource::releaseCachedFd() {
+  SourceFdCache::get().release(*metadata_, fd_, offset_, size_, bytesRead_,
+                               failed_);
+  cachedFd_ = false;
+}
+
+int64_t FileByteSource::sendTo(ClientSocket &socket, int64_t maxBytes,
+                               int32_t *checksum) {
+  if (hasError() || finished()) {
+    return 0;
+  }
+  int64_t toSend = std::min<int64_t>(maxBytes, size_ - bytesRead_);
+  int64_t sent = socket.sendFile(fd_, offset_ + bytesRead_, toSend, checksum);
+  if (sent < 0) {
+    return -1;
+  }
+  bytesRead_ += sent;
+  if (sent < toSend) {
+    // short send is either because of socket error/timeout/abort or because
+    // the file got shorter. Only the latter is a source error.
+    struct stat fileStat;
+    if (fstat(fd_, &fileStat) != 0 || fileStat.st_size < offset_ + size_) {
+      LOG(ERROR) << "file " << metadata_->fullPath << " ended before "
+                 << (offset_ + size_);
+      failed_ = true;
+      this->close();
+      transferStats_.setErrorCode(BYTE_SOURCE_READ_ERROR);
+    }
+  }
+  return sent;
+}
+
 char *FileByteSource::read(int64_t &size) {
   size = 0;
   if (hasError() || finished()) {
     return nullptr;
   }
+  const auto &options = WdtOptions::get();
+  if (bytesRead_ == 0 && !readAheadActive_ && !directIo_ &&
+      options.read_ahead_buffers > 0) {
+    // read ahead is only started once the data is actually read, blocks
+    // sent with sendTo() do not need it
+    // need at least 2 buffers, one is always held by the reader of the data
+    int numBuffers = std::max<int>(2, options.read_ahead_buffers);
+    if (!readAhead_ || readAhead_->getNumBuffers() != numBuffers ||
+        readAhead_->getBufferSize() < bufferSize_) {
+      readAhead_.reset(new ReadAheadPipeline(numBuffers, bufferSize_));
+    }
+    readAhead_->start(fd_, offset_, size_);
+    readAheadActive_ = true;
+  }
   START_PERF_TIMER
-  int64_t toRead =
-      (int64_t)std::min<int64_t>(buffer_->size_, size_ - bytesRead_);
-  int64_t numRead = ::read(fd_, buffer_->data_, toRead);
+  char *data = buffer_->data();
+  int64_t numRead;
+  if (readAheadActive_) {
+    // time recorded is the time spent waiting for the data
+    data = readAhead_->next(numRead);
+  } else {
+    int64_t toRead =
+        (int64_t)std::min<int64_t>(buffer_->size(), size_ - bytesRead_);
+    if (directIo_) {
+      if (toRead < kDirectIoAlignment) {
+        // last partial sector of the block, read it through the page cache
+        setDirectIo(fd_, false);
+        directIo_ = false;
+      } else {
+        toRead -= toRead % kDirectIoAlignment;
+      }
+    }
+    numRead = ::pread(fd_, data, toRead, offset_ + bytesRead_);
+    if (directIo_ && numRead > 0 && !isDirectIoAligned(numRead)) {
+      // short read (end of file), the next offset is no longer aligned
+      setDirectIo(fd_, false);
+      directIo_ = false;
+    }
+  }
   if (numRead < 0) {
     PLOG(ERROR) << "failure while reading file " << metadata_->fullPath;
+    failed_ = true;
     this->close();
     transferStats_.setErrorCode(BYTE_SOURCE_READ_ERROR);
     return nullptr;
@@ -82,7 +201,7 @@ char *FileByteSource::read(int64_t &size) {
   RECORD_PERF_RESULT(PerfStatReport::FILE_READ)
   bytesRead_ += numRead;
   size = numRead;
-  return buffer_->data_;
+  return data;
 }
 }
 }
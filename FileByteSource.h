@@ -11,6 +11,8 @@
 #include <unistd.h>
 
 #include "ByteSource.h"
+#include "DirectIo.h"
+#include "ReadAheadPipeline.h"
 #include "Reporting.h"
 #include <folly/ThreadLocal.h>
 
@@ -21,22 +23,24 @@ namespace wdt {
  * ByteSource that reads data from a file. The buffer used is thread-local
  * for efficiency reasons so only one FileByteSource can be created/used
  * per thread. It's also unsafe to access the same FileByteSource from
- * multiple threads.
+ * multiple threads. Same goes for the read ahead pipeline, which is used
+ * instead of the buffer if read_ahead_buffers is set. The buffer is aligned so
+ * that it can be used for O_DIRECT reads (enable_direct_io).
  */
 class FileByteSource : public ByteSource {
  public:
   /**
    * Create a new FileByteSource for a given path.
    *
-   * @param metadata          shared file data
+   * @param metadata          shared file data, kept alive by the source
    * @param size              size of file; if actual size is larger we'll
    *                          truncate, if it's smaller we'll fail
    * @param offset            block offset
    * @param bufferSize        size of buffer for temporarily storing read
    *                          bytes
    */
-  FileByteSource(SourceMetaData *metadata, int64_t size, int64_t offset,
-                 int64_t bufferSize);
+  FileByteSource(std::shared_ptr<SourceMetaData> metadata, int64_t size,
+                 int64_t offset, int64_t bufferSize);
 
   /// close file descriptor if still open
   virtual ~FileByteSource() {
@@ -73,20 +77,55 @@ class FileByteSource : public ByteSource {
     return fd_ < 0;
   }
 
-  /// @see ByteSource.h
+  /**
+   * @see ByteSource.h
+   * If zero copy send is enabled, the returned pointer points into a read
+   * only mapping of the block instead of the thread-local buffer
+   */
   virtual char *read(int64_t &size) override;
 
+  /**
+   * @return true if data can be sent straight from the file descriptor,
+   *         blocks read with O_DIRECT have to go through the aligned buffer
+   */
+  virtual bool supportsDirectSend() const override {
+    return !directIo_;
+  }
+
+  /// @see ByteSource.h
+  virtual int64_t sendTo(ClientSocket &socket, int64_t maxBytes,
+                         int32_t *checksum) override;
+
+  /// @see ByteSource.h
+  virtual std::unique_ptr<ByteSource> clone() const override {
+    return std::unique_ptr<ByteSource>(
+        new FileByteSource(metadata_, size_, offset_, bufferSize_));
+  }
+
   /// open the source for reading
   virtual ErrorCode open() override;
 
   /// close the source for reading
   virtual void close() override {
+    if (readAheadActive_) {
+      readAhead_->stop();
+      readAheadActive_ = false;
+    }
     if (fd_ >= 0) {
-      START_PERF_TIMER
-      ::close(fd_);
-      RECORD_PERF_RESULT(PerfStatReport::FILE_CLOSE)
+      if (dropPageCache_) {
+        adviseBlock(kDropCacheAdvice);
+      }
+      if (cachedFd_) {
+        releaseCachedFd();
+      } else {
+        START_PERF_TIMER
+        ::close(fd_);
+        RECORD_PERF_RESULT(PerfStatReport::FILE_CLOSE)
+      }
       fd_ = -1;
     }
+    directIo_ = false;
+    dropPageCache_ = false;
   }
 
   /**
@@ -103,28 +142,27 @@ class FileByteSource : public ByteSource {
   }
 
  private:
-  struct Buffer {
-    explicit Buffer(int64_t size) : size_(size) {
-      data_ = new char[size + 1];
-    }
+  /// gives back fd_ to the source fd cache
+  void releaseCachedFd();
 
-    ~Buffer() {
-      delete[] data_;
-    }
+  /// advice given for the block once it is sent, if drop_page_cache is set
+  static const int kDropCacheAdvice;
 
-    char *data_;
-    int64_t size_;
-  };
+  /// calls posix_fadvise for the whole block
+  void adviseBlock(int advice);
 
   /**
    * Buffer for temporarily holding bytes read from file. This is thread-local
    * for efficiency reasons, so only one FileByteSource can be used at once
    * per thread.
    */
-  static folly::ThreadLocalPtr<Buffer> buffer_;
+  static folly::ThreadLocalPtr<AlignedBuffer> buffer_;
+
+  /// thread-local read ahead pipeline, read ahead is done one block at a time
+  static folly::ThreadLocalPtr<ReadAheadPipeline> readAhead_;
 
   /// shared file information
-  SourceMetaData *metadata_;
+  std::shared_ptr<SourceMetaData> metadata_;
 
   /// filesize
   const int64_t size_;
@@ -132,6 +170,12 @@ class FileByteSource : public ByteSource {
   /// open file descriptor for file (set to < 0 on error)
   int fd_{-1};
 
+  /// whether fd_ comes from the source fd cache (sender_fd_cache_size)
+  bool cachedFd_{false};
+
+  /// whether reading the block failed, the cached fd is not reused then
+  bool failed_{false};
+
   /// block offset
   const int64_t offset_;
 
@@ -141,6 +185,15 @@ class FileByteSource : public ByteSource {
   /// buffer size
   int64_t bufferSize_;
 
+  /// whether reads are served by the read ahead pipeline
+  bool readAheadActive_{false};
+
+  /// whether the file is currently read with O_DIRECT
+  bool directIo_{false};
+
+  /// whether the block is dropped from the page cache when closed
+  bool dropPageCache_{false};
+
   /// transfer stats
   TransferStats transferStats_;
 };
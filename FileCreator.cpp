@@ -14,17 +14,29 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <algorithm>
 #include <folly/Conv.h>
 
 namespace facebook {
 namespace wdt {
 
-bool FileCreator::setFileSize(int fd, int64_t fileSize) {
+bool FileCreator::setFileSize(int fd, int64_t fileSize, bool sparse) {
   struct stat fileStat;
   if (fstat(fd, &fileStat) != 0) {
     PLOG(ERROR) << "fstat() failed for " << fd;
     return false;
   }
+  if (sparse) {
+    // drops the previous content, the holes must read as zeros
+    if ((fileStat.st_size > 0 && ftruncate(fd, 0) != 0) ||
+        ftruncate(fd, fileSize) != 0) {
+      PLOG(ERROR) << "ftruncate() failed for " << fd;
+      return false;
+    }
+    return true;
+  }
   if (fileStat.st_size > fileSize) {
     // existing file is larger than required
     if (ftruncate(fd, fileSize) != 0) {
@@ -45,13 +57,106 @@ bool FileCreator::setFileSize(int fd, int64_t fileSize) {
   return true;
 }
 
+void FileCreator::moveToBasis(const std::string &relPath) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!basisFiles_.insert(relPath).second) {
+      // already moved, the file is being received again in this session
+      return;
+    }
+    // listed before it exists, paths can't contain a nul
+    const std::string listPath = rootDir_ + kDeltaBasisListName;
+    if (basisListFd_ < 0) {
+      basisListFd_ =
+          open(listPath.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+      if (basisListFd_ < 0) {
+        PLOG(ERROR) << "Unable to open " << listPath;
+      }
+    }
+    if (basisListFd_ >= 0 &&
+        write(basisListFd_, relPath.c_str(), relPath.size() + 1) !=
+            (ssize_t)relPath.size() + 1) {
+      PLOG(ERROR) << "Unable to write to " << listPath;
+    }
+  }
+  std::string path(rootDir_);
+  path.append(relPath);
+  const std::string basisPath = getBasisPath(relPath);
+  if (rename(path.c_str(), basisPath.c_str()) != 0) {
+    PLOG(ERROR) << "Unable to move " << path << " to " << basisPath;
+    return;
+  }
+  VLOG(1) << "Moved " << path << " to " << basisPath;
+}
+
+void FileCreator::removeBasisFiles() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto &relPath : basisFiles_) {
+    const std::string basisPath = getBasisPath(relPath);
+    if (unlink(basisPath.c_str()) != 0 && errno != ENOENT) {
+      PLOG(ERROR) << "Unable to remove " << basisPath;
+    }
+  }
+  basisFiles_.clear();
+  if (basisListFd_ >= 0) {
+    close(basisListFd_);
+    basisListFd_ = -1;
+    const std::string listPath = rootDir_ + kDeltaBasisListName;
+    if (unlink(listPath.c_str()) != 0) {
+      PLOG(ERROR) << "Unable to remove " << listPath;
+    }
+  }
+}
+
+void FileCreator::removeStaleBasisFiles() {
+  const std::string listPath = rootDir_ + kDeltaBasisListName;
+  int fd = open(listPath.c_str(), O_RDONLY);
+  if (fd < 0) {
+    if (errno != ENOENT) {
+      PLOG(ERROR) << "Unable to open " << listPath;
+    }
+    return;
+  }
+  std::string list;
+  char buf[4096];
+  ssize_t numRead;
+  while ((numRead = read(fd, buf, sizeof(buf))) > 0) {
+    list.append(buf, numRead);
+  }
+  if (numRead < 0) {
+    PLOG(ERROR) << "Unable to read " << listPath;
+  }
+  close(fd);
+  int64_t numRemoved = 0;
+  size_t start = 0;
+  size_t end;
+  // a partially written last entry is ignored
+  while ((end = list.find('\0', start)) != std::string::npos) {
+    const std::string basisPath = getBasisPath(list.substr(start, end - start));
+    if (unlink(basisPath.c_str()) == 0) {
+      numRemoved++;
+    } else if (errno != ENOENT) {
+      PLOG(ERROR) << "Unable to remove " << basisPath;
+    }
+    start = end + 1;
+  }
+  LOG(INFO) << "Removed " << numRemoved << " basis files left by a previous "
+            << "receiver";
+  if (numRead == 0 && unlink(listPath.c_str()) != 0) {
+    PLOG(ERROR) << "Unable to remove " << listPath;
+  }
+}
+
 int FileCreator::openAndSetSize(BlockDetails const *blockDetails) {
   const auto &options = WdtOptions::get();
+  if (blockDetails->deltaEncoded) {
+    moveToBasis(blockDetails->fileName);
+  }
   int fd = createFile(blockDetails->fileName);
   if (fd < 0) {
     return -1;
   }
-  if (!setFileSize(fd, blockDetails->fileSize)) {
+  if (!setFileSize(fd, blockDetails->fileSize, blockDetails->sparse)) {
     close(fd);
     return -1;
   }
@@ -132,6 +237,121 @@ int FileCreator::openForBlocks(int threadIndex,
   return createFile(blockDetails->fileName);
 }
 
+int FileCreator::openCachedForBlocks(int threadIndex,
+                                     BlockDetails const *blockDetails) {
+  const int64_t seqId = blockDetails->seqId;
+  {
+    std::lock_guard<std::mutex> lock(fdCacheMutex_);
+    auto it = fdCache_.find(seqId);
+    if (it != fdCache_.end()) {
+      START_PERF_TIMER
+      CachedFd &entry = it->second;
+      if (entry.refCount++ == 0) {
+        idleFds_.erase(entry.idlePos);
+      }
+      RECORD_PERF_RESULT(PerfStatReport::FD_CACHE_HIT)
+      return entry.fd;
+    }
+  }
+  int fd = openForBlocks(threadIndex, blockDetails);
+  if (fd < 0) {
+    return -1;
+  }
+  std::vector<int> toClose;
+  {
+    std::lock_guard<std::mutex> lock(fdCacheMutex_);
+    auto res = fdCache_.insert(std::make_pair(seqId, CachedFd()));
+    CachedFd &entry = res.first->second;
+    if (res.second) {
+      entry.fd = fd;
+      entry.refCount = 1;
+      // resumed and sparse files are not sent entirely
+      entry.bytesLeft = blockDetails->sendSize >= 0 ? blockDetails->sendSize
+                                                    : blockDetails->fileSize;
+      evictIdleFds(toClose);
+    } else {
+      // another thread opened the file in the meantime
+      if (entry.refCount++ == 0) {
+        idleFds_.erase(entry.idlePos);
+      }
+      toClose.push_back(fd);
+      fd = entry.fd;
+    }
+  }
+  for (int idleFd : toClose) {
+    closeFile(idleFd);
+  }
+  return fd;
+}
+
+void FileCreator::releaseFd(BlockDetails const *blockDetails,
+                            int64_t written) {
+  const int64_t seqId = blockDetails->seqId;
+  std::vector<int> toClose;
+  {
+    std::lock_guard<std::mutex> lock(fdCacheMutex_);
+    auto it = fdCache_.find(seqId);
+    WDT_CHECK(it != fdCache_.end()) << "releasing uncached file " << seqId;
+    CachedFd &entry = it->second;
+    if (written == blockDetails->dataSize &&
+        entry.writtenBlocks.insert(blockDetails->offset).second) {
+      entry.bytesLeft -= written;
+    }
+    if (--entry.refCount > 0) {
+      return;
+    }
+    if (entry.bytesLeft <= 0) {
+      // last block of the file, it won't be needed anymore
+      toClose.push_back(entry.fd);
+      fdCache_.erase(it);
+    } else {
+      entry.idlePos = idleFds_.insert(idleFds_.end(), seqId);
+      evictIdleFds(toClose);
+    }
+  }
+  for (int fd : toClose) {
+    closeFile(fd);
+  }
+}
+
+void FileCreator::evictIdleFds(std::vector<int> &toClose) {
+  const auto &options = WdtOptions::get();
+  const size_t maxSize = std::max(1, options.receiver_fd_cache_size);
+  // files in use can not be closed, the cache may stay bigger till they are
+  // released
+  while (fdCache_.size() > maxSize && !idleFds_.empty()) {
+    auto it = fdCache_.find(idleFds_.front());
+    idleFds_.pop_front();
+    toClose.push_back(it->second.fd);
+    fdCache_.erase(it);
+  }
+}
+
+void FileCreator::clearFdCache() {
+  std::vector<int> toClose;
+  {
+    std::lock_guard<std::mutex> lock(fdCacheMutex_);
+    for (const auto &entry : fdCache_) {
+      WDT_CHECK(entry.second.refCount == 0) << "file " << entry.first
+                                            << " still in use";
+      toClose.push_back(entry.second.fd);
+    }
+    fdCache_.clear();
+    idleFds_.clear();
+  }
+  for (int fd : toClose) {
+    closeFile(fd);
+  }
+}
+
+void FileCreator::closeFile(int fd) {
+  START_PERF_TIMER
+  if (close(fd) != 0) {
+    PLOG(ERROR) << "Unable to close fd " << fd;
+  }
+  RECORD_PERF_RESULT(PerfStatReport::FILE_CLOSE)
+}
+
 using std::string;
 
 int FileCreator::createFile(const string &relPathStr) {
@@ -11,11 +11,15 @@
 #include <wdt/WdtConfig.h>
 #include "Protocol.h"
 #include "TransferLogManager.h"
+#include "DeltaTransfer.h"
 
 #include <glog/logging.h>
+#include <list>
 #include <mutex>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 #include <folly/SpinLock.h>
 #include <map>
 #include <condition_variable>
@@ -54,13 +58,19 @@ class FileCreator {
   }
 
   virtual ~FileCreator() {
+    for (const auto &entry : fdCache_) {
+      close(entry.second.fd);
+    }
+    if (basisListFd_ >= 0) {
+      close(basisListFd_);
+    }
     delete[] threadConditionVariables_;
   }
 
   /**
    * Opens the file and sets its size. If the existing file size is greater than
    * required size, the file is truncated using ftruncate. Space is
-   * allocated using posix_fallocate.
+   * allocated using posix_fallocate, except for sparse files.
    *
    * @param blockDetails  block-details
    *
@@ -81,6 +91,34 @@ class FileCreator {
    */
   int openForBlocks(int threadIndex, BlockDetails const *blockDetails);
 
+  /**
+   * Same as openForBlocks, but the file descriptor is shared by all the blocks
+   * of the file through a cache of receiver_fd_cache_size files, so that the
+   * file is not opened again for every block. Blocks must be written with
+   * pwrite, and the file descriptor given back with releaseFd() instead of
+   * being closed.
+   *
+   * @param threadIndex   index of the calling thread
+   * @param blockDetails  block-details
+   *
+   * @return              file descriptor in case of success, -1 otherwise
+   */
+  int openCachedForBlocks(int threadIndex, BlockDetails const *blockDetails);
+
+  /**
+   * Gives back a file descriptor returned by openCachedForBlocks(). The file
+   * is closed once all the bytes the sender sends of it (the whole file for
+   * older senders) have been written, or when the cache is full and it is
+   * the least recently used file not in use.
+   *
+   * @param blockDetails  block-details
+   * @param written       number of bytes of the block written
+   */
+  void releaseFd(BlockDetails const *blockDetails, int64_t written);
+
+  /// closes the cached files, called after end of each session
+  void clearFdCache();
+
   /// reset internal directory cache
   void resetDirCache() {
     std::lock_guard<std::mutex> lock(mutex_);
@@ -93,6 +131,24 @@ class FileCreator {
     fileStatusMap_.clear();
   }
 
+  /**
+   * @param relPath   path of a delta encoded file relative to root dir
+   *
+   * @return          full path of the copy of the file as it was before the
+   *                  transfer, which copy ops read from
+   */
+  std::string getBasisPath(const std::string &relPath) const {
+    return rootDir_ + relPath + kDeltaBasisSuffix;
+  }
+
+  /// removes the basis files of the delta encoded files, called after end of
+  /// each session
+  void removeBasisFiles();
+
+  /// removes the basis files listed by a previous receiver which did not
+  /// finish its session, called before the first session
+  void removeStaleBasisFiles();
+
  private:
   /**
    * Create a file and open for writing, recursively create subdirs.
@@ -110,13 +166,16 @@ class FileCreator {
   /**
    * sets the size of the file. If the size is greater then the
    * file is truncated using ftruncate. Space is allocated using fallocate.
+   * Sparse files are emptied and extended with ftruncate instead, only their
+   * data extents get written so the rest must be holes.
    *
    * @param fd        file descriptor
    * @param fileSize  size of the file
+   * @param sparse    whether the file is sparse
    *
    * @return          true for suzzess, false otherwise
    */
-  bool setFileSize(int fd, int64_t fileSize);
+  bool setFileSize(int fd, int64_t fileSize, bool sparse);
 
   /**
    * opens the file and sets it size. Called only for the first block to request
@@ -133,9 +192,43 @@ class FileCreator {
   /// waits for allocation of a file to finish
   bool waitForAllocationFinish(int allocatingThreadIndex, int64_t seqId);
 
+  /**
+   * Moves the existing copy of a delta encoded file out of the way, so that
+   * copy ops can read from it while the new file is written. Only done once
+   * per session for a file.
+   */
+  void moveToBasis(const std::string &relPath);
+
   /// appends a trailing / if not already there to path
   static void addTrailingSlash(std::string &path);
 
+  /// closes fd, recording the perf stat
+  static void closeFile(int fd);
+
+  /**
+   * removes least recently used files not in use from the cache till it is
+   * not bigger than receiver_fd_cache_size. Must be called with fdCacheMutex_
+   * held.
+   *
+   * @param toClose   file descriptors of the removed files are added here, to
+   *                  be closed without holding the lock
+   */
+  void evictIdleFds(std::vector<int> &toClose);
+
+  /// file descriptor shared by the blocks of a file
+  struct CachedFd {
+    int fd{-1};
+    /// number of blocks using fd
+    int refCount{0};
+    /// bytes of the file the sender still has to send
+    int64_t bytesLeft{0};
+    /// offsets of the blocks written, duplicates of a block are only counted
+    /// once
+    std::unordered_set<int64_t> writtenBlocks;
+    /// position in idleFds_, only valid when refCount is 0
+    std::list<int64_t>::iterator idlePos;
+  };
+
   /**
    * Create directory recursively, populating cache. Cache is only
    * used if force is false (but it's still populated in any case).
@@ -161,7 +254,14 @@ class FileCreator {
   /// directories created so far, relative to root
   std::unordered_set<std::string> createdDirs_;
 
-  /// protects createdDirs_
+  /// files moved to their basis path in the current session
+  std::unordered_set<std::string> basisFiles_;
+
+  /// appends to the kDeltaBasisListName file, -1 till a file is moved to its
+  /// basis path
+  int basisListFd_{-1};
+
+  /// protects createdDirs_, basisFiles_ and basisListFd_
   std::mutex mutex_;
 
   const int ALLOCATED{-1};
@@ -180,6 +280,12 @@ class FileCreator {
   std::condition_variable *threadConditionVariables_;
   /// lock protecting fileStatusMap_
   folly::SpinLock lock_;
+  /// cached file descriptors, by file sequence id
+  std::unordered_map<int64_t, CachedFd> fdCache_;
+  /// sequence ids of the cached files not in use, least recently used first
+  std::list<int64_t> idleFds_;
+  /// protects fdCache_ and idleFds_
+  std::mutex fdCacheMutex_;
 };
 }
 }
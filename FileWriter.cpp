@@ -10,15 +10,19 @@
 #include "WdtOptions.h"
 #include "Reporting.h"
 
+#include <algorithm>
 #include <fcntl.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
 namespace facebook {
 namespace wdt {
 
+folly::ThreadLocalPtr<AlignedBuffer> FileWriter::stagingBuffer_;
+
 ErrorCode FileWriter::open() {
   auto &options = WdtOptions::get();
   if (options.skip_writes) {
@@ -28,27 +32,45 @@ ErrorCode FileWriter::open() {
     // single block file
     WDT_CHECK(blockDetails_->offset == 0);
     fd_ = fileCreator_->openAndSetSize(blockDetails_);
+  } else if (options.receiver_fd_cache_size > 0 && !options.enable_direct_io) {
+    // multi block file, the fd is shared with the other blocks of the file.
+    // The O_DIRECT flag would be shared too, so direct i/o does not use it
+    fd_ = fileCreator_->openCachedForBlocks(threadIndex_, blockDetails_);
+    cachedFd_ = (fd_ >= 0);
   } else {
     // multi block file
     fd_ = fileCreator_->openForBlocks(threadIndex_, blockDetails_);
-    if (fd_ >= 0 && blockDetails_->offset > 0) {
-      START_PERF_TIMER
-      if (lseek(fd_, blockDetails_->offset, SEEK_SET) < 0) {
-        PLOG(ERROR) << "Unable to seek " << blockDetails_->fileName;
-        close();
-      } else {
-        RECORD_PERF_RESULT(PerfStatReport::FILE_SEEK)
-      }
-    }
   }
   if (fd_ == -1) {
-    LOG(ERROR) << "File open/seek failed for " << blockDetails_->fileName;
+    LOG(ERROR) << "File open failed for " << blockDetails_->fileName;
     return FILE_WRITE_ERROR;
   }
+  if (options.enable_direct_io && isDirectIoAligned(blockDetails_->offset) &&
+      blockDetails_->dataSize >= kDirectIoAlignment) {
+    // falls back to buffered writes if the file system does not support it
+    directIo_ = setDirectIo(fd_, true);
+  }
   return OK;
 }
 
 void FileWriter::close() {
+  if (stagedBytes_ > 0) {
+    // block was not completely received, it has to be resent anyway
+    VLOG(1) << "Discarding " << stagedBytes_ << " staged bytes for "
+            << blockDetails_->fileName;
+    stagedBytes_ = 0;
+  }
+  directIo_ = false;
+  if (syncFd_ >= 0) {
+    // not handed over, the block failed later on
+    ::close(syncFd_);
+    syncFd_ = -1;
+  }
+  if (cachedFd_) {
+    fileCreator_->releaseFd(blockDetails_, totalWritten_);
+    cachedFd_ = false;
+    fd_ = -1;
+  }
   if (fd_ >= 0) {
     START_PERF_TIMER
     if (::close(fd_) != 0) {
@@ -62,28 +84,105 @@ void FileWriter::close() {
 ErrorCode FileWriter::write(char *buf, int64_t size) {
   auto &options = WdtOptions::get();
   if (!options.skip_writes) {
-    int64_t count = 0;
-    while (count < size) {
-      START_PERF_TIMER
-      int64_t written = ::write(fd_, buf + count, size - count);
-      if (written == -1) {
-        if (errno == EINTR) {
-          VLOG(1) << "Disk write interrupted, retrying "
-                  << blockDetails_->fileName;
-          continue;
-        }
-        PLOG(ERROR) << "File write failed for " << blockDetails_->fileName
-                    << "fd : " << fd_ << " " << written << " " << count << " "
-                    << size;
-        return FILE_WRITE_ERROR;
+    bool finished = ((totalWritten_ + size) == blockDetails_->dataSize);
+    ErrorCode code = directIo_ ? writeDirect(buf, size, finished)
+                               : writeAll(buf, size, getWriteOffset());
+    if (code != OK) {
+      return code;
+    }
+  }
+  return addWritten(size);
+}
+
+ErrorCode FileWriter::writeAll(const char *buf, int64_t size,
+                               int64_t offset) {
+  int64_t count = 0;
+  while (count < size) {
+    START_PERF_TIMER
+    int64_t written = ::pwrite(fd_, buf + count, size - count, offset + count);
+    if (written == -1) {
+      if (errno == EINTR) {
+        VLOG(1) << "Disk write interrupted, retrying "
+                << blockDetails_->fileName;
+        continue;
       }
-      RECORD_PERF_RESULT(PerfStatReport::FILE_WRITE)
-      count += written;
+      PLOG(ERROR) << "File write failed for " << blockDetails_->fileName
+                  << "fd : " << fd_ << " " << written << " " << count << " "
+                  << size;
+      return FILE_WRITE_ERROR;
+    }
+    RECORD_PERF_RESULT(PerfStatReport::FILE_WRITE)
+    count += written;
+  }
+  VLOG(1) << "Successfully written " << count << " bytes to fd " << fd_
+          << " for file " << blockDetails_->fileName;
+  return OK;
+}
+
+ErrorCode FileWriter::writeDirect(const char *buf, int64_t size,
+                                  bool finished) {
+  // allocated here rather than in open(), writes may be done by another
+  // thread (write_behind_buffers)
+  const int64_t bufferSize = WdtOptions::get().buffer_size;
+  if (!stagingBuffer_ || stagingBuffer_->size() < bufferSize) {
+    stagingBuffer_.reset(
+        new AlignedBuffer(std::max<int64_t>(bufferSize, kDirectIoAlignment)));
+  }
+  char *staging = stagingBuffer_->data();
+  const int64_t stagingSize = stagingBuffer_->size();
+  // staged bytes are already accounted in totalWritten_
+  int64_t fileOffset = getWriteOffset() - stagedBytes_;
+  int64_t count = 0;
+  while (count < size) {
+    int64_t toCopy =
+        std::min<int64_t>(stagingSize - stagedBytes_, size - count);
+    memcpy(staging + stagedBytes_, buf + count, toCopy);
+    stagedBytes_ += toCopy;
+    count += toCopy;
+    // staging buffer is full or buf is consumed, write out whole sectors
+    int64_t aligned = stagedBytes_ - (stagedBytes_ % kDirectIoAlignment);
+    if (aligned == 0) {
+      continue;
+    }
+    ErrorCode code = writeAll(staging, aligned, fileOffset);
+    if (code != OK) {
+      return code;
+    }
+    fileOffset += aligned;
+    stagedBytes_ -= aligned;
+    memmove(staging, staging + aligned, stagedBytes_);
+  }
+  if (finished && stagedBytes_ > 0) {
+    // last partial sector, write it through the page cache
+    if (!setDirectIo(fd_, false)) {
+      return FILE_WRITE_ERROR;
+    }
+    directIo_ = false;
+    ErrorCode code = writeAll(staging, stagedBytes_, fileOffset);
+    if (code != OK) {
+      return code;
     }
-    VLOG(1) << "Successfully written " << count << " bytes to fd " << fd_
-            << " for file " << blockDetails_->fileName;
+    stagedBytes_ = 0;
+  }
+  return OK;
+}
+
+ErrorCode FileWriter::addWritten(int64_t size) {
+  auto &options = WdtOptions::get();
+  if (!options.skip_writes) {
     bool finished = ((totalWritten_ + size) == blockDetails_->dataSize);
-    if (options.enable_download_resumption && finished) {
+    if (options.enable_download_resumption && finished &&
+        options.durability_commit_interval_ms > 0) {
+      // synced later with the other blocks of the group commit, the fd may
+      // be closed or shared by then
+      syncFd_ = dup(fd_);
+      if (syncFd_ < 0) {
+        PLOG(ERROR) << "dup failed for " << blockDetails_->fileName;
+        return FILE_WRITE_ERROR;
+      }
+      // starts the writeback, leaving less for the group commit to wait for
+      syncFileRange(size, finished);
+    } else if (options.enable_download_resumption && finished) {
       if (fsync(fd_) != 0) {
         PLOG(ERROR) << "fsync failed for " << blockDetails_->fileName
                     << " offset " << blockDetails_->offset << " file-size "
@@ -91,14 +190,23 @@ ErrorCode FileWriter::write(char *buf, int64_t size) {
                     << " data-size  << blockDetails_->dataSize";
         return FILE_WRITE_ERROR;
       }
+      if (options.drop_page_cache) {
+        dropPageCache(blockDetails_->offset + blockDetails_->dataSize, false);
+      }
     } else {
-      syncFileRange(count, finished);
+      syncFileRange(size, finished);
     }
   }
   totalWritten_ += size;
   return OK;
 }
 
+int FileWriter::releaseSyncFd() {
+  int fd = syncFd_;
+  syncFd_ = -1;
+  return fd;
+}
+
 void FileWriter::syncFileRange(int64_t written, bool forced) {
 #ifdef HAS_SYNC_FILE_RANGE
   auto &options = WdtOptions::get();
@@ -129,10 +237,46 @@ void FileWriter::syncFileRange(int64_t written, bool forced) {
     RECORD_PERF_RESULT(PerfStatReport::SYNC_FILE_RANGE)
     VLOG(1) << "file range [" << nextSyncOffset_ << " " << writtenSinceLastSync_
             << "] synced for file " << blockDetails_->fileName;
+    if (options.drop_page_cache) {
+      // writeback of the ranges synced before this one was started earlier
+      // and is likely done by now. At the end of the block, drop everything
+      dropPageCache(forced ? nextSyncOffset_ + writtenSinceLastSync_
+                           : nextSyncOffset_,
+                    true);
+    }
     nextSyncOffset_ += writtenSinceLastSync_;
     writtenSinceLastSync_ = 0;
   }
 #endif
 }
+
+void FileWriter::dropPageCache(int64_t endOffset, bool waitForWriteback) {
+#if defined(HAS_SYNC_FILE_RANGE) && defined(HAS_POSIX_FADVISE)
+  const int64_t length = endOffset - nextDropOffset_;
+  if (length <= 0) {
+    return;
+  }
+  START_PERF_TIMER
+  if (waitForWriteback &&
+      sync_file_range(fd_, nextDropOffset_, length,
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                          SYNC_FILE_RANGE_WAIT_AFTER) != 0) {
+    PLOG(ERROR) << "sync_file_range() wait failed for "
+                << blockDetails_->fileName << " fd " << fd_;
+    return;
+  }
+  int ret = posix_fadvise(fd_, nextDropOffset_, length, POSIX_FADV_DONTNEED);
+  if (ret != 0) {
+    errno = ret;
+    PLOG(WARNING) << "posix_fadvise failed for " << blockDetails_->fileName
+                  << " fd " << fd_;
+    return;
+  }
+  RECORD_PERF_RESULT(PerfStatReport::FILE_FADVISE)
+  VLOG(1) << "file range [" << nextDropOffset_ << " " << length
+          << "] dropped from page cache for " << blockDetails_->fileName;
+  nextDropOffset_ = endOffset;
+#endif
+}
 }
 }
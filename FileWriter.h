@@ -10,8 +10,10 @@
 
 #include <wdt/WdtConfig.h>
 #include "Writer.h"
+#include "DirectIo.h"
 #include "FileCreator.h"
 #include "Protocol.h"
+#include <folly/ThreadLocal.h>
 
 namespace facebook {
 namespace wdt {
@@ -24,6 +26,7 @@ class FileWriter : public Writer {
         blockDetails_(blockDetails),
 #ifdef HAS_SYNC_FILE_RANGE
         nextSyncOffset_(blockDetails->offset),
+        nextDropOffset_(blockDetails->offset),
 #endif
         fileCreator_(fileCreator) {
   }
@@ -46,7 +49,63 @@ class FileWriter : public Writer {
   /// @see Writer.h
   virtual void close() override;
 
+  /// @return   file descriptor, -1 if not open (or writes are skipped)
+  int getFd() const {
+    return fd_;
+  }
+
+  /**
+   * @return    whether the block is written with O_DIRECT. In that case data
+   *            must go through write(), which stages it in an aligned buffer
+   */
+  bool usesDirectIo() const {
+    return directIo_;
+  }
+
+  /// @return   offset in the file where the next byte of the block goes
+  int64_t getWriteOffset() const {
+    return blockDetails_->offset + totalWritten_;
+  }
+
+  /**
+   * Accounts for size bytes written at getWriteOffset() directly to getFd()
+   * by the caller (e.g. by io_uring), and syncs them like write() does.
+   *
+   * @param size    number of bytes written
+   *
+   * @return        status of the sync
+   */
+  ErrorCode addWritten(int64_t size);
+
+  /**
+   * With durability_commit_interval_ms, completed blocks are not fsynced,
+   * a duplicate of the file descriptor is kept instead so that the block can
+   * be synced later as part of a group commit.
+   *
+   * @return    the duplicate, now owned by the caller, -1 if there is none
+   */
+  int releaseSyncFd();
+
  private:
+  /**
+   * writes all of buf to the file at offset, retrying on EINTR and short
+   * writes. pwrite is used, the fd may be shared with other blocks
+   *
+   * @return    OK or FILE_WRITE_ERROR
+   */
+  ErrorCode writeAll(const char *buf, int64_t size, int64_t offset);
+
+  /**
+   * O_DIRECT version of write: copies buf into the aligned staging buffer and
+   * writes out whole sectors. Less than a sector stays staged till more data
+   * arrives. The staged tail of the block is written through the page cache
+   *
+   * @param finished  whether buf is the end of the block
+   *
+   * @return          OK or FILE_WRITE_ERROR
+   */
+  ErrorCode writeDirect(const char *buf, int64_t size, bool finished);
+
   /**
    * calls sync_file_range at disk_sync_interval_mb intervals.
    *
@@ -55,8 +114,22 @@ class FileWriter : public Writer {
    */
   void syncFileRange(int64_t written, bool forced);
 
+  /**
+   * drops written data up to endOffset from the page cache (drop_page_cache)
+   *
+   * @param endOffset         end of the range to drop, the range starts
+   *                          where the previous call stopped
+   * @param waitForWriteback  whether to wait for the writeback of the range
+   *                          first, dirty pages can not be dropped
+   */
+  void dropPageCache(int64_t endOffset, bool waitForWriteback);
+
   /// file handler
   int fd_{-1};
+  /// whether fd_ comes from the fd cache of fileCreator_
+  bool cachedFd_{false};
+  /// duplicate of fd_ to sync the completed block with, -1 if none
+  int syncFd_{-1};
   /// index of the owner receiver thread. This is needed for co-ordination of
   /// disk space allocation in fileCreator
   int threadIndex_;
@@ -67,11 +140,26 @@ class FileWriter : public Writer {
   /// number of bytes written
   int64_t totalWritten_{0};
 
+  /// whether the file is currently written with O_DIRECT
+  bool directIo_{false};
+
+  /// number of bytes in the staging buffer not yet written to the file
+  int64_t stagedBytes_{0};
+
+  /**
+   * Aligned buffer staging data for O_DIRECT writes. This is thread-local, so
+   * only one FileWriter can be used at once per thread, and all the writes of
+   * a block must be done by the same thread.
+   */
+  static folly::ThreadLocalPtr<AlignedBuffer> stagingBuffer_;
+
 #ifdef HAS_SYNC_FILE_RANGE
   /// offset to use for next sync
   int64_t nextSyncOffset_;
   /// number of bytes written since last sync
   int64_t writtenSinceLastSync_{0};
+  /// offset from which data is still in the page cache
+  int64_t nextDropOffset_;
 #endif
   /// reference to file creator
   FileCreator *fileCreator_;
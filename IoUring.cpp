@@ -0,0 +1,515 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include "IoUring.h"
+#include <wdt/WdtConfig.h>
+#include "Reporting.h"
+#include "WdtOptions.h"
+
+#include <folly/Checksum.h>
+#include <glog/logging.h>
+#include <algorithm>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef HAS_IO_URING
+#include <linux/io_uring.h>
+#endif
+
+namespace facebook {
+namespace wdt {
+
+#ifdef HAS_IO_URING
+
+namespace {
+/// user data of cancel requests, completions with it are ignored
+const uint64_t kCancelUserData = ~0ULL;
+/// alignment of the buffers, allows them to be used for direct i/o
+const int64_t kBufferAlignment = 4096;
+
+int ioUringSetup(unsigned entries, struct io_uring_params *params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+int ioUringEnter(int fd, unsigned toSubmit, unsigned minComplete,
+                 unsigned flags, void *arg, size_t argSize) {
+  return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, arg,
+                 argSize);
+}
+
+int ioUringRegister(int fd, unsigned opcode, const void *arg,
+                    unsigned numArgs) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, numArgs);
+}
+}
+
+IoUring::IoUring(int numBuffers, int64_t bufferSize,
+                 WdtBase::IAbortChecker const *abortChecker)
+    : numBuffers_(numBuffers),
+      bufferSize_(bufferSize),
+      abortChecker_(abortChecker) {
+  WDT_CHECK(numBuffers_ > 0 && bufferSize_ > 0);
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  // two ops per buffer, plus room for cancellations
+  const unsigned entries = 4 * numBuffers_;
+  int fd = ioUringSetup(entries, &params);
+  if (fd < 0) {
+    PLOG(ERROR) << "io_uring_setup failed, io_uring can not be used";
+    return;
+  }
+  ringFd_ = fd;
+  features_ = params.features;
+  sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+  cqRingSize_ =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  const bool singleMmap = (features_ & IORING_FEAT_SINGLE_MMAP);
+  if (singleMmap) {
+    sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+  }
+  sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQ_RING);
+  if (sqRing_ == MAP_FAILED) {
+    PLOG(ERROR) << "unable to map io_uring submission queue";
+    sqRing_ = nullptr;
+    destroy();
+    return;
+  }
+  if (singleMmap) {
+    cqRing_ = sqRing_;
+  } else {
+    cqRing_ = mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_CQ_RING);
+    if (cqRing_ == MAP_FAILED) {
+      PLOG(ERROR) << "unable to map io_uring completion queue";
+      cqRing_ = nullptr;
+      destroy();
+      return;
+    }
+  }
+  sqesSize_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  void *sqes = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    PLOG(ERROR) << "unable to map io_uring submission entries";
+    destroy();
+    return;
+  }
+  sqes_ = (struct io_uring_sqe *)sqes;
+  char *sq = (char *)sqRing_;
+  sqHead_ = (uint32_t *)(sq + params.sq_off.head);
+  sqTail_ = (uint32_t *)(sq + params.sq_off.tail);
+  sqMask_ = *(uint32_t *)(sq + params.sq_off.ring_mask);
+  sqEntries_ = *(uint32_t *)(sq + params.sq_off.ring_entries);
+  sqArray_ = (uint32_t *)(sq + params.sq_off.array);
+  char *cq = (char *)cqRing_;
+  cqHead_ = (uint32_t *)(cq + params.cq_off.head);
+  cqTail_ = (uint32_t *)(cq + params.cq_off.tail);
+  cqMask_ = *(uint32_t *)(cq + params.cq_off.ring_mask);
+  cqes_ = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  localSqTail_ = *sqTail_;
+
+  std::vector<struct iovec> iovecs(numBuffers_);
+  for (int i = 0; i < numBuffers_; i++) {
+    void *buf = nullptr;
+    if (posix_memalign(&buf, kBufferAlignment, bufferSize_) != 0) {
+      LOG(ERROR) << "unable to allocate io_uring buffer of size "
+                 << bufferSize_;
+      destroy();
+      return;
+    }
+    buffers_.push_back((char *)buf);
+    iovecs[i].iov_base = buf;
+    iovecs[i].iov_len = bufferSize_;
+  }
+  if (ioUringRegister(ringFd_, IORING_REGISTER_BUFFERS, iovecs.data(),
+                      numBuffers_) == 0) {
+    buffersRegistered_ = true;
+  } else {
+    // most likely RLIMIT_MEMLOCK, unregistered buffers still work
+    PLOG(WARNING) << "unable to register io_uring buffers";
+  }
+  VLOG(1) << "io_uring set up, fd " << ringFd_ << " entries "
+          << params.sq_entries << " features " << features_;
+}
+
+IoUring::~IoUring() {
+  destroy();
+  for (char *buf : buffers_) {
+    free(buf);
+  }
+}
+
+void IoUring::destroy() {
+  if (sqes_ != nullptr) {
+    munmap(sqes_, sqesSize_);
+    sqes_ = nullptr;
+  }
+  if (cqRing_ != nullptr && cqRing_ != sqRing_) {
+    munmap(cqRing_, cqRingSize_);
+  }
+  cqRing_ = nullptr;
+  if (sqRing_ != nullptr) {
+    munmap(sqRing_, sqRingSize_);
+    sqRing_ = nullptr;
+  }
+  if (ringFd_ >= 0) {
+    // also drops the references to registered files and buffers
+    ::close(ringFd_);
+    ringFd_ = -1;
+  }
+  socketRegistered_ = false;
+  socketFd_ = -1;
+}
+
+bool IoUring::setSocket(int socketFd) {
+  if (!isValid()) {
+    return false;
+  }
+  if (socketRegistered_ && socketFd_ == socketFd) {
+    return true;
+  }
+  if (socketRegistered_) {
+    if (ioUringRegister(ringFd_, IORING_UNREGISTER_FILES, nullptr, 0) != 0) {
+      PLOG(ERROR) << "unable to unregister socket " << socketFd_;
+      return false;
+    }
+    socketRegistered_ = false;
+  }
+  socketFd_ = socketFd;
+  if (socketFd < 0) {
+    return true;
+  }
+  if (ioUringRegister(ringFd_, IORING_REGISTER_FILES, &socketFd, 1) == 0) {
+    socketRegistered_ = true;
+  } else {
+    // the socket fd is used directly instead
+    PLOG(WARNING) << "unable to register socket " << socketFd
+                  << " with io_uring";
+  }
+  return true;
+}
+
+IoUring::Op IoUring::fileOp(bool isRead, int fd, int bufIndex, int64_t len,
+                            int64_t offset) {
+  Op op;
+  if (buffersRegistered_) {
+    op.opcode = isRead ? IORING_OP_READ_FIXED : IORING_OP_WRITE_FIXED;
+  } else {
+    op.opcode = isRead ? IORING_OP_READ : IORING_OP_WRITE;
+  }
+  op.fd = fd;
+  op.bufIndex = bufIndex;
+  op.len = len;
+  op.offset = offset;
+  op.msgFlags = 0;
+  op.result = 0;
+  return op;
+}
+
+IoUring::Op IoUring::socketOp(bool isRecv, int bufIndex, int64_t len) {
+  Op op;
+  op.opcode = isRecv ? IORING_OP_RECV : IORING_OP_SEND;
+  op.fd = -1;
+  op.bufIndex = bufIndex;
+  op.len = len;
+  op.offset = 0;
+  // without MSG_WAITALL short transfers would break the chains
+  op.msgFlags = MSG_WAITALL;
+  op.result = 0;
+  return op;
+}
+
+struct io_uring_sqe *IoUring::getSqe() {
+  uint32_t head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+  if (localSqTail_ - head >= sqEntries_) {
+    return nullptr;
+  }
+  uint32_t idx = localSqTail_ & sqMask_;
+  struct io_uring_sqe *sqe = &sqes_[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqArray_[idx] = idx;
+  localSqTail_++;
+  return sqe;
+}
+
+int IoUring::reapCompletions(std::vector<Op> &ops) {
+  int numReaped = 0;
+  uint32_t head = *cqHead_;
+  uint32_t tail = __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    const struct io_uring_cqe &cqe = cqes_[head & cqMask_];
+    if (cqe.user_data != kCancelUserData) {
+      WDT_CHECK(cqe.user_data < ops.size()) << cqe.user_data;
+      ops[cqe.user_data].result = cqe.res;
+      numReaped++;
+    }
+    head++;
+  }
+  __atomic_store_n(cqHead_, head, __ATOMIC_RELEASE);
+  return numReaped;
+}
+
+void IoUring::cancelPending(const std::vector<Op> &ops) {
+  // cancelling the head of the chain cancels the rest of the chain, but ops
+  // may be anywhere in the chain, so all pending ones are cancelled
+  for (size_t i = 0; i < ops.size(); i++) {
+    if (ops[i].result != 0) {
+      continue;
+    }
+    struct io_uring_sqe *sqe = getSqe();
+    if (sqe == nullptr) {
+      break;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = i;
+    sqe->user_data = kCancelUserData;
+  }
+  __atomic_store_n(sqTail_, localSqTail_, __ATOMIC_RELEASE);
+}
+
+ErrorCode IoUring::runChain(std::vector<Op> &ops, int timeoutMillis) {
+  if (!isValid()) {
+    return ERROR;
+  }
+  const int numOps = ops.size();
+  WDT_CHECK(numOps > 0 && numOps <= (int)sqEntries_ / 2) << numOps;
+  for (int i = 0; i < numOps; i++) {
+    Op &op = ops[i];
+    struct io_uring_sqe *sqe = getSqe();
+    WDT_CHECK(sqe != nullptr) << "io_uring submission queue full";
+    sqe->opcode = op.opcode;
+    if (op.fd < 0 && socketRegistered_) {
+      sqe->fd = 0;
+      sqe->flags |= IOSQE_FIXED_FILE;
+    } else {
+      sqe->fd = (op.fd < 0 ? socketFd_ : op.fd);
+    }
+    sqe->addr = (uint64_t)buffers_[op.bufIndex];
+    sqe->len = op.len;
+    if (op.opcode == IORING_OP_SEND || op.opcode == IORING_OP_RECV) {
+      sqe->msg_flags = op.msgFlags;
+    } else {
+      sqe->off = op.offset;
+      if (buffersRegistered_) {
+        sqe->buf_index = op.bufIndex;
+      }
+    }
+    if (i + 1 < numOps) {
+      sqe->flags |= IOSQE_IO_LINK;
+    }
+    sqe->user_data = i;
+    // 0 is a valid result only for EOF, results are overwritten when reaped
+    op.result = 0;
+  }
+  __atomic_store_n(sqTail_, localSqTail_, __ATOMIC_RELEASE);
+
+  const auto &options = WdtOptions::get();
+  int waitMillis = options.abort_check_interval_millis;
+  if (waitMillis <= 0 || (timeoutMillis > 0 && timeoutMillis < waitMillis)) {
+    waitMillis = timeoutMillis;
+  }
+  const bool canWaitWithTimeout =
+      (waitMillis > 0) && (features_ & IORING_FEAT_EXT_ARG);
+  struct __kernel_timespec ts;
+  ts.tv_sec = waitMillis / 1000;
+  ts.tv_nsec = (waitMillis % 1000) * 1000000L;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  arg.sigmask_sz = _NSIG / 8;
+  arg.ts = (uint64_t)&ts;
+
+  // ops which completed with result 0 would be indistinguishable from pending
+  // ones, so completions are counted separately
+  int numCompleted = 0;
+  bool cancelled = false;
+  bool aborted = false;
+  auto lastProgressTime = Clock::now();
+  uint32_t toSubmit = numOps;
+  while (numCompleted < numOps) {
+    unsigned flags = IORING_ENTER_GETEVENTS;
+    void *enterArg = nullptr;
+    size_t enterArgSize = 0;
+    if (canWaitWithTimeout && !cancelled) {
+      flags |= IORING_ENTER_EXT_ARG;
+      enterArg = &arg;
+      enterArgSize = sizeof(arg);
+    }
+    START_PERF_TIMER
+    int ret =
+        ioUringEnter(ringFd_, toSubmit, 1, flags, enterArg, enterArgSize);
+    RECORD_PERF_RESULT(PerfStatReport::IO_URING_ENTER)
+    if (ret < 0) {
+      if (errno != ETIME && errno != EINTR && errno != EAGAIN &&
+          errno != EBUSY) {
+        PLOG(ERROR) << "io_uring_enter failed, disabling io_uring";
+        destroy();
+        return ERROR;
+      }
+    } else {
+      toSubmit -= std::min<uint32_t>(ret, toSubmit);
+    }
+    int numReaped = reapCompletions(ops);
+    numCompleted += numReaped;
+    if (numCompleted >= numOps) {
+      break;
+    }
+    if (numReaped > 0) {
+      lastProgressTime = Clock::now();
+    }
+    if (cancelled) {
+      continue;
+    }
+    const bool timedOut =
+        (timeoutMillis > 0 &&
+         durationMillis(Clock::now() - lastProgressTime) >= timeoutMillis);
+    aborted = (abortChecker_ != nullptr && abortChecker_->shouldAbort());
+    if (timedOut || aborted) {
+      LOG(ERROR) << "cancelling io_uring ops, timed out " << timedOut
+                 << " aborted " << aborted << " completed " << numCompleted
+                 << " of " << numOps;
+      cancelPending(ops);
+      // cancel requests are submitted by the next io_uring_enter
+      toSubmit = localSqTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+      cancelled = true;
+    }
+  }
+  return aborted ? ABORT : OK;
+}
+
+int64_t IoUring::readAndSend(int fileFd, int64_t offset, int64_t nbyte,
+                             int32_t *checksum) {
+  const auto &options = WdtOptions::get();
+  int64_t sent = 0;
+  while (sent < nbyte) {
+    ops_.clear();
+    int64_t batched = 0;
+    for (int i = 0; i < numBuffers_ && sent + batched < nbyte; i++) {
+      int64_t len = std::min<int64_t>(bufferSize_, nbyte - sent - batched);
+      ops_.push_back(fileOp(true, fileFd, i, len, offset + sent + batched));
+      ops_.push_back(socketOp(false, i, len));
+      batched += len;
+    }
+    ErrorCode code = runChain(ops_, options.write_timeout_millis);
+    if (code == ERROR) {
+      return (sent > 0 ? sent : -1);
+    }
+    for (size_t i = 0; i < ops_.size(); i += 2) {
+      const Op &readOp = ops_[i];
+      const Op &sendOp = ops_[i + 1];
+      if (sendOp.result > 0 && checksum != nullptr) {
+        *checksum = folly::crc32c((const uint8_t *)buffers_[sendOp.bufIndex],
+                                  sendOp.result, *checksum);
+      }
+      if (sendOp.result > 0) {
+        sent += sendOp.result;
+      }
+      if (readOp.result != readOp.len || sendOp.result != sendOp.len) {
+        if (readOp.result < 0) {
+          LOG(ERROR) << "io_uring file read failed " << fileFd << " "
+                     << strerror(-readOp.result);
+        } else if (sendOp.result < 0) {
+          LOG(ERROR) << "io_uring socket send failed " << socketFd_ << " "
+                     << strerror(-sendOp.result);
+        }
+        return (sent > 0 ? sent : -1);
+      }
+    }
+    if (code != OK) {
+      return sent;
+    }
+  }
+  return sent;
+}
+
+ErrorCode IoUring::recvAndWrite(int fileFd, int64_t offset, int64_t nbyte,
+                                int32_t *checksum, int64_t &written) {
+  const auto &options = WdtOptions::get();
+  written = 0;
+  while (written < nbyte) {
+    ops_.clear();
+    int64_t batched = 0;
+    for (int i = 0; i < numBuffers_ && written + batched < nbyte; i++) {
+      int64_t len = std::min<int64_t>(bufferSize_, nbyte - written - batched);
+      ops_.push_back(socketOp(true, i, len));
+      ops_.push_back(
+          fileOp(false, fileFd, i, len, offset + written + batched));
+      batched += len;
+    }
+    ErrorCode code = runChain(ops_, options.read_timeout_millis);
+    if (code == ERROR) {
+      return SOCKET_READ_ERROR;
+    }
+    for (size_t i = 0; i < ops_.size(); i += 2) {
+      const Op &recvOp = ops_[i];
+      const Op &writeOp = ops_[i + 1];
+      if (recvOp.result != recvOp.len) {
+        LOG(ERROR) << "io_uring socket recv failed/short " << socketFd_ << " "
+                   << recvOp.result << " " << recvOp.len;
+        return (code == ABORT ? ABORT : SOCKET_READ_ERROR);
+      }
+      if (checksum != nullptr) {
+        *checksum = folly::crc32c((const uint8_t *)buffers_[recvOp.bufIndex],
+                                  recvOp.result, *checksum);
+      }
+      if (writeOp.result != writeOp.len) {
+        LOG(ERROR) << "io_uring file write failed " << fileFd << " "
+                   << writeOp.result << " " << writeOp.len;
+        return (code == ABORT ? ABORT : FILE_WRITE_ERROR);
+      }
+      written += writeOp.result;
+    }
+    if (code != OK) {
+      return code;
+    }
+  }
+  return OK;
+}
+
+#else
+
+IoUring::IoUring(int numBuffers, int64_t bufferSize,
+                 WdtBase::IAbortChecker const *abortChecker)
+    : numBuffers_(numBuffers),
+      bufferSize_(bufferSize),
+      abortChecker_(abortChecker) {
+  LOG(ERROR) << "io_uring is not supported on this platform";
+}
+
+IoUring::~IoUring() {
+}
+
+void IoUring::destroy() {
+}
+
+bool IoUring::setSocket(int /* unused */) {
+  return false;
+}
+
+int64_t IoUring::readAndSend(int /* unused */, int64_t /* unused */,
+                             int64_t /* unused */, int32_t * /* unused */) {
+  return -1;
+}
+
+ErrorCode IoUring::recvAndWrite(int /* unused */, int64_t /* unused */,
+                                int64_t /* unused */, int32_t * /* unused */,
+                                int64_t &written) {
+  written = 0;
+  return ERROR;
+}
+
+#endif
+}
+}
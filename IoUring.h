@@ -0,0 +1,175 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include "ErrorCodes.h"
+#include "WdtBase.h"
+
+#include <stdint.h>
+#include <vector>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Minimal io_uring based i/o engine, talking to the kernel directly (no
+ * liburing dependency). Data is moved between a file and a connected socket
+ * using chains of linked operations: file read -> socket send on the sender
+ * and socket recv -> file write on the receiver. A whole batch of buffers is
+ * submitted and reaped with a single io_uring_enter call instead of two
+ * system calls per buffer. File i/o uses registered buffers and the socket is
+ * registered as a fixed file. Since the ring holds a reference to the
+ * registered socket, it must be destroyed (or setSocket(-1) called) before
+ * the socket is closed.
+ *
+ * Not thread safe, an instance must be used by a single thread.
+ */
+class IoUring {
+ public:
+  /**
+   * Sets up the ring. Use isValid() to find out whether it succeeded.
+   *
+   * @param numBuffers      number of buffers used per batch
+   * @param bufferSize      size of each buffer
+   * @param abortChecker    abort checker, polled while waiting for
+   *                        completions
+   */
+  IoUring(int numBuffers, int64_t bufferSize,
+          WdtBase::IAbortChecker const *abortChecker);
+
+  ~IoUring();
+
+  /// @return     whether io_uring is supported and the ring is usable
+  bool isValid() const {
+    return ringFd_ >= 0;
+  }
+
+  /**
+   * Registers socketFd as the fixed file used for socket operations. Passing
+   * -1 removes the registration.
+   *
+   * @return      false if the socket can not be used with the ring
+   */
+  bool setSocket(int socketFd);
+
+  /// @return     number of bytes moved with one io_uring_enter call
+  int64_t getBatchSize() const {
+    return numBuffers_ * bufferSize_;
+  }
+
+  /**
+   * Reads nbyte bytes of fileFd starting at offset and sends them on the
+   * socket.
+   *
+   * @param checksum    if not null, crc32c of sent data is accumulated here
+   *
+   * @return            number of bytes sent, less than nbyte in case of
+   *                    error/abort/EOF, -1 if nothing could be sent
+   */
+  int64_t readAndSend(int fileFd, int64_t offset, int64_t nbyte,
+                      int32_t *checksum);
+
+  /**
+   * Receives nbyte bytes from the socket and writes them in fileFd starting
+   * at offset.
+   *
+   * @param checksum    if not null, crc32c of received data is accumulated
+   *                    here
+   * @param written     set to number of bytes received and written
+   *
+   * @return            OK, SOCKET_READ_ERROR, FILE_WRITE_ERROR or ABORT
+   */
+  ErrorCode recvAndWrite(int fileFd, int64_t offset, int64_t nbyte,
+                         int32_t *checksum, int64_t &written);
+
+ private:
+  /// single operation of a chain
+  struct Op {
+    uint8_t opcode;
+    /// file descriptor, or -1 to use the registered socket
+    int fd;
+    int bufIndex;
+    int64_t len;
+    int64_t offset;
+    int msgFlags;
+    /// result of the operation, set once completed
+    int64_t result;
+  };
+
+  /// @return     op reading or writing a file
+  Op fileOp(bool isRead, int fd, int bufIndex, int64_t len, int64_t offset);
+
+  /// @return     op sending or receiving on the socket
+  Op socketOp(bool isRecv, int bufIndex, int64_t len);
+
+  /**
+   * Submits ops as one linked chain and waits for all of them to complete.
+   * Once an op fails or is short, the kernel cancels the rest of the chain.
+   * Pending ops are cancelled on abort or if no progress is made for
+   * timeoutMillis.
+   *
+   * @return      OK if the chain was submitted and reaped, ABORT if the
+   *              transfer was aborted, ERROR if the ring is unusable
+   */
+  ErrorCode runChain(std::vector<Op> &ops, int timeoutMillis);
+
+  /// cancels ops which are not complete yet
+  void cancelPending(const std::vector<Op> &ops);
+
+  /// @return     free submission queue entry, nullptr if the queue is full
+  struct ::io_uring_sqe *getSqe();
+
+  /// reaps all available completions into ops, @return number reaped
+  int reapCompletions(std::vector<Op> &ops);
+
+  /// unmaps the rings and closes the ring fd
+  void destroy();
+
+  const int numBuffers_;
+  const int64_t bufferSize_;
+  WdtBase::IAbortChecker const *abortChecker_;
+
+  /// ring file descriptor, -1 if unusable
+  int ringFd_{-1};
+  /// features reported by the kernel
+  uint32_t features_{0};
+  /// whether buffers are registered with the ring
+  bool buffersRegistered_{false};
+  /// whether a socket is registered as fixed file
+  bool socketRegistered_{false};
+  /// currently used socket
+  int socketFd_{-1};
+  std::vector<char *> buffers_;
+  /// pending ops being reused across calls
+  std::vector<Op> ops_;
+
+  // mappings of the rings and pointers into them
+  void *sqRing_{nullptr};
+  size_t sqRingSize_{0};
+  void *cqRing_{nullptr};
+  size_t cqRingSize_{0};
+  struct ::io_uring_sqe *sqes_{nullptr};
+  size_t sqesSize_{0};
+  uint32_t *sqHead_{nullptr};
+  uint32_t *sqTail_{nullptr};
+  uint32_t sqMask_{0};
+  uint32_t sqEntries_{0};
+  uint32_t *sqArray_{nullptr};
+  uint32_t *cqHead_{nullptr};
+  uint32_t *cqTail_{nullptr};
+  uint32_t cqMask_{0};
+  struct ::io_uring_cqe *cqes_{nullptr};
+  /// tail of submitted but not yet entered sqes
+  uint32_t localSqTail_{0};
+};
+}
+}
@@ -0,0 +1,919 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include "PathFilter.h"
+
+#include <glog/logging.h>
+#include <string.h>
+#include <algorithm>
+#include <bitset>
+#include <map>
+
+namespace facebook {
+namespace wdt {
+
+namespace {
+
+typedef std::bitset<256> CharSet;
+
+/// max count of a {n,m} quantifier compiled to a DFA
+const int kMaxRepeat = 64;
+/// max number of literals a pattern can expand to for the trie matchers
+const size_t kMaxLiterals = 256;
+/// max number of characters of a character class expanded to literals
+const size_t kMaxLiteralClassSize = 4;
+/// automatons larger than this fall back to std::regex
+const size_t kMaxNfaStates = 16384;
+const size_t kMaxDfaStates = 4096;
+
+/// chars matched by . (ECMAScript: anything but line terminators)
+CharSet anyCharSet() {
+  CharSet chars;
+  chars.set();
+  chars.reset('\n');
+  chars.reset('\r');
+  return chars;
+}
+
+enum NodeType {
+  CHARS_NODE,
+  CONCAT_NODE,
+  ALT_NODE,
+  REPEAT_NODE,
+  BOL_NODE,
+  EOL_NODE,
+};
+
+/// node of the syntax tree of a pattern
+struct Node {
+  NodeType type;
+  CharSet chars;
+  std::vector<int> children;
+  int min{0};
+  /// -1 for unbounded
+  int max{0};
+};
+
+/**
+ * Parser of the regular subset of the ECMAScript grammar. Anything else,
+ * including what std::regex would reject, makes parse() fail so the pattern
+ * is left to std::regex.
+ */
+class Parser {
+ public:
+  Parser(const std::string &pattern, std::vector<Node> &nodes)
+      : pattern_(pattern), nodes_(nodes) {
+  }
+
+  /// @return   root node, -1 if the pattern is not supported
+  int parse() {
+    int root = parseAlternation();
+    if (root < 0 || pos_ != pattern_.size()) {
+      return -1;
+    }
+    return root;
+  }
+
+ private:
+  int addNode(Node node) {
+    nodes_.emplace_back(std::move(node));
+    return nodes_.size() - 1;
+  }
+
+  bool atEnd() const {
+    return pos_ >= pattern_.size();
+  }
+
+  char peek() const {
+    return pattern_[pos_];
+  }
+
+  int parseAlternation() {
+    int first = parseConcat();
+    if (first < 0 || atEnd() || peek() != '|') {
+      return first;
+    }
+    Node alt;
+    alt.type = ALT_NODE;
+    alt.children.push_back(first);
+    while (!atEnd() && peek() == '|') {
+      pos_++;
+      int child = parseConcat();
+      if (child < 0) {
+        return -1;
+      }
+      alt.children.push_back(child);
+    }
+    return addNode(std::move(alt));
+  }
+
+  int parseConcat() {
+    Node concat;
+    concat.type = CONCAT_NODE;
+    while (!atEnd() && peek() != '|' && peek() != ')') {
+      int term = parseTerm();
+      if (term < 0) {
+        return -1;
+      }
+      concat.children.push_back(term);
+    }
+    return addNode(std::move(concat));
+  }
+
+  bool parseInt(int &value) {
+    const size_t start = pos_;
+    value = 0;
+    while (!atEnd() && isdigit(peek()) && pos_ - start < 6) {
+      value = value * 10 + (peek() - '0');
+      pos_++;
+    }
+    return pos_ > start && (atEnd() || !isdigit(peek()));
+  }
+
+  int parseTerm() {
+    int atom = parseAtom();
+    if (atom < 0 || atEnd()) {
+      return atom;
+    }
+    int min, max;
+    switch (peek()) {
+      case '*':
+        min = 0;
+        max = -1;
+        pos_++;
+        break;
+      case '+':
+        min = 1;
+        max = -1;
+        pos_++;
+        break;
+      case '?':
+        min = 0;
+        max = 1;
+        pos_++;
+        break;
+      case '{':
+        pos_++;
+        if (!parseInt(min) || atEnd()) {
+          return -1;
+        }
+        max = min;
+        if (peek() == ',') {
+          pos_++;
+          max = -1;
+          if (!atEnd() && peek() != '}' && !parseInt(max)) {
+            return -1;
+          }
+        }
+        if (atEnd() || peek() != '}') {
+          return -1;
+        }
+        pos_++;
+        break;
+      default:
+        return atom;
+    }
+    if (nodes_[atom].type == BOL_NODE || nodes_[atom].type == EOL_NODE) {
+      return -1;
+    }
+    if (min > kMaxRepeat || max > kMaxRepeat || (max >= 0 && max < min)) {
+      return -1;
+    }
+    // non greedy quantifiers match the same whole strings
+    if (!atEnd() && peek() == '?') {
+      pos_++;
+    }
+    if (!atEnd() &&
+        (peek() == '*' || peek() == '+' || peek() == '?' || peek() == '{')) {
+      return -1;
+    }
+    Node repeat;
+    repeat.type = REPEAT_NODE;
+    repeat.children.push_back(atom);
+    repeat.min = min;
+    repeat.max = max;
+    return addNode(std::move(repeat));
+  }
+
+  int parseAtom() {
+    Node node;
+    node.type = CHARS_NODE;
+    const char c = peek();
+    switch (c) {
+      case '(': {
+        pos_++;
+        if (!atEnd() && peek() == '?') {
+          // only non capturing groups, no look aheads
+          if (pattern_.compare(pos_, 2, "?:") != 0) {
+            return -1;
+          }
+          pos_ += 2;
+        }
+        // capturing groups are only needed by back references
+        int inner = parseAlternation();
+        if (inner < 0 || atEnd() || peek() != ')') {
+          return -1;
+        }
+        pos_++;
+        return inner;
+      }
+      case '[':
+        if (!parseClass(node.chars)) {
+          return -1;
+        }
+        return addNode(std::move(node));
+      case '.':
+        pos_++;
+        node.chars = anyCharSet();
+        return addNode(std::move(node));
+      case '^':
+        pos_++;
+        node.type = BOL_NODE;
+        return addNode(std::move(node));
+      case '$':
+        pos_++;
+        node.type = EOL_NODE;
+        return addNode(std::move(node));
+      case '\\': {
+        bool single;
+        unsigned char ch;
+        if (!parseEscape(node.chars, single, ch)) {
+          return -1;
+        }
+        return addNode(std::move(node));
+      }
+      case ')':
+      case ']':
+      case '{':
+      case '}':
+      case '*':
+      case '+':
+      case '?':
+      case '|':
+        return -1;
+      default:
+        pos_++;
+        node.chars.set((unsigned char)c);
+        return addNode(std::move(node));
+    }
+  }
+
+  /**
+   * parses an escape sequence
+   *
+   * @param chars     chars of the escape are added to it
+   * @param single    set to whether the escape is a single char
+   * @param ch        set to that char
+   */
+  bool parseEscape(CharSet &chars, bool &single, unsigned char &ch) {
+    pos_++;
+    if (atEnd()) {
+      return false;
+    }
+    const char c = pattern_[pos_++];
+    single = false;
+    CharSet set;
+    switch (c) {
+      case 'd':
+      case 'D':
+        for (int i = '0'; i <= '9'; i++) {
+          set.set(i);
+        }
+        break;
+      case 'w':
+      case 'W':
+        for (int i = 0; i < 128; i++) {
+          if (isalnum(i) || i == '_') {
+            set.set(i);
+          }
+        }
+        break;
+      case 's':
+      case 'S':
+        for (char space : {' ', '\t', '\n', '\v', '\f', '\r'}) {
+          set.set((unsigned char)space);
+        }
+        break;
+      case 'n':
+        single = true;
+        ch = '\n';
+        break;
+      case 't':
+        single = true;
+        ch = '\t';
+        break;
+      case 'r':
+        single = true;
+        ch = '\r';
+        break;
+      case 'v':
+        single = true;
+        ch = '\v';
+        break;
+      case 'f':
+        single = true;
+        ch = '\f';
+        break;
+      case 'x': {
+        if (pos_ + 2 > pattern_.size() || !isxdigit(pattern_[pos_]) ||
+            !isxdigit(pattern_[pos_ + 1])) {
+          return false;
+        }
+        single = true;
+        ch = std::stoi(pattern_.substr(pos_, 2), nullptr, 16);
+        pos_ += 2;
+        break;
+      }
+      default:
+        // word boundaries, back references, control and unicode escapes...
+        if (isalnum((unsigned char)c) || (c & 0x80)) {
+          return false;
+        }
+        single = true;
+        ch = c;
+        break;
+    }
+    if (single) {
+      chars.set(ch);
+    } else if (isupper(c)) {
+      chars |= ~set;
+    } else {
+      chars |= set;
+    }
+    return true;
+  }
+
+  /// parses one char or escape of a class
+  bool parseClassAtom(CharSet &chars, bool &single, unsigned char &ch) {
+    const char c = peek();
+    if (c == '\\') {
+      return parseEscape(chars, single, ch);
+    }
+    if (c == '[' || (c & 0x80)) {
+      // [:alpha:] like classes, non ascii ranges depend on char's signedness
+      return false;
+    }
+    pos_++;
+    single = true;
+    ch = c;
+    chars.set(ch);
+    return true;
+  }
+
+  bool parseClass(CharSet &chars) {
+    pos_++;
+    bool negate = false;
+    if (!atEnd() && peek() == '^') {
+      negate = true;
+      pos_++;
+    }
+    bool first = true;
+    while (true) {
+      if (atEnd()) {
+        return false;
+      }
+      if (peek() == ']') {
+        if (first) {
+          // [] and [^] are ECMAScript specific, leave them to std::regex
+          return false;
+        }
+        pos_++;
+        break;
+      }
+      first = false;
+      CharSet atomChars;
+      bool single;
+      unsigned char lo;
+      if (!parseClassAtom(atomChars, single, lo)) {
+        return false;
+      }
+      if (pos_ + 1 < pattern_.size() && peek() == '-' &&
+          pattern_[pos_ + 1] != ']') {
+        if (!single) {
+          // ranges of classes like [\d-z]
+          return false;
+        }
+        pos_++;
+        CharSet hiChars;
+        unsigned char hi;
+        if (atEnd() || !parseClassAtom(hiChars, single, hi) || !single ||
+            hi < lo) {
+          return false;
+        }
+        for (int i = lo; i <= hi; i++) {
+          chars.set(i);
+        }
+        continue;
+      }
+      chars |= atomChars;
+    }
+    if (negate) {
+      chars.flip();
+    }
+    return true;
+  }
+
+  const std::string &pattern_;
+  std::vector<Node> &nodes_;
+  size_t pos_{0};
+};
+
+/// @return   whether node is .*
+bool isAnyStar(const std::vector<Node> &nodes, int node) {
+  const Node &n = nodes[node];
+  return n.type == REPEAT_NODE && n.min == 0 && n.max == -1 &&
+         nodes[n.children[0]].type == CHARS_NODE &&
+         nodes[n.children[0]].chars == anyCharSet();
+}
+
+/// expands the strings matched by node, @return false if there are too many
+/// or infinitely many of them
+bool expandLiterals(const std::vector<Node> &nodes, int node,
+                    std::vector<std::string> &literals) {
+  const Node &n = nodes[node];
+  switch (n.type) {
+    case CHARS_NODE: {
+      if (n.chars.count() > kMaxLiteralClassSize) {
+        return false;
+      }
+      literals.clear();
+      for (int i = 0; i < 256; i++) {
+        if (n.chars.test(i)) {
+          literals.emplace_back(1, (char)i);
+        }
+      }
+      return true;
+    }
+    case CONCAT_NODE:
+    case REPEAT_NODE: {
+      std::vector<int> parts;
+      if (n.type == CONCAT_NODE) {
+        parts = n.children;
+      } else if (n.min == n.max) {
+        parts.assign(n.min, n.children[0]);
+      } else {
+        return false;
+      }
+      literals.assign(1, "");
+      for (int part : parts) {
+        std::vector<std::string> partLiterals;
+        if (!expandLiterals(nodes, part, partLiterals) ||
+            literals.size() * partLiterals.size() > kMaxLiterals) {
+          return false;
+        }
+        std::vector<std::string> product;
+        for (const auto &prefix : literals) {
+          for (const auto &suffix : partLiterals) {
+            product.push_back(prefix + suffix);
+          }
+        }
+        literals.swap(product);
+      }
+      return true;
+    }
+    case ALT_NODE: {
+      literals.clear();
+      for (int child : n.children) {
+        std::vector<std::string> childLiterals;
+        if (!expandLiterals(nodes, child, childLiterals) ||
+            literals.size() + childLiterals.size() > kMaxLiterals) {
+          return false;
+        }
+        literals.insert(literals.end(), childLiterals.begin(),
+                        childLiterals.end());
+      }
+      return true;
+    }
+    default:
+      return false;
+  }
+}
+
+/// state of the NFA of a pattern
+struct NfaState {
+  enum Type {
+    CHARS_STATE,
+    EPSILON_STATE,
+    /// epsilon transition only taken at the start of the path
+    BOL_STATE,
+    /// epsilon transition only taken at the end of the path
+    EOL_STATE,
+    MATCH_STATE,
+  };
+  Type type;
+  CharSet chars;
+  std::vector<int> out;
+};
+
+/// Thompson construction of the NFA of a syntax tree
+class NfaBuilder {
+ public:
+  NfaBuilder(const std::vector<Node> &nodes, std::vector<NfaState> &states)
+      : nodes_(nodes), states_(states) {
+  }
+
+  /// @return   start state, -1 if the NFA is too large
+  int build(int root) {
+    int start, end;
+    if (!build(root, start, end)) {
+      return -1;
+    }
+    const int match = addState(NfaState::MATCH_STATE);
+    states_[end].out.push_back(match);
+    return start;
+  }
+
+ private:
+  int addState(NfaState::Type type) {
+    NfaState state;
+    state.type = type;
+    states_.emplace_back(std::move(state));
+    return states_.size() - 1;
+  }
+
+  /// builds the fragment of node, end is an epsilon state with no out yet
+  bool build(int node, int &start, int &end) {
+    if (states_.size() > kMaxNfaStates) {
+      return false;
+    }
+    const Node &n = nodes_[node];
+    switch (n.type) {
+      case CHARS_NODE:
+      case BOL_NODE:
+      case EOL_NODE: {
+        NfaState::Type type =
+            (n.type == CHARS_NODE)
+                ? NfaState::CHARS_STATE
+                : (n.type == BOL_NODE ? NfaState::BOL_STATE
+                                      : NfaState::EOL_STATE);
+        start = addState(type);
+        states_[start].chars = n.chars;
+        end = addState(NfaState::EPSILON_STATE);
+        states_[start].out.push_back(end);
+        return true;
+      }
+      case CONCAT_NODE: {
+        start = end = addState(NfaState::EPSILON_STATE);
+        for (int child : n.children) {
+          int childStart, childEnd;
+          if (!build(child, childStart, childEnd)) {
+            return false;
+          }
+          states_[end].out.push_back(childStart);
+          end = childEnd;
+        }
+        return true;
+      }
+      case ALT_NODE: {
+        start = addState(NfaState::EPSILON_STATE);
+        end = addState(NfaState::EPSILON_STATE);
+        for (int child : n.children) {
+          int childStart, childEnd;
+          if (!build(child, childStart, childEnd)) {
+            return false;
+          }
+          states_[start].out.push_back(childStart);
+          states_[childEnd].out.push_back(end);
+        }
+        return true;
+      }
+      case REPEAT_NODE: {
+        const int child = n.children[0];
+        start = end = addState(NfaState::EPSILON_STATE);
+        for (int i = 0; i < n.min; i++) {
+          int childStart, childEnd;
+          if (!build(child, childStart, childEnd)) {
+            return false;
+          }
+          states_[end].out.push_back(childStart);
+          end = childEnd;
+        }
+        if (n.max < 0) {
+          int childStart, childEnd;
+          if (!build(child, childStart, childEnd)) {
+            return false;
+          }
+          const int loopEnd = addState(NfaState::EPSILON_STATE);
+          states_[end].out.push_back(childStart);
+          states_[end].out.push_back(loopEnd);
+          states_[childEnd].out.push_back(childStart);
+          states_[childEnd].out.push_back(loopEnd);
+          end = loopEnd;
+          return true;
+        }
+        // optional copies, each one skips to the end
+        const int optionalEnd = addState(NfaState::EPSILON_STATE);
+        for (int i = n.min; i < n.max; i++) {
+          int childStart, childEnd;
+          if (!build(child, childStart, childEnd)) {
+            return false;
+          }
+          states_[end].out.push_back(childStart);
+          states_[end].out.push_back(optionalEnd);
+          end = childEnd;
+        }
+        states_[end].out.push_back(optionalEnd);
+        end = optionalEnd;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  const std::vector<Node> &nodes_;
+  std::vector<NfaState> &states_;
+};
+
+/**
+ * Adds to set the states reachable from states without consuming a char.
+ * Only chars, match and (unless atEnd) end of line states are kept, the
+ * later can still be followed once the end of the path is reached.
+ */
+void closure(const std::vector<NfaState> &nfa, std::vector<int> states,
+             bool atStart, bool atEnd, std::vector<int> &set) {
+  std::vector<char> seen(nfa.size(), 0);
+  set.clear();
+  while (!states.empty()) {
+    const int s = states.back();
+    states.pop_back();
+    if (seen[s]) {
+      continue;
+    }
+    seen[s] = 1;
+    const NfaState &state = nfa[s];
+    switch (state.type) {
+      case NfaState::CHARS_STATE:
+      case NfaState::MATCH_STATE:
+        set.push_back(s);
+        break;
+      case NfaState::BOL_STATE:
+        if (atStart) {
+          states.insert(states.end(), state.out.begin(), state.out.end());
+        }
+        break;
+      case NfaState::EOL_STATE:
+        if (atEnd) {
+          states.insert(states.end(), state.out.begin(), state.out.end());
+        } else {
+          set.push_back(s);
+        }
+        break;
+      case NfaState::EPSILON_STATE:
+        states.insert(states.end(), state.out.begin(), state.out.end());
+        break;
+    }
+  }
+  std::sort(set.begin(), set.end());
+}
+
+/// @return   whether the path can end in the set of states
+bool isAccepting(const std::vector<NfaState> &nfa, const std::vector<int> &set,
+                 bool atStart) {
+  std::vector<int> endSet;
+  closure(nfa, set, atStart, true, endSet);
+  for (int s : endSet) {
+    if (nfa[s].type == NfaState::MATCH_STATE) {
+      return true;
+    }
+  }
+  return false;
+}
+}
+
+PathFilter::PathFilter() : PathFilter(std::string()) {
+}
+
+PathFilter::PathFilter(const std::string &pattern) {
+  // std::regex validates the pattern, and throws for invalid ones as before
+  regex_ = std::make_shared<std::regex>(pattern);
+  std::vector<Node> nodes;
+  Parser parser(pattern, nodes);
+  const int root = parser.parse();
+  if (root < 0) {
+    VLOG(1) << "Pattern " << pattern << " matched with std::regex";
+    return;
+  }
+  // ^ and $ at the ends of the pattern don't matter for a whole match
+  std::vector<int> items;
+  if (nodes[root].type == CONCAT_NODE) {
+    items = nodes[root].children;
+  } else {
+    items.push_back(root);
+  }
+  while (!items.empty() && nodes[items.front()].type == BOL_NODE) {
+    items.erase(items.begin());
+  }
+  while (!items.empty() && nodes[items.back()].type == EOL_NODE) {
+    items.pop_back();
+  }
+  const bool leadingAny = !items.empty() && isAnyStar(nodes, items.front());
+  if (leadingAny) {
+    items.erase(items.begin());
+  }
+  const bool trailingAny = !items.empty() && isAnyStar(nodes, items.back());
+  if (trailingAny) {
+    items.pop_back();
+  }
+  Node middle;
+  middle.type = CONCAT_NODE;
+  middle.children = items;
+  nodes.push_back(middle);
+  std::vector<std::string> literals;
+  if (expandLiterals(nodes, nodes.size() - 1, literals)) {
+    if (leadingAny && trailingAny) {
+      if (literals.size() == 1) {
+        matcherType_ = CONTAINS_MATCHER;
+        literal_ = literals[0];
+      }
+    } else {
+      matcherType_ = leadingAny ? SUFFIX_MATCHER
+                                : (trailingAny ? PREFIX_MATCHER
+                                               : LITERAL_MATCHER);
+      trie_.resize(1);
+      for (const auto &literal : literals) {
+        addLiteral(literal, leadingAny);
+      }
+    }
+  }
+  if (matcherType_ == STD_REGEX_MATCHER && buildDfa(pattern)) {
+    matcherType_ = DFA_MATCHER;
+  }
+  VLOG(1) << "Pattern " << pattern << " matched with " << getMatcherName();
+}
+
+const char *PathFilter::getMatcherName() const {
+  switch (matcherType_) {
+    case LITERAL_MATCHER:
+      return "literal";
+    case PREFIX_MATCHER:
+      return "prefix";
+    case SUFFIX_MATCHER:
+      return "suffix";
+    case CONTAINS_MATCHER:
+      return "contains";
+    case DFA_MATCHER:
+      return "dfa";
+    case STD_REGEX_MATCHER:
+      return "std::regex";
+  }
+  return "unknown";
+}
+
+void PathFilter::addLiteral(const std::string &literal, bool reversed) {
+  int node = 0;
+  const int64_t size = literal.size();
+  for (int64_t i = 0; i < size; i++) {
+    const unsigned char c = literal[reversed ? size - 1 - i : i];
+    int child = getChild(node, c);
+    if (child < 0) {
+      child = trie_.size();
+      trie_[node].children.emplace_back(c, child);
+      trie_.emplace_back();
+    }
+    node = child;
+  }
+  trie_[node].terminal = true;
+}
+
+int PathFilter::getChild(int node, unsigned char c) const {
+  for (const auto &child : trie_[node].children) {
+    if (child.first == c) {
+      return child.second;
+    }
+  }
+  return -1;
+}
+
+bool PathFilter::matchTrie(const std::string &path) const {
+  const int64_t size = path.size();
+  const bool reversed = (matcherType_ == SUFFIX_MATCHER);
+  int node = 0;
+  for (int64_t i = 0; i < size; i++) {
+    if (matcherType_ != LITERAL_MATCHER && trie_[node].terminal) {
+      // rest of the path is matched by .*
+      return true;
+    }
+    node = getChild(node, path[reversed ? size - 1 - i : i]);
+    if (node < 0) {
+      return false;
+    }
+  }
+  return trie_[node].terminal;
+}
+
+bool PathFilter::buildDfa(const std::string &pattern) {
+  std::vector<Node> nodes;
+  Parser parser(pattern, nodes);
+  const int root = parser.parse();
+  std::vector<NfaState> nfa;
+  NfaBuilder builder(nodes, nfa);
+  const int nfaStart = builder.build(root);
+  if (nfaStart < 0) {
+    LOG(WARNING) << "Pattern " << pattern << " too large for a dfa";
+    return false;
+  }
+  // bytes in the same char sets are equivalent
+  std::vector<CharSet> charSets;
+  for (const auto &state : nfa) {
+    if (state.type == NfaState::CHARS_STATE &&
+        std::find(charSets.begin(), charSets.end(), state.chars) ==
+            charSets.end()) {
+      charSets.push_back(state.chars);
+    }
+  }
+  std::map<std::vector<bool>, int> classIds;
+  std::vector<int> classRepresentatives;
+  for (int c = 0; c < 256; c++) {
+    std::vector<bool> key;
+    for (const auto &chars : charSets) {
+      key.push_back(chars.test(c));
+    }
+    auto it = classIds.find(key);
+    if (it == classIds.end()) {
+      it = classIds.emplace(key, classRepresentatives.size()).first;
+      classRepresentatives.push_back(c);
+    }
+    byteClasses_[c] = it->second;
+  }
+  numClasses_ = classRepresentatives.size();
+  // subset construction. The start state is never reused for the same set
+  // of NFA states reached later: ^ after $ only matches the empty path
+  std::map<std::vector<int>, int> dfaStates;
+  std::vector<std::vector<int>> sets(1);
+  closure(nfa, {nfaStart}, true, false, sets[0]);
+  for (size_t d = 0; d < sets.size(); d++) {
+    if (sets.size() > kMaxDfaStates) {
+      LOG(WARNING) << "Pattern " << pattern << " too large for a dfa";
+      transitions_.clear();
+      accepting_.clear();
+      return false;
+    }
+    accepting_.push_back(isAccepting(nfa, sets[d], d == 0));
+    for (int cls = 0; cls < numClasses_; cls++) {
+      const int c = classRepresentatives[cls];
+      std::vector<int> next;
+      for (int s : sets[d]) {
+        if (nfa[s].type == NfaState::CHARS_STATE && nfa[s].chars.test(c)) {
+          next.insert(next.end(), nfa[s].out.begin(), nfa[s].out.end());
+        }
+      }
+      if (next.empty()) {
+        transitions_.push_back(-1);
+        continue;
+      }
+      std::vector<int> nextSet;
+      closure(nfa, next, false, false, nextSet);
+      auto it = dfaStates.find(nextSet);
+      if (it == dfaStates.end()) {
+        it = dfaStates.emplace(nextSet, sets.size()).first;
+        sets.push_back(nextSet);
+      }
+      transitions_.push_back(it->second);
+    }
+  }
+  VLOG(1) << "Pattern " << pattern << " compiled to a dfa of " << sets.size()
+          << " states and " << numClasses_ << " byte classes";
+  return true;
+}
+
+bool PathFilter::matchDfa(const std::string &path) const {
+  int state = 0;
+  for (unsigned char c : path) {
+    state = transitions_[state * numClasses_ + byteClasses_[c]];
+    if (state < 0) {
+      return false;
+    }
+  }
+  return accepting_[state];
+}
+
+bool PathFilter::matches(const std::string &path) const {
+  switch (matcherType_) {
+    case LITERAL_MATCHER:
+      return matchTrie(path);
+    case PREFIX_MATCHER:
+    case SUFFIX_MATCHER:
+    case CONTAINS_MATCHER:
+      // . doesn't match line terminators
+      if (memchr(path.data(), '\n', path.size()) ||
+          memchr(path.data(), '\r', path.size())) {
+        break;
+      }
+      if (matcherType_ == CONTAINS_MATCHER) {
+        return path.find(literal_) != std::string::npos;
+      }
+      return matchTrie(path);
+    case DFA_MATCHER:
+      return matchDfa(path);
+    case STD_REGEX_MATCHER:
+      break;
+  }
+  return std::regex_match(path, *regex_);
+}
+}
+}
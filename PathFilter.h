@@ -0,0 +1,103 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <memory>
+#include <regex>
+#include <string>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Matches paths against one of the discovery patterns (include_regex,
+ * exclude_regex, prune_dir_regex) with the same result as std::regex_match
+ * with the default (ECMAScript) grammar, compiled once:
+ *  - sets of literals, optionally preceded and/or followed by .* (e.g.
+ *    .*\.(jpg|png) or logs/.*), are matched with a trie
+ *  - other regular expressions are compiled to a DFA
+ *  - constructs a DFA can't express (back references, look aheads, word
+ *    boundaries...) or too large automatons fall back to std::regex
+ * Read only once built, can be used by several threads at once.
+ */
+class PathFilter {
+ public:
+  /// kind of matcher used for a pattern
+  enum MatcherType {
+    LITERAL_MATCHER,
+    PREFIX_MATCHER,
+    SUFFIX_MATCHER,
+    CONTAINS_MATCHER,
+    DFA_MATCHER,
+    STD_REGEX_MATCHER,
+  };
+
+  /// filter of the empty pattern, which only matches the empty path
+  PathFilter();
+
+  /**
+   * Compiles a pattern
+   *
+   * @param pattern   ECMAScript regex, an invalid one throws std::regex_error
+   *                  just like std::regex does
+   */
+  explicit PathFilter(const std::string &pattern);
+
+  /// @return   whether the whole path matches the pattern
+  bool matches(const std::string &path) const;
+
+  /// @return   matcher used for the pattern
+  MatcherType getMatcherType() const {
+    return matcherType_;
+  }
+
+  /// @return   printable name of the matcher used for the pattern
+  const char *getMatcherName() const;
+
+ private:
+  /// node of the trie of literals, children are few so they are scanned
+  struct TrieNode {
+    std::vector<std::pair<unsigned char, int>> children;
+    bool terminal{false};
+  };
+
+  /// adds a literal to the trie, reversed for suffix matching
+  void addLiteral(const std::string &literal, bool reversed);
+
+  /// @return   child of node for c, -1 if there is none
+  int getChild(int node, unsigned char c) const;
+
+  /// @return   whether the pattern could be compiled to a DFA
+  bool buildDfa(const std::string &pattern);
+
+  bool matchTrie(const std::string &path) const;
+
+  bool matchDfa(const std::string &path) const;
+
+  MatcherType matcherType_{STD_REGEX_MATCHER};
+
+  std::vector<TrieNode> trie_;
+  /// literal of CONTAINS_MATCHER
+  std::string literal_;
+
+  /// DFA transitions, numClasses_ per state, -1 for the dead state
+  std::vector<int32_t> transitions_;
+  /// whether reaching the end of the path in a state is a match
+  std::vector<char> accepting_;
+  /// bytes which all DFA states treat the same belong to the same class
+  uint8_t byteClasses_[256];
+  int numClasses_{0};
+
+  /// fall back, shared by the copies of the filter. Also used by the .*
+  /// matchers for the rare paths with line terminators, which . doesn't match
+  std::shared_ptr<const std::regex> regex_;
+};
+}
+}
@@ -0,0 +1,94 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include "PathFilter.h"
+#include "ErrorCodes.h"
+#include "Reporting.h"
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <random>
+
+DEFINE_int32(num_paths, 3000000, "Number of generated paths to match");
+DEFINE_string(pattern, "",
+              "Pattern to benchmark, instead of the default set of "
+              "include/exclude/prune_dir like patterns");
+
+using namespace std;
+using namespace facebook::wdt;
+
+/// @return   paths looking like a source tree with build outputs and logs
+static vector<string> generatePaths(int numPaths) {
+  const vector<string> dirs = {"src",    "include", "lib",  "build", "logs",
+                               "data",   "test",    ".git", "tmp",   "docs",
+                               "common", "server",  "util", "io",    "net"};
+  const vector<string> exts = {".cpp", ".h",   ".o",   ".log", ".txt",
+                               ".jpg", ".png", ".py",  ".json", ""};
+  mt19937 rng(0);
+  vector<string> paths;
+  paths.reserve(numPaths);
+  for (int i = 0; i < numPaths; i++) {
+    string path;
+    const int depth = 1 + rng() % 6;
+    for (int d = 0; d < depth; d++) {
+      path.append(dirs[rng() % dirs.size()]);
+      path.append(to_string(rng() % 20));
+      path.push_back('/');
+    }
+    path.append("file_");
+    path.append(to_string(rng()));
+    path.append(exts[rng() % exts.size()]);
+    paths.emplace_back(move(path));
+  }
+  return paths;
+}
+
+static void benchmark(const string &pattern, const vector<string> &paths) {
+  const PathFilter filter(pattern);
+  const regex stdRegex(pattern);
+  int64_t numFilterMatches = 0;
+  auto startTime = Clock::now();
+  for (const auto &path : paths) {
+    numFilterMatches += filter.matches(path);
+  }
+  const double filterTime = durationSeconds(Clock::now() - startTime);
+  int64_t numRegexMatches = 0;
+  startTime = Clock::now();
+  for (const auto &path : paths) {
+    numRegexMatches += regex_match(path, stdRegex);
+  }
+  const double regexTime = durationSeconds(Clock::now() - startTime);
+  WDT_CHECK_EQ(numFilterMatches, numRegexMatches) << pattern;
+  const double numPaths = paths.size();
+  LOG(INFO) << "Pattern " << pattern << " (" << filter.getMatcherName()
+            << ") matches " << numFilterMatches << " paths: "
+            << filterTime * 1e9 / numPaths << " ns/path vs std::regex "
+            << regexTime * 1e9 / numPaths << " ns/path, speedup "
+            << regexTime / filterTime;
+}
+
+int main(int argc, char *argv[]) {
+  FLAGS_logtostderr = true;
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  const vector<string> paths = generatePaths(FLAGS_num_paths);
+  vector<string> patterns = {".*\\.(cpp|h)",
+                             "src[0-9]*/.*",
+                             "(.*/)?\\.git[0-9]*/.*",
+                             ".*\\.log",
+                             ".*tmp.*",
+                             "(src|include)[0-9]+/.*\\.(cpp|h)",
+                             "(.*/)?build[0-9]*/.*\\.o",
+                             "([^/]+/){3}file_[0-9]+\\.txt"};
+  if (!FLAGS_pattern.empty()) {
+    patterns.assign(1, FLAGS_pattern);
+  }
+  for (const auto &pattern : patterns) {
+    benchmark(pattern, paths);
+  }
+  return 0;
+}
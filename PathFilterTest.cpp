@@ -0,0 +1,82 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include "PathFilter.h"
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+using namespace std;
+namespace facebook {
+namespace wdt {
+
+const vector<string> kPatterns = {
+    "", "abc", "a/b/c.txt", "logs/.*", ".*\\.(jpg|png|gif)", ".*\\.log$",
+    "^.*tmp.*$", ".*/\\.git/.*", "(src|include)/.*\\.(h|cpp)", "a|b|",
+    ".*", ".+", "[a-c]x?", "[^/]*", "\\d+\\.txt", "a{2,3}b{2}c{0,}",
+    "(ab)*c", ".*(foo|bar).*", "\\w+/\\W*\\s?\\S", "[\\d-]+", "x\\.y\\/z",
+    "a.*b.*c", "(a|ab)(c|bcd)(d*)", "\\x41\\t", "[\\]a]", "a+?b??c*?",
+    "(?:ab|cd){1,3}", "^^a$$", "a^b", "a$b", "(^a|b)c", "[a-]", "[-a]",
+    ".*\\.(cpp|h)|README", "build/[^/]+/.*\\.o", "\\.", "(a*)*", "(|a)+",
+    "(.*/)?core\\.[0-9]+", "(a)\\1", "\\bword", "(?=a)a", "[[:alpha:]]+",
+    "[]a]", "a{1}{2}",
+};
+
+const vector<string> kPaths = {
+    "", "a", "b", "c", "abc", "a/b/c.txt", "a/b/c.txtx", "logs/", "logs/x",
+    "logs", "x/logs/y", "img.jpg", "dir/img.png", "img.jpeg", "a.log",
+    "a.log.1", "tmp", "x/tmp/y", "src/.git/HEAD", ".git/x", "src/a.h",
+    "include/a/b.cpp", "lib/a.h", "ax", "bx", "cx", "dx", "12.txt", ".txt",
+    "aab", "aabb", "aaabbccc", "aaaabb", "ababc", "c", "abac", "xfooy",
+    "bar", "ba", "ab/ x", "ab/!", "1-2", "x.y/z", "axbxc", "acb",
+    "abcd", "abcdd", "ac", "A\t", "]", "ababcd", "cdabab", "abcdabcd",
+    "-", "README", "build/x/y.o", "build/y.o", ".", "aaaa", "core.12",
+    "x/core.1", "core.", "word", "aa", "line\nbreak", "logs/a\nb",
+    "x\r.jpg", "tmp\n", "a\nb\nc", "\xe9t\xe9.log",
+};
+
+TEST(PathFilter, SameAsStdRegex) {
+  for (const auto &pattern : kPatterns) {
+    regex expected(pattern);
+    PathFilter filter(pattern);
+    for (const auto &path : kPaths) {
+      EXPECT_EQ(regex_match(path, expected), filter.matches(path))
+          << "pattern " << pattern << " path " << path << " matcher "
+          << filter.getMatcherName();
+    }
+  }
+}
+
+TEST(PathFilter, MatcherType) {
+  EXPECT_EQ(PathFilter::LITERAL_MATCHER,
+            PathFilter("a/b\\.txt").getMatcherType());
+  EXPECT_EQ(PathFilter::PREFIX_MATCHER, PathFilter("logs/.*").getMatcherType());
+  EXPECT_EQ(PathFilter::SUFFIX_MATCHER,
+            PathFilter(".*\\.(jpg|png)").getMatcherType());
+  EXPECT_EQ(PathFilter::CONTAINS_MATCHER,
+            PathFilter(".*/tmp/.*").getMatcherType());
+  EXPECT_EQ(PathFilter::DFA_MATCHER,
+            PathFilter("build/[^/]+/.*\\.o").getMatcherType());
+  EXPECT_EQ(PathFilter::STD_REGEX_MATCHER,
+            PathFilter("(a)\\1").getMatcherType());
+}
+
+TEST(PathFilter, InvalidPattern) {
+  EXPECT_THROW(PathFilter("a("), regex_error);
+  EXPECT_THROW(PathFilter("[a"), regex_error);
+}
+}
+}
+
+int main(int argc, char *argv[]) {
+  FLAGS_logtostderr = true;
+  testing::InitGoogleTest(&argc, argv);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  int ret = RUN_ALL_TESTS();
+  return ret;
+}
@@ -26,6 +26,13 @@ const int Protocol::protocol_version = WDT_PROTOCOL_VERSION;
 const int Protocol::RECEIVER_PROGRESS_REPORT_VERSION = 11;
 const int Protocol::CHECKSUM_VERSION = 12;
 const int Protocol::DOWNLOAD_RESUMPTION_VERSION = 13;
+const int Protocol::FILE_BUNDLE_VERSION = 16;
+const int Protocol::FILE_HANDLE_VERSION = 17;
+const int Protocol::COMPRESSION_VERSION = 18;
+const int Protocol::DELTA_VERSION = 19;
+const int Protocol::SPARSE_VERSION = 20;
+const int Protocol::HEARTBEAT_VERSION = 21;
+const int Protocol::SEND_SIZE_VERSION = 22;
 
 const int Protocol::SETTINGS_FLAG_VERSION = 12;
 const int Protocol::HEADER_FLAG_AND_PREV_SEQ_ID_VERSION = 13;
@@ -106,12 +113,29 @@ void Protocol::encodeHeader(int senderProtocolVersion, char *dest, int64_t &off,
   encodeInt(dest, off, blockDetails.fileSize);
   if (senderProtocolVersion >= HEADER_FLAG_AND_PREV_SEQ_ID_VERSION) {
     uint8_t flags = blockDetails.allocationStatus;
+    const bool sendFileHandle = (senderProtocolVersion >= FILE_HANDLE_VERSION &&
+                                 blockDetails.fileHandle >= 0);
+    if (sendFileHandle) {
+      flags |= kFileHandleFlag;
+    }
+    if (senderProtocolVersion >= DELTA_VERSION && blockDetails.deltaEncoded) {
+      flags |= kDeltaFlag;
+    }
+    if (senderProtocolVersion >= SPARSE_VERSION && blockDetails.sparse) {
+      flags |= kSparseFlag;
+    }
     dest[off++] = flags;
     if (blockDetails.allocationStatus == EXISTS_TOO_SMALL ||
         blockDetails.allocationStatus == EXISTS_TOO_LARGE) {
       // prev seq-id is only used in case the size is less on the sender side
       encodeInt(dest, off, blockDetails.prevSeqId);
     }
+    if (sendFileHandle) {
+      encodeInt(dest, off, blockDetails.fileHandle);
+    }
+    if (senderProtocolVersion >= SEND_SIZE_VERSION) {
+      encodeInt(dest, off, blockDetails.sendSize);
+    }
   }
   WDT_CHECK(off <= max) << "Memory corruption:" << off << " " << max;
 }
@@ -141,6 +165,107 @@ bool Protocol::decodeHeader(int receiverProtocolVersion, char *src,
           blockDetails.allocationStatus == EXISTS_TOO_LARGE) {
         blockDetails.prevSeqId = decodeInt(br);
       }
+      blockDetails.fileHandle = -1;
+      if (receiverProtocolVersion >= FILE_HANDLE_VERSION &&
+          (flags & kFileHandleFlag)) {
+        blockDetails.fileHandle = decodeInt(br);
+      }
+      blockDetails.deltaEncoded =
+          (receiverProtocolVersion >= DELTA_VERSION && (flags & kDeltaFlag));
+      blockDetails.sparse =
+          (receiverProtocolVersion >= SPARSE_VERSION && (flags & kSparseFlag));
+      blockDetails.sendSize = -1;
+      if (receiverProtocolVersion >= SEND_SIZE_VERSION) {
+        blockDetails.sendSize = decodeInt(br);
+      }
+    }
+  } catch (const std::exception &ex) {
+    LOG(ERROR) << "got exception " << folly::exceptionStr(ex);
+    return false;
+  }
+  off = br.start() - (uint8_t *)src;
+  return !checkForOverflow(off, max);
+}
+
+void Protocol::encodeBlockHeader(char *dest, int64_t &off, int64_t max,
+                                 const BlockDetails &blockDetails) {
+  WDT_CHECK(blockDetails.fileHandle >= 0)
+      << "block of an unregistered file " << blockDetails.fileName;
+  encodeInt(dest, off, blockDetails.fileHandle);
+  encodeInt(dest, off, blockDetails.offset);
+  encodeInt(dest, off, blockDetails.dataSize);
+  WDT_CHECK(off <= max) << "Memory corruption:" << off << " " << max;
+}
+
+bool Protocol::decodeBlockHeader(char *src, int64_t &off, int64_t max,
+                                 BlockDetails &blockDetails) {
+  folly::ByteRange br((uint8_t *)(src + off), max);
+  try {
+    blockDetails.fileHandle = decodeInt(br);
+    blockDetails.offset = decodeInt(br);
+    blockDetails.dataSize = decodeInt(br);
+  } catch (const std::exception &ex) {
+    LOG(ERROR) << "got exception " << folly::exceptionStr(ex);
+    return false;
+  }
+  off = br.start() - (uint8_t *)src;
+  return !checkForOverflow(off, max);
+}
+
+void Protocol::encodeBundleHeader(char *dest, int64_t &off, int64_t max,
+                                  const std::vector<BlockDetails> &files) {
+  encodeInt(dest, off, files.size());
+  for (const auto &blockDetails : files) {
+    WDT_CHECK(blockDetails.offset == 0 &&
+              blockDetails.dataSize == blockDetails.fileSize)
+        << "only complete files can be bundled " << blockDetails.fileName;
+    encodeString(dest, off, blockDetails.fileName);
+    encodeInt(dest, off, blockDetails.seqId);
+    encodeInt(dest, off, blockDetails.fileSize);
+    uint8_t flags = blockDetails.allocationStatus;
+    dest[off++] = flags;
+    if (blockDetails.allocationStatus == EXISTS_TOO_SMALL ||
+        blockDetails.allocationStatus == EXISTS_TOO_LARGE) {
+      encodeInt(dest, off, blockDetails.prevSeqId);
+    }
+  }
+  WDT_CHECK(off <= max) << "Memory corruption:" << off << " " << max;
+}
+
+bool Protocol::decodeBundleHeader(char *src, int64_t &off, int64_t max,
+                                  std::vector<BlockDetails> &files) {
+  folly::ByteRange br((uint8_t *)(src + off), max);
+  try {
+    int64_t numFiles = decodeInt(br);
+    if (numFiles < 0 || numFiles > kMaxBundleHeader) {
+      LOG(ERROR) << "Invalid number of files in bundle " << numFiles;
+      return false;
+    }
+    files.resize(numFiles);
+    for (auto &blockDetails : files) {
+      if (!decodeString(br, src, max, blockDetails.fileName)) {
+        return false;
+      }
+      blockDetails.seqId = decodeInt(br);
+      blockDetails.fileSize = decodeInt(br);
+      blockDetails.dataSize = blockDetails.fileSize;
+      blockDetails.offset = 0;
+      if (br.empty()) {
+        LOG(ERROR) << "Invalid (too short) bundle header";
+        return false;
+      }
+      uint8_t flags = br.front();
+      blockDetails.allocationStatus = (FileAllocationStatus)(flags & 3);
+      br.pop_front();
+      blockDetails.prevSeqId = 0;
+      if (blockDetails.allocationStatus == EXISTS_TOO_SMALL ||
+          blockDetails.allocationStatus == EXISTS_TOO_LARGE) {
+        blockDetails.prevSeqId = decodeInt(br);
+      }
+      int64_t curOff = br.start() - (uint8_t *)src;
+      if (checkForOverflow(curOff, max)) {
+        return false;
+      }
     }
   } catch (const std::exception &ex) {
     LOG(ERROR) << "got exception " << folly::exceptionStr(ex);
@@ -367,6 +492,119 @@ bool Protocol::decodeFileChunksInfoList(
   return true;
 }
 
+int64_t Protocol::maxEncodeLen(const FileSignatures &fileSignatures) {
+  return 2 + fileSignatures.fileName.size() + 4 * 10 +
+         fileSignatures.signatures.size() * kBlockSignatureLen;
+}
+
+int64_t Protocol::encodeFileSignaturesList(
+    char *dest, int64_t &off, int64_t bufSize, int64_t startIndex,
+    const std::vector<FileSignatures> &fileSignaturesList) {
+  int64_t numEncoded = 0;
+  const int64_t numEntries = fileSignaturesList.size();
+  for (int64_t i = startIndex; i < numEntries; i++) {
+    const FileSignatures &fileSignatures = fileSignaturesList[i];
+    if (maxEncodeLen(fileSignatures) + off > bufSize) {
+      break;
+    }
+    encodeString(dest, off, fileSignatures.fileName);
+    encodeInt(dest, off, fileSignatures.fileSize);
+    encodeInt(dest, off, fileSignatures.blockSize);
+    encodeInt(dest, off, fileSignatures.firstBlock);
+    encodeInt(dest, off, fileSignatures.signatures.size());
+    for (const auto &signature : fileSignatures.signatures) {
+      folly::storeUnaligned<uint32_t>(dest + off,
+                                      folly::Endian::little(signature.weak));
+      off += sizeof(uint32_t);
+      folly::storeUnaligned<uint32_t>(dest + off,
+                                      folly::Endian::little(signature.strong));
+      off += sizeof(uint32_t);
+    }
+    numEncoded++;
+  }
+  WDT_CHECK(off <= bufSize) << "Memory corruption:" << off << " " << bufSize;
+  return numEncoded;
+}
+
+bool Protocol::decodeFileSignaturesList(
+    char *src, int64_t &off, int64_t dataSize,
+    std::vector<FileSignatures> &fileSignaturesList) {
+  const int64_t max = off + dataSize;
+  folly::ByteRange br((uint8_t *)(src + off), dataSize);
+  try {
+    while (!br.empty()) {
+      FileSignatures fileSignatures;
+      if (!decodeString(br, src, max, fileSignatures.fileName)) {
+        return false;
+      }
+      fileSignatures.fileSize = decodeInt(br);
+      fileSignatures.blockSize = decodeInt(br);
+      fileSignatures.firstBlock = decodeInt(br);
+      int64_t numSignatures = decodeInt(br);
+      if (fileSignatures.blockSize <= 0 || fileSignatures.firstBlock < 0 ||
+          numSignatures < 0 ||
+          numSignatures > (int64_t)br.size() / kBlockSignatureLen) {
+        LOG(ERROR) << "Invalid signatures entry for "
+                   << fileSignatures.fileName << " " << fileSignatures.blockSize
+                   << " " << fileSignatures.firstBlock << " " << numSignatures;
+        return false;
+      }
+      fileSignatures.signatures.resize(numSignatures);
+      for (auto &signature : fileSignatures.signatures) {
+        signature.weak =
+            folly::Endian::little(folly::loadUnaligned<uint32_t>(br.data()));
+        br.advance(sizeof(uint32_t));
+        signature.strong =
+            folly::Endian::little(folly::loadUnaligned<uint32_t>(br.data()));
+        br.advance(sizeof(uint32_t));
+      }
+      fileSignaturesList.emplace_back(std::move(fileSignatures));
+    }
+  } catch (const std::exception &ex) {
+    LOG(ERROR) << "got exception " << folly::exceptionStr(ex);
+    return false;
+  }
+  off = br.start() - (uint8_t *)src;
+  return !checkForOverflow(off, max);
+}
+
+int64_t Protocol::encodeFileNamesList(
+    char *dest, int64_t &off, int64_t bufSize, int64_t startIndex,
+    const std::vector<std::string> &fileNames) {
+  int64_t numEncoded = 0;
+  const int64_t numNames = fileNames.size();
+  for (int64_t i = startIndex; i < numNames; i++) {
+    // varint length followed by the name
+    if (10 + (int64_t)fileNames[i].size() + off > bufSize) {
+      break;
+    }
+    encodeString(dest, off, fileNames[i]);
+    numEncoded++;
+  }
+  WDT_CHECK(off <= bufSize) << "Memory corruption:" << off << " " << bufSize;
+  return numEncoded;
+}
+
+bool Protocol::decodeFileNamesList(char *src, int64_t &off, int64_t dataSize,
+                                   std::vector<std::string> &fileNames) {
+  const int64_t max = off + dataSize;
+  folly::ByteRange br((uint8_t *)(src + off), dataSize);
+  try {
+    while (!br.empty()) {
+      std::string fileName;
+      if (!decodeString(br, src, max, fileName)) {
+        return false;
+      }
+      fileNames.emplace_back(std::move(fileName));
+    }
+  } catch (const std::exception &ex) {
+    LOG(ERROR) << "got exception " << folly::exceptionStr(ex);
+    return false;
+  }
+  off = br.start() - (uint8_t *)src;
+  return !checkForOverflow(off, max);
+}
+
 void Protocol::encodeSettings(int senderProtocolVersion, char *dest,
                               int64_t &off, int64_t max,
                               const Settings &settings) {
@@ -382,8 +620,15 @@ void Protocol::encodeSettings(int senderProtocolVersion, char *dest,
     if (settings.sendFileChunks) {
       flags |= (1 << 1);
     }
+    if (senderProtocolVersion >= DELTA_VERSION &&
+        settings.sendDeltaSignatures) {
+      flags |= (1 << 2);
+    }
     dest[off++] = flags;
   }
+  if (senderProtocolVersion >= COMPRESSION_VERSION) {
+    encodeInt(dest, off, settings.compression);
+  }
   WDT_CHECK(off <= max) << "Memory corruption:" << off << " " << max;
 }
 
@@ -403,6 +648,8 @@ bool Protocol::decodeVersion(char *src, int64_t &off, int64_t max,
 bool Protocol::decodeSettings(int protocolVersion, char *src, int64_t &off,
                               int64_t max, Settings &settings) {
   settings.enableChecksum = settings.sendFileChunks = false;
+  settings.sendDeltaSignatures = false;
+  settings.compression = NO_COMPRESSION;
   folly::ByteRange br((uint8_t *)(src + off), max);
   try {
     settings.readTimeoutMillis = decodeInt(br);
@@ -414,8 +661,14 @@ bool Protocol::decodeSettings(int protocolVersion, char *src, int64_t &off,
       uint8_t flags = br.front();
       settings.enableChecksum = flags & 1;
       settings.sendFileChunks = flags & (1 << 1);
+      if (protocolVersion >= DELTA_VERSION) {
+        settings.sendDeltaSignatures = flags & (1 << 2);
+      }
       br.pop_front();
     }
+    if (protocolVersion >= COMPRESSION_VERSION) {
+      settings.compression = (CompressionCodec)decodeInt(br);
+    }
   } catch (const std::exception &ex) {
     LOG(ERROR) << "got exception " << folly::exceptionStr(ex);
     return false;
@@ -424,6 +677,44 @@ bool Protocol::decodeSettings(int protocolVersion, char *src, int64_t &off,
   return !checkForOverflow(off, max);
 }
 
+void Protocol::encodeChunkHeader(char *dest, int64_t &off, bool compressed,
+                                 int32_t rawSize, int32_t wireSize) {
+  dest[off++] = compressed ? kCompressedChunkFlag : 0;
+  folly::storeUnaligned<int32_t>(dest + off, folly::Endian::little(rawSize));
+  off += sizeof(int32_t);
+  folly::storeUnaligned<int32_t>(dest + off, folly::Endian::little(wireSize));
+  off += sizeof(int32_t);
+}
+
+void Protocol::decodeChunkHeader(char *src, int64_t &off, bool &compressed,
+                                 int32_t &rawSize, int32_t &wireSize) {
+  compressed = (src[off++] & kCompressedChunkFlag);
+  rawSize = folly::Endian::little(folly::loadUnaligned<int32_t>(src + off));
+  off += sizeof(int32_t);
+  wireSize = folly::Endian::little(folly::loadUnaligned<int32_t>(src + off));
+  off += sizeof(int32_t);
+}
+
+void Protocol::encodeDeltaOp(char *dest, int64_t &off, uint8_t op,
+                             int64_t basisOffset, int32_t length) {
+  dest[off++] = op;
+  folly::storeUnaligned<int64_t>(dest + off,
+                                 folly::Endian::little(basisOffset));
+  off += sizeof(int64_t);
+  folly::storeUnaligned<int32_t>(dest + off, folly::Endian::little(length));
+  off += sizeof(int32_t);
+}
+
+void Protocol::decodeDeltaOp(char *src, int64_t &off, uint8_t &op,
+                             int64_t &basisOffset, int32_t &length) {
+  op = src[off++];
+  basisOffset =
+      folly::Endian::little(folly::loadUnaligned<int64_t>(src + off));
+  off += sizeof(int64_t);
+  length = folly::Endian::little(folly::loadUnaligned<int32_t>(src + off));
+  off += sizeof(int32_t);
+}
+
 void Protocol::encodeFooter(char *dest, int64_t &off, int64_t max,
                             int32_t checksum) {
   encodeInt(dest, off, checksum);
@@ -145,6 +145,13 @@ enum FileAllocationStatus {
   EXISTS_TOO_SMALL,     // file exists, but too small
 };
 
+/// codecs used to compress blocks, values are sent in the settings cmd
+enum CompressionCodec {
+  NO_COMPRESSION,
+  LZ4_COMPRESSION,
+  ZLIB_COMPRESSION,
+};
+
 /// structure representing details of a block
 struct BlockDetails {
   /// name of the file
@@ -161,6 +168,44 @@ struct BlockDetails {
   FileAllocationStatus allocationStatus;
   /// seq-id of previous transfer, only valid if there is a size mismatch
   int64_t prevSeqId;
+  /// id of the file in the per connection file handle table, -1 if the file
+  /// is not registered
+  int64_t fileHandle{-1};
+  /// whether the data of the block is sent as a delta against the copy of the
+  /// file existing on the receiver
+  bool deltaEncoded{false};
+  /// whether only the data extents of the file are sent, the receiver then
+  /// leaves the rest of the file as holes
+  bool sparse{false};
+  /// number of bytes of the file sent in the session (not counting
+  /// duplicates), -1 if the sender doesn't say
+  int64_t sendSize{-1};
+};
+
+/// signature of a block of a file existing on the receiver
+struct BlockSignature {
+  /// rolling checksum of the block
+  uint32_t weak;
+  /// crc32c of the block
+  uint32_t strong;
+};
+
+/**
+ * Signatures of consecutive blocks of a file existing on the receiver. The
+ * signatures of a large file are split in several entries, each one small
+ * enough to be sent in one buffer.
+ */
+struct FileSignatures {
+  /// name of the file
+  std::string fileName;
+  /// size of the existing file
+  int64_t fileSize;
+  /// size of the blocks, the last block of the file can be shorter
+  int64_t blockSize;
+  /// index of the block of the first signature
+  int64_t firstBlock;
+  /// signatures of the blocks
+  std::vector<BlockSignature> signatures;
 };
 
 /// structure representing settings cmd
@@ -175,6 +220,11 @@ struct Settings {
   bool enableChecksum;
   /// whether sender wants to read previously transferred chunks or not
   bool sendFileChunks;
+  /// whether sender wants signatures of the files existing on the receiver,
+  /// to send them as deltas. Only valid along with sendFileChunks
+  bool sendDeltaSignatures;
+  /// codec used to compress the data of file and block cmds
+  CompressionCodec compression;
 };
 
 class Protocol {
@@ -189,6 +239,22 @@ class Protocol {
   static const int CHECKSUM_VERSION;
   /// version from which download resumption is supported
   static const int DOWNLOAD_RESUMPTION_VERSION;
+  /// version from which small files can be sent in bundles
+  static const int FILE_BUNDLE_VERSION;
+  /// version from which blocks after the first one of a file are sent with a
+  /// compact header referring to a file handle
+  static const int FILE_HANDLE_VERSION;
+  /// version from which blocks can be compressed
+  static const int COMPRESSION_VERSION;
+  /// version from which files existing on the receiver can be sent as deltas
+  static const int DELTA_VERSION;
+  /// version from which sparse files are sent as their data extents
+  static const int SPARSE_VERSION;
+  /// version from which an idle sender sends heartbeats (continuous_sync)
+  static const int HEARTBEAT_VERSION;
+  /// version from which file headers have the number of bytes of the file
+  /// sent in the session
+  static const int SEND_SIZE_VERSION;
 
   // list of encoding/decoding versions
   /// version from which flags are sent with settings cmd
@@ -198,27 +264,53 @@ class Protocol {
 
   /// Both version, magic number and command byte
   enum CMD_MAGIC {
-    DONE_CMD = 0x44,      // D)one
-    FILE_CMD = 0x4C,      // L)oad
-    WAIT_CMD = 0x57,      // W)ait
-    ERR_CMD = 0x45,       // E)rr
-    SETTINGS_CMD = 0x53,  // S)ettings
-    ABORT_CMD = 0x41,     // A)bort
-    CHUNKS_CMD = 0x43,    // C)hunk
-    ACK_CMD = 0x61,       // a)ck
-    EXIT_CMD = 0x65,      // e)xit
-    SIZE_CMD = 0x5A,      // Si(Z)e
-    FOOTER_CMD = 0x46,    // F)ooter
+    DONE_CMD = 0x44,       // D)one
+    FILE_CMD = 0x4C,       // L)oad
+    WAIT_CMD = 0x57,       // W)ait
+    ERR_CMD = 0x45,        // E)rr
+    SETTINGS_CMD = 0x53,   // S)ettings
+    ABORT_CMD = 0x41,      // A)bort
+    CHUNKS_CMD = 0x43,     // C)hunk
+    ACK_CMD = 0x61,        // a)ck
+    EXIT_CMD = 0x65,       // e)xit
+    SIZE_CMD = 0x5A,       // Si(Z)e
+    FOOTER_CMD = 0x46,     // F)ooter
+    BUNDLE_CMD = 0x42,     // B)undle
+    BLOCK_CMD = 0x62,      // b)lock of an already registered file
+    HEARTBEAT_CMD = 0x48,  // H)eartbeat of an idle sender
+    FILE_LIST_CMD = 0x6C,  // l)ist of the sender's files, to sign
   };
 
   /// Max size of sender or receiver id
   static const int64_t kMaxTransferIdLength = 50;
   /// 1 byte for cmd, 2 bytes for file-name length, Max size of filename, 4
   /// variants(seq-id, data-size, offset, file-size), 1 byte for flag, 10 bytes
+  /// prev seq-id, 10 bytes file-handle, 10 bytes send size
+  static const int64_t kMaxHeader =
+      1 + 2 + PATH_MAX + 4 * 10 + 1 + 10 + 10 + 10;
+  /// max size of the header of a bundle cmd (including cmd, status and
+  /// header length), this bounds the number of files in a bundle
+  static const int64_t kMaxBundleHeader = 16 * 1024;
+  /// max size of the encoding of one file in a bundle header: 2 bytes for
+  /// file-name length, 2 varints(seq-id, file-size), 1 byte for flag, 10 bytes
   /// prev seq-id
-  static const int64_t kMaxHeader = 1 + 2 + PATH_MAX + 4 * 10 + 1 + 10;
+  static const int64_t kMaxBundleEntryOverhead = 2 + 2 * 10 + 1 + 10;
+  /// size of the per connection file handle table
+  static const int64_t kMaxFileHandles = 1024;
+  /// flag set in the header flags when a file handle is registered
+  static const uint8_t kFileHandleFlag = 4;
+  /// flag set in the header flags when the file is delta encoded
+  static const uint8_t kDeltaFlag = 8;
+  /// flag set in the header flags when the file is sparse
+  static const uint8_t kSparseFlag = 16;
+  /// 1 byte for cmd, 1 for status, 2 for header length, 3 varints(file-handle,
+  /// offset, data-size)
+  static const int64_t kMaxBlockHeader = 1 + 1 + 2 + 3 * 10;
   /// min number of bytes that must be send to unblock receiver
   static const int64_t kMinBufLength = 256;
+  /// size of the buffers the file list of delta transfers is sent in, larger
+  /// than any encoded path
+  static const int64_t kFileListBufferSize = 64 * 1024;
   /// max size of local checkpoint encoding
   static const int64_t kMaxLocalCheckpoint = 10 + 2 * 10;
   /// max size of done command encoding(1 byte for cmd, 1 for status, 10 for
@@ -227,7 +319,31 @@ class Protocol {
   /// max length of the size cmd encoding
   static const int64_t kMaxSize = 1 + 10;
   /// max size of settings command encoding
-  static const int64_t kMaxSettings = 1 + 3 * 10 + kMaxTransferIdLength + 1;
+  static const int64_t kMaxSettings =
+      1 + 3 * 10 + kMaxTransferIdLength + 1 + 10;
+  /**
+   * header of each chunk of the data of file and block cmds when compression
+   * is enabled: 1 byte for flags, 4 bytes for uncompressed size, 4 bytes for
+   * size on the wire
+   */
+  static const int64_t kChunkHeaderLength = 1 + 2 * sizeof(int32_t);
+  /// flag set in the chunk header when the chunk is compressed
+  static const uint8_t kCompressedChunkFlag = 1;
+  /**
+   * header of each op of the data of a delta encoded block: 1 byte for the op
+   * type, 8 bytes for the offset in the existing file (copy ops), 4 bytes for
+   * the length. Literal ops are followed by length bytes of data
+   */
+  static const int64_t kDeltaOpHeaderLength =
+      1 + sizeof(int64_t) + sizeof(int32_t);
+  /// delta op sending new data
+  static const uint8_t kDeltaLiteralOp = 0;
+  /// delta op copying data from the file existing on the receiver
+  static const uint8_t kDeltaCopyOp = 1;
+  /// max length of a literal delta op, the receiver buffers each op whole
+  static const int64_t kMaxDeltaLiteralLen = 1024 * 1024;
+  /// size of the encoding of a block signature
+  static const int64_t kBlockSignatureLen = 2 * sizeof(uint32_t);
   /// max length of the footer cmd encoding
   static const int64_t kMaxFooter = 1 + 10;
   /// max size of chunks cmd
@@ -271,6 +387,57 @@ class Protocol {
   static bool decodeHeader(int receiverProtocolVersion, char *src, int64_t &off,
                            int64_t max, BlockDetails &blockDetails);
 
+  /**
+   * encodes the compact header of a block of a file registered in the file
+   * handle table: only fileHandle, offset and dataSize are sent.
+   * moves the off into dest pointer, not going past max
+   */
+  static void encodeBlockHeader(char *dest, int64_t &off, int64_t max,
+                                const BlockDetails &blockDetails);
+
+  /// decodes from src+off and consumes/moves off but not past max
+  /// sets fileHandle, offset and dataSize of blockDetails
+  /// @return false if there isn't enough data in src+off to src+max
+  static bool decodeBlockHeader(char *src, int64_t &off, int64_t max,
+                                BlockDetails &blockDetails);
+
+  /**
+   * encodes the files of a bundle into dest+off. Files in a bundle are
+   * complete files (offset 0, dataSize == fileSize), only the fields needed
+   * to recreate the BlockDetails are sent.
+   * moves the off into dest pointer, not going past max
+   */
+  static void encodeBundleHeader(char *dest, int64_t &off, int64_t max,
+                                 const std::vector<BlockDetails> &files);
+
+  /// decodes from src+off and consumes/moves off but not past max
+  /// sets files
+  /// @return false if there isn't enough data in src+off to src+max
+  static bool decodeBundleHeader(char *src, int64_t &off, int64_t max,
+                                 std::vector<BlockDetails> &files);
+
+  /**
+   * encodes the header of a chunk of compressed data into dest+off, it is
+   * always kChunkHeaderLength long
+   */
+  static void encodeChunkHeader(char *dest, int64_t &off, bool compressed,
+                                int32_t rawSize, int32_t wireSize);
+
+  /// decodes the header of a chunk of compressed data from src+off and
+  /// moves off by kChunkHeaderLength
+  static void decodeChunkHeader(char *src, int64_t &off, bool &compressed,
+                                int32_t &rawSize, int32_t &wireSize);
+
+  /// encodes an op of a delta encoded block into dest+off, it is always
+  /// kDeltaOpHeaderLength long
+  static void encodeDeltaOp(char *dest, int64_t &off, uint8_t op,
+                            int64_t basisOffset, int32_t length);
+
+  /// decodes an op of a delta encoded block from src+off and moves off by
+  /// kDeltaOpHeaderLength
+  static void decodeDeltaOp(char *src, int64_t &off, uint8_t &op,
+                            int64_t &basisOffset, int32_t &length);
+
   /// encodes checkpoints into dest+off
   /// moves the off into dest pointer, not going past max
   /// @return false if there isn't enough room to encode
@@ -402,6 +569,36 @@ class Protocol {
   static bool decodeFileChunksInfoList(
       char *src, int64_t &off, int64_t dataSize,
       std::vector<FileChunksInfo> &fileChunksInfoList);
+
+  /// @return   maximum number of bytes to encode fileSignatures
+  static int64_t maxEncodeLen(const FileSignatures &fileSignatures);
+
+  /// encodes fileSignaturesList starting at startIndex into dest+off
+  /// moves the off into dest pointer, not going past bufSize
+  /// returns number of entries encoded
+  static int64_t encodeFileSignaturesList(
+      char *dest, int64_t &off, int64_t bufSize, int64_t startIndex,
+      const std::vector<FileSignatures> &fileSignaturesList);
+
+  /// decodes from src+off and consumes/moves off
+  /// adds the decoded entries to fileSignaturesList
+  /// @return false if there isn't enough data in src+off to src+max
+  static bool decodeFileSignaturesList(
+      char *src, int64_t &off, int64_t dataSize,
+      std::vector<FileSignatures> &fileSignaturesList);
+
+  /// encodes the file names starting at startIndex into dest+off
+  /// moves the off into dest pointer, not going past bufSize
+  /// returns number of names encoded
+  static int64_t encodeFileNamesList(char *dest, int64_t &off,
+                                     int64_t bufSize, int64_t startIndex,
+                                     const std::vector<std::string> &fileNames);
+
+  /// decodes from src+off and consumes/moves off
+  /// adds the decoded names to fileNames
+  /// @return false if there isn't enough data in src+off to src+max
+  static bool decodeFileNamesList(char *src, int64_t &off, int64_t dataSize,
+                                  std::vector<std::string> &fileNames);
 };
 }
 }  // namespace facebook::wdt
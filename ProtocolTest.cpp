@@ -154,12 +154,280 @@ void testSettings() {
   EXPECT_EQ(nsettings.transferId, settings.transferId);
   EXPECT_EQ(nsettings.enableChecksum, settings.enableChecksum);
   EXPECT_EQ(nsettings.sendFileChunks, settings.sendFileChunks);
+  EXPECT_EQ(nsettings.compression, NO_COMPRESSION);
+
+  // compression codec is only sent by newer versions
+  senderProtocolVersion = Protocol::COMPRESSION_VERSION;
+  settings.compression = LZ4_COMPRESSION;
+  off = 0;
+  Protocol::encodeSettings(senderProtocolVersion, buf, off, sizeof(buf),
+                           settings);
+  noff = 0;
+  success = Protocol::decodeVersion(buf, noff, off, nsenderProtocolVersion);
+  EXPECT_TRUE(success);
+  EXPECT_EQ(nsenderProtocolVersion, senderProtocolVersion);
+  success = Protocol::decodeSettings(senderProtocolVersion, buf, noff, off,
+                                     nsettings);
+  EXPECT_TRUE(success);
+  EXPECT_EQ(noff, off);
+  EXPECT_EQ(nsettings.compression, settings.compression);
+  EXPECT_FALSE(nsettings.sendDeltaSignatures);
+
+  // delta signatures request is only sent by newer versions
+  senderProtocolVersion = Protocol::DELTA_VERSION;
+  settings.sendDeltaSignatures = true;
+  off = 0;
+  Protocol::encodeSettings(senderProtocolVersion, buf, off, sizeof(buf),
+                           settings);
+  noff = 0;
+  success = Protocol::decodeVersion(buf, noff, off, nsenderProtocolVersion);
+  EXPECT_TRUE(success);
+  success = Protocol::decodeSettings(senderProtocolVersion, buf, noff, off,
+                                     nsettings);
+  EXPECT_TRUE(success);
+  EXPECT_EQ(noff, off);
+  EXPECT_TRUE(nsettings.sendDeltaSignatures);
+  EXPECT_EQ(nsettings.compression, settings.compression);
+}
+
+void testChunkHeader() {
+  char buf[Protocol::kChunkHeaderLength];
+  int64_t off = 0;
+  Protocol::encodeChunkHeader(buf, off, true, 1 << 20, 12345);
+  EXPECT_EQ(off, 9);
+  int64_t noff = 0;
+  bool compressed = false;
+  int32_t rawSize = 0, wireSize = 0;
+  Protocol::decodeChunkHeader(buf, noff, compressed, rawSize, wireSize);
+  EXPECT_EQ(noff, off);
+  EXPECT_TRUE(compressed);
+  EXPECT_EQ(rawSize, 1 << 20);
+  EXPECT_EQ(wireSize, 12345);
+}
+
+void testDeltaOp() {
+  char buf[Protocol::kDeltaOpHeaderLength];
+  int64_t off = 0;
+  Protocol::encodeDeltaOp(buf, off, Protocol::kDeltaCopyOp, 1LL << 33, 65536);
+  EXPECT_EQ(off, 13);
+  int64_t noff = 0;
+  uint8_t op = 0;
+  int64_t basisOffset = 0;
+  int32_t length = 0;
+  Protocol::decodeDeltaOp(buf, noff, op, basisOffset, length);
+  EXPECT_EQ(noff, off);
+  EXPECT_EQ(op, 1);
+  EXPECT_EQ(basisOffset, 1LL << 33);
+  EXPECT_EQ(length, 65536);
+}
+
+void testFileSignatures() {
+  std::vector<FileSignatures> entries(2);
+  entries[0].fileName = "abc";
+  entries[0].fileSize = 200000;
+  entries[0].blockSize = 65536;
+  entries[0].firstBlock = 0;
+  entries[0].signatures = {{1, 2}, {0xffffffff, 4}};
+  entries[1].fileName = "dir/def";
+  entries[1].fileSize = 70000;
+  entries[1].blockSize = 65536;
+  entries[1].firstBlock = 0;
+  entries[1].signatures = {{5, 6}};
+
+  char buf[128];
+  int64_t off = 0;
+  int64_t numEncoded =
+      Protocol::encodeFileSignaturesList(buf, off, sizeof(buf), 0, entries);
+  EXPECT_EQ(numEncoded, 2);
+  std::vector<FileSignatures> nentries;
+  int64_t noff = 0;
+  bool success = Protocol::decodeFileSignaturesList(buf, noff, off, nentries);
+  EXPECT_TRUE(success);
+  EXPECT_EQ(noff, off);
+  ASSERT_EQ(nentries.size(), entries.size());
+  for (size_t i = 0; i < entries.size(); i++) {
+    EXPECT_EQ(nentries[i].fileName, entries[i].fileName);
+    EXPECT_EQ(nentries[i].fileSize, entries[i].fileSize);
+    EXPECT_EQ(nentries[i].blockSize, entries[i].blockSize);
+    EXPECT_EQ(nentries[i].firstBlock, entries[i].firstBlock);
+    ASSERT_EQ(nentries[i].signatures.size(), entries[i].signatures.size());
+    for (size_t j = 0; j < entries[i].signatures.size(); j++) {
+      EXPECT_EQ(nentries[i].signatures[j].weak, entries[i].signatures[j].weak);
+      EXPECT_EQ(nentries[i].signatures[j].strong,
+                entries[i].signatures[j].strong);
+    }
+  }
+
+  // only the entries fitting in the buffer are encoded
+  off = 0;
+  numEncoded = Protocol::encodeFileSignaturesList(
+      buf, off, Protocol::maxEncodeLen(entries[0]), 0, entries);
+  EXPECT_EQ(numEncoded, 1);
+
+  LOG(INFO) << "error tests, expect errors";
+  // too short
+  noff = 0;
+  nentries.clear();
+  success = Protocol::decodeFileSignaturesList(buf, noff, off - 1, nentries);
+  EXPECT_FALSE(success);
+}
+
+void testFileNames() {
+  std::vector<std::string> names = {"abc", "dir/def", ""};
+  char buf[128];
+  int64_t off = 0;
+  int64_t numEncoded =
+      Protocol::encodeFileNamesList(buf, off, sizeof(buf), 0, names);
+  EXPECT_EQ(numEncoded, 3);
+  std::vector<std::string> nnames;
+  int64_t noff = 0;
+  bool success = Protocol::decodeFileNamesList(buf, noff, off, nnames);
+  EXPECT_TRUE(success);
+  EXPECT_EQ(noff, off);
+  EXPECT_EQ(nnames, names);
+
+  // only the names fitting in the buffer are encoded
+  off = 0;
+  numEncoded = Protocol::encodeFileNamesList(buf, off, 14, 0, names);
+  EXPECT_EQ(numEncoded, 1);
+
+  LOG(INFO) << "error tests, expect errors";
+  // too short
+  noff = 0;
+  nnames.clear();
+  success = Protocol::decodeFileNamesList(buf, noff, off - 1, nnames);
+  EXPECT_FALSE(success);
+}
+
+void testBlockHeader() {
+  BlockDetails bd;
+  bd.fileName = "abcdef";
+  bd.seqId = 3;
+  bd.dataSize = 1024;
+  bd.offset = 0;
+  bd.fileSize = 4096;
+  bd.allocationStatus = NOT_EXISTS;
+  bd.fileHandle = 5;
+
+  // first block registers the file handle
+  char buf[128];
+  int64_t off = 0;
+  Protocol::encodeHeader(Protocol::FILE_HANDLE_VERSION, buf, off, sizeof(buf),
+                         bd);
+  BlockDetails nbd;
+  int64_t noff = 0;
+  bool success = Protocol::decodeHeader(Protocol::FILE_HANDLE_VERSION, buf,
+                                        noff, off, nbd);
+  EXPECT_TRUE(success);
+  EXPECT_EQ(noff, off);
+  EXPECT_EQ(nbd.fileName, bd.fileName);
+  EXPECT_EQ(nbd.allocationStatus, bd.allocationStatus);
+  EXPECT_EQ(nbd.fileHandle, bd.fileHandle);
+  EXPECT_FALSE(nbd.sparse);
+
+  // sparse flag is only sent by newer versions
+  bd.sparse = true;
+  off = 0;
+  Protocol::encodeHeader(Protocol::SPARSE_VERSION, buf, off, sizeof(buf), bd);
+  noff = 0;
+  success = Protocol::decodeHeader(Protocol::SPARSE_VERSION, buf, noff, off,
+                                   nbd);
+  EXPECT_TRUE(success);
+  EXPECT_EQ(noff, off);
+  EXPECT_TRUE(nbd.sparse);
+  EXPECT_EQ(nbd.allocationStatus, bd.allocationStatus);
+  EXPECT_EQ(nbd.fileHandle, bd.fileHandle);
+  EXPECT_EQ(-1, nbd.sendSize);
+
+  // bytes of the file sent, only by newer versions
+  bd.sendSize = 2048;
+  off = 0;
+  Protocol::encodeHeader(Protocol::SEND_SIZE_VERSION, buf, off, sizeof(buf),
+                         bd);
+  noff = 0;
+  success = Protocol::decodeHeader(Protocol::SEND_SIZE_VERSION, buf, noff, off,
+                                   nbd);
+  EXPECT_TRUE(success);
+  EXPECT_EQ(noff, off);
+  EXPECT_EQ(nbd.sendSize, bd.sendSize);
+  EXPECT_TRUE(nbd.sparse);
+  EXPECT_EQ(nbd.fileHandle, bd.fileHandle);
+
+  // later blocks only send handle, offset and size
+  bd.offset = 1024;
+  off = 0;
+  Protocol::encodeBlockHeader(buf, off, sizeof(buf), bd);
+  EXPECT_EQ(off, 1 + 2 + 2);
+  BlockDetails cbd;
+  noff = 0;
+  success = Protocol::decodeBlockHeader(buf, noff, off, cbd);
+  EXPECT_TRUE(success);
+  EXPECT_EQ(noff, off);
+  EXPECT_EQ(cbd.fileHandle, bd.fileHandle);
+  EXPECT_EQ(cbd.offset, bd.offset);
+  EXPECT_EQ(cbd.dataSize, bd.dataSize);
+
+  LOG(INFO) << "error tests, expect errors";
+  // too short
+  noff = 0;
+  success = Protocol::decodeBlockHeader(buf, noff, off - 1, cbd);
+  EXPECT_FALSE(success);
+}
+
+void testBundleHeader() {
+  std::vector<BlockDetails> files(2);
+  files[0].fileName = "abc";
+  files[0].seqId = 1;
+  files[0].fileSize = 10;
+  files[0].offset = 0;
+  files[0].dataSize = 10;
+  files[0].allocationStatus = NOT_EXISTS;
+  files[0].prevSeqId = 0;
+  files[1].fileName = "dir/defgh";
+  files[1].seqId = 300;
+  files[1].fileSize = 0;
+  files[1].offset = 0;
+  files[1].dataSize = 0;
+  files[1].allocationStatus = EXISTS_TOO_LARGE;
+  files[1].prevSeqId = 7;
+
+  char buf[128];
+  int64_t off = 0;
+  Protocol::encodeBundleHeader(buf, off, sizeof(buf), files);
+  std::vector<BlockDetails> nfiles;
+  int64_t noff = 0;
+  bool success = Protocol::decodeBundleHeader(buf, noff, off, nfiles);
+  EXPECT_TRUE(success);
+  EXPECT_EQ(noff, off);
+  ASSERT_EQ(nfiles.size(), files.size());
+  for (size_t i = 0; i < files.size(); i++) {
+    EXPECT_EQ(nfiles[i].fileName, files[i].fileName);
+    EXPECT_EQ(nfiles[i].seqId, files[i].seqId);
+    EXPECT_EQ(nfiles[i].fileSize, files[i].fileSize);
+    EXPECT_EQ(nfiles[i].offset, files[i].offset);
+    EXPECT_EQ(nfiles[i].dataSize, files[i].dataSize);
+    EXPECT_EQ(nfiles[i].allocationStatus, files[i].allocationStatus);
+    EXPECT_EQ(nfiles[i].prevSeqId, files[i].prevSeqId);
+  }
+
+  LOG(INFO) << "error tests, expect errors";
+  // too short
+  noff = 0;
+  nfiles.clear();
+  success = Protocol::decodeBundleHeader(buf, noff, off - 1, nfiles);
+  EXPECT_FALSE(success);
 }
 
 TEST(Protocol, Simple) {
   testHeader();
+  testBlockHeader();
+  testBundleHeader();
   testSettings();
+  testChunkHeader();
+  testDeltaOp();
   testFileChunksInfo();
+  testFileSignatures();
+  testFileNames();
 }
 }
 }  // namespaces
@@ -0,0 +1,145 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include "ReadAheadPipeline.h"
+#include "ErrorCodes.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <glog/logging.h>
+#include <unistd.h>
+
+namespace facebook {
+namespace wdt {
+
+ReadAheadPipeline::ReadAheadPipeline(int numBuffers, int64_t bufferSize)
+    : numBuffers_(numBuffers), bufferSize_(bufferSize), slots_(numBuffers) {
+  WDT_CHECK(numBuffers_ >= 2) << "read ahead needs at least 2 buffers "
+                              << numBuffers_;
+  for (int i = 0; i < numBuffers_; i++) {
+    slots_[i].data.reset(new char[bufferSize_]);
+    freeSlots_.push_back(i);
+  }
+  readerThread_ = std::thread(&ReadAheadPipeline::readLoop, this);
+}
+
+ReadAheadPipeline::~ReadAheadPipeline() {
+  stop();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    finished_ = true;
+  }
+  readerCondition_.notify_one();
+  readerThread_.join();
+}
+
+void ReadAheadPipeline::start(int fd, int64_t offset, int64_t size) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    WDT_CHECK(fd_ < 0) << "read ahead started without stopping previous "
+                       << "region " << fd_;
+    fd_ = fd;
+    nextOffset_ = offset;
+    endOffset_ = offset + size;
+  }
+  readerCondition_.notify_one();
+}
+
+char *ReadAheadPipeline::next(int64_t &size) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  WDT_CHECK(fd_ >= 0) << "next called without an active region";
+  if (consumerSlot_ >= 0) {
+    freeSlots_.push_back(consumerSlot_);
+    consumerSlot_ = -1;
+    readerCondition_.notify_one();
+  }
+  if (readySlots_.empty() && nextOffset_ >= endOffset_ && !reading_) {
+    // everything in the region has been consumed
+    size = 0;
+    return nullptr;
+  }
+  consumerCondition_.wait(lock, [this] { return !readySlots_.empty(); });
+  int idx = readySlots_.front();
+  readySlots_.pop_front();
+  consumerSlot_ = idx;
+  Slot &slot = slots_[idx];
+  size = slot.size;
+  if (size <= 0) {
+    errno = slot.error;
+    return nullptr;
+  }
+  return slot.data.get();
+}
+
+void ReadAheadPipeline::stop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  generation_++;
+  fd_ = -1;
+  nextOffset_ = endOffset_ = 0;
+  if (consumerSlot_ >= 0) {
+    freeSlots_.push_back(consumerSlot_);
+    consumerSlot_ = -1;
+  }
+  for (int idx : readySlots_) {
+    freeSlots_.push_back(idx);
+  }
+  readySlots_.clear();
+  // the caller may close the fd after we return
+  consumerCondition_.wait(lock, [this] { return !reading_; });
+}
+
+void ReadAheadPipeline::readLoop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    readerCondition_.wait(lock, [this] {
+      return finished_ ||
+             (fd_ >= 0 && nextOffset_ < endOffset_ && !freeSlots_.empty());
+    });
+    if (finished_) {
+      return;
+    }
+    int idx = freeSlots_.back();
+    freeSlots_.pop_back();
+    const int fd = fd_;
+    const int64_t offset = nextOffset_;
+    const int64_t toRead = std::min<int64_t>(bufferSize_, endOffset_ - offset);
+    const int64_t generation = generation_;
+    nextOffset_ += toRead;
+    reading_ = true;
+    lock.unlock();
+
+    Slot &slot = slots_[idx];
+    int64_t numRead = ::pread(fd, slot.data.get(), toRead, offset);
+    int error = errno;
+
+    lock.lock();
+    reading_ = false;
+    if (generation != generation_) {
+      // region was stopped while reading
+      freeSlots_.push_back(idx);
+    } else {
+      slot.size = numRead;
+      slot.error = error;
+      readySlots_.push_back(idx);
+      if (numRead <= 0) {
+        // EOF or error, nothing more to read in this region
+        if (numRead < 0) {
+          PLOG(ERROR) << "read ahead failed for fd " << fd << " offset "
+                      << offset;
+        }
+        nextOffset_ = endOffset_;
+      } else if (numRead < toRead) {
+        // short read, read the rest of the chunk next
+        nextOffset_ = offset + numRead;
+      }
+    }
+    consumerCondition_.notify_all();
+  }
+}
+}
+}
@@ -0,0 +1,118 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Reads a region of a file ahead of its consumer using a background reader
+ * thread and a fixed number of buffers, so that disk reads overlap with
+ * whatever the consumer does with the data (typically socket writes).
+ * Only one region is active at a time. next() and the region management
+ * methods must be called from the same (consumer) thread.
+ */
+class ReadAheadPipeline {
+ public:
+  /**
+   * @param numBuffers    number of buffers, must be at least 2: one is held by
+   *                      the consumer while others are being filled
+   * @param bufferSize    size of each buffer
+   */
+  ReadAheadPipeline(int numBuffers, int64_t bufferSize);
+
+  /// stops reading and joins the reader thread
+  ~ReadAheadPipeline();
+
+  /**
+   * Starts reading a new region. Any previous region must have been stopped.
+   *
+   * @param fd        file descriptor, must stay open till stop() returns
+   * @param offset    offset of the region in the file
+   * @param size      size of the region
+   */
+  void start(int fd, int64_t offset, int64_t size);
+
+  /**
+   * Returns the next chunk of the region, waiting for it to be read if
+   * needed. The returned data stays valid till the next call to next() or
+   * stop().
+   *
+   * @param size      set to the number of bytes returned, 0 on EOF, < 0 on
+   *                  read error (errno is set)
+   *
+   * @return          pointer to the data, nullptr on EOF or error
+   */
+  char *next(int64_t &size);
+
+  /**
+   * Stops reading the current region and discards data read so far. Waits
+   * for any in-flight read to finish, so the fd can be closed afterwards.
+   */
+  void stop();
+
+  /// @return   number of buffers
+  int getNumBuffers() const {
+    return numBuffers_;
+  }
+
+  /// @return   size of each buffer
+  int64_t getBufferSize() const {
+    return bufferSize_;
+  }
+
+ private:
+  struct Slot {
+    std::unique_ptr<char[]> data;
+    /// bytes read in the slot, 0 for EOF, -1 for error
+    int64_t size{0};
+    /// errno of the failed read
+    int error{0};
+  };
+
+  /// entry point of the reader thread
+  void readLoop();
+
+  const int numBuffers_;
+  const int64_t bufferSize_;
+  std::vector<Slot> slots_;
+  /// indices of slots available for reading
+  std::vector<int> freeSlots_;
+  /// indices of filled slots, in file order
+  std::deque<int> readySlots_;
+  /// slot held by the consumer, -1 if none
+  int consumerSlot_{-1};
+  /// file being read, -1 if no region is active
+  int fd_{-1};
+  /// offset of the next read
+  int64_t nextOffset_{0};
+  /// end offset of the current region
+  int64_t endOffset_{0};
+  /// incremented on every stop(), used to discard in-flight reads
+  int64_t generation_{0};
+  /// whether the reader thread is in the middle of a read
+  bool reading_{false};
+  /// whether the reader thread should exit
+  bool finished_{false};
+  std::mutex mutex_;
+  /// signalled when there is work for the reader thread
+  std::condition_variable readerCondition_;
+  /// signalled when a slot is filled or a read finishes
+  std::condition_variable consumerCondition_;
+  std::thread readerThread_;
+};
+}
+}
@@ -24,6 +24,7 @@
 #include <glog/logging.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <future>
 #include <thread>
 using std::vector;
 namespace facebook {
@@ -92,8 +93,9 @@ const Receiver::StateFunction Receiver::stateMap_[] = {
     &Receiver::listen, &Receiver::acceptFirstConnection,
     &Receiver::acceptWithTimeout, &Receiver::sendLocalCheckpoint,
     &Receiver::readNextCmd, &Receiver::processFileCmd,
-    &Receiver::processExitCmd, &Receiver::processSettingsCmd,
-    &Receiver::processDoneCmd, &Receiver::processSizeCmd,
+    &Receiver::processBundleCmd, &Receiver::processExitCmd,
+    &Receiver::processSettingsCmd, &Receiver::processDoneCmd,
+    &Receiver::processSizeCmd,
     &Receiver::sendFileChunks, &Receiver::sendGlobalCheckpoint,
     &Receiver::sendDoneCmd, &Receiver::sendAbortCmd,
     &Receiver::waitForFinishOrNewCheckpoint,
@@ -407,15 +409,21 @@ void Receiver::start() {
   markTransferFinished(false);
   const auto &options = WdtOptions::get();
   int64_t bufferSize = options.buffer_size;
-  if (bufferSize < Protocol::kMaxHeader) {
+  // bundle headers are the largest headers
+  const int64_t minBufferSize =
+      (Protocol::kMaxBundleHeader > Protocol::kMaxHeader)
+          ? Protocol::kMaxBundleHeader
+          : Protocol::kMaxHeader;
+  if (bufferSize < minBufferSize) {
     // round up to even k
-    bufferSize = 2 * 1024 * ((Protocol::kMaxHeader - 1) / (2 * 1024) + 1);
+    bufferSize = 2 * 1024 * ((minBufferSize - 1) / (2 * 1024) + 1);
     LOG(INFO) << "Specified -buffer_size " << options.buffer_size
-              << " smaller than " << Protocol::kMaxHeader << " using "
-              << bufferSize << " instead";
+              << " smaller than " << minBufferSize << " using " << bufferSize
+              << " instead";
   }
   fileCreator_.reset(new FileCreator(destDir_, threadServerSockets_.size(),
                                      transferLogManager_));
+  fileCreator_->removeStaleBasisFiles();
   perfReports_.resize(threadServerSockets_.size());
   const int64_t numSockets = threadServerSockets_.size();
   for (int64_t i = 0; i < numSockets; i++) {
@@ -468,6 +476,8 @@ void Receiver::endCurGlobalSession() {
   waitingWithErrorThreadCount_ = 0;
   checkpoints_.clear();
   fileCreator_->clearAllocationMap();
+  fileCreator_->clearFdCache();
+  fileCreator_->removeBasisFiles();
   conditionAllFinished_.notify_all();
 }
 
@@ -501,6 +511,7 @@ void Receiver::startNewGlobalSession(ThreadData &data) {
   }
   transferStartedCount_++;
   startTime_ = Clock::now();
+  numBlocksSend_ = -1;
 
   if (options.enable_download_resumption) {
     transferLogManager_.openAndStartWriter(socket.getPeerIp());
@@ -638,6 +649,8 @@ Receiver::ReceiverState Receiver::acceptWithTimeout(ThreadData &data) {
     }
     return WAIT_FOR_FINISH_WITH_THREAD_ERROR;
   }
+  // file handles are only valid for the connection they were registered on
+  data.fileHandles_.clear();
 
   if (doneSendFailure) {
     // no need to reset any session variables in this case
@@ -713,15 +726,26 @@ Receiver::ReceiverState Receiver::readNextCmd(ThreadData &data) {
   if (cmd == Protocol::DONE_CMD) {
     return PROCESS_DONE_CMD;
   }
-  if (cmd == Protocol::FILE_CMD) {
+  if (cmd == Protocol::FILE_CMD || cmd == Protocol::BLOCK_CMD) {
     return PROCESS_FILE_CMD;
   }
+  if (cmd == Protocol::BUNDLE_CMD) {
+    return PROCESS_BUNDLE_CMD;
+  }
   if (cmd == Protocol::SETTINGS_CMD) {
     return PROCESS_SETTINGS_CMD;
   }
   if (cmd == Protocol::SIZE_CMD) {
     return PROCESS_SIZE_CMD;
   }
+  if (cmd == Protocol::HEARTBEAT_CMD) {
+    // the sender waits for new files (continuous_sync), the padding up to
+    // kMinBufLength is skipped
+    VLOG(2) << data << " received heartbeat";
+    numRead -= Protocol::kMinBufLength;
+    off = (numRead > 0) ? oldOffset + Protocol::kMinBufLength : 0;
+    return READ_NEXT_CMD;
+  }
   LOG(ERROR) << "received an unknown cmd";
   threadStats.setErrorCode(PROTOCOL_ERROR);
   return WAIT_FOR_FINISH_WITH_THREAD_ERROR;
@@ -804,6 +828,19 @@ Receiver::ReceiverState Receiver::processSettingsCmd(ThreadData &data) {
   senderReadTimeout = settings.readTimeoutMillis;
   senderWriteTimeout = settings.writeTimeoutMillis;
   enableChecksum = settings.enableChecksum;
+  data.sendDeltaSignatures_ = settings.sendDeltaSignatures;
+  if (settings.compression == NO_COMPRESSION) {
+    data.decompressor_.reset();
+  } else if (!Compressor::isSupported(settings.compression)) {
+    LOG(ERROR) << "Sender uses compression codec "
+               << Compressor::getCodecName(settings.compression)
+               << " which is not supported by this build";
+    threadStats.setErrorCode(VERSION_INCOMPATIBLE);
+    return SEND_ABORT_CMD;
+  } else if (!data.decompressor_ ||
+             data.decompressor_->getCodec() != settings.compression) {
+    data.decompressor_.reset(new Compressor(settings.compression));
+  }
   if (settings.sendFileChunks) {
     // We only move to SEND_FILE_CHUNKS state, if download resumption is enabled
     // in the sender side
@@ -831,7 +868,9 @@ Receiver::ReceiverState Receiver::processFileCmd(ThreadData &data) {
   auto &pendingCheckpointIndex = data.pendingCheckpointIndex_;
   auto &enableChecksum = data.enableChecksum_;
   auto &protocolVersion = data.threadProtocolVersion_;
+  auto &fileHandles = data.fileHandles_;
   BlockDetails blockDetails;
+  const bool isBlockCmd = (buf[oldOffset] == Protocol::BLOCK_CMD);
 
   auto guard = folly::makeGuard([&socket, &threadStats] {
     if (threadStats.getErrorCode() != OK) {
@@ -860,8 +899,14 @@ Receiver::ReceiverState Receiver::processFileCmd(ThreadData &data) {
     return ACCEPT_WITH_TIMEOUT;
   }
   off += sizeof(int16_t);
-  bool success = Protocol::decodeHeader(protocolVersion, buf, off,
-                                        numRead + oldOffset, blockDetails);
+  bool success;
+  if (isBlockCmd) {
+    success = Protocol::decodeBlockHeader(buf, off, numRead + oldOffset,
+                                          blockDetails);
+  } else {
+    success = Protocol::decodeHeader(protocolVersion, buf, off,
+                                     numRead + oldOffset, blockDetails);
+  }
   int64_t headerBytes = off - oldOffset;
   // transferred header length must match decoded header length
   WDT_CHECK(headerLen == headerBytes);
@@ -873,6 +918,34 @@ Receiver::ReceiverState Receiver::processFileCmd(ThreadData &data) {
     threadStats.setErrorCode(PROTOCOL_ERROR);
     return WAIT_FOR_FINISH_WITH_THREAD_ERROR;
   }
+  const int64_t fileHandle = blockDetails.fileHandle;
+  if (fileHandle >= Protocol::kMaxFileHandles) {
+    LOG(ERROR) << "Invalid file handle " << fileHandle;
+    threadStats.setErrorCode(PROTOCOL_ERROR);
+    return WAIT_FOR_FINISH_WITH_THREAD_ERROR;
+  }
+  if (isBlockCmd) {
+    if (fileHandle < 0 || fileHandle >= (int64_t)fileHandles.size() ||
+        fileHandles[fileHandle].fileHandle != fileHandle) {
+      LOG(ERROR) << "Block cmd for unknown file handle " << fileHandle;
+      threadStats.setErrorCode(PROTOCOL_ERROR);
+      return WAIT_FOR_FINISH_WITH_THREAD_ERROR;
+    }
+    const BlockDetails &file = fileHandles[fileHandle];
+    blockDetails.fileName = file.fileName;
+    blockDetails.seqId = file.seqId;
+    blockDetails.fileSize = file.fileSize;
+    blockDetails.allocationStatus = file.allocationStatus;
+    blockDetails.prevSeqId = file.prevSeqId;
+    blockDetails.deltaEncoded = file.deltaEncoded;
+    blockDetails.sparse = file.sparse;
+    blockDetails.sendSize = file.sendSize;
+  } else if (fileHandle >= 0) {
+    if (fileHandle >= (int64_t)fileHandles.size()) {
+      fileHandles.resize(fileHandle + 1);
+    }
+    fileHandles[fileHandle] = blockDetails;
+  }
 
   // received a well formed file cmd, apply the pending checkpoint update
   checkpointIndex = pendingCheckpointIndex;
@@ -886,6 +959,33 @@ Receiver::ReceiverState Receiver::processFileCmd(ThreadData &data) {
     threadStats.setErrorCode(FILE_WRITE_ERROR);
     return SEND_ABORT_CMD;
   }
+  const bool receiveToFile = !blockDetails.deltaEncoded &&
+                             !data.decompressor_ &&
+                             socket.canReceiveToFile() &&
+                             writer.getFd() >= 0 && !writer.usesDirectIo();
+  WriteBehindPipeline *writeBehind = nullptr;
+  if (options.write_behind_buffers > 0 && !blockDetails.deltaEncoded &&
+      !data.decompressor_ && !receiveToFile && writer.getFd() >= 0) {
+    // need at least 2 buffers, one is always being filled
+    int numBuffers = std::max<int>(2, options.write_behind_buffers);
+    auto &pipeline = data.writeBehind_;
+    if (!pipeline || pipeline->getNumBuffers() != numBuffers ||
+        pipeline->getBufferSize() < bufferSize) {
+      if (pipeline) {
+        *perfStatReport += pipeline->stop();
+      }
+      pipeline.reset(new WriteBehindPipeline(numBuffers, bufferSize));
+    }
+    writeBehind = pipeline.get();
+  }
+  // writer must not be used by the pipeline once we return
+  auto writeBehindGuard = folly::makeGuard([writeBehind] {
+    if (writeBehind) {
+      writeBehind->drain();
+    }
+  });
+  // bytes of the block handed to the write behind pipeline
+  int64_t received = 0;
   int32_t checksum = 0;
   int64_t remainingData = numRead + oldOffset - off;
   int64_t toWrite = remainingData;
@@ -893,6 +993,11 @@ Receiver::ReceiverState Receiver::processFileCmd(ThreadData &data) {
   if (remainingData >= blockDetails.dataSize) {
     toWrite = blockDetails.dataSize;
   }
+  if (blockDetails.deltaEncoded || data.decompressor_) {
+    // extra bytes are delta ops or compressed chunks, handled in the loop
+    // below
+    toWrite = 0;
+  }
   threadStats.addDataBytes(toWrite);
   if (enableChecksum) {
     checksum = folly::crc32c((const uint8_t *)(buf + off), toWrite, checksum);
@@ -903,20 +1008,140 @@ Receiver::ReceiverState Receiver::processFileCmd(ThreadData &data) {
     // on the network
     throttler_->limit(toWrite + headerBytes);
   }
-  ErrorCode code = writer.write(buf + off, toWrite);
+  ErrorCode code;
+  if (writeBehind) {
+    // all the writes of a block are done by the same thread
+    memcpy(writeBehind->getBuffer(), buf + off, toWrite);
+    code = writeBehind->submit(&writer, toWrite);
+    received = toWrite;
+  } else {
+    code = writer.write(buf + off, toWrite);
+  }
   if (code != OK) {
     threadStats.setErrorCode(code);
     return SEND_ABORT_CMD;
   }
   off += toWrite;
   remainingData -= toWrite;
+  // rest of the block can go from the socket to the file without passing
+  // through buf
+  // copy ops of delta encoded blocks read from the file as it was before
+  int basisFd = -1;
+  int64_t basisSize = 0;
+  if (blockDetails.deltaEncoded) {
+    const std::string basisPath =
+        fileCreator_->getBasisPath(blockDetails.fileName);
+    basisFd = open(basisPath.c_str(), O_RDONLY);
+    struct stat basisStat;
+    if (basisFd < 0) {
+      PLOG(ERROR) << "Unable to open " << basisPath;
+    } else if (fstat(basisFd, &basisStat) != 0) {
+      PLOG(ERROR) << "fstat() failed for " << basisPath;
+      close(basisFd);
+      basisFd = -1;
+    } else {
+      basisSize = basisStat.st_size;
+    }
+  }
+  auto basisGuard = folly::makeGuard([&] {
+    if (basisFd >= 0) {
+      close(basisFd);
+    }
+  });
   // also means no leftOver so it's ok we use buf from start
-  while (writer.getTotalWritten() < blockDetails.dataSize) {
+  while ((writeBehind ? received : writer.getTotalWritten()) <
+         blockDetails.dataSize) {
     if (getCurAbortCode() != OK) {
       LOG(ERROR) << "Thread marked for abort while processing a file."
                  << " port : " << socket.getPort();
       return FAILED;
     }
+    if (blockDetails.deltaEncoded) {
+      code = receiveDeltaOp(data, writer, blockDetails, basisFd, basisSize,
+                            checksum, remainingData);
+      if (code == FILE_WRITE_ERROR) {
+        threadStats.setErrorCode(code);
+        return SEND_ABORT_CMD;
+      }
+      if (code == PROTOCOL_ERROR) {
+        threadStats.setErrorCode(code);
+        return WAIT_FOR_FINISH_WITH_THREAD_ERROR;
+      }
+      if (code != OK) {
+        break;
+      }
+      continue;
+    }
+    if (data.decompressor_) {
+      code = receiveCompressedChunk(data, writer, blockDetails, checksum,
+                                    remainingData);
+      if (code == FILE_WRITE_ERROR) {
+        threadStats.setErrorCode(code);
+        return SEND_ABORT_CMD;
+      }
+      if (code == PROTOCOL_ERROR) {
+        threadStats.setErrorCode(code);
+        return WAIT_FOR_FINISH_WITH_THREAD_ERROR;
+      }
+      if (code != OK) {
+        break;
+      }
+      continue;
+    }
+    if (receiveToFile) {
+      // one io_uring batch at a time, also bounds the time between abort
+      // checks with splice
+      int64_t toReceive = std::min<int64_t>(
+          blockDetails.dataSize - writer.getTotalWritten(),
+          bufferSize * std::max(1, options.io_uring_batch_buffers));
+      int64_t nres = 0;
+      code = socket.receiveToFile(writer.getFd(), writer.getWriteOffset(),
+                                  toReceive,
+                                  enableChecksum ? &checksum : nullptr, nres);
+      if (nres > 0) {
+        if (throttler_) {
+          throttler_->limit(nres);
+        }
+        threadStats.addDataBytes(nres);
+        ErrorCode syncCode = writer.addWritten(nres);
+        if (syncCode != OK) {
+          threadStats.setErrorCode(syncCode);
+          return SEND_ABORT_CMD;
+        }
+      }
+      if (code == FILE_WRITE_ERROR) {
+        threadStats.setErrorCode(code);
+        return SEND_ABORT_CMD;
+      }
+      if (code != OK) {
+        break;
+      }
+      continue;
+    }
+    if (writeBehind) {
+      // read into the next free buffer, the disk write happens in the
+      // background
+      char *writeBuf = writeBehind->getBuffer();
+      int64_t nres = readAtMost(socket, writeBuf, bufferSize,
+                                blockDetails.dataSize - received);
+      if (nres <= 0) {
+        break;
+      }
+      if (throttler_) {
+        throttler_->limit(nres);
+      }
+      threadStats.addDataBytes(nres);
+      if (enableChecksum) {
+        checksum = folly::crc32c((const uint8_t *)writeBuf, nres, checksum);
+      }
+      code = writeBehind->submit(&writer, nres);
+      received += nres;
+      if (code != OK) {
+        threadStats.setErrorCode(code);
+        return SEND_ABORT_CMD;
+      }
+      continue;
+    }
     int64_t nres = readAtMost(socket, buf, bufferSize,
                               blockDetails.dataSize - writer.getTotalWritten());
     if (nres <= 0) {
@@ -937,6 +1162,14 @@ Receiver::ReceiverState Receiver::processFileCmd(ThreadData &data) {
       return SEND_ABORT_CMD;
     }
   }
+  if (writeBehind) {
+    // the checksum is only validated and the block logged once it is on disk
+    code = writeBehind->drain();
+    if (code != OK) {
+      threadStats.setErrorCode(code);
+      return SEND_ABORT_CMD;
+    }
+  }
   if (writer.getTotalWritten() != blockDetails.dataSize) {
     // This can only happen if there are transmission errors
     // Write errors to disk are already taken care of above
@@ -948,6 +1181,325 @@ Receiver::ReceiverState Receiver::processFileCmd(ThreadData &data) {
   VLOG(2) << "completed " << blockDetails.fileName << " off: " << off
           << " numRead: " << numRead;
   // Transfer of the file is complete here, mark the bytes effective
+  code = processDataEnd(data, remainingData, checksum, blockDetails.fileName);
+  if (code != OK) {
+    threadStats.setErrorCode(code);
+    if (code == PROTOCOL_ERROR) {
+      return WAIT_FOR_FINISH_WITH_THREAD_ERROR;
+    }
+    return ACCEPT_WITH_TIMEOUT;
+  }
+  if (options.enable_download_resumption) {
+    transferLogManager_.addBlockWriteEntry(
+        blockDetails.seqId, blockDetails.offset, blockDetails.dataSize,
+        writer.releaseSyncFd());
+  }
+  threadStats.addEffectiveBytes(headerBytes, blockDetails.dataSize);
+  threadStats.incrNumBlocks();
+  return READ_NEXT_CMD;
+}
+
+char *Receiver::readChunkBytes(ThreadData &data, int64_t size,
+                               int64_t &remainingData) {
+  auto &socket = data.socket_;
+  char *buf = data.getBuf();
+  auto &off = data.off_;
+  auto bufferSize = data.bufferSize_;
+  if (remainingData < size) {
+    char *dest = buf;
+    int64_t destSize = bufferSize;
+    if (size > bufferSize) {
+      // chunks are as big as the sender buffer, which can be larger than ours
+      if (size > data.chunkBufSize_) {
+        data.chunkBuf_.reset(new char[size]);
+        data.chunkBufSize_ = size;
+      }
+      dest = data.chunkBuf_.get();
+      // only read this chunk, the rest stays in the socket
+      destSize = size;
+    }
+    memmove(dest, buf + off, remainingData);
+    off = 0;
+    int64_t numRead =
+        readAtLeast(socket, dest, destSize, size, remainingData);
+    if (numRead < size) {
+      LOG(ERROR) << "Unable to read compressed chunk " << size << " "
+                 << numRead;
+      return nullptr;
+    }
+    if (throttler_) {
+      throttler_->limit(numRead - remainingData);
+    }
+    remainingData = numRead;
+    if (dest != buf) {
+      remainingData -= size;
+      WDT_CHECK(remainingData == 0);
+      return dest;
+    }
+  }
+  char *bytes = buf + off;
+  off += size;
+  remainingData -= size;
+  return bytes;
+}
+
+ErrorCode Receiver::receiveCompressedChunk(ThreadData &data,
+                                           FileWriter &writer,
+                                           const BlockDetails &blockDetails,
+                                           int32_t &checksum,
+                                           int64_t &remainingData) {
+  auto &threadStats = data.threadStats_;
+  char *header =
+      readChunkBytes(data, Protocol::kChunkHeaderLength, remainingData);
+  if (!header) {
+    return SOCKET_READ_ERROR;
+  }
+  int64_t headerOff = 0;
+  bool compressed;
+  int32_t rawSize, wireSize;
+  Protocol::decodeChunkHeader(header, headerOff, compressed, rawSize,
+                              wireSize);
+  threadStats.addHeaderBytes(headerOff);
+  const int64_t blockLeft = blockDetails.dataSize - writer.getTotalWritten();
+  if (rawSize <= 0 || rawSize > blockLeft || wireSize <= 0 ||
+      (compressed ? wireSize >= rawSize : wireSize != rawSize)) {
+    LOG(ERROR) << "Invalid chunk header " << compressed << " " << rawSize
+               << " " << wireSize << " for " << blockDetails.fileName
+               << ", block bytes left " << blockLeft;
+    return PROTOCOL_ERROR;
+  }
+  char *payload = readChunkBytes(data, wireSize, remainingData);
+  if (!payload) {
+    return SOCKET_READ_ERROR;
+  }
+  if (compressed) {
+    START_PERF_TIMER
+    payload = data.decompressor_->decompress(payload, wireSize, rawSize);
+    RECORD_PERF_RESULT_BYTES(PerfStatReport::DECOMPRESS, rawSize)
+    if (!payload) {
+      LOG(ERROR) << "Unable to decompress chunk of " << blockDetails.fileName;
+      return PROTOCOL_ERROR;
+    }
+  }
+  threadStats.addDataBytes(rawSize);
+  threadStats.addCompressionBytes(rawSize, wireSize);
+  if (data.enableChecksum_) {
+    checksum = folly::crc32c((const uint8_t *)payload, rawSize, checksum);
+  }
+  return writer.write(payload, rawSize);
+}
+
+ErrorCode Receiver::receiveDeltaOp(ThreadData &data, FileWriter &writer,
+                                   const BlockDetails &blockDetails,
+                                   int basisFd, int64_t basisSize,
+                                   int32_t &checksum,
+                                   int64_t &remainingData) {
+  auto &threadStats = data.threadStats_;
+  char *header =
+      readChunkBytes(data, Protocol::kDeltaOpHeaderLength, remainingData);
+  if (!header) {
+    return SOCKET_READ_ERROR;
+  }
+  int64_t headerOff = 0;
+  uint8_t op;
+  int64_t basisOffset;
+  int32_t length;
+  Protocol::decodeDeltaOp(header, headerOff, op, basisOffset, length);
+  threadStats.addHeaderBytes(headerOff);
+  const int64_t blockLeft = blockDetails.dataSize - writer.getTotalWritten();
+  // ops are read whole, their length is bounded by the block size of our
+  // signatures (copy) or by the encoder (literal), not by the peer
+  int64_t maxLength = 0;
+  if (op == Protocol::kDeltaLiteralOp) {
+    maxLength = Protocol::kMaxDeltaLiteralLen;
+  } else if (op == Protocol::kDeltaCopyOp) {
+    maxLength = WdtOptions::get().delta_block_size_kbytes * 1024;
+  }
+  if (length <= 0 || length > maxLength || length > blockLeft ||
+      basisOffset < 0) {
+    LOG(ERROR) << "Invalid delta op " << (int)op << " " << basisOffset << " "
+               << length << " for " << blockDetails.fileName
+               << ", block bytes left " << blockLeft << ", max length "
+               << maxLength;
+    return PROTOCOL_ERROR;
+  }
+  char *bytes;
+  if (op == Protocol::kDeltaLiteralOp) {
+    bytes = readChunkBytes(data, length, remainingData);
+    if (!bytes) {
+      return SOCKET_READ_ERROR;
+    }
+  } else {
+    if (basisFd < 0) {
+      LOG(ERROR) << "No existing copy of " << blockDetails.fileName
+                 << " to copy from";
+      return FILE_WRITE_ERROR;
+    }
+    if (basisOffset + length > basisSize) {
+      LOG(ERROR) << "Copy op " << basisOffset << " " << length
+                 << " past the end of the existing copy of "
+                 << blockDetails.fileName << " of size " << basisSize;
+      return PROTOCOL_ERROR;
+    }
+    // chunkBuf_ never holds unconsumed bytes, see readChunkBytes
+    if (length > data.chunkBufSize_) {
+      data.chunkBuf_.reset(new char[length]);
+      data.chunkBufSize_ = length;
+    }
+    bytes = data.chunkBuf_.get();
+    int64_t numRead = 0;
+    while (numRead < length) {
+      START_PERF_TIMER
+      ssize_t n = pread(basisFd, bytes + numRead, length - numRead,
+                        basisOffset + numRead);
+      RECORD_PERF_RESULT(PerfStatReport::FILE_READ)
+      if (n <= 0) {
+        PLOG(ERROR) << "Unable to read existing copy of "
+                    << blockDetails.fileName << " at "
+                    << basisOffset + numRead << " " << n;
+        return FILE_WRITE_ERROR;
+      }
+      numRead += n;
+    }
+    threadStats.addDeltaCopiedBytes(length);
+  }
+  threadStats.addDataBytes(length);
+  if (data.enableChecksum_) {
+    checksum = folly::crc32c((const uint8_t *)bytes, length, checksum);
+  }
+  return writer.write(bytes, length);
+}
+
+ErrorCode Receiver::readSenderFileList(ThreadData &data,
+                                       std::vector<std::string> &relPaths) {
+  auto &socket = data.socket_;
+  auto &threadStats = data.threadStats_;
+  char *buf = data.getBuf();
+  buf[0] = Protocol::FILE_LIST_CMD;
+  int64_t written = socket.write(buf, 1);
+  if (written != 1) {
+    LOG(ERROR) << "Socket write error 1 " << written;
+    return SOCKET_WRITE_ERROR;
+  }
+  threadStats.addHeaderBytes(written);
+  // the sender keeps us waiting till its files are discovered
+  do {
+    int64_t numRead = socket.read(buf, 1);
+    if (numRead != 1) {
+      LOG(ERROR) << "Socket read error 1 " << numRead;
+      return SOCKET_READ_ERROR;
+    }
+    threadStats.addHeaderBytes(numRead);
+  } while (buf[0] == Protocol::WAIT_CMD);
+  if (buf[0] != Protocol::CHUNKS_CMD) {
+    LOG(ERROR) << "Expecting the file list, but received " << buf[0];
+    return PROTOCOL_ERROR;
+  }
+  // same format as the file chunks: <cmd><buffer size><number of entries>
+  // and then buffers of <data-size><entry1><entry2>...
+  int64_t toRead = Protocol::kChunksCmdLen;
+  int64_t numRead = socket.read(buf, toRead);
+  if (numRead != toRead) {
+    LOG(ERROR) << "Socket read error " << toRead << " " << numRead;
+    return SOCKET_READ_ERROR;
+  }
+  threadStats.addHeaderBytes(numRead);
+  int64_t off = 0;
+  int64_t listBufSize, numFiles;
+  Protocol::decodeChunksCmd(buf, off, listBufSize, numFiles);
+  if (listBufSize <= 0 || listBufSize > Protocol::kFileListBufferSize ||
+      numFiles < 0) {
+    LOG(ERROR) << "Invalid file list cmd " << listBufSize << " " << numFiles;
+    return PROTOCOL_ERROR;
+  }
+  LOG(INFO) << data << " sender announced " << numFiles << " files";
+  std::unique_ptr<char[]> listBuffer(new char[listBufSize]);
+  relPaths.clear();
+  while ((int64_t)relPaths.size() < numFiles) {
+    toRead = sizeof(int32_t);
+    numRead = socket.read(buf, toRead);
+    if (numRead != toRead) {
+      LOG(ERROR) << "Socket read error " << toRead << " " << numRead;
+      return SOCKET_READ_ERROR;
+    }
+    toRead = folly::loadUnaligned<int32_t>(buf);
+    toRead = folly::Endian::little(toRead);
+    if (toRead <= 0 || toRead > listBufSize) {
+      LOG(ERROR) << "Invalid file list buffer length " << toRead;
+      return PROTOCOL_ERROR;
+    }
+    numRead = socket.read(listBuffer.get(), toRead);
+    if (numRead != toRead) {
+      LOG(ERROR) << "Socket read error " << toRead << " " << numRead;
+      return SOCKET_READ_ERROR;
+    }
+    threadStats.addHeaderBytes(sizeof(int32_t) + numRead);
+    off = 0;
+    if (!Protocol::decodeFileNamesList(listBuffer.get(), off, toRead,
+                                       relPaths)) {
+      LOG(ERROR) << "Unable to decode the file list";
+      return PROTOCOL_ERROR;
+    }
+  }
+  if ((int64_t)relPaths.size() != numFiles) {
+    LOG(ERROR) << "Number of files received is more than the number "
+                  "mentioned in CHUNKS_CMD " << relPaths.size() << " "
+               << numFiles;
+    return PROTOCOL_ERROR;
+  }
+  return OK;
+}
+
+bool Receiver::signExistingFiles(ThreadData &data,
+                                 const std::vector<std::string> &relPaths,
+                                 std::vector<FileSignatures> &fileSignatures) {
+  const auto &options = WdtOptions::get();
+  auto &socket = data.socket_;
+  auto &threadStats = data.threadStats_;
+  const int64_t blockSize = options.delta_block_size_kbytes * 1024;
+  if (blockSize <= 0) {
+    LOG(WARNING) << "Invalid -delta_block_size_kbytes "
+                 << options.delta_block_size_kbytes
+                 << ", not sending signatures";
+    return true;
+  }
+  // entries are sent in buffers prefixed by their length
+  const int64_t maxEntryLen = data.bufferSize_ - sizeof(int32_t);
+  LOG(INFO) << data << " computing signatures of the existing files among "
+            << relPaths.size() << " in " << destDir_;
+  START_PERF_TIMER
+  // signing can take longer than the sender's read timeout, keep it waiting
+  auto signingDone = std::async(std::launch::async, [&] {
+    DeltaSignatures::computeForFiles(destDir_, relPaths, blockSize,
+                                     maxEntryLen, fileSignatures);
+  });
+  WDT_CHECK(data.senderReadTimeout_ > 0);  // must have received settings
+  const auto waitingTime =
+      std::chrono::milliseconds(data.senderReadTimeout_ / kWaitTimeoutFactor);
+  while (signingDone.wait_for(waitingTime) != std::future_status::ready) {
+    char cmd = Protocol::WAIT_CMD;
+    int64_t written = socket.write(&cmd, 1);
+    if (written != 1) {
+      LOG(ERROR) << "Socket write error 1 " << written;
+      signingDone.wait();
+      return false;
+    }
+    threadStats.addHeaderBytes(written);
+  }
+  RECORD_PERF_RESULT(PerfStatReport::DELTA_SIGNATURES)
+  LOG(INFO) << data << " computed " << fileSignatures.size()
+            << " signature entries";
+  return true;
+}
+
+ErrorCode Receiver::processDataEnd(ThreadData &data, int64_t remainingData,
+                                   int32_t checksum, const std::string &name) {
+  auto &socket = data.socket_;
+  char *buf = data.getBuf();
+  auto &numRead = data.numRead_;
+  auto &off = data.off_;
+  auto &oldOffset = data.oldOffset_;
+  auto bufferSize = data.bufferSize_;
   WDT_CHECK(remainingData >= 0) << "Negative remainingData " << remainingData;
   if (remainingData > 0) {
     // if we need to read more anyway, let's move the data
@@ -968,47 +1520,195 @@ Receiver::ReceiverState Receiver::processFileCmd(ThreadData &data) {
   } else {
     numRead = off = 0;
   }
-  if (enableChecksum) {
-    // have to read footer cmd
-    oldOffset = off;
-    numRead = readAtLeast(socket, buf + off, bufferSize - off,
-                          Protocol::kMinBufLength, numRead);
-    if (numRead < Protocol::kMinBufLength) {
-      LOG(ERROR) << "socket read failure " << Protocol::kMinBufLength << " "
-                 << numRead;
-      threadStats.setErrorCode(SOCKET_READ_ERROR);
-      return ACCEPT_WITH_TIMEOUT;
+  if (!data.enableChecksum_) {
+    return OK;
+  }
+  // have to read footer cmd
+  oldOffset = off;
+  numRead = readAtLeast(socket, buf + off, bufferSize - off,
+                        Protocol::kMinBufLength, numRead);
+  if (numRead < Protocol::kMinBufLength) {
+    LOG(ERROR) << "socket read failure " << Protocol::kMinBufLength << " "
+               << numRead;
+    return SOCKET_READ_ERROR;
+  }
+  Protocol::CMD_MAGIC cmd = (Protocol::CMD_MAGIC)buf[off++];
+  if (cmd != Protocol::FOOTER_CMD) {
+    LOG(ERROR) << "Expecting footer cmd, but received " << cmd;
+    return PROTOCOL_ERROR;
+  }
+  int32_t receivedChecksum;
+  bool success = Protocol::decodeFooter(
+      buf, off, oldOffset + Protocol::kMaxFooter, receivedChecksum);
+  if (!success) {
+    LOG(ERROR) << "Unable to decode footer cmd";
+    return PROTOCOL_ERROR;
+  }
+  if (checksum != receivedChecksum) {
+    LOG(ERROR) << "Checksum mismatch " << checksum << " " << receivedChecksum
+               << " port " << socket.getPort() << " file " << name;
+    return CHECKSUM_MISMATCH;
+  }
+  int64_t msgLen = off - oldOffset;
+  numRead -= msgLen;
+  return OK;
+}
+
+/***PROCESS_BUNDLE_CMD***/
+Receiver::ReceiverState Receiver::processBundleCmd(ThreadData &data) {
+  VLOG(1) << data << " entered PROCESS_BUNDLE_CMD state ";
+  const auto &options = WdtOptions::get();
+  auto &socket = data.socket_;
+  auto &threadIndex = data.threadIndex_;
+  auto &threadStats = data.threadStats_;
+  char *buf = data.getBuf();
+  auto &numRead = data.numRead_;
+  auto &off = data.off_;
+  auto &oldOffset = data.oldOffset_;
+  auto bufferSize = data.bufferSize_;
+  auto &checkpointIndex = data.checkpointIndex_;
+  auto &pendingCheckpointIndex = data.pendingCheckpointIndex_;
+  auto &enableChecksum = data.enableChecksum_;
+  std::vector<BlockDetails> files;
+
+  auto guard = folly::makeGuard([&threadStats] {
+    if (threadStats.getErrorCode() != OK) {
+      threadStats.incrFailedAttempts();
     }
-    Protocol::CMD_MAGIC cmd = (Protocol::CMD_MAGIC)buf[off++];
-    if (cmd != Protocol::FOOTER_CMD) {
-      LOG(ERROR) << "Expecting footer cmd, but received " << cmd;
-      threadStats.setErrorCode(PROTOCOL_ERROR);
-      return WAIT_FOR_FINISH_WITH_THREAD_ERROR;
+  });
+
+  ErrorCode transferStatus = (ErrorCode)buf[off++];
+  if (transferStatus != OK) {
+    VLOG(1) << "sender entered into error state "
+            << errorCodeToStr(transferStatus);
+  }
+  int16_t headerLen = folly::loadUnaligned<int16_t>(buf + off);
+  headerLen = folly::Endian::little(headerLen);
+  VLOG(2) << "Processing BUNDLE_CMD, header len " << headerLen;
+  if (headerLen < 0 || headerLen > Protocol::kMaxBundleHeader) {
+    LOG(ERROR) << "Invalid bundle header len " << headerLen;
+    threadStats.setErrorCode(PROTOCOL_ERROR);
+    return WAIT_FOR_FINISH_WITH_THREAD_ERROR;
+  }
+  if (headerLen > numRead) {
+    if (oldOffset + headerLen > bufferSize) {
+      // bundle headers can be large, make room for the whole header
+      memmove(buf, buf + oldOffset, numRead);
+      off -= oldOffset;
+      oldOffset = 0;
     }
-    int32_t receivedChecksum;
-    bool success = Protocol::decodeFooter(
-        buf, off, oldOffset + Protocol::kMaxFooter, receivedChecksum);
-    if (!success) {
-      LOG(ERROR) << "Unable to decode footer cmd";
-      threadStats.setErrorCode(PROTOCOL_ERROR);
-      return WAIT_FOR_FINISH_WITH_THREAD_ERROR;
+    numRead = readAtLeast(socket, buf + oldOffset, bufferSize - oldOffset,
+                          headerLen, numRead);
+  }
+  if (numRead < headerLen) {
+    LOG(ERROR) << "Unable to read full bundle header " << headerLen << " "
+               << numRead;
+    threadStats.setErrorCode(SOCKET_READ_ERROR);
+    return ACCEPT_WITH_TIMEOUT;
+  }
+  off += sizeof(int16_t);
+  bool success = Protocol::decodeBundleHeader(buf, off, oldOffset + headerLen,
+                                              files);
+  int64_t headerBytes = off - oldOffset;
+  if (!success || headerLen != headerBytes) {
+    LOG(ERROR) << "Error decoding bundle at"
+               << " ooff:" << oldOffset << " off: " << off
+               << " numRead: " << numRead << " headerLen: " << headerLen;
+    threadStats.setErrorCode(PROTOCOL_ERROR);
+    return WAIT_FOR_FINISH_WITH_THREAD_ERROR;
+  }
+  threadStats.addHeaderBytes(headerBytes);
+  // received a well formed bundle cmd, apply the pending checkpoint update
+  checkpointIndex = pendingCheckpointIndex;
+  VLOG(1) << "Read bundle of " << files.size() << " files, ooff:" << oldOffset
+          << " off: " << off << " numRead: " << numRead;
+
+  int32_t checksum = 0;
+  int64_t remainingData = numRead + oldOffset - off;
+  int64_t bundleSize = 0;
+  if (throttler_) {
+    throttler_->limit(headerBytes + remainingData);
+  }
+  // fds of the blocks to sync with the group commit, in order of files
+  std::vector<int> syncFds;
+  auto syncFdsGuard = folly::makeGuard([&syncFds] {
+    for (int syncFd : syncFds) {
+      if (syncFd >= 0) {
+        ::close(syncFd);
+      }
     }
-    if (checksum != receivedChecksum) {
-      LOG(ERROR) << "Checksum mismatch " << checksum << " " << receivedChecksum
-                 << " port " << socket.getPort() << " file "
-                 << blockDetails.fileName;
-      threadStats.setErrorCode(CHECKSUM_MISMATCH);
+  });
+  for (auto &blockDetails : files) {
+    FileWriter writer(threadIndex, &blockDetails, fileCreator_.get());
+    if (writer.open() != OK) {
+      threadStats.setErrorCode(FILE_WRITE_ERROR);
+      return SEND_ABORT_CMD;
+    }
+    while (writer.getTotalWritten() < blockDetails.dataSize) {
+      if (remainingData == 0) {
+        if (getCurAbortCode() != OK) {
+          LOG(ERROR) << "Thread marked for abort while processing a bundle."
+                     << " port : " << socket.getPort();
+          return FAILED;
+        }
+        // nothing left in buf, read the rest of the file from the socket
+        off = 0;
+        int64_t nres =
+            readAtMost(socket, buf, bufferSize,
+                       blockDetails.dataSize - writer.getTotalWritten());
+        if (nres <= 0) {
+          break;
+        }
+        if (throttler_) {
+          throttler_->limit(nres);
+        }
+        remainingData = nres;
+      }
+      const int64_t toWrite = std::min<int64_t>(
+          remainingData, blockDetails.dataSize - writer.getTotalWritten());
+      threadStats.addDataBytes(toWrite);
+      if (enableChecksum) {
+        checksum =
+            folly::crc32c((const uint8_t *)(buf + off), toWrite, checksum);
+      }
+      ErrorCode code = writer.write(buf + off, toWrite);
+      if (code != OK) {
+        threadStats.setErrorCode(code);
+        return SEND_ABORT_CMD;
+      }
+      off += toWrite;
+      remainingData -= toWrite;
+    }
+    if (writer.getTotalWritten() != blockDetails.dataSize) {
+      LOG(ERROR) << "could not read entire content for "
+                 << blockDetails.fileName << " port " << socket.getPort();
+      threadStats.setErrorCode(SOCKET_READ_ERROR);
       return ACCEPT_WITH_TIMEOUT;
     }
-    int64_t msgLen = off - oldOffset;
-    numRead -= msgLen;
+    syncFds.push_back(writer.releaseSyncFd());
+    bundleSize += blockDetails.dataSize;
   }
-  if (options.enable_download_resumption) {
-    transferLogManager_.addBlockWriteEntry(
-        blockDetails.seqId, blockDetails.offset, blockDetails.dataSize);
+  VLOG(2) << "completed bundle of " << files.size() << " files, off: " << off
+          << " numRead: " << numRead;
+  ErrorCode code = processDataEnd(data, remainingData, checksum, "bundle");
+  if (code != OK) {
+    threadStats.setErrorCode(code);
+    if (code == PROTOCOL_ERROR) {
+      return WAIT_FOR_FINISH_WITH_THREAD_ERROR;
+    }
+    return ACCEPT_WITH_TIMEOUT;
   }
-  threadStats.addEffectiveBytes(headerBytes, blockDetails.dataSize);
-  threadStats.incrNumBlocks();
+  for (size_t i = 0; i < files.size(); i++) {
+    const auto &blockDetails = files[i];
+    if (options.enable_download_resumption) {
+      transferLogManager_.addBlockWriteEntry(
+          blockDetails.seqId, blockDetails.offset, blockDetails.dataSize,
+          syncFds[i]);
+      syncFds[i] = -1;
+    }
+    threadStats.incrNumBlocks();
+  }
+  threadStats.addEffectiveBytes(headerBytes, bundleSize);
   return READ_NEXT_CMD;
 }
 
@@ -1043,7 +1743,9 @@ Receiver::ReceiverState Receiver::processDoneCmd(ThreadData &data) {
   // received a valid command, applying pending checkpoint write update
   checkpointIndex = pendingCheckpointIndex;
   std::unique_lock<std::mutex> lock(mutex_);
-  numBlocksSend_ = numBlocksSend;
+  // the number of blocks only grows: blocks split at the end of the transfer
+  // (split_tail_blocks) are only counted by the threads done after the split
+  numBlocksSend_ = std::max(numBlocksSend_, numBlocksSend);
   return WAIT_FOR_FINISH_OR_NEW_CHECKPOINT;
 }
 
@@ -1120,6 +1822,19 @@ Receiver::ReceiverState Receiver::sendFileChunks(ThreadData &data) {
           sendChunksStatus_ = NOT_STARTED;
           conditionFileChunksSent_.notify_one();
         });
+        std::vector<FileSignatures> fileSignatures;
+        if (data.sendDeltaSignatures_) {
+          std::vector<std::string> relPaths;
+          ErrorCode code = readSenderFileList(data, relPaths);
+          if (code != OK) {
+            threadStats.setErrorCode(code);
+            return ACCEPT_WITH_TIMEOUT;
+          }
+          if (!signExistingFiles(data, relPaths, fileSignatures)) {
+            threadStats.setErrorCode(SOCKET_WRITE_ERROR);
+            return ACCEPT_WITH_TIMEOUT;
+          }
+        }
         const auto &parsedFileChunksInfo =
             transferLogManager_.getParsedFileChunksInfo();
         int64_t off = 0;
@@ -1161,6 +1876,50 @@ Receiver::ReceiverState Receiver::sendFileChunks(ThreadData &data) {
           threadStats.setErrorCode(SOCKET_WRITE_ERROR);
           return ACCEPT_WITH_TIMEOUT;
         }
+        if (data.sendDeltaSignatures_) {
+          // signatures follow in the same format: <cmd><buffer size><number
+          // of entries> and then buffers of <data-size><entry1><entry2>...
+          off = 0;
+          buf[off++] = Protocol::CHUNKS_CMD;
+          const int64_t numSignatureEntries = fileSignatures.size();
+          Protocol::encodeChunksCmd(buf, off, bufferSize, numSignatureEntries);
+          written = socket.write(buf, off);
+          if (written > 0) {
+            threadStats.addHeaderBytes(written);
+          }
+          if (written != off) {
+            LOG(ERROR) << "Socket write error " << off << " " << written;
+            threadStats.setErrorCode(SOCKET_WRITE_ERROR);
+            return ACCEPT_WITH_TIMEOUT;
+          }
+          numEntriesWritten = 0;
+          while (numEntriesWritten < numSignatureEntries) {
+            off = sizeof(int32_t);
+            int64_t numEntriesEncoded = Protocol::encodeFileSignaturesList(
+                buf, off, bufferSize, numEntriesWritten, fileSignatures);
+            if (numEntriesEncoded == 0) {
+              // entries are split to fit in a buffer
+              LOG(ERROR) << "Signatures entry too large for a buffer";
+              break;
+            }
+            int32_t dataSize = folly::Endian::little(off - sizeof(int32_t));
+            folly::storeUnaligned<int32_t>(buf, dataSize);
+            written = socket.write(buf, off);
+            if (written > 0) {
+              threadStats.addHeaderBytes(written);
+            }
+            if (written != off) {
+              break;
+            }
+            numEntriesWritten += numEntriesEncoded;
+          }
+          if (numEntriesWritten != numSignatureEntries) {
+            LOG(ERROR) << "Could not write all the signatures "
+                       << numSignatureEntries << " " << numEntriesWritten;
+            threadStats.setErrorCode(SOCKET_WRITE_ERROR);
+            return ACCEPT_WITH_TIMEOUT;
+          }
+        }
         // try to read ack
         int64_t toRead = 1;
         int64_t numRead = socket.read(buf, toRead);
@@ -1395,6 +2154,12 @@ void Receiver::receiveOne(int threadIndex, ServerSocket &socket,
   });
   ThreadData data(threadIndex, socket, threadStats, protocolVersion_,
                   bufferSize);
+  // runs before the perf report is copied above
+  auto writeBehindGuard = folly::makeGuard([&data] {
+    if (data.writeBehind_) {
+      *perfStatReport += data.writeBehind_->stop();
+    }
+  });
   if (!data.getBuf()) {
     LOG(ERROR) << "error allocating " << bufferSize;
     threadStats.setErrorCode(MEMORY_ALLOCATION_ERROR);
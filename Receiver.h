@@ -15,9 +15,11 @@
 #include "Reporting.h"
 #include "ServerSocket.h"
 #include "Protocol.h"
-#include "Writer.h"
+#include "FileWriter.h"
+#include "WriteBehindPipeline.h"
 #include "Throttler.h"
 #include "TransferLogManager.h"
+#include "Compressor.h"
 #include <memory>
 #include <string>
 #include <condition_variable>
@@ -117,6 +119,7 @@ class Receiver : public WdtBase {
     SEND_LOCAL_CHECKPOINT,
     READ_NEXT_CMD,
     PROCESS_FILE_CMD,
+    PROCESS_BUNDLE_CMD,
     PROCESS_EXIT_CMD,
     PROCESS_SETTINGS_CMD,
     PROCESS_DONE_CMD,
@@ -200,6 +203,25 @@ class Receiver : public WdtBase {
     /// Checkpoints that have not been sent back to the sender
     std::vector<Checkpoint> newCheckpoints_;
 
+    /**
+     * Files registered by the sender on the current connection, indexed by
+     * file handle. Entries with a fileHandle of -1 are unused
+     */
+    std::vector<BlockDetails> fileHandles_;
+
+    /// whether the sender asked for signatures of the existing files
+    bool sendDeltaSignatures_{false};
+
+    /// decompressor, null if the sender does not compress blocks
+    std::unique_ptr<Compressor> decompressor_;
+
+    /// buffer for compressed chunks which do not fit in buf_
+    std::unique_ptr<char[]> chunkBuf_;
+    int64_t chunkBufSize_{0};
+
+    /// writes received blocks in the background, null if not used yet
+    std::unique_ptr<WriteBehindPipeline> writeBehind_;
+
     /// Constructor for thread data
     ThreadData(int threadIndex, ServerSocket &socket,
                TransferStats &threadStats, int protocolVersion,
@@ -221,6 +243,8 @@ class Receiver : public WdtBase {
       checkpointIndex_ = pendingCheckpointIndex_ = 0;
       doneSendFailure_ = false;
       senderReadTimeout_ = senderWriteTimeout_ = -1;
+      fileHandles_.clear();
+      decompressor_.reset();
       threadStats_.reset();
     }
 
@@ -292,8 +316,10 @@ class Receiver : public WdtBase {
    *                   ACCEPT_WITH_TIMEOUT,
    *                   PROCESS_SETTINGS_CMD,
    *                   PROCESS_FILE_CMD,
+   *                   PROCESS_BUNDLE_CMD,
    *                   SEND_GLOBAL_CHECKPOINTS,
    * Next states : PROCESS_FILE_CMD,
+   *               PROCESS_BUNDLE_CMD,
    *               PROCESS_EXIT_CMD,
    *               PROCESS_DONE_CMD,
    *               PROCESS_SETTINGS_CMD,
@@ -310,14 +336,109 @@ class Receiver : public WdtBase {
    */
   ReceiverState processExitCmd(ThreadData &data);
   /**
-   * Processes file cmd. Logic of how we write the file to the destination
-   * directory is defined here.
+   * Processes file cmd and block cmd. Logic of how we write the file to the
+   * destination directory is defined here. Block cmds carry a compact header
+   * referring to a file registered by an earlier file cmd on the same
+   * connection.
    * Previous states : READ_NEXT_CMD
    * Next states : READ_NEXT_CMD(success),
    *               WAIT_FOR_FINISH_WITH_THREAD_ERROR(protocol error),
    *               ACCEPT_WITH_TIMEOUT(socket read failure)
    */
   ReceiverState processFileCmd(ThreadData &data);
+  /**
+   * Processes bundle cmd, which carries several complete small files one
+   * after the other, followed by a single footer.
+   * Previous states : READ_NEXT_CMD
+   * Next states : READ_NEXT_CMD(success),
+   *               WAIT_FOR_FINISH_WITH_THREAD_ERROR(protocol error),
+   *               ACCEPT_WITH_TIMEOUT(socket read failure)
+   */
+  ReceiverState processBundleCmd(ThreadData &data);
+  /**
+   * Helper of PROCESS_FILE_CMD and PROCESS_BUNDLE_CMD states, called once all
+   * the data of the cmd is received. Keeps the extra bytes read for the next
+   * cmd and, if checksum is enabled, reads and verifies the footer.
+   *
+   * @param data            thread data
+   * @param remainingData   number of bytes read past the data of the cmd
+   * @param checksum        checksum of the received data
+   * @param name            name of the file/bundle, used for logging
+   *
+   * @return                OK, SOCKET_READ_ERROR, PROTOCOL_ERROR or
+   *                        CHECKSUM_MISMATCH
+   */
+  ErrorCode processDataEnd(ThreadData &data, int64_t remainingData,
+                           int32_t checksum, const std::string &name);
+
+  /**
+   * Helper of PROCESS_FILE_CMD state for compressed blocks. Returns the next
+   * size bytes of the cmd, using first the remainingData extra bytes at the
+   * current offset and then reading from the socket.
+   *
+   * @return                the bytes, valid till the next call, nullptr if
+   *                        they could not be read
+   */
+  char *readChunkBytes(ThreadData &data, int64_t size,
+                       int64_t &remainingData);
+
+  /**
+   * Helper of PROCESS_FILE_CMD state for compressed blocks. Reads one chunk,
+   * decompresses it and writes it to the file.
+   *
+   * @param data            thread data
+   * @param writer          writer of the block
+   * @param blockDetails    details of the block
+   * @param checksum        checksum of the uncompressed data
+   * @param remainingData   number of extra bytes already read
+   *
+   * @return                OK, SOCKET_READ_ERROR, PROTOCOL_ERROR or
+   *                        FILE_WRITE_ERROR
+   */
+  ErrorCode receiveCompressedChunk(ThreadData &data, FileWriter &writer,
+                                   const BlockDetails &blockDetails,
+                                   int32_t &checksum, int64_t &remainingData);
+
+  /**
+   * Helper of PROCESS_FILE_CMD state for delta encoded blocks. Reads one op
+   * and writes the data it adds or copies from the existing file.
+   *
+   * @param data            thread data
+   * @param writer          writer of the block
+   * @param blockDetails    details of the block
+   * @param basisFd         existing copy of the file, -1 if it can't be read
+   * @param basisSize       size of the existing copy, copy ops past its end
+   *                        are protocol errors
+   * @param checksum        checksum of the data written
+   * @param remainingData   number of extra bytes already read
+   *
+   * @return                OK, SOCKET_READ_ERROR, PROTOCOL_ERROR or
+   *                        FILE_WRITE_ERROR
+   */
+  ErrorCode receiveDeltaOp(ThreadData &data, FileWriter &writer,
+                           const BlockDetails &blockDetails, int basisFd,
+                           int64_t basisSize, int32_t &checksum,
+                           int64_t &remainingData);
+
+  /**
+   * Helper of SEND_FILE_CHUNKS state, asks the sender for the files it is
+   * going to send, which are the only ones worth signing
+   *
+   * @return    OK, SOCKET_READ_ERROR, SOCKET_WRITE_ERROR or PROTOCOL_ERROR
+   */
+  ErrorCode readSenderFileList(ThreadData &data,
+                               std::vector<std::string> &relPaths);
+
+  /**
+   * Helper of SEND_FILE_CHUNKS state, computes the signatures of the files
+   * announced by the sender which exist in the destination directory. Sends
+   * wait cmds to the sender while doing so.
+   *
+   * @return    false if the sender could not be kept waiting
+   */
+  bool signExistingFiles(ThreadData &data,
+                         const std::vector<std::string> &relPaths,
+                         std::vector<FileSignatures> &fileSignatures);
   /**
    * Processes settings cmd. Settings has a connection settings,
    * protocol version, transfer id, etc. For more info check Protocol.h
@@ -378,7 +499,8 @@ class Receiver : public WdtBase {
 
   /**
    * Sends ABORT cmd back to the sender
-   * Previous states : PROCESS_FILE_CMD
+   * Previous states : PROCESS_FILE_CMD,
+   *                   PROCESS_BUNDLE_CMD
    * Next states : WAIT_FOR_FINISH_WITH_THREAD_ERROR
    */
   ReceiverState sendAbortCmd(ThreadData &data);
@@ -30,6 +30,9 @@ TransferStats& TransferStats::operator+=(const TransferStats& stats) {
   numFiles_ += stats.numFiles_;
   numBlocks_ += stats.numBlocks_;
   failedAttempts_ += stats.failedAttempts_;
+  uncompressedBytes_ += stats.uncompressedBytes_;
+  compressedBytes_ += stats.compressedBytes_;
+  deltaCopiedBytes_ += stats.deltaCopiedBytes_;
   if (stats.errCode_ != OK) {
     if (errCode_ == OK) {
       // First error. Setting this as the error code
@@ -80,6 +83,15 @@ std::ostream& operator<<(std::ostream& os, const TransferStats& stats) {
      << ". Wasted bytes due to failure = "
      << (stats.dataBytes_ - stats.effectiveDataBytes_) << " ("
      << failureOverhead << "% overhead).";
+  if (stats.uncompressedBytes_ > 0) {
+    os << " Compressed Mbytes = " << stats.compressedBytes_ / kMbToB << " ("
+       << 100.0 * stats.compressedBytes_ / stats.uncompressedBytes_ << "% of "
+       << stats.uncompressedBytes_ / kMbToB << " uncompressed Mbytes).";
+  }
+  if (stats.deltaCopiedBytes_ > 0) {
+    os << " Delta copied Mbytes = " << stats.deltaCopiedBytes_ / kMbToB
+       << ".";
+  }
   return os;
 }
 
@@ -236,7 +248,9 @@ folly::ThreadLocalPtr<PerfStatReport> perfStatReport;
 const std::string PerfStatReport::statTypeDescription_[] = {
     "Socket Read",     "Socket Write",       "File Open",       "File Close",
     "File Read",       "File Write",         "Sync File Range", "File Seek",
-    "Throttler Sleep", "Receiver Wait Sleep"};
+    "Throttler Sleep", "Receiver Wait Sleep", "File Sendfile",
+    "Io Uring Enter",  "File Fadvise",       "Compress",        "Decompress",
+    "Delta Encode",    "Delta Signatures",   "File Splice",     "Fd Cache Hit"};
 
 PerfStatReport::PerfStatReport() {
   static_assert(
@@ -269,7 +283,8 @@ const int32_t PerfStatReport::kHistogramBuckets[] = {
     2000,  3000,  4000,  5000,  7500,  10000,
     20000, 30000, 40000, 50000, 75000, 100000};
 
-void PerfStatReport::addPerfStat(StatType statType, int64_t timeInMicros) {
+void PerfStatReport::addPerfStat(StatType statType, int64_t timeInMicros,
+                                 int64_t numBytes) {
   int64_t timeInMillis = timeInMicros / kMicroToMilli;
   if (timeInMicros >= networkTimeoutMillis_ * 750) {
     LOG(WARNING) << statTypeDescription_[statType] << " system call took "
@@ -282,6 +297,7 @@ void PerfStatReport::addPerfStat(StatType statType, int64_t timeInMicros) {
       std::min<int64_t>(minValueMicros_[statType], timeInMicros);
   count_[statType]++;
   sumMicros_[statType] += timeInMicros;
+  numBytes_[statType] += numBytes;
 }
 
 PerfStatReport& PerfStatReport::operator+=(const PerfStatReport& statReport) {
@@ -297,6 +313,7 @@ PerfStatReport& PerfStatReport::operator+=(const PerfStatReport& statReport) {
         std::min<int64_t>(minValueMicros_[i], statReport.minValueMicros_[i]);
     count_[i] += statReport.count_[i];
     sumMicros_[i] += statReport.sumMicros_[i];
+    numBytes_[i] += statReport.numBytes_[i];
   }
   return *this;
 }
@@ -320,6 +337,10 @@ std::ostream& operator<<(std::ostream& os, const PerfStatReport& statReport) {
     os << "Ncalls " << statReport.count_[i] << " Stats in ms : SumPerThread "
        << sumPerThread << " Min " << min << " Max " << max << " Avg " << avg
        << " ";
+    if (statReport.numBytes_[i] > 0) {
+      os << "Bytes " << statReport.numBytes_[i] << " BytesPerCall "
+         << statReport.numBytes_[i] / statReport.count_[i] << " ";
+    }
 
     // One extra bucket for values extending beyond last bucket
     int numBuckets = 1 +
@@ -75,6 +75,15 @@ class TransferStats {
   /// number of failed transfers
   int64_t failedAttempts_ = 0;
 
+  /// number of data bytes of compressed blocks, before compression
+  int64_t uncompressedBytes_ = 0;
+  /// number of data bytes of compressed blocks, as sent on the wire
+  int64_t compressedBytes_ = 0;
+
+  /// number of data bytes of delta encoded blocks copied from the receiver's
+  /// existing files instead of being sent
+  int64_t deltaCopiedBytes_ = 0;
+
   /// status of the transfer
   ErrorCode errCode_ = OK;
 
@@ -111,6 +120,8 @@ class TransferStats {
     effectiveHeaderBytes_ = effectiveDataBytes_ = 0;
     numFiles_ = numBlocks_ = 0;
     failedAttempts_ = 0;
+    uncompressedBytes_ = compressedBytes_ = 0;
+    deltaCopiedBytes_ = 0;
     errCode_ = remoteErrCode_ = OK;
   }
 
@@ -187,6 +198,24 @@ class TransferStats {
     return failedAttempts_;
   }
 
+  /// @return number of data bytes of compressed blocks, before compression
+  int64_t getUncompressedBytes() const {
+    folly::RWSpinLock::ReadHolder lock(mutex_.get());
+    return uncompressedBytes_;
+  }
+
+  /// @return number of data bytes of compressed blocks, as sent on the wire
+  int64_t getCompressedBytes() const {
+    folly::RWSpinLock::ReadHolder lock(mutex_.get());
+    return compressedBytes_;
+  }
+
+  /// @return number of data bytes copied from the receiver's existing files
+  int64_t getDeltaCopiedBytes() const {
+    folly::RWSpinLock::ReadHolder lock(mutex_.get());
+    return deltaCopiedBytes_;
+  }
+
   /// @return error code based on combinator of local and remote error
   ErrorCode getCombinedErrorCode() const {
     folly::RWSpinLock::ReadHolder lock(mutex_.get());
@@ -219,6 +248,22 @@ class TransferStats {
     dataBytes_ += count;
   }
 
+  /**
+   * @param uncompressedBytes   data bytes of a compressed block chunk
+   * @param compressedBytes     size of the chunk on the wire
+   */
+  void addCompressionBytes(int64_t uncompressedBytes, int64_t compressedBytes) {
+    folly::RWSpinLock::WriteHolder lock(mutex_.get());
+    uncompressedBytes_ += uncompressedBytes;
+    compressedBytes_ += compressedBytes;
+  }
+
+  /// @param count  data bytes copied from the receiver's existing files
+  void addDeltaCopiedBytes(int64_t count) {
+    folly::RWSpinLock::WriteHolder lock(mutex_.get());
+    deltaCopiedBytes_ += count;
+  }
+
   /// @param number of additional header bytes transferred
   void addHeaderBytes(int64_t count) {
     folly::RWSpinLock::WriteHolder lock(mutex_.get());
@@ -459,6 +504,13 @@ class ProgressReporter {
     perfStatReport->addPerfStat(statType, duration);                 \
   }
 
+/// same as RECORD_PERF_RESULT, but also accounts numBytes for the stat-type
+#define RECORD_PERF_RESULT_BYTES(statType, numBytes)                 \
+  if (WdtOptions::get().enable_perf_stat_collection) {               \
+    int64_t duration = durationMicros(Clock::now() - startTimePERF); \
+    perfStatReport->addPerfStat(statType, duration, numBytes);       \
+  }
+
 /// class representing perf stat collection
 class PerfStatReport {
  public:
@@ -475,6 +527,15 @@ class PerfStatReport {
     RECEIVER_WAIT_SLEEP,  // receiver sleep duration between sending wait cmd to
                           // sender. A high sum for this suggestes threads
                           // were not properly load balanced
+    FILE_SENDFILE,        // zero copy transfer from file to socket
+    IO_URING_ENTER,       // io_uring submission and/or wait for completions
+    FILE_FADVISE,         // page cache hints (and waiting for writeback)
+    COMPRESS,             // compression of a chunk of a block
+    DECOMPRESS,           // decompression of a chunk of a block
+    DELTA_ENCODE,         // search of a block for data the receiver has
+    DELTA_SIGNATURES,     // signing of the receiver's existing files
+    FILE_SPLICE,          // zero copy transfer from a pipe to a file
+    FD_CACHE_HIT,         // block written with an already open file
     END
   };
 
@@ -483,8 +544,10 @@ class PerfStatReport {
   /**
    * @param statType      stat-type
    * @param timeInMicros  time taken by the operatin in microseconds
+   * @param numBytes      number of bytes processed by the operation
    */
-  void addPerfStat(StatType statType, int64_t timeInMicros);
+  void addPerfStat(StatType statType, int64_t timeInMicros,
+                   int64_t numBytes = 0);
 
   friend std::ostream &operator<<(std::ostream &os,
                                   const PerfStatReport &statReport);
@@ -504,6 +567,8 @@ class PerfStatReport {
   int64_t count_[kNumTypes_] = {0};
   /// sum of all records for different stat types
   int64_t sumMicros_[kNumTypes_] = {0};
+  /// number of bytes processed for different stat types
+  int64_t numBytes_[kNumTypes_] = {0};
   /// network timeout in milliseconds
   int networkTimeoutMillis_;
 };
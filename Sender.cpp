@@ -11,6 +11,7 @@
 #include "ClientSocket.h"
 #include "Throttler.h"
 #include "SocketUtils.h"
+#include "SourceFdCache.h"
 
 #include <folly/Conv.h>
 #include <folly/Memory.h>
@@ -20,6 +21,7 @@
 #include <sys/stat.h>
 #include <folly/Checksum.h>
 
+#include <limits>
 #include <thread>
 
 namespace facebook {
@@ -131,7 +133,8 @@ void ThreadTransferHistory::markSourceAsFailed(
 const Sender::StateFunction Sender::stateMap_[] = {
     &Sender::connect, &Sender::readLocalCheckPoint, &Sender::sendSettings,
     &Sender::sendBlocks, &Sender::sendDoneCmd, &Sender::sendSizeCmd,
-    &Sender::checkForAbort, &Sender::readFileChunks, &Sender::readReceiverCmd,
+    &Sender::sendHeartbeatCmd, &Sender::checkForAbort,
+    &Sender::readFileChunks, &Sender::readReceiverCmd,
     &Sender::processDoneCmd, &Sender::processWaitCmd, &Sender::processErrCmd,
     &Sender::processAbortCmd, &Sender::processVersionMismatch};
 
@@ -151,6 +154,7 @@ Sender::Sender(const std::string &destHost, const std::string &srcDir) {
   dirQueue_->setExcludePattern(options.exclude_regex);
   dirQueue_->setPruneDirPattern(options.prune_dir_regex);
   dirQueue_->setFollowSymlinks(options.follow_symlinks);
+  dirQueue_->setDestination(destHost_);
   progressReportIntervalMillis_ = options.progress_report_interval_millis;
   progressReporter_ = folly::make_unique<ProgressReporter>();
 }
@@ -213,6 +217,10 @@ void Sender::setFollowSymlinks(const bool followSymlinks) {
   dirQueue_->setFollowSymlinks(followSymlinks);
 }
 
+void Sender::setDestinationDirectory(const std::string &destDir) {
+  dirQueue_->setDestination(destHost_ + ":" + destDir);
+}
+
 void Sender::setProgressReportIntervalMillis(
     const int progressReportIntervalMillis) {
   progressReportIntervalMillis_ = progressReportIntervalMillis;
@@ -265,9 +273,14 @@ std::unique_ptr<TransferReport> Sender::finish() {
     senderThreads_[i].join();
   }
   if (!twoPhases) {
+    // nothing is sent anymore, discovery must not wait for the queue to drain
+    dirQueue_->unblockDiscovery();
+    dirQueue_->stopWatching();
     dirThread_.join();
   }
   WDT_CHECK(numActiveThreads_ == 0);
+  // files may be replaced before the next transfer
+  SourceFdCache::get().closeIdle();
   if (progressReportEnabled) {
     {
       std::unique_lock<std::mutex> lock(mutex_);
@@ -314,6 +327,10 @@ std::unique_ptr<TransferReport> Sender::finish() {
           transferredSourceStats, dirQueue_->getFailedSourceStats(),
           globalThreadStats_, dirQueue_->getFailedDirectories(), totalTime,
           totalFileSize, dirQueue_->getCount());
+  if (transferReport->getSummary().getErrorCode() == OK) {
+    // everything discovered was sent, the next transfer can skip it
+    dirQueue_->commitManifest();
+  }
 
   if (progressReportEnabled) {
     progressReporter_->end(transferReport);
@@ -328,7 +345,8 @@ std::unique_ptr<TransferReport> Sender::finish() {
   double directoryTime;
   directoryTime = dirQueue_->getDirectoryTime();
   LOG(INFO) << "Total sender time = " << totalTime << " seconds ("
-            << directoryTime << " dirTime)"
+            << directoryTime << " dirTime, "
+            << dirQueue_->getDirectoryThroughput() << " dir entries/sec)"
             << ". Transfer summary : " << *transferReport
             << "\nTotal sender throughput = "
             << transferReport->getThroughputMBps() << " Mbytes/sec ("
@@ -354,10 +372,28 @@ ErrorCode Sender::start() {
   const bool twoPhases = options.two_phases;
   WDT_CHECK(!(twoPhases && options.enable_download_resumption))
       << "Two phase is not supported with download resumption";
+  WDT_CHECK(!(twoPhases && (options.max_queued_blocks > 0 ||
+                            options.max_queued_mbytes > 0)))
+      << "Two phase is not supported with a bounded source queue";
+  WDT_CHECK(!(twoPhases && options.continuous_sync))
+      << "Two phase is not supported with continuous sync";
   LOG(INFO) << "Client (sending) to " << destHost_ << ", Using ports [ "
             << ports_ << "]";
   startTime_ = Clock::now();
   downloadResumptionEnabled_ = options.enable_download_resumption;
+  deltaTransferEnabled_ = options.enable_delta_transfer;
+  if (!Compressor::parseCodec(options.compression, compression_)) {
+    LOG(ERROR) << "Unknown compression codec " << options.compression
+               << ", sending uncompressed";
+    compression_ = NO_COMPRESSION;
+  } else if (!Compressor::isSupported(compression_)) {
+    LOG(ERROR) << "Compression codec " << options.compression
+               << " is not supported by this build, sending uncompressed";
+    compression_ = NO_COMPRESSION;
+  }
+  if (protocolVersion_ < Protocol::SPARSE_VERSION) {
+    dirQueue_->disableSparseFiles();
+  }
   dirThread_ = std::move(dirQueue_->buildQueueAsynchronously());
   if (twoPhases) {
     dirThread_.join();
@@ -383,6 +419,7 @@ ErrorCode Sender::start() {
   }
   perfReports_.resize(numPorts);
   negotiatedProtocolVersions_.resize(numPorts, 0);
+  inFlightBlocks_.resize(numPorts);
   numActiveThreads_ = numPorts;
   transferFinished_ = false;
   for (int64_t i = 0; i < numPorts; i++) {
@@ -518,6 +555,8 @@ Sender::SenderState Sender::connect(ThreadData &data) {
   // clearing the totalSizeSent_ flag. This way if anything breaks, we resendthe
   // total size.
   data.totalSizeSent_ = false;
+  // file handles are only valid for the connection they were registered on
+  data.resetFileHandles();
   auto nextState =
       threadStats.getErrorCode() == OK ? SEND_SETTINGS : READ_LOCAL_CHECKPOINT;
   // clear the error code, as this is a new transfer
@@ -586,12 +625,17 @@ Sender::SenderState Sender::sendSettings(ThreadData &data) {
   int64_t off = 0;
   buf[off++] = Protocol::SETTINGS_CMD;
   bool sendFileChunks;
+  bool sendDeltaSignatures;
   {
     std::lock_guard<std::mutex> lock(mutex_);
+    sendDeltaSignatures = deltaTransferEnabled_ &&
+                          protocolVersion_ >= Protocol::DELTA_VERSION &&
+                          !fileChunksReceived_;
     sendFileChunks =
-        downloadResumptionEnabled_ &&
-        protocolVersion_ >= Protocol::DOWNLOAD_RESUMPTION_VERSION &&
-        !fileChunksReceived_;
+        (downloadResumptionEnabled_ &&
+         protocolVersion_ >= Protocol::DOWNLOAD_RESUMPTION_VERSION &&
+         !fileChunksReceived_) ||
+        sendDeltaSignatures;
   }
   Settings settings;
   settings.readTimeoutMillis = readTimeoutMillis;
@@ -599,6 +643,16 @@ Sender::SenderState Sender::sendSettings(ThreadData &data) {
   settings.transferId = transferId_;
   settings.enableChecksum = options.enable_checksum;
   settings.sendFileChunks = sendFileChunks;
+  settings.sendDeltaSignatures = sendDeltaSignatures;
+  settings.compression = NO_COMPRESSION;
+  if (protocolVersion_ >= Protocol::COMPRESSION_VERSION) {
+    settings.compression = compression_;
+  }
+  if (settings.compression == NO_COMPRESSION) {
+    data.compressor_.reset();
+  } else if (!data.compressor_) {
+    data.compressor_.reset(new Compressor(settings.compression));
+  }
   Protocol::encodeSettings(protocolVersion_, buf, off, Protocol::kMaxSettings,
                            settings);
   int64_t toWrite = sendFileChunks ? Protocol::kMinBufLength : off;
@@ -623,14 +677,60 @@ Sender::SenderState Sender::sendBlocks(ThreadData &data) {
     return SEND_SIZE_CMD;
   }
 
+  // the throughput of each thread decides how the last blocks are shared
+  const double elapsedSecs = durationSeconds(Clock::now() - data.startTime_);
+  if (elapsedSecs > 0) {
+    dirQueue_->setThroughput(data.threadIndex_,
+                             threadStats.getEffectiveDataBytes() / elapsedSecs);
+  }
+
   ErrorCode transferStatus;
-  std::unique_ptr<ByteSource> source = dirQueue_->getNextSource(transferStatus);
+  bool timedOut;
+  std::unique_ptr<ByteSource> source =
+      dirQueue_->getNextSource(data.threadIndex_, transferStatus,
+                               getHeartbeatIntervalMillis(), timedOut);
+  if (timedOut) {
+    return SEND_HEARTBEAT_CMD;
+  }
+  if (!source && WdtOptions::get().speculative_duplicates) {
+    source = copyStragglerBlock(data);
+  }
   if (!source) {
     return SEND_DONE_CMD;
   }
   WDT_CHECK(!source->hasError());
+  if (!data.inFlightBlock_ && source->getOffset() == 0 &&
+      source->getSize() == source->getMetaData().size &&
+      source->getSize() <= getMaxBundledFileSize()) {
+    return sendBundle(data, source, transferStatus);
+  }
+  if (!data.inFlightBlock_) {
+    registerInFlightBlock(data, source);
+  }
   TransferStats transferStats =
-      sendOneByteSource(data.socket_, source, transferStatus);
+      sendOneByteSource(data, source, transferStatus);
+  std::shared_ptr<InFlightBlock> block = unregisterInFlightBlock(data);
+  if (block && transferStats.getErrorCode() != OK) {
+    // the thread of the first copy is responsible for the block unless the
+    // other copy got it, a copy only if it got it
+    const bool responsible = (block->thread == data.threadIndex_)
+                                 ? block->claim(data.threadIndex_)
+                                 : block->owner.load() == data.threadIndex_;
+    if (!responsible) {
+      // the stats of the dropped copy are not accounted, the block is sent
+      // once as far as both sides are concerned
+      LOG(INFO) << "Dropping copy of " << source->getIdentifier() << " off "
+                << source->getOffset() << " on thread " << data.threadIndex_
+                << ", sent by thread " << block->owner.load();
+      source->close();
+      threadStats.setErrorCode(transferStats.getErrorCode());
+      // the receiver waits for the rest of the block, the connection is
+      // reset to drop it
+      return transferStats.getErrorCode() == CONN_ERROR_RETRYABLE
+                 ? CONNECT
+                 : CHECK_FOR_ABORT;
+    }
+  }
   threadStats += transferStats;
   source->addTransferStats(transferStats);
   source->close();
@@ -649,6 +749,263 @@ Sender::SenderState Sender::sendBlocks(ThreadData &data) {
   return SEND_BLOCKS;
 }
 
+void Sender::registerInFlightBlock(ThreadData &data,
+                                   const std::unique_ptr<ByteSource> &source) {
+  const auto &options = WdtOptions::get();
+  // retries are not copied, their stats of failed attempts must be kept
+  if (!options.speculative_duplicates ||
+      source->getSize() < options.min_split_block_kbytes * 1024 ||
+      source->getTransferStats().getFailedAttempts() > 0) {
+    return;
+  }
+  data.inFlightBlock_ =
+      std::make_shared<InFlightBlock>(data.threadIndex_, source.get());
+  std::lock_guard<std::mutex> lock(inFlightMutex_);
+  inFlightBlocks_[data.threadIndex_] = data.inFlightBlock_;
+}
+
+std::shared_ptr<Sender::InFlightBlock> Sender::unregisterInFlightBlock(
+    ThreadData &data) {
+  std::shared_ptr<InFlightBlock> block = std::move(data.inFlightBlock_);
+  if (block && block->thread == data.threadIndex_) {
+    std::lock_guard<std::mutex> lock(inFlightMutex_);
+    block->source = nullptr;
+    inFlightBlocks_[data.threadIndex_].reset();
+  }
+  return block;
+}
+
+std::unique_ptr<ByteSource> Sender::copyStragglerBlock(ThreadData &data) {
+  const int64_t minSize = WdtOptions::get().min_split_block_kbytes * 1024;
+  const int64_t throughput = dirQueue_->getThroughput(data.threadIndex_);
+  if (throughput <= 0) {
+    return nullptr;
+  }
+  std::shared_ptr<InFlightBlock> straggler;
+  std::unique_ptr<ByteSource> copy;
+  int64_t bytesLeft = 0;
+  {
+    std::lock_guard<std::mutex> lock(inFlightMutex_);
+    double maxSecsLeft = 0;
+    for (size_t i = 0; i < inFlightBlocks_.size(); i++) {
+      const auto &block = inFlightBlocks_[i];
+      if (!block || block->duplicated || block->owner.load() >= 0) {
+        continue;
+      }
+      const int64_t size = block->source->getSize();
+      const int64_t left = size - block->bytesSent.load();
+      if (left < minSize) {
+        continue;
+      }
+      // a thread which hasn't sent anything yet is as slow as can be
+      const int64_t otherThroughput = dirQueue_->getThroughput(i);
+      const double secsLeft = (otherThroughput > 0)
+                                  ? (double)left / otherThroughput
+                                  : std::numeric_limits<double>::max();
+      // the copy has to be sent entirely before the rest of the first one
+      if (secsLeft <= (double)size / throughput || secsLeft <= maxSecsLeft) {
+        continue;
+      }
+      straggler = block;
+      maxSecsLeft = secsLeft;
+      bytesLeft = left;
+    }
+    if (!straggler) {
+      return nullptr;
+    }
+    straggler->duplicated = true;
+    copy = straggler->source->clone();
+  }
+  if (!copy || copy->open() != OK) {
+    return nullptr;
+  }
+  LOG(INFO) << "Thread " << data.threadIndex_ << " sending a copy of "
+            << copy->getIdentifier() << " off " << copy->getOffset()
+            << ", thread " << straggler->thread << " has " << bytesLeft
+            << " bytes of it left";
+  data.inFlightBlock_ = std::move(straggler);
+  return copy;
+}
+
+int64_t Sender::getMaxBundledFileSize() const {
+  const auto &options = WdtOptions::get();
+  if (protocolVersion_ < Protocol::FILE_BUNDLE_VERSION ||
+      options.small_file_bundle_kbytes <= 0) {
+    // no file, not even an empty one, is small enough
+    return -1;
+  }
+  return std::min<int64_t>((int64_t)options.small_file_bundle_kbytes * 1024,
+                           options.buffer_size);
+}
+
+Sender::SenderState Sender::sendBundle(ThreadData &data,
+                                       std::unique_ptr<ByteSource> &source,
+                                       ErrorCode transferStatus) {
+  VLOG(1) << "sending bundle " << data.threadIndex_;
+  TransferStats &threadStats = data.threadStats_;
+  ThreadTransferHistory &transferHistory = data.getTransferHistory();
+  auto &socket = data.socket_;
+  const auto &options = WdtOptions::get();
+  const int64_t maxDataSize = options.buffer_size;
+  // cmd, status, header length and number of files
+  const int64_t kBundlePrefix = 1 + 1 + sizeof(int16_t) + 10;
+
+  std::vector<std::unique_ptr<ByteSource>> candidates;
+  candidates.emplace_back(std::move(source));
+  dirQueue_->getSmallSources(
+      data.threadIndex_, getMaxBundledFileSize(),
+      maxDataSize - candidates[0]->getSize(),
+      Protocol::kMaxBundleHeader / Protocol::kMaxBundleEntryOverhead,
+      candidates);
+  if (!data.bundleBuf_) {
+    data.bundleBuf_.reset(new char[Protocol::kMaxBundleHeader + maxDataSize +
+                                   Protocol::kMaxFooter]);
+  }
+  // data goes right after the space reserved for the header, so that header,
+  // data and footer can be written at once
+  char *const dataStart = data.bundleBuf_.get() + Protocol::kMaxBundleHeader;
+  std::vector<std::unique_ptr<ByteSource>> bundled;
+  std::vector<std::unique_ptr<ByteSource>> leftOver;
+  std::vector<BlockDetails> files;
+  int64_t maxHeaderSize = kBundlePrefix;
+  int64_t dataSize = 0;
+  int32_t checksum = 0;
+  const bool doChecksum = options.enable_checksum;
+  const int64_t numCandidates = candidates.size();
+  for (int64_t i = 0; i < numCandidates; i++) {
+    auto &candidate = candidates[i];
+    const SourceMetaData &metadata = candidate->getMetaData();
+    const int64_t maxEntrySize =
+        Protocol::kMaxBundleEntryOverhead + metadata.relPath.size();
+    if (!leftOver.empty() ||
+        maxHeaderSize + maxEntrySize > Protocol::kMaxBundleHeader) {
+      leftOver.emplace_back(std::move(candidate));
+      continue;
+    }
+    // the first source is opened by the queue
+    bool success = (i == 0 || candidate->open() == OK);
+    int64_t size = 0;
+    while (success && !candidate->finished()) {
+      int64_t numRead;
+      char *buffer = candidate->read(numRead);
+      if (candidate->hasError() || !buffer ||
+          size + numRead > candidate->getSize()) {
+        success = false;
+        break;
+      }
+      memcpy(dataStart + dataSize + size, buffer, numRead);
+      size += numRead;
+    }
+    candidate->close();
+    if (!success || size != candidate->getSize()) {
+      LOG(ERROR) << "Failed reading file " << candidate->getIdentifier()
+                 << " for bundle, returning it to the queue";
+      TransferStats &sourceStats = candidate->getTransferStats();
+      sourceStats.setErrorCode(BYTE_SOURCE_READ_ERROR);
+      sourceStats.incrFailedAttempts();
+      threadStats.incrFailedAttempts();
+      dirQueue_->returnToQueue(candidate);
+      continue;
+    }
+    if (doChecksum) {
+      checksum = folly::crc32c((const uint8_t *)(dataStart + dataSize), size,
+                               checksum);
+    }
+    BlockDetails blockDetails;
+    blockDetails.fileName = metadata.relPath;
+    blockDetails.seqId = metadata.seqId;
+    blockDetails.fileSize = metadata.size;
+    blockDetails.offset = 0;
+    blockDetails.dataSize = size;
+    blockDetails.allocationStatus = metadata.allocationStatus;
+    blockDetails.prevSeqId = metadata.prevSeqId;
+    files.emplace_back(std::move(blockDetails));
+    bundled.emplace_back(std::move(candidate));
+    maxHeaderSize += maxEntrySize;
+    dataSize += size;
+  }
+  if (!leftOver.empty()) {
+    dirQueue_->returnToQueue(leftOver);
+  }
+  if (bundled.empty()) {
+    return SEND_BLOCKS;
+  }
+
+  char headerBuf[Protocol::kMaxBundleHeader];
+  int64_t off = 0;
+  headerBuf[off++] = Protocol::BUNDLE_CMD;
+  headerBuf[off++] = transferStatus;
+  char *headerLenPtr = headerBuf + off;
+  off += sizeof(int16_t);
+  Protocol::encodeBundleHeader(headerBuf, off, Protocol::kMaxBundleHeader,
+                               files);
+  int16_t littleEndianOff = folly::Endian::little((int16_t)off);
+  folly::storeUnaligned<int16_t>(headerLenPtr, littleEndianOff);
+  const int64_t headerSize = off;
+  char *const bundleStart = dataStart - headerSize;
+  memcpy(bundleStart, headerBuf, headerSize);
+  int64_t footerSize = 0;
+  if (doChecksum) {
+    char *footer = dataStart + dataSize;
+    footer[footerSize++] = Protocol::FOOTER_CMD;
+    Protocol::encodeFooter(footer, footerSize, Protocol::kMaxFooter, checksum);
+  }
+  const int64_t toWrite = headerSize + dataSize + footerSize;
+  if (throttler_) {
+    throttler_->limit(toWrite);
+  }
+  int64_t written = socket->write(bundleStart, toWrite);
+  ErrorCode errCode = OK;
+  if (written != toWrite) {
+    PLOG(ERROR) << "Bundle write error/mismatch " << written << " " << toWrite
+                << ". fd = " << socket->getFd()
+                << ". port = " << socket->getPort();
+    errCode = SOCKET_WRITE_ERROR;
+  } else if (getCurAbortCode() != OK) {
+    LOG(ERROR) << "Transfer aborted during bundle transfer "
+               << socket->getPort();
+    errCode = ABORT;
+  }
+  if (errCode != OK) {
+    for (auto &bundledSource : bundled) {
+      TransferStats stats;
+      stats.setErrorCode(errCode);
+      stats.incrFailedAttempts();
+      threadStats += stats;
+      bundledSource->addTransferStats(stats);
+    }
+    dirQueue_->returnToQueue(bundled);
+    return CHECK_FOR_ABORT;
+  }
+  VLOG(2) << "Sent bundle of " << files.size() << " files, " << dataSize
+          << " bytes on " << socket->getFd();
+  bool globalCheckpoint = false;
+  const int64_t numBundled = bundled.size();
+  for (int64_t i = 0; i < numBundled; i++) {
+    TransferStats stats;
+    // header and footer are accounted to the first file of the bundle
+    if (i == 0) {
+      stats.addHeaderBytes(headerSize + footerSize);
+    }
+    stats.addDataBytes(files[i].dataSize);
+    stats.setErrorCode(OK);
+    stats.incrNumBlocks();
+    stats.addEffectiveBytes(stats.getHeaderBytes(), stats.getDataBytes());
+    threadStats += stats;
+    bundled[i]->addTransferStats(stats);
+    if (!transferHistory.addSource(bundled[i])) {
+      globalCheckpoint = true;
+    }
+  }
+  if (globalCheckpoint) {
+    // global checkpoint received for this thread. no point in continuing
+    LOG(ERROR) << "global checkpoint received, no point in continuing";
+    threadStats.setErrorCode(CONN_ERROR);
+    return END;
+  }
+  return SEND_BLOCKS;
+}
+
 Sender::SenderState Sender::sendSizeCmd(ThreadData &data) {
   VLOG(1) << "entered SEND_SIZE_CMD state " << data.threadIndex_;
   TransferStats &threadStats = data.threadStats_;
@@ -697,6 +1054,45 @@ Sender::SenderState Sender::sendDoneCmd(ThreadData &data) {
   return READ_RECEIVER_CMD;
 }
 
+int Sender::getHeartbeatIntervalMillis() const {
+  const auto &options = WdtOptions::get();
+  if (!options.continuous_sync ||
+      protocolVersion_ < Protocol::HEARTBEAT_VERSION) {
+    return -1;
+  }
+  // well within the read timeout of the receiver, assumed to be the same
+  return std::max(1, options.read_timeout_millis / 4);
+}
+
+Sender::SenderState Sender::sendHeartbeatCmd(ThreadData &data) {
+  VLOG(2) << "entered SEND_HEARTBEAT_CMD state " << data.threadIndex_;
+  TransferStats &threadStats = data.threadStats_;
+  char *buf = data.buf_;
+  auto &socket = data.socket_;
+  if (getCurAbortCode() != OK) {
+    LOG(ERROR) << "Transfer aborted while waiting for new files "
+               << data.threadIndex_;
+    threadStats.setErrorCode(ABORT);
+    return END;
+  }
+  // padded like the done cmd, the receiver reads commands kMinBufLength
+  // bytes at a time
+  buf[0] = Protocol::HEARTBEAT_CMD;
+  const int64_t toWrite = Protocol::kMinBufLength;
+  int64_t written = socket->write(buf, toWrite);
+  if (written != toWrite) {
+    LOG(ERROR) << "Socket write failure " << written << " " << toWrite;
+    threadStats.setErrorCode(SOCKET_WRITE_ERROR);
+    return CHECK_FOR_ABORT;
+  }
+  threadStats.addHeaderBytes(toWrite);
+  return SEND_BLOCKS;
+}
+
+void Sender::stopSync() {
+  dirQueue_->stopWatching();
+}
+
 Sender::SenderState Sender::checkForAbort(ThreadData &data) {
   LOG(INFO) << "entered CHECK_FOR_ABORT state " << data.threadIndex_;
   char *buf = data.buf_;
@@ -737,6 +1133,14 @@ Sender::SenderState Sender::readFileChunks(ThreadData &data) {
   if (cmd == Protocol::WAIT_CMD) {
     return READ_FILE_CHUNKS;
   }
+  if (cmd == Protocol::FILE_LIST_CMD) {
+    ErrorCode code = sendFileList(data);
+    if (code != OK) {
+      threadStats.setErrorCode(code);
+      return CHECK_FOR_ABORT;
+    }
+    return READ_FILE_CHUNKS;
+  }
   if (cmd == Protocol::ACK_CMD) {
     {
       std::lock_guard<std::mutex> lock(mutex_);
@@ -812,11 +1216,26 @@ Sender::SenderState Sender::readFileChunks(ThreadData &data) {
       return END;
     }
   }
+  std::vector<FileSignatures> fileSignatures;
+  if (deltaTransferEnabled_ && protocolVersion_ >= Protocol::DELTA_VERSION) {
+    ErrorCode code = readDeltaSignatures(data, fileSignatures);
+    if (code != OK) {
+      threadStats.setErrorCode(code);
+      return code == PROTOCOL_ERROR ? END : CHECK_FOR_ABORT;
+    }
+  }
+  if (!downloadResumptionEnabled_) {
+    // the exchange only happened for the signatures
+    fileChunksInfoList.clear();
+  }
   {
     std::lock_guard<std::mutex> lock(mutex_);
     if (fileChunksReceived_) {
       LOG(WARNING) << "File chunks list received multiple times";
     } else {
+      if (!fileSignatures.empty()) {
+        dirQueue_->setDeltaSignatures(fileSignatures);
+      }
       dirQueue_->setPreviouslyReceivedChunks(fileChunksInfoList);
       fileChunksReceived_ = true;
     }
@@ -834,6 +1253,128 @@ Sender::SenderState Sender::readFileChunks(ThreadData &data) {
   return SEND_BLOCKS;
 }
 
+ErrorCode Sender::sendFileList(ThreadData &data) {
+  TransferStats &threadStats = data.threadStats_;
+  char *buf = data.buf_;
+  auto &socket = data.socket_;
+  // well within the read timeout of the receiver, assumed to be the same
+  const int64_t waitMillis =
+      std::max(1, WdtOptions::get().read_timeout_millis / 4);
+  std::vector<std::string> relPaths;
+  while (!dirQueue_->getDiscoveredFiles(waitMillis, relPaths)) {
+    if (getCurAbortCode() != OK) {
+      return ABORT;
+    }
+    buf[0] = Protocol::WAIT_CMD;
+    int64_t written = socket->write(buf, 1);
+    if (written != 1) {
+      LOG(ERROR) << "Socket write error 1 " << written;
+      return SOCKET_WRITE_ERROR;
+    }
+    threadStats.addHeaderBytes(written);
+  }
+  LOG(INFO) << "Sending the list of " << relPaths.size()
+            << " files for the receiver to sign";
+  // same format as the file chunks: <cmd><buffer size><number of entries>
+  // and then buffers of <data-size><entry1><entry2>...
+  int64_t off = 0;
+  buf[off++] = Protocol::CHUNKS_CMD;
+  const int64_t numFiles = relPaths.size();
+  Protocol::encodeChunksCmd(buf, off, Protocol::kFileListBufferSize,
+                            numFiles);
+  int64_t written = socket->write(buf, off);
+  if (written != off) {
+    LOG(ERROR) << "Socket write error " << off << " " << written;
+    return SOCKET_WRITE_ERROR;
+  }
+  threadStats.addHeaderBytes(written);
+  std::unique_ptr<char[]> listBuffer(
+      new char[Protocol::kFileListBufferSize]);
+  int64_t numEntriesWritten = 0;
+  while (numEntriesWritten < numFiles) {
+    off = sizeof(int32_t);
+    int64_t numEntriesEncoded = Protocol::encodeFileNamesList(
+        listBuffer.get(), off, Protocol::kFileListBufferSize,
+        numEntriesWritten, relPaths);
+    if (numEntriesEncoded == 0) {
+      LOG(ERROR) << "File name too long for a buffer "
+                 << relPaths[numEntriesWritten];
+      return PROTOCOL_ERROR;
+    }
+    int32_t dataSize = folly::Endian::little(off - sizeof(int32_t));
+    folly::storeUnaligned<int32_t>(listBuffer.get(), dataSize);
+    written = socket->write(listBuffer.get(), off);
+    if (written != off) {
+      LOG(ERROR) << "Socket write error " << off << " " << written;
+      return SOCKET_WRITE_ERROR;
+    }
+    threadStats.addHeaderBytes(written);
+    numEntriesWritten += numEntriesEncoded;
+  }
+  return OK;
+}
+
+ErrorCode Sender::readDeltaSignatures(
+    ThreadData &data, std::vector<FileSignatures> &fileSignatures) {
+  TransferStats &threadStats = data.threadStats_;
+  char *buf = data.buf_;
+  auto &socket = data.socket_;
+  int64_t toRead = 1 + Protocol::kChunksCmdLen;
+  int64_t numRead = socket->read(buf, toRead);
+  if (numRead != toRead) {
+    LOG(ERROR) << "Socket read error " << toRead << " " << numRead;
+    return SOCKET_READ_ERROR;
+  }
+  threadStats.addHeaderBytes(numRead);
+  if (buf[0] != Protocol::CHUNKS_CMD) {
+    LOG(ERROR) << "Expecting signatures, but received " << buf[0];
+    return PROTOCOL_ERROR;
+  }
+  int64_t off = 1;
+  int64_t bufSize, numEntries;
+  Protocol::decodeChunksCmd(buf, off, bufSize, numEntries);
+  if (bufSize <= 0 || numEntries < 0) {
+    LOG(ERROR) << "Invalid signatures cmd " << bufSize << " " << numEntries;
+    return PROTOCOL_ERROR;
+  }
+  LOG(INFO) << "Signatures list has " << numEntries
+            << " entries and is broken in buffers of length " << bufSize;
+  std::unique_ptr<char[]> signaturesBuffer(new char[bufSize]);
+  while ((int64_t)fileSignatures.size() < numEntries) {
+    toRead = sizeof(int32_t);
+    numRead = socket->read(buf, toRead);
+    if (numRead != toRead) {
+      LOG(ERROR) << "Socket read error " << toRead << " " << numRead;
+      return SOCKET_READ_ERROR;
+    }
+    toRead = folly::loadUnaligned<int32_t>(buf);
+    toRead = folly::Endian::little(toRead);
+    if (toRead <= 0 || toRead > bufSize) {
+      LOG(ERROR) << "Invalid signatures buffer length " << toRead;
+      return PROTOCOL_ERROR;
+    }
+    numRead = socket->read(signaturesBuffer.get(), toRead);
+    if (numRead != toRead) {
+      LOG(ERROR) << "Socket read error " << toRead << " " << numRead;
+      return SOCKET_READ_ERROR;
+    }
+    threadStats.addHeaderBytes(sizeof(int32_t) + numRead);
+    off = 0;
+    if (!Protocol::decodeFileSignaturesList(signaturesBuffer.get(), off,
+                                            toRead, fileSignatures)) {
+      LOG(ERROR) << "Unable to decode signatures list";
+      return PROTOCOL_ERROR;
+    }
+  }
+  if ((int64_t)fileSignatures.size() != numEntries) {
+    LOG(ERROR) << "Number of signatures received is more than the number "
+                  "mentioned in CHUNKS_CMD " << fileSignatures.size() << " "
+               << numEntries;
+    return PROTOCOL_ERROR;
+  }
+  return OK;
+}
+
 Sender::SenderState Sender::readReceiverCmd(ThreadData &data) {
   VLOG(1) << "entered READ_RECEIVER_CMD state " << data.threadIndex_;
   TransferStats &threadStats = data.threadStats_;
@@ -1055,6 +1596,10 @@ Sender::SenderState Sender::processVersionMismatch(ThreadData &data) {
       << "Changing protocol version to " << negotiatedProtocol
       << ", previous version " << protocolVersion_;
   protocolVersion_ = negotiatedProtocol;
+  if (protocolVersion_ < Protocol::SPARSE_VERSION) {
+    // the holes of the sparse files have to be sent too
+    dirQueue_->disableSparseFiles();
+  }
   threadStats.setRemoteErrorCode(OK);
   protoNegotiationStatus_ = V_MISMATCH_RESOLVED;
   clearAbort();
@@ -1112,18 +1657,15 @@ void Sender::sendOne(int threadIndex) {
 }
 
 TransferStats Sender::sendOneByteSource(
-    const std::unique_ptr<ClientSocket> &socket,
-    const std::unique_ptr<ByteSource> &source, ErrorCode transferStatus) {
+    ThreadData &data, const std::unique_ptr<ByteSource> &source,
+    ErrorCode transferStatus) {
   TransferStats stats;
   auto &options = WdtOptions::get();
-  char headerBuf[Protocol::kMaxHeader];
-  int64_t off = 0;
-  headerBuf[off++] = Protocol::FILE_CMD;
-  headerBuf[off++] = transferStatus;
-  char *headerLenPtr = headerBuf + off;
-  off += sizeof(int16_t);
+  auto &socket = data.socket_;
   const int64_t expectedSize = source->getSize();
   int64_t actualSize = 0;
+  // set if the block may also be sent by another thread
+  InFlightBlock *inFlightBlock = data.inFlightBlock_.get();
 
   const SourceMetaData &metadata = source->getMetaData();
   BlockDetails blockDetails;
@@ -1134,9 +1676,38 @@ TransferStats Sender::sendOneByteSource(
   blockDetails.dataSize = source->getSize();
   blockDetails.allocationStatus = metadata.allocationStatus;
   blockDetails.prevSeqId = metadata.prevSeqId;
+  blockDetails.deltaEncoded = (metadata.deltaSignatures != nullptr &&
+                               protocolVersion_ >= Protocol::DELTA_VERSION);
+  // older receivers get the holes as well, see disableSparseFiles()
+  blockDetails.sparse = metadata.sparse;
+  blockDetails.sendSize = metadata.sendSize;
+
+  bool registerFile = false;
+  if (protocolVersion_ >= Protocol::FILE_HANDLE_VERSION) {
+    auto it = data.fileHandles_.find(metadata.seqId);
+    if (it != data.fileHandles_.end()) {
+      blockDetails.fileHandle = it->second;
+    } else if (metadata.size > expectedSize) {
+      // only files with more blocks to come are worth registering
+      registerFile = true;
+      blockDetails.fileHandle = data.nextFileHandle_;
+    }
+  }
+  const bool isBlockCmd = (blockDetails.fileHandle >= 0 && !registerFile);
 
-  Protocol::encodeHeader(protocolVersion_, headerBuf, off, Protocol::kMaxHeader,
-                         blockDetails);
+  char headerBuf[Protocol::kMaxHeader];
+  int64_t off = 0;
+  headerBuf[off++] = isBlockCmd ? Protocol::BLOCK_CMD : Protocol::FILE_CMD;
+  headerBuf[off++] = transferStatus;
+  char *headerLenPtr = headerBuf + off;
+  off += sizeof(int16_t);
+  if (isBlockCmd) {
+    Protocol::encodeBlockHeader(headerBuf, off, Protocol::kMaxBlockHeader,
+                                blockDetails);
+  } else {
+    Protocol::encodeHeader(protocolVersion_, headerBuf, off,
+                           Protocol::kMaxHeader, blockDetails);
+  }
   int16_t littleEndianOff = folly::Endian::little((int16_t)off);
   folly::storeUnaligned<int16_t>(headerLenPtr, littleEndianOff);
   int64_t written = socket->write(headerBuf, off);
@@ -1148,6 +1719,11 @@ TransferStats Sender::sendOneByteSource(
     stats.incrFailedAttempts();
     return stats;
   }
+  if (registerFile) {
+    // the receiver registers the file as soon as it decodes the header. If
+    // anything fails later, both sides start over with a new connection
+    data.registerFileHandle(metadata.seqId);
+  }
   stats.addHeaderBytes(written);
   int64_t byteSourceHeaderBytes = written;
   int64_t throttlerInstanceBytes = byteSourceHeaderBytes;
@@ -1155,18 +1731,95 @@ TransferStats Sender::sendOneByteSource(
   VLOG(3) << "Sent " << written << " on " << socket->getFd() << " : "
           << folly::humanify(std::string(headerBuf, off));
   int32_t checksum = 0;
+  const bool doChecksum = (protocolVersion_ >= Protocol::CHECKSUM_VERSION &&
+                           options.enable_checksum);
+  // data is sent as ops copying from the receiver's file or adding literals
+  const bool doDelta = blockDetails.deltaEncoded;
+  if (doDelta) {
+    if (!data.deltaEncoder_) {
+      int64_t maxLiteral = options.buffer_size;
+      if (maxLiteral > Protocol::kMaxDeltaLiteralLen) {
+        maxLiteral = Protocol::kMaxDeltaLiteralLen;
+      }
+      data.deltaEncoder_.reset(new DeltaEncoder(maxLiteral));
+    }
+    data.deltaEncoder_->reset(metadata.deltaSignatures.get());
+  }
+  // data is compressed chunk by chunk, each chunk with a small header
+  const bool doCompress = (data.compressor_ != nullptr && !doDelta);
+  // data is sent encoded, so data bytes can't be counted from the wire
+  const bool encodeData = (doDelta || doCompress);
+  // data is moved from the file to the socket by the kernel (sendfile or
+  // io_uring), without going through the source buffer
+  const bool sendDirectly = (!encodeData && source->supportsDirectSend() &&
+                             socket->canSendFile());
+  // bytes of the data sent on the wire, including chunk headers
+  int64_t wireDataBytes = 0;
+  int64_t directChunkSize = options.buffer_size;
+  if (options.enable_io_uring) {
+    // one io_uring batch per chunk
+    directChunkSize *= std::max(1, options.io_uring_batch_buffers);
+  }
   while (!source->finished()) {
     int64_t size;
-    char *buffer = source->read(size);
-    if (source->hasError()) {
-      LOG(ERROR) << "Failed reading file " << source->getIdentifier()
-                 << " for fd " << socket->getFd();
-      break;
+    char *buffer = nullptr;
+    if (inFlightBlock && inFlightBlock->thread == data.threadIndex_) {
+      inFlightBlock->bytesSent.store(actualSize);
+    }
+    if (sendDirectly) {
+      size = std::min<int64_t>(directChunkSize, expectedSize - actualSize);
+    } else {
+      buffer = source->read(size);
+      if (source->hasError()) {
+        LOG(ERROR) << "Failed reading file " << source->getIdentifier()
+                   << " for fd " << socket->getFd();
+        break;
+      }
+      WDT_CHECK(buffer && size > 0);
+      if (doChecksum) {
+        checksum = folly::crc32c((const uint8_t *)buffer, size, checksum);
+      }
     }
-    WDT_CHECK(buffer && size > 0);
-    if (protocolVersion_ >= Protocol::CHECKSUM_VERSION &&
-        options.enable_checksum) {
-      checksum = folly::crc32c((const uint8_t *)buffer, size, checksum);
+    if (inFlightBlock) {
+      // only one copy of the block gets its last chunk written
+      const bool lastChunk = sendDirectly ? actualSize + size == expectedSize
+                                          : source->finished();
+      if (lastChunk ? !inFlightBlock->claim(data.threadIndex_)
+                    : inFlightBlock->isClaimedByOther(data.threadIndex_)) {
+        VLOG(1) << "Other copy of " << source->getIdentifier() << " off "
+                << blockDetails.offset << " sent first";
+        stats.setErrorCode(CONN_ERROR_RETRYABLE);
+        return stats;
+      }
+    }
+    const char *payload = buffer;
+    int64_t payloadSize = size;
+    if (doDelta) {
+      START_PERF_TIMER
+      payload = data.deltaEncoder_->encode(buffer, size, source->finished(),
+                                           payloadSize);
+      RECORD_PERF_RESULT_BYTES(PerfStatReport::DELTA_ENCODE, size)
+    } else if (doCompress) {
+      bool compressed;
+      payload = compressChunk(data, metadata, buffer, size, payloadSize,
+                              compressed);
+      char chunkHeader[Protocol::kChunkHeaderLength];
+      int64_t chunkOff = 0;
+      Protocol::encodeChunkHeader(chunkHeader, chunkOff, compressed, size,
+                                  payloadSize);
+      written = socket->write(chunkHeader, chunkOff);
+      if (written != chunkOff) {
+        PLOG(ERROR) << "Write error/mismatch " << written << " " << chunkOff
+                    << ". fd = " << socket->getFd()
+                    << ". port = " << socket->getPort();
+        stats.setErrorCode(SOCKET_WRITE_ERROR);
+        stats.incrFailedAttempts();
+        return stats;
+      }
+      stats.addHeaderBytes(chunkOff);
+      stats.addCompressionBytes(size, payloadSize);
+      throttlerInstanceBytes += chunkOff;
+      wireDataBytes += chunkOff;
     }
     written = 0;
     if (throttler_) {
@@ -1179,29 +1832,65 @@ TransferStats Sender::sendOneByteSource(
        * included. In the next iterations throttler is only called
        * with the bytes being written.
        */
-      throttlerInstanceBytes += size;
+      throttlerInstanceBytes += payloadSize;
       throttler_->limit(throttlerInstanceBytes);
       totalThrottlerBytes += throttlerInstanceBytes;
       throttlerInstanceBytes = 0;
     }
-    do {
-      int64_t w = socket->write(buffer + written, size - written);
+    if (sendDirectly) {
+      written = source->sendTo(*socket, size, doChecksum ? &checksum : nullptr);
+      if (written > 0) {
+        stats.addDataBytes(written);
+        actualSize += written;
+      }
+      if (source->hasError()) {
+        LOG(ERROR) << "Failed reading file " << source->getIdentifier()
+                   << " for fd " << socket->getFd();
+        break;
+      }
+      if (getCurAbortCode() != OK) {
+        LOG(ERROR) << "Transfer aborted during block transfer "
+                   << socket->getPort() << " " << source->getIdentifier();
+        stats.setErrorCode(ABORT);
+        stats.incrFailedAttempts();
+        return stats;
+      }
+      if (written != size) {
+        PLOG(ERROR) << "Direct send error/mismatch " << written << " " << size
+                    << ". fd = " << socket->getFd()
+                    << ". port = " << socket->getPort();
+        stats.setErrorCode(SOCKET_WRITE_ERROR);
+        stats.incrFailedAttempts();
+        return stats;
+      }
+      VLOG(3) << "Sent " << size << " bytes of " << source->getIdentifier()
+              << " directly on " << socket->getFd();
+      wireDataBytes += size;
+      continue;
+    }
+    // encoded data can be empty, bytes are kept for the next chunk
+    while (written < payloadSize) {
+      int64_t w =
+          socket->write((char *)payload + written, payloadSize - written);
       if (w < 0) {
         // TODO: retries, close connection etc...
-        PLOG(ERROR) << "Write error " << written << " (" << size << ")"
+        PLOG(ERROR) << "Write error " << written << " (" << payloadSize << ")"
                     << ". fd = " << socket->getFd()
                     << ". port = " << socket->getPort();
         stats.setErrorCode(SOCKET_WRITE_ERROR);
         stats.incrFailedAttempts();
         return stats;
       }
-      stats.addDataBytes(w);
+      if (!encodeData) {
+        stats.addDataBytes(w);
+      }
       written += w;
-      if (w != size) {
+      if (w != payloadSize) {
         VLOG(1) << "Short write " << w << " sub total now " << written << " on "
-                << socket->getFd() << " out of " << size;
+                << socket->getFd() << " out of " << payloadSize;
       } else {
-        VLOG(3) << "Wrote all of " << size << " on " << socket->getFd();
+        VLOG(3) << "Wrote all of " << payloadSize << " on "
+                << socket->getFd();
       }
       if (getCurAbortCode() != OK) {
         LOG(ERROR) << "Transfer aborted during block transfer "
@@ -1210,14 +1899,19 @@ TransferStats Sender::sendOneByteSource(
         stats.incrFailedAttempts();
         return stats;
       }
-    } while (written < size);
-    if (written > size) {
-      LOG(ERROR) << "Write error " << written << " > " << size;
+    }
+    if (written > payloadSize) {
+      LOG(ERROR) << "Write error " << written << " > " << payloadSize;
       stats.setErrorCode(SOCKET_WRITE_ERROR);
       stats.incrFailedAttempts();
       return stats;
     }
-    actualSize += written;
+    if (encodeData) {
+      // data bytes are accounted before encoding
+      stats.addDataBytes(size);
+    }
+    wireDataBytes += written;
+    actualSize += size;
   }
   if (actualSize != expectedSize) {
     // Can only happen if sender thread can not read complete source byte
@@ -1236,11 +1930,11 @@ TransferStats Sender::sendOneByteSource(
     return stats;
   }
   if (throttler_ && actualSize > 0) {
-    WDT_CHECK(totalThrottlerBytes == actualSize + byteSourceHeaderBytes)
-        << totalThrottlerBytes << " " << (actualSize + totalThrottlerBytes);
+    WDT_CHECK(totalThrottlerBytes == wireDataBytes + byteSourceHeaderBytes)
+        << totalThrottlerBytes << " "
+        << (wireDataBytes + byteSourceHeaderBytes);
   }
-  if (protocolVersion_ >= Protocol::CHECKSUM_VERSION &&
-      options.enable_checksum) {
+  if (doChecksum) {
     off = 0;
     headerBuf[off++] = Protocol::FOOTER_CMD;
     Protocol::encodeFooter(headerBuf, off, Protocol::kMaxFooter, checksum);
@@ -1254,12 +1948,49 @@ TransferStats Sender::sendOneByteSource(
     }
     stats.addHeaderBytes(toWrite);
   }
+  if (doDelta) {
+    stats.addDeltaCopiedBytes(data.deltaEncoder_->getCopiedBytes());
+  }
   stats.setErrorCode(OK);
   stats.incrNumBlocks();
   stats.addEffectiveBytes(stats.getHeaderBytes(), stats.getDataBytes());
   return stats;
 }
 
+const char *Sender::compressChunk(ThreadData &data,
+                                  const SourceMetaData &metadata,
+                                  const char *buffer, int64_t size,
+                                  int64_t &payloadSize, bool &compressed) {
+  const bool adaptive = WdtOptions::get().adaptive_compression;
+  compressed = false;
+  payloadSize = size;
+  if (adaptive && metadata.compressibility.load() == INCOMPRESSIBLE) {
+    return buffer;
+  }
+  int64_t compressedSize = 0;
+  START_PERF_TIMER
+  const char *compressedData =
+      data.compressor_->compress(buffer, size, compressedSize);
+  RECORD_PERF_RESULT_BYTES(PerfStatReport::COMPRESS, size)
+  if (!compressedData) {
+    return buffer;
+  }
+  if (adaptive && metadata.compressibility.load() == COMPRESSIBILITY_UNKNOWN) {
+    const bool isCompressible =
+        compressedSize <= size * Compressor::kMaxCompressedRatio;
+    metadata.compressibility.store(isCompressible ? COMPRESSIBLE
+                                                  : INCOMPRESSIBLE);
+    VLOG(1) << metadata.relPath << " sample compressed from " << size << " to "
+            << compressedSize << (isCompressible ? "" : ", incompressible");
+  }
+  if (compressedSize >= size) {
+    return buffer;
+  }
+  compressed = true;
+  payloadSize = compressedSize;
+  return compressedData;
+}
+
 void Sender::reportProgress() {
   WDT_CHECK(progressReportIntervalMillis_ > 0);
   int throughputUpdateIntervalMillis =
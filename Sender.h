@@ -16,14 +16,18 @@
 #include "WdtOptions.h"
 #include "Reporting.h"
 #include "Protocol.h"
+#include "Compressor.h"
+#include "DeltaTransfer.h"
 
 #include <folly/SpinLock.h>
 
+#include <atomic>
 #include <chrono>
 #include <memory>
 #include <condition_variable>
 #include <mutex>
 #include <iostream>
+#include <unordered_map>
 
 namespace facebook {
 namespace wdt {
@@ -152,6 +156,12 @@ class Sender : public WdtBase {
    */
   std::unique_ptr<TransferReport> finish() override;
 
+  /**
+   * With continuous_sync, stops watching the source directory. The files
+   * already found are still sent and the transfer then finishes normally
+   */
+  void stopSync();
+
   /**
    * API to initiate a transfer and return back to the context
    * from where it was called. Caller would have to call finish
@@ -194,6 +204,11 @@ class Sender : public WdtBase {
   /// @param followSymlinks   whether to follow symlinks or not
   void setFollowSymlinks(const bool followSymlinks);
 
+  /// Sets the directory of the receiver, when known, which identifies the
+  /// destination of a discovery manifest along with the host
+  /// @param destDir          directory the receiver writes to
+  void setDestinationDirectory(const std::string &destDir);
+
   /// Get the ports sender is operating on
   /// @return     list of destination ports
   const std::vector<int32_t> &getPorts() const;
@@ -237,6 +252,7 @@ class Sender : public WdtBase {
     SEND_BLOCKS,
     SEND_DONE_CMD,
     SEND_SIZE_CMD,
+    SEND_HEARTBEAT_CMD,
     CHECK_FOR_ABORT,
     READ_FILE_CHUNKS,
     READ_RECEIVER_CMD,
@@ -248,6 +264,45 @@ class Sender : public WdtBase {
     END
   };
 
+  /**
+   * Block being sent by a thread, which an idle thread may send a copy of
+   * once the queue is empty (speculative_duplicates). Each copy claims the
+   * block before writing its last chunk, the one which doesn't get it stops
+   * in the middle of the block and resets its connection, so that the
+   * receiver drops it. The thread of the first copy also claims the block
+   * when it fails, to return it to the queue.
+   */
+  struct InFlightBlock {
+    InFlightBlock(int thread, const ByteSource *source)
+        : thread(thread), source(source) {
+    }
+
+    /// thread sending the first copy
+    const int thread;
+    /// source of the first copy, null once the thread is done with it.
+    /// Guarded by inFlightMutex_
+    const ByteSource *source;
+    /// whether a second copy is sent, guarded by inFlightMutex_
+    bool duplicated{false};
+    /// bytes of the first copy sent so far
+    std::atomic<int64_t> bytesSent{0};
+    /// thread which got the block, -1 till a copy claims it
+    std::atomic<int> owner{-1};
+
+    /// @return   whether the block is (now) owned by the thread
+    bool claim(int threadIndex) {
+      int expected = -1;
+      return owner.compare_exchange_strong(expected, threadIndex) ||
+             expected == threadIndex;
+    }
+
+    /// @return   whether another thread got the block
+    bool isClaimedByOther(int threadIndex) const {
+      const int current = owner.load();
+      return current >= 0 && current != threadIndex;
+    }
+  };
+
   /// structure to share data among different states
   struct ThreadData {
     const int threadIndex_;
@@ -257,6 +312,24 @@ class Sender : public WdtBase {
     char buf_[Protocol::kMinBufLength];
     /// whether total file size has been sent to the receiver
     bool totalSizeSent_{false};
+    /// buffer used to build bundles of small files, allocated on first use
+    std::unique_ptr<char[]> bundleBuf_;
+    /// file handles of the files registered on the current connection, by
+    /// seq-id
+    std::unordered_map<int64_t, int64_t> fileHandles_;
+    /// seq-id of the file registered with each handle
+    std::vector<int64_t> fileHandleSeqIds_;
+    /// handle used for the next registration, handles are reused round robin
+    int64_t nextFileHandle_{0};
+    /// compressor for the data of blocks, null if compression is not used on
+    /// the current connection
+    std::unique_ptr<Compressor> compressor_;
+    /// encoder of the blocks of delta encoded files, created on first use
+    std::unique_ptr<DeltaEncoder> deltaEncoder_;
+    /// block being sent, if it may be sent twice (speculative_duplicates)
+    std::shared_ptr<InFlightBlock> inFlightBlock_;
+    /// time the thread started, to compute its throughput
+    const Clock::time_point startTime_{Clock::now()};
     ThreadData(int threadIndex, TransferStats &threadStats,
                std::vector<ThreadTransferHistory> &transferHistories)
         : threadIndex_(threadIndex),
@@ -267,6 +340,29 @@ class Sender : public WdtBase {
     ThreadTransferHistory &getTransferHistory() {
       return transferHistories_[threadIndex_];
     }
+
+    /// registers a file in the table, evicting the oldest file if needed
+    /// @return   handle of the file
+    int64_t registerFileHandle(int64_t seqId) {
+      const int64_t handle = nextFileHandle_;
+      if (handle < (int64_t)fileHandleSeqIds_.size()) {
+        fileHandles_.erase(fileHandleSeqIds_[handle]);
+        fileHandleSeqIds_[handle] = seqId;
+      } else {
+        fileHandleSeqIds_.push_back(seqId);
+      }
+      fileHandles_[seqId] = handle;
+      nextFileHandle_ = (handle + 1) % Protocol::kMaxFileHandles;
+      return handle;
+    }
+
+    /// forgets all the registered files, must be called for each new
+    /// connection
+    void resetFileHandles() {
+      fileHandles_.clear();
+      fileHandleSeqIds_.clear();
+      nextFileHandle_ = 0;
+    }
   };
 
   typedef SenderState (Sender::*StateFunction)(ThreadData &data);
@@ -309,9 +405,35 @@ class Sender : public WdtBase {
    * Next states : SEND_BLOCKS(success),
    *               END(global checkpoint received),
    *               CHECK_FOR_ABORT(socket write failure),
-   *               SEND_DONE_CMD(no more blocks left to transfer)
+   *               SEND_DONE_CMD(no more blocks left to transfer),
+   *               SEND_HEARTBEAT_CMD(no new file in a while, continuous_sync)
    */
   SenderState sendBlocks(ThreadData &data);
+  /**
+   * helper of SEND_BLOCKS state. Reads source and more small files from the
+   * queue into the bundle buffer and sends them in one BUNDLE_CMD. Files which
+   * can not be read are returned to the queue and skipped.
+   * Next states : same as SEND_BLOCKS
+   */
+  SenderState sendBundle(ThreadData &data, std::unique_ptr<ByteSource> &source,
+                         ErrorCode transferStatus);
+  /// @return   max size of files sent in bundles, -1 if bundling is disabled
+  int64_t getMaxBundledFileSize() const;
+  /**
+   * helper of SEND_BLOCKS state, once the queue is empty. Picks the block
+   * another thread is still sending which this thread could send entirely
+   * before the other one finishes it, based on their throughputs
+   *
+   * @return    an open copy of the block, null if there is none worth it
+   */
+  std::unique_ptr<ByteSource> copyStragglerBlock(ThreadData &data);
+  /// registers source as the block the thread is sending, if it may be
+  /// copied by an idle thread
+  void registerInFlightBlock(ThreadData &data,
+                             const std::unique_ptr<ByteSource> &source);
+  /// unregisters the block set by registerInFlightBlock()/copied by
+  /// copyStragglerBlock(), once it has been sent
+  std::shared_ptr<InFlightBlock> unregisterInFlightBlock(ThreadData &data);
   /**
    * sends DONE cmd to the receiver
    * Previous states : SEND_BLOCKS
@@ -326,6 +448,18 @@ class Sender : public WdtBase {
    *               SEND_BLOCKS(success)
    */
   SenderState sendSizeCmd(ThreadData &data);
+  /**
+   * sends a heartbeat cmd, so that the receiver doesn't time out while no
+   * file is queued
+   * Previous states : SEND_BLOCKS
+   * Next states : CHECK_FOR_ABORT(failure),
+   *               END(aborted),
+   *               SEND_BLOCKS(success)
+   */
+  SenderState sendHeartbeatCmd(ThreadData &data);
+  /// @return   max time to wait for a source before sending a heartbeat, -1
+  ///           to wait till there is one
+  int getHeartbeatIntervalMillis() const;
   /**
    * checks to see if the receiver has sent ABORT or not
    * Previous states : SEND_BLOCKS,
@@ -347,6 +481,23 @@ class Sender : public WdtBase {
    *
    */
   SenderState readFileChunks(ThreadData &data);
+
+  /**
+   * Helper of READ_FILE_CHUNKS state, sends the files to the receiver to
+   * sign once they are discovered. Sends wait cmds to the receiver meanwhile.
+   *
+   * @return    OK, ABORT, SOCKET_WRITE_ERROR or PROTOCOL_ERROR
+   */
+  ErrorCode sendFileList(ThreadData &data);
+
+  /**
+   * Helper of READ_FILE_CHUNKS state, reads the signatures of the files
+   * existing on the receiver which follow the file chunks list
+   *
+   * @return    OK, SOCKET_READ_ERROR or PROTOCOL_ERROR
+   */
+  ErrorCode readDeltaSignatures(ThreadData &data,
+                                std::vector<FileSignatures> &fileSignatures);
   /**
    * reads receiver cmd
    * Previous states : SEND_DONE_CMD
@@ -399,10 +550,35 @@ class Sender : public WdtBase {
   /// mapping from sender states to state functions
   static const StateFunction stateMap_[];
 
-  /// Method responsible for sending one source to the destination
+  /**
+   * Method responsible for sending one source to the destination. The first
+   * block of a multi block file registers a file handle on the connection,
+   * later blocks of the file are sent with a compact BLOCK_CMD header.
+   * If the block is also sent by another thread and that copy gets it first,
+   * stops in the middle of the block with CONN_ERROR_RETRYABLE.
+   */
   virtual TransferStats sendOneByteSource(
-      const std::unique_ptr<ClientSocket> &socket,
-      const std::unique_ptr<ByteSource> &source, ErrorCode transferStatus);
+      ThreadData &data, const std::unique_ptr<ByteSource> &source,
+      ErrorCode transferStatus);
+
+  /**
+   * Compresses a chunk of a block read from the source. With adaptive
+   * compression, the first chunk compressed for a file decides whether the
+   * rest of the file is worth compressing.
+   *
+   * @param data          thread data
+   * @param metadata      metadata of the file
+   * @param buffer        chunk to compress
+   * @param size          size of the chunk
+   * @param payloadSize   set to the size of the data to send
+   * @param compressed    set to whether the returned data is compressed
+   *
+   * @return              data to send, buffer itself if the chunk is sent
+   *                      uncompressed
+   */
+  const char *compressChunk(ThreadData &data, const SourceMetaData &metadata,
+                            const char *buffer, int64_t size,
+                            int64_t &payloadSize, bool &compressed);
 
   /// Every sender thread executes this method to send the data
   void sendOne(int threadIndex);
@@ -452,6 +628,10 @@ class Sender : public WdtBase {
   SocketCreator socketCreator_{nullptr};
   /// Whether download resumption is enabled or not
   bool downloadResumptionEnabled_{false};
+  /// Codec used to compress blocks, from -compression
+  CompressionCodec compression_{NO_COMPRESSION};
+  /// Whether files existing on the receiver are sent as deltas
+  bool deltaTransferEnabled_{false};
   /// Flags representing whether file chunks have been received or not
   bool fileChunksReceived_{false};
   /// Thread that is running the discovery of files using the dirQueue_
@@ -496,6 +676,10 @@ class Sender : public WdtBase {
   std::chrono::time_point<Clock> endTime_;
   /// Per thread transfer history
   std::vector<ThreadTransferHistory> transferHistories_;
+  /// block each thread is sending, null if it may not be copied
+  std::vector<std::shared_ptr<InFlightBlock>> inFlightBlocks_;
+  /// protects inFlightBlocks_ and the sources of the blocks
+  std::mutex inFlightMutex_;
   /// Has finished been called and threads joined
   bool areThreadsJoined_{true};
   /// Mutex for the management of this instance, specifically to keep the
@@ -46,6 +46,8 @@ ServerSocket::ServerSocket(ServerSocket &&that) noexcept
   listeningFd_ = that.listeningFd_;
   fd_ = that.fd_;
   abortChecker_ = that.abortChecker_;
+  ioUring_ = std::move(that.ioUring_);
+  splicePipe_ = std::move(that.splicePipe_);
   // A temporary ServerSocket should be changed such that
   // the fd doesn't get closed when it (temp obj) is getting
   // destructed and "this" object will remain intact
@@ -62,12 +64,16 @@ ServerSocket &ServerSocket::operator=(ServerSocket &&that) {
   swap(listeningFd_, that.listeningFd_);
   swap(fd_, that.fd_);
   swap(abortChecker_, that.abortChecker_);
+  swap(ioUring_, that.ioUring_);
+  swap(splicePipe_, that.splicePipe_);
   return *this;
 }
 
 void ServerSocket::closeAll() {
   VLOG(1) << "Destroying server socket (port, listen fd, fd)" << port_ << ", "
           << listeningFd_ << ", " << fd_;
+  // the ring holds a reference to the socket
+  ioUring_.reset();
   if (fd_ >= 0) {
     int ret = ::close(fd_);
     if (ret != 0) {
@@ -206,6 +212,27 @@ ErrorCode ServerSocket::acceptNextConnection(int timeoutMillis) {
           << peerPort_;
   SocketUtils::setReadTimeout(fd_);
   SocketUtils::setWriteTimeout(fd_);
+  const auto &options = WdtOptions::get();
+  if (options.enable_io_uring) {
+    if (!ioUring_) {
+      ioUring_.reset(new IoUring(std::max(1, options.io_uring_batch_buffers),
+                                 options.buffer_size, abortChecker_));
+    }
+    if (!ioUring_->isValid() || !ioUring_->setSocket(fd_)) {
+      LOG(WARNING) << "io_uring can not be used for " << port_;
+      ioUring_.reset();
+    }
+  }
+  if (options.enable_splice_receive && !ioUring_) {
+    // pipes are closed if data got stuck in them, make new ones then
+    if (!splicePipe_ || !splicePipe_->isValid()) {
+      splicePipe_.reset(new SplicePipe(options.buffer_size, abortChecker_));
+    }
+    if (!splicePipe_->isValid()) {
+      LOG(WARNING) << "splice can not be used for " << port_;
+      splicePipe_.reset();
+    }
+  }
   return OK;
 }
 
@@ -229,8 +256,28 @@ int ServerSocket::write(const char *buf, int nbyte, bool tryFull) {
                                           tryFull);
 }
 
+bool ServerSocket::canReceiveToFile() const {
+  return (ioUring_ && ioUring_->isValid()) ||
+         (splicePipe_ && splicePipe_->isValid());
+}
+
+ErrorCode ServerSocket::receiveToFile(int fileFd, int64_t offset,
+                                      int64_t nbyte, int32_t *checksum,
+                                      int64_t &written) {
+  WDT_CHECK(canReceiveToFile());
+  if (ioUring_) {
+    return ioUring_->recvAndWrite(fileFd, offset, nbyte, checksum, written);
+  }
+  return splicePipe_->receiveToFile(fd_, fileFd, offset, nbyte, checksum,
+                                    written);
+}
+
 int ServerSocket::closeCurrentConnection() {
   int retValue = 0;
+  if (ioUring_) {
+    // unregister the socket, the ring is reused for the next connection
+    ioUring_->setSocket(-1);
+  }
   if (fd_ >= 0) {
     retValue = ::close(fd_);
     fd_ = -1;
@@ -9,8 +9,11 @@
 #pragma once
 
 #include "ErrorCodes.h"
+#include "IoUring.h"
+#include "SplicePipe.h"
 #include "WdtBase.h"
 
+#include <memory>
 #include <string>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -36,6 +39,20 @@ class ServerSocket {
   int read(char *buf, int nbyte, bool tryFull = true);
   /// tries to write nbyte data and periodically checks for abort
   int write(const char *buf, int nbyte, bool tryFull = true);
+  /// @return       whether receiveToFile() can be used
+  bool canReceiveToFile() const;
+  /**
+   * Receives nbyte bytes and writes them to fileFd starting at offset using
+   * the io_uring engine, or splice(2) (enable_splice_receive). Periodically
+   * checks for abort.
+   *
+   * @param checksum  if not null, crc32c of received data is accumulated here
+   * @param written   set to number of bytes received and written
+   *
+   * @return          OK, SOCKET_READ_ERROR, FILE_WRITE_ERROR or ABORT
+   */
+  ErrorCode receiveToFile(int fileFd, int64_t offset, int64_t nbyte,
+                          int32_t *checksum, int64_t &written);
   /// @return       peer ip
   std::string getPeerIp() const;
   /// @return       peer port
@@ -58,6 +75,10 @@ class ServerSocket {
   std::string peerPort_;
   struct addrinfo sa_;
   WdtBase::IAbortChecker const *abortChecker_;
+  /// io_uring engine for the current connection, null if not enabled
+  std::unique_ptr<IoUring> ioUring_;
+  /// pipes to splice received data through, null if not enabled
+  std::unique_ptr<SplicePipe> splicePipe_;
 };
 }
 }  // namespace facebook::wdt
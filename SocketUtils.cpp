@@ -7,6 +7,7 @@
  * of patent rights can be found in the PATENTS file in the same directory.
  */
 #include "SocketUtils.h"
+#include <wdt/WdtConfig.h>
 #include "WdtOptions.h"
 #include "Reporting.h"
 #include "ErrorCodes.h"
@@ -17,6 +18,12 @@
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <algorithm>
+#ifdef HAS_SENDFILE
+#include <sys/sendfile.h>
+#endif
+#ifdef HAS_SPLICE
+#include <fcntl.h>
+#endif
 
 namespace facebook {
 namespace wdt {
@@ -105,6 +112,54 @@ int64_t SocketUtils::writeWithAbortCheck(
   return written;
 }
 
+int64_t SocketUtils::sendFileWithAbortCheck(
+    int fd, int fileFd, int64_t offset, int64_t nbyte,
+    WdtBase::IAbortChecker const *abortChecker) {
+#ifdef HAS_SENDFILE
+  const auto &options = WdtOptions::get();
+  // perf stats are recorded per sendfile call, so that Ncalls reflects the
+  // number of system calls needed to move the data
+  auto sendFileAt = [fileFd](int sockFd, int64_t fileOffset,
+                             int64_t count) -> int64_t {
+    off_t off = fileOffset;
+    START_PERF_TIMER
+    int64_t sent = ::sendfile(sockFd, fileFd, &off, count);
+    RECORD_PERF_RESULT_BYTES(PerfStatReport::FILE_SENDFILE,
+                             std::max<int64_t>(sent, 0))
+    return sent;
+  };
+  return ioWithAbortCheck(sendFileAt, fd, offset, nbyte, abortChecker,
+                          options.write_timeout_millis, true);
+#else
+  LOG(ERROR) << "sendfile is not supported on this platform";
+  return -1;
+#endif
+}
+
+int64_t SocketUtils::spliceWithAbortCheck(
+    int fd, int pipeFd, int64_t nbyte,
+    WdtBase::IAbortChecker const *abortChecker) {
+#ifdef HAS_SPLICE
+  const auto &options = WdtOptions::get();
+  // the offset is not used, the data just goes at the end of the pipe
+  auto spliceToPipe = [pipeFd](int sockFd, int64_t /* unused */,
+                               int64_t count) -> int64_t {
+    return ::splice(sockFd, nullptr, pipeFd, nullptr, count,
+                    SPLICE_F_MOVE | SPLICE_F_MORE);
+  };
+  START_PERF_TIMER
+  int64_t numMoved = ioWithAbortCheck(spliceToPipe, fd, (int64_t)0, nbyte,
+                                      abortChecker,
+                                      options.read_timeout_millis, false);
+  RECORD_PERF_RESULT_BYTES(PerfStatReport::SOCKET_READ,
+                           std::max<int64_t>(numMoved, 0))
+  return numMoved;
+#else
+  LOG(ERROR) << "splice is not supported on this platform";
+  return -1;
+#endif
+}
+
 template <typename F, typename T>
 int64_t SocketUtils::ioWithAbortCheck(
     F readOrWrite, int fd, T tbuf, int64_t numBytes,
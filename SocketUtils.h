@@ -41,6 +41,27 @@ class SocketUtils {
   static int64_t writeWithAbortCheck(int fd, const char *buf, int64_t nbyte,
                                      WdtBase::IAbortChecker const *abortChecker,
                                      bool tryFull);
+  /**
+   * Sends nbyte bytes of fileFd starting at offset to the socket fd using
+   * sendfile(2), i.e without copying the data through user space. Periodically
+   * checks for abort.
+   *
+   * @return              number of bytes sent, can be less than nbyte if the
+   *                      file is shorter than expected, -1 in case of error
+   */
+  static int64_t sendFileWithAbortCheck(
+      int fd, int fileFd, int64_t offset, int64_t nbyte,
+      WdtBase::IAbortChecker const *abortChecker);
+  /**
+   * Moves up to nbyte bytes received on the socket fd into the pipe pipeFd
+   * using splice(2). Returns after the first successful splice. Periodically
+   * checks for abort.
+   *
+   * @return              number of bytes moved, 0 on EOF, -1 in case of error
+   */
+  static int64_t spliceWithAbortCheck(
+      int fd, int pipeFd, int64_t nbyte,
+      WdtBase::IAbortChecker const *abortChecker);
 
  private:
   /**
@@ -0,0 +1,177 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include "SourceFdCache.h"
+#include "ErrorCodes.h"
+#include "Reporting.h"
+#include "WdtOptions.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <glog/logging.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+namespace facebook {
+namespace wdt {
+
+SourceFdCache &SourceFdCache::get() {
+  // never destroyed, sender threads may still use it at exit
+  static SourceFdCache *instance = new SourceFdCache();
+  return *instance;
+}
+
+int SourceFdCache::open(const SourceMetaData &metadata, int64_t &fileSize) {
+  const std::string &fullPath = metadata.fullPath;
+  const Key key(metadata.seqId, fullPath);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      START_PERF_TIMER
+      Entry &entry = it->second;
+      if (entry.refCount++ == 0) {
+        idle_.erase(entry.idlePos);
+      }
+      fileSize = entry.fileSize;
+      RECORD_PERF_RESULT(PerfStatReport::FD_CACHE_HIT)
+      return entry.fd;
+    }
+  }
+  START_PERF_TIMER
+  int fd = ::open(fullPath.c_str(), O_RDONLY);
+  if (fd < 0) {
+    PLOG(ERROR) << "error opening file " << fullPath;
+    return -1;
+  }
+  RECORD_PERF_RESULT(PerfStatReport::FILE_OPEN)
+  // size is checked once for all the blocks of the file
+  struct stat fileStat;
+  if (fstat(fd, &fileStat) != 0) {
+    PLOG(ERROR) << "fstat failed for " << fullPath;
+    closeFile(fd);
+    return -1;
+  }
+  if (fileStat.st_size != metadata.size) {
+    LOG(WARNING) << "file " << fullPath << " changed size, previous size "
+                 << metadata.size << " current size " << fileStat.st_size;
+  }
+  std::vector<int> toClose;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto res = entries_.insert(std::make_pair(key, Entry()));
+    Entry &entry = res.first->second;
+    if (!res.second) {
+      // another thread opened the file in the meantime
+      if (entry.refCount++ == 0) {
+        idle_.erase(entry.idlePos);
+      }
+      toClose.push_back(fd);
+      fd = entry.fd;
+      fileSize = entry.fileSize;
+    } else {
+      entry.fd = fd;
+      entry.refCount = 1;
+      entry.fileSize = fileStat.st_size;
+      // the whole file if the queued bytes are not known
+      entry.bytesLeft =
+          metadata.sendSize >= 0 ? metadata.sendSize : metadata.size;
+      fileSize = entry.fileSize;
+      evictIdle(toClose);
+    }
+  }
+  for (int idleFd : toClose) {
+    closeFile(idleFd);
+  }
+  return fd;
+}
+
+void SourceFdCache::release(const SourceMetaData &metadata, int fd,
+                            int64_t offset, int64_t size, int64_t bytesRead,
+                            bool failed) {
+  std::vector<int> toClose;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const Key key(metadata.seqId, metadata.fullPath);
+    auto it = entries_.find(key);
+    if (it == entries_.end() || it->second.fd != fd) {
+      // removed from the cache after a failure
+      auto droppedIt = dropped_.find(fd);
+      WDT_CHECK(droppedIt != dropped_.end()) << "releasing uncached file "
+                                             << metadata.fullPath;
+      if (--droppedIt->second > 0) {
+        return;
+      }
+      dropped_.erase(droppedIt);
+      toClose.push_back(fd);
+    } else if (failed && it->second.refCount > 1) {
+      // other blocks still use the fd, the next ones get a new one
+      dropped_[fd] = it->second.refCount - 1;
+      entries_.erase(it);
+    } else {
+      Entry &entry = it->second;
+      if (bytesRead == size && entry.readBlocks.insert(offset).second) {
+        entry.bytesLeft -= bytesRead;
+      }
+      if (--entry.refCount > 0) {
+        return;
+      }
+      if (failed || entry.bytesLeft <= 0) {
+        // failed, or last block of the file which won't be needed anymore
+        toClose.push_back(entry.fd);
+        entries_.erase(it);
+      } else {
+        entry.idlePos = idle_.insert(idle_.end(), key);
+        evictIdle(toClose);
+      }
+    }
+  }
+  for (int fd : toClose) {
+    closeFile(fd);
+  }
+}
+
+void SourceFdCache::closeIdle() {
+  std::vector<int> toClose;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &key : idle_) {
+      auto it = entries_.find(key);
+      toClose.push_back(it->second.fd);
+      entries_.erase(it);
+    }
+    idle_.clear();
+  }
+  for (int fd : toClose) {
+    closeFile(fd);
+  }
+}
+
+void SourceFdCache::evictIdle(std::vector<int> &toClose) {
+  const auto &options = WdtOptions::get();
+  const size_t maxSize = std::max(1, options.sender_fd_cache_size);
+  // files in use can not be closed, the cache may stay bigger till they are
+  // released
+  while (entries_.size() > maxSize && !idle_.empty()) {
+    auto it = entries_.find(idle_.front());
+    idle_.pop_front();
+    toClose.push_back(it->second.fd);
+    entries_.erase(it);
+  }
+}
+
+void SourceFdCache::closeFile(int fd) {
+  START_PERF_TIMER
+  if (::close(fd) != 0) {
+    PLOG(ERROR) << "Unable to close fd " << fd;
+  }
+  RECORD_PERF_RESULT(PerfStatReport::FILE_CLOSE)
+}
+}
+}
@@ -0,0 +1,120 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include "ByteSource.h"
+
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Process wide cache of read only file descriptors of source files, shared by
+ * the blocks of a file (and the sender threads reading them), so that files
+ * are opened and their size checked once instead of for every block. Reads
+ * must use pread. Keeping the fd also keeps the kernel read ahead state of
+ * the file across blocks. Files are keyed by seqId and full path: a file
+ * queued again (replaced or appended to while synced) gets a new seqId and
+ * is opened again, so that its blocks are read from the current inode and
+ * checked against its current size.
+ *
+ * This class is thread-safe.
+ */
+class SourceFdCache {
+ public:
+  /// @return   the process wide instance
+  static SourceFdCache &get();
+
+  /**
+   * Returns a file descriptor for the file, opening it if it is not cached.
+   * It must be given back with release() instead of being closed.
+   *
+   * @param metadata    metadata of the file
+   * @param fileSize    set to the size of the file when it was opened
+   *
+   * @return            file descriptor, -1 if the file can not be opened
+   */
+  int open(const SourceMetaData &metadata, int64_t &fileSize);
+
+  /**
+   * Gives back a file descriptor returned by open(). The file is closed once
+   * all its queued blocks have been read, or when the cache is full and it is
+   * the least recently used file not in use. A block read again (speculative
+   * duplicate, retry) is only counted once.
+   *
+   * @param metadata    metadata of the file
+   * @param fd          file descriptor returned by open()
+   * @param offset      offset of the block
+   * @param size        size of the block
+   * @param bytesRead   number of bytes of the block read
+   * @param failed      whether reading the file failed, it is opened again
+   *                    for the next blocks then
+   */
+  void release(const SourceMetaData &metadata, int fd, int64_t offset,
+               int64_t size, int64_t bytesRead, bool failed);
+
+  /**
+   * Closes the files not in use, called at the end of a transfer so that the
+   * next one sees files replaced in the meantime
+   */
+  void closeIdle();
+
+ private:
+  /// seqId and full path of a file
+  typedef std::pair<int64_t, std::string> Key;
+
+  /// file descriptor shared by the blocks of a file
+  struct Entry {
+    int fd{-1};
+    /// number of blocks using fd
+    int refCount{0};
+    /// size of the file when it was opened
+    int64_t fileSize{0};
+    /// queued bytes of the file not read yet
+    int64_t bytesLeft{0};
+    /// offsets of the blocks completely read
+    std::unordered_set<int64_t> readBlocks;
+    /// position in idle_, only valid when refCount is 0
+    std::list<Key>::iterator idlePos;
+  };
+
+  /**
+   * removes least recently used files not in use till the cache is not
+   * bigger than sender_fd_cache_size. Must be called with mutex_ held.
+   *
+   * @param toClose   file descriptors of the removed files are added here, to
+   *                  be closed without holding the lock
+   */
+  void evictIdle(std::vector<int> &toClose);
+
+  /// closes fd, recording the perf stat
+  static void closeFile(int fd);
+
+  /// cached files
+  std::map<Key, Entry> entries_;
+  /// keys of the cached files not in use, least recently used first
+  std::list<Key> idle_;
+  /**
+   * number of users of file descriptors removed from the cache after a
+   * failure while still in use, they are closed by their last user
+   */
+  std::unordered_map<int, int> dropped_;
+  /// protects entries_, idle_ and dropped_
+  std::mutex mutex_;
+};
+}
+}
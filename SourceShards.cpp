@@ -0,0 +1,231 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include "SourceShards.h"
+#include "ErrorCodes.h"
+
+#include <algorithm>
+
+namespace facebook {
+namespace wdt {
+
+const int64_t SourceShards::kMaxStealBatch;
+
+SourceShards::SourceShards(int numShards, const FileArena *files,
+                           bool physicalOrder) {
+  WDT_CHECK_GT(numShards, 0);
+  const SourceComparator comparator(files, physicalOrder);
+  // one more for the retry shard
+  for (int i = 0; i <= numShards; i++) {
+    shards_.emplace_back(new Shard(comparator));
+  }
+}
+
+void SourceShards::push(std::vector<QueuedBlocks> &entries) {
+  const int numShards = getNumShards();
+  int64_t numBlocks = 0;
+  int64_t numBytes = 0;
+  for (const auto &entry : entries) {
+    numBlocks += entry.numBlocks;
+    numBytes += entry.getNumBytes();
+  }
+  // counted first, so that size_ is never less than the number of blocks
+  // consumers can find
+  numBytes_ += numBytes;
+  size_ += numBlocks;
+  // reserving the round robin slots of all the entries at once
+  uint64_t next = nextShard_.fetch_add(entries.size());
+  std::vector<std::vector<QueuedBlocks>> entriesByShard(shards_.size());
+  for (auto &entry : entries) {
+    int shard = numShards;
+    if (entry.getFailedAttempts() == 0) {
+      shard = next++ % numShards;
+    }
+    entriesByShard[shard].emplace_back(std::move(entry));
+  }
+  entries.clear();
+  for (size_t i = 0; i < shards_.size(); i++) {
+    auto &shardEntries = entriesByShard[i];
+    if (shardEntries.empty()) {
+      continue;
+    }
+    Shard &shard = *shards_[i];
+    int64_t shardBlocks = 0;
+    {
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      for (auto &entry : shardEntries) {
+        shardBlocks += entry.numBlocks;
+        shard.entries.push(std::move(entry));
+      }
+      shard.size += shardBlocks;
+    }
+  }
+}
+
+void SourceShards::push(QueuedBlocks entry) {
+  std::vector<QueuedBlocks> entries;
+  entries.emplace_back(std::move(entry));
+  push(entries);
+}
+
+QueuedBlocks SourceShards::takeBlocks(QueuedBlocks &entry,
+                                      int64_t numBlocks) {
+  QueuedBlocks blocks;
+  blocks.source = std::move(entry.source);
+  blocks.file = entry.file;
+  blocks.offset = entry.offset;
+  blocks.blockSize = entry.blockSize;
+  blocks.numBlocks = numBlocks;
+  blocks.location = entry.location;
+  entry.offset += numBlocks * entry.blockSize;
+  entry.numBlocks -= numBlocks;
+  return blocks;
+}
+
+bool SourceShards::popHead(Shard &shard, QueuedBlocks &block) {
+  if (shard.size.load(std::memory_order_relaxed) == 0) {
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    if (shard.entries.empty()) {
+      return false;
+    }
+    // using const_cast since priority_queue returns a const reference
+    QueuedBlocks head = std::move(const_cast<QueuedBlocks &>(
+        shard.entries.top()));
+    shard.entries.pop();
+    block = takeBlocks(head, 1);
+    if (head.numBlocks > 0) {
+      // the next blocks, still ahead of the entries with smaller blocks
+      shard.entries.push(std::move(head));
+    }
+    shard.size--;
+  }
+  numBytes_ -= block.getSize();
+  size_--;
+  return true;
+}
+
+bool SourceShards::steal(Shard &victim, Shard &thief, QueuedBlocks &block) {
+  {
+    // both locks, so the stolen blocks are always visible to the others
+    std::lock(victim.mutex, thief.mutex);
+    std::lock_guard<std::mutex> victimLock(victim.mutex, std::adopt_lock);
+    std::lock_guard<std::mutex> thiefLock(thief.mutex, std::adopt_lock);
+    const int64_t count =
+        std::min<int64_t>(kMaxStealBatch, (victim.size.load() + 1) / 2);
+    int64_t numStolen = 0;
+    while (numStolen < count && !victim.entries.empty()) {
+      QueuedBlocks head = std::move(const_cast<QueuedBlocks &>(
+          victim.entries.top()));
+      victim.entries.pop();
+      const int64_t numTaken = std::min(head.numBlocks, count - numStolen);
+      QueuedBlocks stolen = takeBlocks(head, numTaken);
+      if (head.numBlocks > 0) {
+        victim.entries.push(std::move(head));
+      }
+      if (numStolen == 0) {
+        block = takeBlocks(stolen, 1);
+      }
+      numStolen += numTaken;
+      if (stolen.numBlocks > 0) {
+        thief.entries.push(std::move(stolen));
+      }
+    }
+    if (numStolen == 0) {
+      return false;
+    }
+    victim.size -= numStolen;
+    thief.size += numStolen - 1;
+  }
+  numSteals_++;
+  numBytes_ -= block.getSize();
+  size_--;
+  return true;
+}
+
+bool SourceShards::pop(int shard, QueuedBlocks &block) {
+  const int numShards = getNumShards();
+  const int index = (shard % numShards + numShards) % numShards;
+  Shard &own = *shards_[index];
+  Shard &retries = *shards_.back();
+  while (!empty()) {
+    if (popHead(own, block)) {
+      return true;
+    }
+    for (int i = 1; i < numShards; i++) {
+      Shard &victim = *shards_[(index + i) % numShards];
+      if (victim.size.load(std::memory_order_relaxed) == 0) {
+        continue;
+      }
+      if (steal(victim, own, block)) {
+        return true;
+      }
+    }
+    // only retries are left
+    if (retries.size.load() == size_.load() && popHead(retries, block)) {
+      return true;
+    }
+    // other consumers are popping the last blocks
+  }
+  return false;
+}
+
+void SourceShards::popWhile(
+    int shard, int64_t maxCount,
+    const std::function<bool(const QueuedBlocks &)> &accept,
+    std::vector<QueuedBlocks> &entries) {
+  const int numShards = getNumShards();
+  Shard *head = shards_[(shard % numShards + numShards) % numShards].get();
+  Shard &retries = *shards_.back();
+  if (head->size.load() == 0 && retries.size.load() == size_.load()) {
+    // only retries are left
+    head = &retries;
+  }
+  int64_t count = 0;
+  int64_t numBlocks = 0;
+  int64_t numBytes = 0;
+  {
+    std::lock_guard<std::mutex> lock(head->mutex);
+    while (count < maxCount && !head->entries.empty() &&
+           accept(head->entries.top())) {
+      entries.emplace_back(
+          std::move(const_cast<QueuedBlocks &>(head->entries.top())));
+      head->entries.pop();
+      numBlocks += entries.back().numBlocks;
+      numBytes += entries.back().getNumBytes();
+      count++;
+    }
+    head->size -= numBlocks;
+  }
+  numBytes_ -= numBytes;
+  size_ -= numBlocks;
+}
+
+void SourceShards::popAll(std::vector<QueuedBlocks> &entries) {
+  for (auto &shard : shards_) {
+    int64_t numBlocks = 0;
+    int64_t numBytes = 0;
+    {
+      std::lock_guard<std::mutex> lock(shard->mutex);
+      while (!shard->entries.empty()) {
+        entries.emplace_back(
+            std::move(const_cast<QueuedBlocks &>(shard->entries.top())));
+        shard->entries.pop();
+        numBlocks += entries.back().numBlocks;
+        numBytes += entries.back().getNumBytes();
+      }
+      shard->size -= numBlocks;
+    }
+    numBytes_ -= numBytes;
+    size_ -= numBlocks;
+  }
+}
+}
+}
@@ -0,0 +1,240 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include "ByteSource.h"
+#include "FileArena.h"
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Entry of the source queue: either consecutive blocks of a file of the
+ * FileArena, only turned into sources when popped, or a source which was
+ * already popped (a retry)
+ */
+struct QueuedBlocks {
+  /// source returned to the queue, null for blocks not yet popped
+  std::unique_ptr<ByteSource> source;
+  /// index of the file in the arena, -1 for a source
+  int64_t file{-1};
+  /// offset of the first block
+  int64_t offset{0};
+  /// size of each block
+  int64_t blockSize{0};
+  /// number of blocks, 1 for a source
+  int64_t numBlocks{1};
+  /// with physical_block_order, where the blocks are on disk: byte address
+  /// of the first block of a run of blocks contiguous on disk, the same for
+  /// all the blocks of the run
+  uint64_t location{0};
+
+  int64_t getFailedAttempts() const {
+    return source ? source->getTransferStats().getFailedAttempts() : 0;
+  }
+
+  int64_t getSize() const {
+    return source ? source->getSize() : blockSize;
+  }
+
+  int64_t getOffset() const {
+    return source ? source->getOffset() : offset;
+  }
+
+  /// @return   total size of the blocks
+  int64_t getNumBytes() const {
+    return numBlocks * getSize();
+  }
+};
+
+/**
+ * Orders queue entries by their first block: first by increasing
+ * failedAttempts, then by decreasing size. If sizes are equal (always for
+ * blocks), sources are ordered by offset. This way, we ensure that all the
+ * threads in the receiver side are not writing to the same file at the same
+ * time. The blocks of an entry all have the same size and follow the first
+ * one, so the blocks are popped in the same order as if each was queued on
+ * its own.
+ * With physicalOrder, entries are instead ordered by increasing location and
+ * then offset, so that blocks are read in the order they are on disk.
+ */
+class SourceComparator {
+ public:
+  /**
+   * @param files           arena of the files of the queued blocks
+   * @param physicalOrder   whether to order by location on disk
+   */
+  explicit SourceComparator(const FileArena *files, bool physicalOrder = false)
+      : files_(files), physicalOrder_(physicalOrder) {
+  }
+
+  bool operator()(const QueuedBlocks &entry1,
+                  const QueuedBlocks &entry2) const {
+    auto retryCount1 = entry1.getFailedAttempts();
+    auto retryCount2 = entry2.getFailedAttempts();
+    if (retryCount1 != retryCount2) {
+      return retryCount1 > retryCount2;
+    }
+    if (physicalOrder_) {
+      if (entry1.location != entry2.location) {
+        return entry1.location > entry2.location;
+      }
+    } else if (entry1.getSize() != entry2.getSize()) {
+      return entry1.getSize() < entry2.getSize();
+    }
+    if (entry1.getOffset() != entry2.getOffset()) {
+      return entry1.getOffset() > entry2.getOffset();
+    }
+    if (!entry1.source && !entry2.source) {
+      return files_->compareRelPaths(entry1.file, entry2.file) > 0;
+    }
+    return getIdentifier(entry1) > getIdentifier(entry2);
+  }
+
+ private:
+  std::string getIdentifier(const QueuedBlocks &entry) const {
+    return entry.source ? entry.source->getIdentifier()
+                        : files_->getRelPath(entry.file);
+  }
+
+  const FileArena *files_;
+  const bool physicalOrder_;
+};
+
+/**
+ * Blocks waiting to be sent, split in priority queues (shards) each
+ * consumer mostly uses alone, so that sender threads don't all contend on
+ * one lock:
+ *  - new entries are spread round robin over the shards
+ *  - a consumer pops the first block of the head of its own shard. Once it
+ *    is empty, it steals a batch of the highest priority blocks of another
+ *    shard, moved to its own shard in one go
+ *  - sources which already failed are kept in a separate retry shard, only
+ *    popped once all the other shards are empty
+ * Failed attempts are thus ordered across shards just like with a single
+ * queue (SourceComparator), size (or location) is only ordered within each
+ * shard: each consumer reads its own runs of contiguous blocks. With one
+ * shard, blocks are popped in exactly the same order as with a single
+ * priority queue. Sizes are counted in blocks. Thread safe.
+ */
+class SourceShards {
+ public:
+  /**
+   * @param numShards       number of consumer shards, at least 1
+   * @param files           arena of the files of the queued blocks
+   * @param physicalOrder   whether blocks are ordered by location on disk,
+   *                        @see SourceComparator
+   */
+  SourceShards(int numShards, const FileArena *files,
+               bool physicalOrder = false);
+
+  /// @return   number of consumer shards
+  int getNumShards() const {
+    return shards_.size() - 1;
+  }
+
+  /// adds entries, entries is emptied
+  void push(std::vector<QueuedBlocks> &entries);
+
+  /// adds an entry
+  void push(QueuedBlocks entry);
+
+  /**
+   * Pops the next block of a consumer
+   *
+   * @param shard   shard of the consumer, any index is accepted
+   * @param block   set to the block, an entry with a single block
+   *
+   * @return        false if all the shards are empty
+   */
+  bool pop(int shard, QueuedBlocks &block);
+
+  /**
+   * Pops entries from the head of a shard (without stealing) as long as
+   * accept returns true for them
+   *
+   * @param shard     shard of the consumer
+   * @param maxCount  max number of entries to pop
+   * @param accept    called with the head of the shard
+   * @param entries   popped entries are appended here
+   */
+  void popWhile(int shard, int64_t maxCount,
+                const std::function<bool(const QueuedBlocks &)> &accept,
+                std::vector<QueuedBlocks> &entries);
+
+  /// pops all the entries, appended to entries
+  void popAll(std::vector<QueuedBlocks> &entries);
+
+  /// @return   whether all the shards are empty
+  bool empty() const {
+    return size_.load() <= 0;
+  }
+
+  /// @return   number of blocks in all the shards
+  int64_t size() const {
+    return size_.load();
+  }
+
+  /// @return   total size of the blocks in all the shards
+  int64_t getNumBytes() const {
+    return numBytes_.load();
+  }
+
+  /// @return   number of batches stolen from other shards
+  int64_t getNumSteals() const {
+    return numSteals_.load();
+  }
+
+ private:
+  /// max number of blocks stolen at once
+  static const int64_t kMaxStealBatch = 32;
+
+  struct Shard {
+    explicit Shard(const SourceComparator &comparator)
+        : entries(comparator) {
+    }
+
+    std::mutex mutex;
+    std::priority_queue<QueuedBlocks, std::vector<QueuedBlocks>,
+                        SourceComparator> entries;
+    /// number of blocks of entries, read without the lock to skip empty
+    /// shards
+    std::atomic<int64_t> size{0};
+  };
+
+  /// removes the first numBlocks blocks of entry, @return them
+  static QueuedBlocks takeBlocks(QueuedBlocks &entry, int64_t numBlocks);
+
+  /// pops the first block of a shard, @return false if it is empty
+  bool popHead(Shard &shard, QueuedBlocks &block);
+
+  /// moves up to half of victim's blocks to thief, block is set to the first
+  /// one. @return false if victim is empty
+  bool steal(Shard &victim, Shard &thief, QueuedBlocks &block);
+
+  /// consumer shards, followed by the retry shard
+  std::vector<std::unique_ptr<Shard>> shards_;
+  /// total number of blocks
+  std::atomic<int64_t> size_{0};
+  /// total size of the blocks
+  std::atomic<int64_t> numBytes_{0};
+  /// shard the next new source is added to
+  std::atomic<uint64_t> nextShard_{0};
+  std::atomic<int64_t> numSteals_{0};
+};
+}
+}
@@ -0,0 +1,77 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include "SourceShards.h"
+#include "ErrorCodes.h"
+#include "Reporting.h"
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <thread>
+
+DEFINE_int32(num_sources, 2000000, "Number of blocks popped per run");
+DEFINE_int32(max_threads, 64, "Max number of consumer threads");
+
+using namespace std;
+using namespace facebook::wdt;
+
+/**
+ * Pops all the blocks with numThreads consumers
+ *
+ * @return   pops per second
+ */
+static double run(int numShards, int numThreads, const FileArena &files) {
+  SourceShards shards(numShards, &files);
+  vector<QueuedBlocks> entries;
+  for (int i = 0; i < FLAGS_num_sources; i++) {
+    // a mix of full blocks and smaller files, as for a real tree
+    entries.emplace_back();
+    entries.back().file = i % files.getNumFiles();
+    entries.back().blockSize =
+        (i % 4 == 0) ? (16 << 20) : (i % 1000) * 1024;
+  }
+  shards.push(entries);
+  atomic<int64_t> numPopped{0};
+  auto startTime = Clock::now();
+  vector<thread> threads;
+  for (int t = 0; t < numThreads; t++) {
+    threads.emplace_back([&shards, &numPopped, t]() {
+      int64_t count = 0;
+      QueuedBlocks block;
+      while (shards.pop(t, block)) {
+        count++;
+      }
+      numPopped += count;
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  const double time = durationSeconds(Clock::now() - startTime);
+  WDT_CHECK_EQ(FLAGS_num_sources, numPopped.load());
+  VLOG(1) << numShards << " shards, " << shards.getNumSteals() << " steals";
+  return numPopped / time;
+}
+
+int main(int argc, char *argv[]) {
+  FLAGS_logtostderr = true;
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  FileArena files("/");
+  for (int i = 0; i < 1000; i++) {
+    const string relPath = "file" + to_string(i);
+    files.addFile("/" + relPath, relPath, 16 << 20, i, 0, NOT_EXISTS, false);
+  }
+  for (int threads = 1; threads <= FLAGS_max_threads; threads *= 2) {
+    const double singleRate = run(1, threads, files);
+    const double shardedRate = run(threads, threads, files);
+    LOG(INFO) << threads << " consumers: single queue " << singleRate / 1e6
+              << " M pops/sec, sharded " << shardedRate / 1e6
+              << " M pops/sec, speedup " << shardedRate / singleRate;
+  }
+  return 0;
+}
@@ -0,0 +1,181 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include "SourceShards.h"
+#include "FileByteSource.h"
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <set>
+#include <thread>
+using namespace std;
+namespace facebook {
+namespace wdt {
+
+class SourceShardsTest : public testing::Test {
+ protected:
+  SourceShardsTest() : files_("/tmp/") {
+  }
+
+  void SetUp() override {
+    metadata_ = make_shared<SourceMetaData>();
+    metadata_->relPath = "retried";
+  }
+
+  /// adds numFiles files of various sizes, with 4 blocks of blockSize and a
+  /// smaller tail block each
+  void addFiles(SourceShards &shards, int numFiles, int64_t blockSize) {
+    vector<QueuedBlocks> entries;
+    for (int i = 0; i < numFiles; i++) {
+      const int64_t tailSize = (i * 7919) % blockSize;
+      const string relPath = "dir" + to_string(i % 10) + "/file" +
+                             to_string(i);
+      const int64_t file =
+          files_.addFile("/tmp/" + relPath, relPath, 4 * blockSize + tailSize,
+                         i, 0, NOT_EXISTS, false);
+      entries.emplace_back();
+      entries.back().file = file;
+      entries.back().blockSize = blockSize;
+      entries.back().numBlocks = 4;
+      if (tailSize > 0) {
+        entries.emplace_back();
+        entries.back().file = file;
+        entries.back().offset = 4 * blockSize;
+        entries.back().blockSize = tailSize;
+      }
+    }
+    shards.push(entries);
+  }
+
+  /// adds numSources sources which already failed
+  void addRetries(SourceShards &shards, int numSources) {
+    vector<QueuedBlocks> entries(numSources);
+    for (int i = 0; i < numSources; i++) {
+      entries[i].source.reset(
+          new FileByteSource(metadata_, (i * 7919) % 1000, i * 1000, 0));
+      TransferStats stats;
+      stats.incrFailedAttempts();
+      entries[i].source->addTransferStats(stats);
+    }
+    shards.push(entries);
+  }
+
+  FileArena files_;
+  shared_ptr<SourceMetaData> metadata_;
+};
+
+TEST_F(SourceShardsTest, SingleShardOrder) {
+  SourceShards shards(1, &files_);
+  addRetries(shards, 100);
+  addFiles(shards, 1000, 1000);
+  int64_t numBlocks = 4000 + 100;
+  for (int i = 0; i < 1000; i++) {
+    numBlocks += ((i * 7919) % 1000) > 0;
+  }
+  EXPECT_EQ(numBlocks, shards.size());
+  SourceComparator comparator(&files_);
+  QueuedBlocks prev, block;
+  ASSERT_TRUE(shards.pop(0, prev));
+  int64_t numPopped = 1;
+  while (shards.pop(0, block)) {
+    EXPECT_EQ(1, block.numBlocks);
+    // prev is not lower priority than block
+    EXPECT_FALSE(comparator(prev, block));
+    prev = move(block);
+    numPopped++;
+  }
+  EXPECT_EQ(numBlocks, numPopped);
+  EXPECT_TRUE(shards.empty());
+}
+
+TEST_F(SourceShardsTest, PhysicalOrder) {
+  SourceShards shards(1, &files_, true);
+  addRetries(shards, 10);
+  // runs of 4 blocks, the later files first on disk
+  const int64_t blockSize = 1000;
+  vector<QueuedBlocks> entries;
+  for (int i = 0; i < 100; i++) {
+    const string relPath = "file" + to_string(i);
+    const int64_t file = files_.addFile("/tmp/" + relPath, relPath,
+                                        4 * blockSize, i, 0, NOT_EXISTS,
+                                        false);
+    entries.emplace_back();
+    entries.back().file = file;
+    entries.back().blockSize = blockSize;
+    entries.back().numBlocks = 4;
+    entries.back().location = (100 - i) * 4 * blockSize;
+  }
+  shards.push(entries);
+  QueuedBlocks block;
+  uint64_t prevLocation = 0;
+  for (int i = 0; i < 400; i++) {
+    ASSERT_TRUE(shards.pop(0, block));
+    EXPECT_TRUE(block.source == nullptr);
+    const uint64_t location = block.location + block.offset % (4 * blockSize);
+    EXPECT_LT(prevLocation, location);
+    prevLocation = location;
+  }
+  // the retries last
+  for (int i = 0; i < 10; i++) {
+    ASSERT_TRUE(shards.pop(0, block));
+    EXPECT_TRUE(block.source != nullptr);
+  }
+  EXPECT_TRUE(shards.empty());
+}
+
+TEST_F(SourceShardsTest, ConcurrentConsumers) {
+  const int numThreads = 8;
+  SourceShards shards(numThreads, &files_);
+  addRetries(shards, 50);
+  addFiles(shards, 2000, 1000);
+  const int64_t numBlocks = shards.size();
+  vector<vector<QueuedBlocks>> popped(numThreads);
+  vector<thread> threads;
+  for (int t = 0; t < numThreads; t++) {
+    threads.emplace_back([&, t]() {
+      // consumers start at different times, stealing from each other
+      QueuedBlocks block;
+      while (shards.pop(t, block)) {
+        popped[t].emplace_back(move(block));
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  set<pair<int64_t, int64_t>> blocks;
+  int64_t numPopped = 0;
+  for (const auto &consumerBlocks : popped) {
+    int numRetries = 0;
+    for (const auto &block : consumerBlocks) {
+      EXPECT_EQ(1, block.numBlocks);
+      blocks.emplace(block.file, block.getOffset());
+      if (block.getFailedAttempts() > 0) {
+        numRetries++;
+      } else {
+        // retries only come once all the new blocks are popped
+        EXPECT_EQ(0, numRetries);
+      }
+    }
+    numPopped += consumerBlocks.size();
+  }
+  EXPECT_EQ(numBlocks, numPopped);
+  EXPECT_EQ(numBlocks, blocks.size());
+  EXPECT_TRUE(shards.empty());
+}
+}
+}
+
+int main(int argc, char *argv[]) {
+  FLAGS_logtostderr = true;
+  testing::InitGoogleTest(&argc, argv);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  int ret = RUN_ALL_TESTS();
+  return ret;
+}
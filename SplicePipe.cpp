@@ -0,0 +1,192 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include "SplicePipe.h"
+#include <wdt/WdtConfig.h>
+#include "Reporting.h"
+#include "SocketUtils.h"
+#include "WdtOptions.h"
+
+#include <folly/Checksum.h>
+#include <glog/logging.h>
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace facebook {
+namespace wdt {
+
+#ifdef HAS_SPLICE
+
+SplicePipe::SplicePipe(int64_t bufferSize,
+                       WdtBase::IAbortChecker const *abortChecker)
+    : abortChecker_(abortChecker) {
+  pipeFds_[0] = pipeFds_[1] = -1;
+  checksumPipeFds_[0] = checksumPipeFds_[1] = -1;
+  if (pipe2(pipeFds_, O_CLOEXEC) != 0) {
+    PLOG(ERROR) << "Unable to create splice pipe";
+    pipeFds_[0] = pipeFds_[1] = -1;
+    return;
+  }
+  if (pipe2(checksumPipeFds_, O_CLOEXEC) != 0) {
+    PLOG(ERROR) << "Unable to create checksum pipe";
+    checksumPipeFds_[0] = checksumPipeFds_[1] = -1;
+    closePipes();
+    return;
+  }
+  // bigger pipes mean fewer system calls. May be capped by
+  // /proc/sys/fs/pipe-max-size, the default size is used then
+  for (int fd : {pipeFds_[1], checksumPipeFds_[1]}) {
+    if (fcntl(fd, F_SETPIPE_SZ, (int)bufferSize) < 0) {
+      PLOG(WARNING) << "Unable to set pipe size to " << bufferSize;
+    }
+  }
+  pipeSize_ = std::min(fcntl(pipeFds_[1], F_GETPIPE_SZ),
+                       fcntl(checksumPipeFds_[1], F_GETPIPE_SZ));
+  if (pipeSize_ <= 0) {
+    PLOG(ERROR) << "Unable to get pipe size";
+    closePipes();
+    return;
+  }
+  VLOG(1) << "Splice pipe size " << pipeSize_;
+}
+
+SplicePipe::~SplicePipe() {
+  closePipes();
+}
+
+void SplicePipe::closePipes() {
+  for (int *fds : {pipeFds_, checksumPipeFds_}) {
+    for (int i = 0; i < 2; i++) {
+      if (fds[i] >= 0) {
+        ::close(fds[i]);
+        fds[i] = -1;
+      }
+    }
+  }
+}
+
+ErrorCode SplicePipe::receiveToFile(int socketFd, int fileFd, int64_t offset,
+                                    int64_t nbyte, int32_t *checksum,
+                                    int64_t &written) {
+  WDT_CHECK(isValid());
+  written = 0;
+  while (written < nbyte) {
+    // the pipe is empty here, fill it at most once
+    const int64_t toMove = std::min(pipeSize_, nbyte - written);
+    const int64_t numMoved = SocketUtils::spliceWithAbortCheck(
+        socketFd, pipeFds_[1], toMove, abortChecker_);
+    if (numMoved <= 0) {
+      LOG(ERROR) << "splice from socket failed " << socketFd << " "
+                 << numMoved << " " << toMove;
+      return SOCKET_READ_ERROR;
+    }
+    if (checksum != nullptr && !checksumPipe(numMoved, *checksum)) {
+      closePipes();
+      // not a problem of the destination, the block can be resent
+      return SOCKET_READ_ERROR;
+    }
+    if (!drainToFile(fileFd, offset + written, numMoved)) {
+      closePipes();
+      return FILE_WRITE_ERROR;
+    }
+    written += numMoved;
+  }
+  return OK;
+}
+
+bool SplicePipe::checksumPipe(int64_t size, int32_t &checksum) {
+  if (!checksumBuf_) {
+    checksumBuf_.reset(new char[pipeSize_]);
+  }
+  // tee does not consume the data pipe, so a partial tee could not be
+  // continued. The checksum pipe is empty and as big, everything fits at once
+  int64_t teed;
+  do {
+    teed = tee(pipeFds_[0], checksumPipeFds_[1], size, 0);
+  } while (teed < 0 && errno == EINTR);
+  if (teed != size) {
+    PLOG(ERROR) << "tee failed " << teed << " " << size;
+    return false;
+  }
+  int64_t numRead = 0;
+  while (numRead < size) {
+    int64_t ret =
+        ::read(checksumPipeFds_[0], checksumBuf_.get() + numRead,
+               size - numRead);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      PLOG(ERROR) << "read of checksum pipe failed " << ret << " " << size;
+      return false;
+    }
+    numRead += ret;
+  }
+  checksum =
+      folly::crc32c((const uint8_t *)checksumBuf_.get(), size, checksum);
+  return true;
+}
+
+bool SplicePipe::drainToFile(int fileFd, int64_t offset, int64_t size) {
+  int64_t drained = 0;
+  while (drained < size) {
+    loff_t off = offset + drained;
+    START_PERF_TIMER
+    int64_t ret = splice(pipeFds_[0], nullptr, fileFd, &off, size - drained,
+                         SPLICE_F_MOVE);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      PLOG(ERROR) << "splice to file failed " << fileFd << " " << ret << " "
+                  << drained << " " << size;
+      return false;
+    }
+    RECORD_PERF_RESULT_BYTES(PerfStatReport::FILE_SPLICE, ret)
+    drained += ret;
+  }
+  return true;
+}
+
+#else
+
+SplicePipe::SplicePipe(int64_t /* unused */,
+                       WdtBase::IAbortChecker const *abortChecker)
+    : abortChecker_(abortChecker) {
+  pipeFds_[0] = pipeFds_[1] = -1;
+  checksumPipeFds_[0] = checksumPipeFds_[1] = -1;
+  LOG(ERROR) << "splice is not supported on this platform";
+}
+
+SplicePipe::~SplicePipe() {
+}
+
+void SplicePipe::closePipes() {
+}
+
+ErrorCode SplicePipe::receiveToFile(int /* unused */, int /* unused */,
+                                    int64_t /* unused */, int64_t /* unused */,
+                                    int32_t * /* unused */, int64_t &written) {
+  written = 0;
+  return ERROR;
+}
+
+bool SplicePipe::checksumPipe(int64_t /* unused */, int32_t & /* unused */) {
+  return false;
+}
+
+bool SplicePipe::drainToFile(int /* unused */, int64_t /* unused */,
+                             int64_t /* unused */) {
+  return false;
+}
+
+#endif
+}
+}
@@ -0,0 +1,91 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include "ErrorCodes.h"
+#include "WdtBase.h"
+
+#include <memory>
+#include <stdint.h>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Moves received data from a socket to files with splice(2), going through a
+ * pipe: socket -> pipe -> file. The data is not copied to user space, except
+ * when it has to be checksummed: then the pipe is tee'd into a second pipe
+ * which is read, saving the copy back to the kernel done by write().
+ * The pipes are reused for every connection.
+ *
+ * Not thread safe, an instance must be used by a single thread.
+ */
+class SplicePipe {
+ public:
+  /**
+   * Creates the pipes. Use isValid() to find out whether it succeeded.
+   *
+   * @param bufferSize      size requested for the pipes, also the most data
+   *                        moved per splice call
+   * @param abortChecker    abort checker, polled while waiting for data
+   */
+  SplicePipe(int64_t bufferSize, WdtBase::IAbortChecker const *abortChecker);
+
+  ~SplicePipe();
+
+  /// @return     whether splice is supported and the pipes are usable
+  bool isValid() const {
+    return pipeFds_[0] >= 0;
+  }
+
+  /**
+   * Receives nbyte bytes from socketFd and writes them in fileFd starting at
+   * offset. The pipes are closed (and the instance becomes invalid) if data
+   * could not be drained from them.
+   *
+   * @param checksum    if not null, crc32c of received data is accumulated
+   *                    here
+   * @param written     set to number of bytes received and written
+   *
+   * @return            OK, SOCKET_READ_ERROR or FILE_WRITE_ERROR
+   */
+  ErrorCode receiveToFile(int socketFd, int fileFd, int64_t offset,
+                          int64_t nbyte, int32_t *checksum, int64_t &written);
+
+ private:
+  /**
+   * tees size bytes of the data pipe into the checksum pipe, reads them and
+   * accumulates their crc32c in checksum
+   *
+   * @return      whether the data could be checksummed
+   */
+  bool checksumPipe(int64_t size, int32_t &checksum);
+
+  /**
+   * splices size bytes from the data pipe to fileFd at offset
+   *
+   * @return      whether all the bytes could be written
+   */
+  bool drainToFile(int fileFd, int64_t offset, int64_t size);
+
+  /// closes the pipes
+  void closePipes();
+
+  /// data pipe, read end first
+  int pipeFds_[2];
+  /// pipe the data is tee'd into for checksumming, read end first
+  int checksumPipeFds_[2];
+  /// capacity of the pipes
+  int64_t pipeSize_{0};
+  /// buffer the checksum pipe is read in, allocated when first needed
+  std::unique_ptr<char[]> checksumBuf_;
+  WdtBase::IAbortChecker const *abortChecker_;
+};
+}
+}
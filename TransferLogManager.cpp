@@ -70,6 +70,14 @@ bool TransferLogManager::openAndStartWriter(const std::string &curSenderIp) {
   if (fd_ < 0) {
     return false;
   } else {
+    finished_ = false;
+    writerStopped_ = false;
+    if (options.durability_commit_interval_ms > 0) {
+      stopSyncThreads_ = false;
+      for (int i = 1; i < kMaxParallelSyncs; i++) {
+        syncThreads_.emplace_back(&TransferLogManager::syncFilesLoop, this);
+      }
+    }
     writerThread_ =
         std::move(std::thread(&TransferLogManager::writeEntriesToDisk, this));
     LOG(INFO) << "Log writer thread started " << fd_;
@@ -146,8 +154,11 @@ void TransferLogManager::addFileCreationEntry(const std::string &fileName,
 }
 
 void TransferLogManager::addBlockWriteEntry(int64_t seqId, int64_t offset,
-                                            int64_t blockSize) {
+                                            int64_t blockSize, int syncFd) {
   if (!loggingEnabled_ || fd_ < 0) {
+    if (syncFd >= 0) {
+      ::close(syncFd);
+    }
     return;
   }
   VLOG(1) << "Adding block entry to log " << seqId << " " << offset << " "
@@ -163,8 +174,32 @@ void TransferLogManager::addBlockWriteEntry(int64_t seqId, int64_t offset,
   encodeInt(ptr, size, blockSize);
 
   folly::storeUnaligned<int16_t>(buf, size);
-  std::lock_guard<std::mutex> lock(mutex_);
-  entries_.emplace_back(buf, size + sizeof(int16_t));
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (syncFd < 0) {
+    entries_.emplace_back(buf, size + sizeof(int16_t));
+    return;
+  }
+  if (writerStopped_) {
+    lock.unlock();
+    ::close(syncFd);
+    return;
+  }
+  pendingBlockEntries_.emplace_back(seqId,
+                                    std::string(buf, size + sizeof(int16_t)));
+  // one sync per file. The descriptor kept is the oldest one, which also
+  // reports the write errors of the later blocks
+  if (!pendingSyncFds_.insert(std::make_pair(seqId, syncFd)).second) {
+    lock.unlock();
+    ::close(syncFd);
+    return;
+  }
+  if (pendingSyncFds_.size() >= kMaxPendingSyncFds) {
+    VLOG(1) << "Too many files waiting for a group commit, committing early";
+    conditionFinished_.notify_all();
+    conditionCommitted_.wait(lock, [this] {
+      return pendingSyncFds_.size() < kMaxPendingSyncFds || writerStopped_;
+    });
+  }
 }
 
 void TransferLogManager::addInvalidationEntry(int64_t seqId) {
@@ -203,7 +238,7 @@ bool TransferLogManager::unlink() {
 }
 
 bool TransferLogManager::closeAndStopWriter() {
-  if (fd_ < 0) {
+  if (!writerThread_.joinable()) {
     return false;
   }
   {
@@ -212,7 +247,14 @@ bool TransferLogManager::closeAndStopWriter() {
     conditionFinished_.notify_all();
   }
   writerThread_.join();
+  stopSyncThreads();
+  if (fd_ < 0) {
+    // the writer thread stopped after a log write error
+    entries_.clear();
+    return false;
+  }
   WDT_CHECK(entries_.empty());
+  WDT_CHECK(pendingSyncFds_.empty());
   if (!close()) {
     return false;
   }
@@ -223,25 +265,57 @@ void TransferLogManager::writeEntriesToDisk() {
   WDT_CHECK(fd_ >= 0) << "Writer thread started before the log is opened";
   auto &options = WdtOptions::get();
   WDT_CHECK(options.transfer_log_write_interval_ms >= 0);
-  auto waitingTime =
-      std::chrono::milliseconds(options.transfer_log_write_interval_ms);
+  WDT_CHECK(options.durability_commit_interval_ms >= 0);
+  // with group commit, the log is written at every commit
+  auto waitingTime = std::chrono::milliseconds(
+      options.durability_commit_interval_ms > 0
+          ? options.durability_commit_interval_ms
+          : options.transfer_log_write_interval_ms);
+  auto pendingGuard = folly::makeGuard([this] {
+    // blocks added after a log write error are never logged
+    std::lock_guard<std::mutex> lock(mutex_);
+    writerStopped_ = true;
+    for (const auto &pending : pendingSyncFds_) {
+      ::close(pending.second);
+    }
+    pendingSyncFds_.clear();
+    pendingBlockEntries_.clear();
+    conditionCommitted_.notify_all();
+  });
   std::vector<std::string> entries;
+  std::vector<std::pair<int64_t, std::string>> blockEntries;
+  std::unordered_map<int64_t, int> syncFds;
   bool finished = false;
   while (!finished) {
     {
       std::unique_lock<std::mutex> lock(mutex_);
-      conditionFinished_.wait_for(lock, waitingTime);
+      conditionFinished_.wait_for(lock, waitingTime, [this] {
+        return finished_ || pendingSyncFds_.size() >= kMaxPendingSyncFds;
+      });
       finished = finished_;
       // make a copy of all the entries so that we do not need to hold lock
       // during writing
       entries = entries_;
       entries_.clear();
+      blockEntries.clear();
+      blockEntries.swap(pendingBlockEntries_);
+      syncFds.clear();
+      syncFds.swap(pendingSyncFds_);
+      conditionCommitted_.notify_all();
     }
     std::string buffer;
     // write entries to disk
     for (const auto &entry : entries) {
       buffer.append(entry);
     }
+    // group commit: blocks are logged once their file is durable, after the
+    // other entries (file creations) which were added before them
+    const std::unordered_set<int64_t> synced = syncFiles(syncFds);
+    for (const auto &blockEntry : blockEntries) {
+      if (synced.find(blockEntry.first) != synced.end()) {
+        buffer.append(blockEntry.second);
+      }
+    }
     int toWrite = buffer.size();
     int written = ::write(fd_, buffer.c_str(), toWrite);
     if (written != toWrite) {
@@ -250,7 +324,94 @@ void TransferLogManager::writeEntriesToDisk() {
       close();
       return;
     }
+    if (!blockEntries.empty() && fdatasync(fd_) != 0) {
+      PLOG(ERROR) << "fdatasync failed for transfer log";
+      close();
+      return;
+    }
+  }
+}
+
+std::unordered_set<int64_t> TransferLogManager::syncFiles(
+    const std::unordered_map<int64_t, int> &syncFds) {
+  std::unordered_set<int64_t> synced;
+  if (syncFds.empty()) {
+    return synced;
+  }
+  std::vector<int64_t> seqIds;
+  std::unique_lock<std::mutex> lock(syncMutex_);
+  WDT_CHECK(syncBatch_.empty());
+  for (const auto &syncFd : syncFds) {
+    seqIds.push_back(syncFd.first);
+    syncBatch_.push_back(syncFd.second);
+  }
+  syncResults_.assign(syncBatch_.size(), false);
+  nextSync_ = 0;
+  numSynced_ = 0;
+  syncCondition_.notify_all();
+  // the writer thread syncs too
+  while (syncNextFile(lock)) {
+  }
+  syncDoneCondition_.wait(lock,
+                          [this] { return numSynced_ == syncBatch_.size(); });
+  for (size_t i = 0; i < seqIds.size(); i++) {
+    if (syncResults_[i]) {
+      synced.insert(seqIds[i]);
+    }
+  }
+  syncBatch_.clear();
+  return synced;
+}
+
+bool TransferLogManager::syncNextFile(std::unique_lock<std::mutex> &lock) {
+  if (nextSync_ >= syncBatch_.size()) {
+    return false;
+  }
+  const size_t index = nextSync_++;
+  const int fd = syncBatch_[index];
+  lock.unlock();
+#ifdef __APPLE__
+  bool success = (fsync(fd) == 0);
+#else
+  bool success = (fdatasync(fd) == 0);
+#endif
+  if (!success) {
+    PLOG(ERROR) << "sync failed for fd " << fd << ", blocks not logged";
+  }
+  if (::close(fd) != 0) {
+    PLOG(ERROR) << "Unable to close fd " << fd;
+  }
+  lock.lock();
+  syncResults_[index] = success;
+  if (++numSynced_ == syncBatch_.size()) {
+    syncDoneCondition_.notify_all();
+  }
+  return true;
+}
+
+void TransferLogManager::syncFilesLoop() {
+  std::unique_lock<std::mutex> lock(syncMutex_);
+  while (true) {
+    syncCondition_.wait(lock, [this] {
+      return stopSyncThreads_ || nextSync_ < syncBatch_.size();
+    });
+    if (!syncNextFile(lock)) {
+      // nothing left to sync, so stopping
+      break;
+    }
+  }
+}
+
+void TransferLogManager::stopSyncThreads() {
+  {
+    std::lock_guard<std::mutex> lock(syncMutex_);
+    stopSyncThreads_ = true;
+    syncCondition_.notify_all();
+  }
+  for (auto &syncThread : syncThreads_) {
+    syncThread.join();
   }
+  syncThreads_.clear();
 }
 
 bool TransferLogManager::parseLogHeader(char *buf, int16_t entrySize,
@@ -12,6 +12,9 @@
 
 #include <string>
 #include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 #include <condition_variable>
 #include <mutex>
 #include <thread>
@@ -60,8 +63,13 @@ class TransferLogManager {
    * @param seqId     seq-id of the file
    * @param offset    block offset
    * @param blockSize size of the block
+   * @param syncFd    if not -1, file descriptor of the block not synced yet
+   *                  (group commit), the entry is only written once the file
+   *                  is synced. Ownership is taken. Waits for an early commit
+   *                  if too many files are pending
    */
-  void addBlockWriteEntry(int64_t seqId, int64_t offset, int64_t blockSize);
+  void addBlockWriteEntry(int64_t seqId, int64_t offset, int64_t blockSize,
+                          int syncFd = -1);
 
   /**
    * Adds an invalidation entry to the log buffer
@@ -117,6 +125,14 @@ class TransferLogManager {
   /// 2 bytes for entry size, 1 byte for entry-type, PATH_MAX for file-name, 10
   /// bytes for seq-id, 10 bytes for file-size, 10 bytes for timestamp
   static const int64_t kMaxEntryLength = 2 + 1 + 10 + PATH_MAX + 2 * 10;
+  /// maximum number of threads syncing the files of a group commit,
+  /// including the writer thread
+  static const int kMaxParallelSyncs = 8;
+  /// maximum number of files waiting for a group commit. Their descriptors
+  /// are kept open till then (up to twice as many while the previous commit
+  /// syncs), the commit is done early when reached so that the receiver
+  /// stays well below the usual limit of 1024 open files
+  static const size_t kMaxPendingSyncFds = 128;
   enum EntryType {
     HEADER,             // log header
     FILE_CREATION,      // File created and space allocated
@@ -152,6 +168,33 @@ class TransferLogManager {
    */
   void writeEntriesToDisk();
 
+  /**
+   * syncs the files of a group commit in parallel with the sync threads, and
+   * closes their file descriptors
+   *
+   * @param syncFds   file descriptors of the files, by seq-id
+   *
+   * @return          seq-ids of the files which could be synced
+   */
+  std::unordered_set<int64_t> syncFiles(
+      const std::unordered_map<int64_t, int> &syncFds);
+
+  /**
+   * syncs and closes the next file of the batch of syncFiles(), if any
+   *
+   * @param lock      lock of syncMutex_, held. Released during the sync
+   *
+   * @return          false if there was no file left to sync
+   */
+  bool syncNextFile(std::unique_lock<std::mutex> &lock);
+
+  /// entry point of the sync threads, helping the writer thread with the
+  /// syncs of group commits
+  void syncFilesLoop();
+
+  /// stops and joins the sync threads
+  void stopSyncThreads();
+
   /**
    * Enocodes invalidation entry
    *
@@ -220,6 +263,14 @@ class TransferLogManager {
   bool loggingEnabled_{false};
   /// Entry buffer
   std::vector<std::string> entries_;
+  /// Block write entries waiting for the sync of their file (group commit),
+  /// with the seq-id of the file
+  std::vector<std::pair<int64_t, std::string>> pendingBlockEntries_;
+  /// File descriptors to sync before writing pendingBlockEntries_, one per
+  /// file, by seq-id
+  std::unordered_map<int64_t, int> pendingSyncFds_;
+  /// set when the writer thread exits, no entry is written anymore
+  bool writerStopped_{false};
   /// Parsed log entries
   std::vector<FileChunksInfo> parsedFileChunksInfo_;
   /// Flag to signal end to the writer thread
@@ -228,6 +279,27 @@ class TransferLogManager {
   std::thread writerThread_;
   std::mutex mutex_;
   std::condition_variable conditionFinished_;
+  /// signaled when the pending files are taken by a group commit
+  std::condition_variable conditionCommitted_;
+
+  /// Threads syncing files of group commits
+  std::vector<std::thread> syncThreads_;
+  /// file descriptors of the files of the group commit being synced
+  std::vector<int> syncBatch_;
+  /// whether each file of syncBatch_ could be synced
+  std::vector<char> syncResults_;
+  /// index in syncBatch_ of the next file to sync
+  size_t nextSync_{0};
+  /// number of files of syncBatch_ synced (or not) and closed
+  size_t numSynced_{0};
+  /// flag to signal end to the sync threads
+  bool stopSyncThreads_{false};
+  /// protects the sync batch
+  std::mutex syncMutex_;
+  /// signaled when files are added to syncBatch_, or to stop
+  std::condition_variable syncCondition_;
+  /// signaled when all the files of syncBatch_ are synced
+  std::condition_variable syncDoneCondition_;
 };
 }
 }
@@ -0,0 +1,128 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include "TransferLogManager.h"
+#include "WdtOptions.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <thread>
+#include <unistd.h>
+using namespace std;
+namespace facebook {
+namespace wdt {
+
+/// @return   number of file descriptors open in the process
+static int getNumOpenFds() {
+  DIR *dir = opendir("/proc/self/fd");
+  if (dir == nullptr) {
+    return -1;
+  }
+  int numFds = 0;
+  while (readdir(dir) != nullptr) {
+    numFds++;
+  }
+  closedir(dir);
+  // ., .. and the fd of dir
+  return numFds - 3;
+}
+
+class TransferLogManagerTest : public testing::Test {
+ protected:
+  void SetUp() override {
+    char dirTemplate[] = "/tmp/wdtLogTestXXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dirTemplate));
+    rootDir_ = dirTemplate;
+    auto &options = WdtOptions::getMutable();
+    options.enable_download_resumption = true;
+  }
+
+  void TearDown() override {
+    auto &options = WdtOptions::getMutable();
+    options.enable_download_resumption = false;
+    options.durability_commit_interval_ms = 0;
+    string cmd = "rm -rf " + rootDir_;
+    EXPECT_EQ(0, system(cmd.c_str()));
+  }
+
+  string rootDir_;
+};
+
+TEST_F(TransferLogManagerTest, GroupCommit) {
+  auto &options = WdtOptions::getMutable();
+  // long enough for the commits to be forced by the number of files
+  options.durability_commit_interval_ms = 10000;
+  const int kNumThreads = 4;
+  const int kNumFilesPerThread = 400;
+  const int kNumBlocksPerFile = 3;
+  const int numFdsBefore = getNumOpenFds();
+
+  TransferLogManager logManager;
+  logManager.setRootDir(rootDir_);
+  logManager.parseAndMatch("recoveryId");
+  ASSERT_TRUE(logManager.openAndStartWriter("1.2.3.4"));
+  logManager.enableLogging();
+  logManager.addLogHeader();
+  int maxOpenFds = 0;
+  vector<thread> threads;
+  for (int t = 0; t < kNumThreads; t++) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < kNumFilesPerThread; i++) {
+        const int64_t seqId = t * kNumFilesPerThread + i;
+        const string name = "file" + to_string(seqId);
+        const string path = rootDir_ + "/" + name;
+        int fd = ::open(path.c_str(), O_CREAT | O_WRONLY, 0644);
+        ASSERT_GE(fd, 0);
+        logManager.addFileCreationEntry(name, seqId, kNumBlocksPerFile);
+        for (int block = 0; block < kNumBlocksPerFile; block++) {
+          ASSERT_EQ(1, pwrite(fd, "x", 1, block));
+          // what FileWriter hands over for every completed block
+          int syncFd = dup(fd);
+          ASSERT_GE(syncFd, 0);
+          logManager.addBlockWriteEntry(seqId, block, 1, syncFd);
+        }
+        ::close(fd);
+        if (t == 0) {
+          maxOpenFds = max(maxOpenFds, getNumOpenFds() - numFdsBefore);
+        }
+      }
+    });
+  }
+  for (auto &t : threads) {
+    t.join();
+  }
+  ASSERT_TRUE(logManager.closeAndStopWriter());
+  // the files waiting for a commit are bounded, not the number of blocks
+  EXPECT_LT(maxOpenFds, 300);
+  EXPECT_EQ(numFdsBefore, getNumOpenFds());
+
+  // every block is in the log
+  TransferLogManager parser;
+  parser.setRootDir(rootDir_);
+  ASSERT_TRUE(parser.parseAndMatch("recoveryId"));
+  const auto &parsedInfo = parser.getParsedFileChunksInfo();
+  EXPECT_EQ(kNumThreads * kNumFilesPerThread, (int)parsedInfo.size());
+  for (const auto &fileInfo : parsedInfo) {
+    ASSERT_EQ(1, (int)fileInfo.getChunks().size()) << fileInfo.getFileName();
+    EXPECT_EQ(Interval(0, kNumBlocksPerFile), fileInfo.getChunks()[0]);
+  }
+}
+}
+}
+
+int main(int argc, char *argv[]) {
+  FLAGS_logtostderr = true;
+  testing::InitGoogleTest(&argc, argv);
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  int ret = RUN_ALL_TESTS();
+  return ret;
+}
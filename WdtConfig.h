@@ -5,12 +5,21 @@
 #pragma once
 
 #define WDT_VERSION_MAJOR 1
-#define WDT_VERSION_MINOR 15
+#define WDT_VERSION_MINOR 22
 #define WDT_VERSION_BUILD 1507290
 // Add -fbcode to version str
-#define WDT_VERSION_STR "1.15.1507290-fbcode"
+#define WDT_VERSION_STR "1.22.1507290-fbcode"
 // Tie minor and proto version
 #define WDT_PROTOCOL_VERSION WDT_VERSION_MINOR
 
 #define HAS_POSIX_FALLOCATE 1
 #define HAS_SYNC_FILE_RANGE 1
+#define HAS_POSIX_FADVISE 1
+#define HAS_SENDFILE 1
+#define HAS_IO_URING 1
+#define HAS_SEEK_DATA 1
+#define HAS_INOTIFY 1
+#define HAS_FIEMAP 1
+#define HAS_SPLICE 1
+#define HAS_ZLIB 1
+#define HAS_LZ4 1
@@ -60,6 +60,12 @@ class WdtOptions {
    */
   bool follow_symlinks{false};
 
+  /**
+   * Number of threads listing directories during discovery. Files are still
+   * added to the queue in the same order as with one thread
+   */
+  int32_t num_discovery_threads{4};
+
   /**
    * Starting start_port for wdt. Number of ports allocated
    * are contiguous sequence starting of numSockets
@@ -233,6 +239,216 @@ class WdtOptions {
    */
   bool disable_sender_verfication_during_resumption{false};
 
+  /**
+   * If true, sender avoids copying file data through user space buffers.
+   * Blocks are sent using sendfile(2). With checksums, the data is also read
+   * with pread to be checksummed, it is not written from user space.
+   */
+  bool enable_zero_copy_send{false};
+
+  /**
+   * Number of buffers (of buffer_size each) read ahead by a background
+   * reader thread for every sender thread, overlapping disk reads with
+   * network writes. 0 disables read ahead. Ignored for zero copy send
+   */
+  int read_ahead_buffers{0};
+
+  /**
+   * If true, data is moved between files and sockets by an io_uring based
+   * engine: linked read->send (sender) and recv->write (receiver) chains are
+   * submitted in batches. Regular system calls are used if io_uring is not
+   * available
+   */
+  bool enable_io_uring{false};
+
+  /**
+   * Number of buffers (of buffer_size each) submitted per io_uring batch
+   */
+  int io_uring_batch_buffers{4};
+
+  /**
+   * If true, file data is read (sender) and written (receiver) with O_DIRECT,
+   * bypassing the page cache. Only blocks starting at a 4KB aligned offset
+   * use it, the unaligned tail of a block goes through the page cache. Blocks
+   * read with O_DIRECT do not use zero copy send, read ahead or io_uring
+   */
+  bool enable_direct_io{false};
+
+  /**
+   * If true, WDT keeps the files it transfers out of the page cache, a
+   * lighter alternative to enable_direct_io. The sender hints sequential
+   * access and read ahead for every block and drops the block from the cache
+   * once sent (note that this also drops pages which were cached before the
+   * transfer). The receiver waits for the writeback of data behind the write
+   * cursor and drops it, every disk_sync_interval_mb
+   */
+  bool drop_page_cache{false};
+
+  /**
+   * Files smaller than this (in KB) are sent in bundles: many complete files
+   * with a single header and footer in one BUNDLE_CMD. A bundle holds at most
+   * buffer_size bytes of data. 0 disables bundling
+   */
+  int small_file_bundle_kbytes{0};
+
+  /**
+   * Codec used to compress the data of blocks: lz4 or zlib. Empty (default)
+   * disables compression. Only used by the sender, the receiver follows
+   */
+  std::string compression{""};
+
+  /**
+   * If true, the first chunk compressed for each file is used as a sample
+   * and files which don't compress well are sent uncompressed
+   */
+  bool adaptive_compression{true};
+
+  /**
+   * If true, files which already exist on the receiver are sent as deltas:
+   * the receiver sends signatures of the blocks of its copy and only the
+   * data not found in it is sent. The receiver only signs the files
+   * discovered before sending starts (all of them unless the queue is
+   * bounded). Only used by the sender
+   */
+  bool enable_delta_transfer{false};
+
+  /**
+   * Size of the blocks (in KB) the receiver computes signatures of for delta
+   * transfers. Smaller blocks find more matches but cost more signatures
+   */
+  int delta_block_size_kbytes{64};
+
+  /**
+   * If true, only the data extents of sparse files are sent and the receiver
+   * leaves the holes unallocated. Receivers older than protocol version 20
+   * get the holes as zeros, like without this option. Only used by the
+   * sender
+   */
+  bool enable_sparse_files{false};
+
+  /**
+   * If true, the queue of blocks to send is split in one shard per port:
+   * each sender thread pops from its own shard and steals batches from the
+   * others once it is empty, instead of all of them contending on one lock.
+   * Larger blocks are then only sent first within each shard
+   */
+  bool shard_source_queue{false};
+
+  /**
+   * If > 0, discovery waits while this many blocks are queued for sending,
+   * and the discovery threads stop listing directories while as many listed
+   * files are waiting to be queued. Not supported with two_phases
+   */
+  int64_t max_queued_blocks{0};
+
+  /// If > 0, discovery waits while this many MB of blocks are queued
+  int64_t max_queued_mbytes{0};
+
+  /**
+   * If set, path of the manifest of the files sent by the previous transfer
+   * of the same directory to the same destination (host, and directory when
+   * a connection url is used). Files which did not change since (same size,
+   * mtime and inode) are not sent, and the manifest is replaced once all the
+   * discovered files are sent. A manifest written for another destination is
+   * ignored
+   */
+  std::string discovery_manifest{""};
+
+  /**
+   * If true, directories whose mtime and inode are the same as in the
+   * discovery_manifest are not listed again, their files are assumed
+   * unchanged without being stat'ed. Files modified in place are then not
+   * sent. Not used with follow_symlinks
+   */
+  bool manifest_trust_dir_mtime{false};
+
+  /**
+   * If true, the sender keeps watching the directory after discovery (with
+   * inotify) and sends the files written or renamed into it, and what was
+   * appended to them, over the same connections till the
+   * transfer is stopped or aborted. Files are expected to only be appended
+   * to or replaced. Not used with a file list or two_phases
+   */
+  bool continuous_sync{false};
+
+  /**
+   * With continuous_sync, what is appended to a file still open for writing
+   * is sent this long after its first unsent write, instead of once the file
+   * is closed. 0 to only send files once closed
+   */
+  int32_t sync_modified_files_millis{1000};
+
+  /**
+   * If true, blocks are sent in the order they are on disk (FIEMAP, or inode
+   * order when the extents can't be mapped) instead of largest first, and
+   * each sender thread gets runs of blocks contiguous on disk. Avoids seeks
+   * on hard drives, at the cost of an open and ioctl per file during
+   * discovery
+   */
+  bool physical_block_order{false};
+
+  /**
+   * If true, once discovery is over and few bytes are left in the queue,
+   * blocks are split so that each sender thread gets a share of the bytes
+   * left proportional to its throughput, instead of one thread sending a
+   * whole last block while the others are idle
+   */
+  bool split_tail_blocks{false};
+
+  /**
+   * If true, once the queue is empty, an idle sender thread sends a copy of
+   * a block a slower thread is still sending. The copy which gets to its
+   * last chunk first is kept, the connection sending the other one is reset
+   * and the receiver drops the partial block
+   */
+  bool speculative_duplicates{false};
+
+  /// Smallest piece a tail block is split in and smallest block copied, in KB
+  int64_t min_split_block_kbytes{1024};
+
+  /**
+   * Number of buffers (of buffer_size each) written behind by a background
+   * writer thread for every receiver thread, so that socket reads continue
+   * while the disk is busy. 0 disables write behind. Not used for blocks
+   * received straight to the file, delta encoded or compressed blocks
+   */
+  int write_behind_buffers{0};
+
+  /**
+   * If true, the receiver moves block data from the socket to the files
+   * through a pipe with splice(2) instead of copying it through its buffer.
+   * With enable_checksum, the data is also tee'd into a second pipe and read
+   * once for the checksum. Not used if the io_uring engine is, or for direct
+   * i/o, delta encoded or compressed blocks
+   */
+  bool enable_splice_receive{false};
+
+  /**
+   * Number of multi block files the receiver keeps open between blocks,
+   * shared by all its threads, instead of opening the file for every block.
+   * Files are closed once completely written, or least recently used first.
+   * 0 disables the cache. Not used with direct i/o
+   */
+  int receiver_fd_cache_size{0};
+
+  /**
+   * Number of multi block files the sender keeps open between blocks, shared
+   * by all the sender threads of the process. Their size is checked once
+   * when opened. Files are closed once completely read, least recently used
+   * first, or at the end of the transfer. 0 disables the cache. Not used with
+   * direct i/o
+   */
+  int sender_fd_cache_size{0};
+
+  /**
+   * With download resumption, interval in milliseconds at which completed
+   * blocks are made durable as a group instead of fsyncing every block: the
+   * files touched by the blocks of all the threads are synced in parallel and
+   * the blocks are recorded by a single (synced) transfer log write. Replaces
+   * transfer_log_write_interval_ms then. 0 fsyncs every block
+   */
+  int durability_commit_interval_ms{0};
+
   /**
    * Since this is a singleton copy constructor
    * and assignment operator are deleted
@@ -0,0 +1,103 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#include "WriteBehindPipeline.h"
+
+#include <glog/logging.h>
+
+namespace facebook {
+namespace wdt {
+
+WriteBehindPipeline::WriteBehindPipeline(int numBuffers, int64_t bufferSize)
+    : numBuffers_(numBuffers), bufferSize_(bufferSize), slots_(numBuffers) {
+  WDT_CHECK(numBuffers_ >= 2) << "write behind needs at least 2 buffers "
+                              << numBuffers_;
+  for (int i = 0; i < numBuffers_; i++) {
+    slots_[i].data.reset(new char[bufferSize_]);
+  }
+  writerThread_ = std::thread(&WriteBehindPipeline::writeLoop, this);
+}
+
+WriteBehindPipeline::~WriteBehindPipeline() {
+  if (writerThread_.joinable()) {
+    stop();
+  }
+}
+
+char *WriteBehindPipeline::getBuffer() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  // the slot at tail_ is free as long as the ring is not full
+  producerCondition_.wait(lock, [this] { return numQueued_ < numBuffers_; });
+  return slots_[tail_].data.get();
+}
+
+ErrorCode WriteBehindPipeline::submit(Writer *writer, int64_t size) {
+  WDT_CHECK(size <= bufferSize_) << "submitted " << size << " bytes, buffer "
+                                 << "size " << bufferSize_;
+  ErrorCode code;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    WDT_CHECK(numQueued_ < numBuffers_) << "submit without a free buffer";
+    Slot &slot = slots_[tail_];
+    slot.writer = writer;
+    slot.size = size;
+    tail_ = (tail_ + 1) % numBuffers_;
+    numQueued_++;
+    code = error_;
+  }
+  writerCondition_.notify_one();
+  return code;
+}
+
+ErrorCode WriteBehindPipeline::drain() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  producerCondition_.wait(lock, [this] { return numQueued_ == 0; });
+  ErrorCode code = error_;
+  error_ = OK;
+  return code;
+}
+
+PerfStatReport WriteBehindPipeline::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    finished_ = true;
+  }
+  writerCondition_.notify_one();
+  writerThread_.join();
+  return perfReport_;
+}
+
+void WriteBehindPipeline::writeLoop() {
+  INIT_PERF_STAT_REPORT
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    writerCondition_.wait(lock,
+                          [this] { return finished_ || numQueued_ > 0; });
+    if (numQueued_ == 0) {
+      // finished and everything queued is written
+      break;
+    }
+    Slot &slot = slots_[head_];
+    const bool skip = (error_ != OK);
+    lock.unlock();
+
+    // after a failure the rest of the block is discarded, it is resent anyway
+    ErrorCode code = skip ? OK : slot.writer->write(slot.data.get(), slot.size);
+
+    lock.lock();
+    if (code != OK && error_ == OK) {
+      error_ = code;
+    }
+    head_ = (head_ + 1) % numBuffers_;
+    numQueued_--;
+    producerCondition_.notify_one();
+  }
+  perfReport_ = *perfStatReport;
+}
+}
+}
@@ -0,0 +1,125 @@
+/**
+ * Copyright (c) 2014-present, Facebook, Inc.
+ * All rights reserved.
+ *
+ * This source code is licensed under the BSD-style license found in the
+ * LICENSE file in the root directory of this source tree. An additional grant
+ * of patent rights can be found in the PATENTS file in the same directory.
+ */
+#pragma once
+
+#include "ErrorCodes.h"
+#include "Reporting.h"
+#include "Writer.h"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace facebook {
+namespace wdt {
+
+/**
+ * Writes received data behind its producer using a background writer thread
+ * and a bounded ring of buffers, so that a receiver thread can keep reading
+ * from its socket while the disk is busy. The producer fills the buffer
+ * returned by getBuffer() and hands it over with submit(); buffers are written
+ * in submission order. All methods must be called from the same (producer)
+ * thread.
+ */
+class WriteBehindPipeline {
+ public:
+  /**
+   * @param numBuffers    number of buffers in the ring, must be at least 2:
+   *                      one is filled while others are being written
+   * @param bufferSize    size of each buffer
+   */
+  WriteBehindPipeline(int numBuffers, int64_t bufferSize);
+
+  /// waits for queued writes and joins the writer thread
+  ~WriteBehindPipeline();
+
+  /**
+   * Returns the next buffer to fill, waiting for the writer to free it if the
+   * ring is full. The same buffer is returned till it is submitted.
+   *
+   * @return          buffer of getBufferSize() bytes
+   */
+  char *getBuffer();
+
+  /**
+   * Queues the buffer returned by getBuffer() to be written. Writers of
+   * queued buffers must stay valid till drain() returns.
+   *
+   * @param writer    writer of the block the data belongs to
+   * @param size      number of bytes filled in the buffer
+   *
+   * @return          error of a previous write, OK if none failed so far.
+   *                  Once a write fails, the following ones are skipped
+   */
+  ErrorCode submit(Writer *writer, int64_t size);
+
+  /**
+   * Waits for all queued buffers to be written.
+   *
+   * @return          error of the first failed write since the last drain(),
+   *                  OK if all succeeded
+   */
+  ErrorCode drain();
+
+  /**
+   * Waits for queued writes and stops the writer thread. The pipeline can not
+   * be used afterwards.
+   *
+   * @return          perf stats of the writes done by the writer thread
+   */
+  PerfStatReport stop();
+
+  /// @return   number of buffers
+  int getNumBuffers() const {
+    return numBuffers_;
+  }
+
+  /// @return   size of each buffer
+  int64_t getBufferSize() const {
+    return bufferSize_;
+  }
+
+ private:
+  struct Slot {
+    std::unique_ptr<char[]> data;
+    /// writer of the data
+    Writer *writer{nullptr};
+    /// bytes to write
+    int64_t size{0};
+  };
+
+  /// entry point of the writer thread
+  void writeLoop();
+
+  const int numBuffers_;
+  const int64_t bufferSize_;
+  std::vector<Slot> slots_;
+  /// index of the next slot to write, only changed by the writer thread
+  int head_{0};
+  /// index of the next slot to fill, only changed by the producer thread
+  int tail_{0};
+  /// number of queued slots, including the one being written
+  int numQueued_{0};
+  /// error of the first failed write since the last drain()
+  ErrorCode error_{OK};
+  /// whether the writer thread should exit
+  bool finished_{false};
+  /// perf stats of the writer thread, set when it exits
+  PerfStatReport perfReport_;
+  std::mutex mutex_;
+  /// signalled when a slot is queued
+  std::condition_variable writerCondition_;
+  /// signalled when a slot is written
+  std::condition_variable producerCondition_;
+  std::thread writerThread_;
+};
+}
+}
@@ -108,6 +108,14 @@ void cancelAbort() {
   abortCondVar.notify_one();
 }
 
+/// sender of a continuous sync, SIGINT and SIGTERM end it gracefully
+Sender *syncSender = nullptr;
+
+void stopSync(int /* signal */) {
+  // only sets an atomic flag
+  syncSender->stopSync();
+}
+
 int main(int argc, char *argv[]) {
   FLAGS_logtostderr = true;
   // Ugliness in gflags' api; to be able to use program name
@@ -195,18 +203,29 @@ int main(int argc, char *argv[]) {
       }
     }
     req.hostName = FLAGS_destination;
+    // receiver's directory, from its url
+    std::string destDirectory;
     if (!FLAGS_connection_url.empty()) {
       LOG(INFO) << "Input url: " << FLAGS_connection_url;
       // TODO: merge instead
       req = WdtTransferRequest(FLAGS_connection_url);
+      destDirectory = req.directory;
       req.directory = FLAGS_directory;  // re-set it for now
     }
     Sender sender(req);
+    if (!destDirectory.empty()) {
+      sender.setDestinationDirectory(destDirectory);
+    }
     WdtTransferRequest processedRequest = sender.init();
     LOG(INFO) << "Starting sender with details "
               << processedRequest.generateUrl(true);
     ADDITIONAL_SENDER_SETUP
     setUpAbort(sender);
+    if (WdtOptions::get().continuous_sync) {
+      syncSender = &sender;
+      signal(SIGINT, stopSync);
+      signal(SIGTERM, stopSync);
+    }
     sender.setIncludeRegex(FLAGS_include_regex);
     sender.setExcludeRegex(FLAGS_exclude_regex);
     sender.setPruneDirRegex(FLAGS_prune_dir_regex);
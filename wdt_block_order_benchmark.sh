@@ -0,0 +1,87 @@
+#! /bin/bash
+
+# Compares the default block order (largest first) with the on disk order
+# (-physical_block_order) on files fragmented by concurrent appends, so that
+# the sender seeks a lot. Meant for hard drives: the source directory must
+# be on a real disk (not /dev/shm) and the page cache is dropped before each
+# run when possible (needs root).
+# Usage: wdt_block_order_benchmark.sh [path to wdt binary] [base dir]
+
+echo "Run from the cmake build dir (or ~/fbcode - or fbmake runtests)"
+
+if [ -z "$1" ]; then
+  WDT="_bin/wdt/wdt"
+else
+  WDT="$1"
+fi
+WDTBIN_OPTS="-minloglevel=0 -num_ports=8 -block_size_mbytes=1 \
+  -enable_perf_stat_collection"
+WDTBIN="$WDT $WDTBIN_OPTS"
+if [ -z "$NUM_FILES" ]; then
+  NUM_FILES=16
+fi
+if [ -z "$NUM_APPENDS" ]; then
+  NUM_APPENDS=64
+fi
+
+if [ -z "$2" ]; then
+  BASEDIR=/var/tmp/tmpWDT
+else
+  BASEDIR="$2"
+fi
+mkdir -p $BASEDIR
+DIR=`mktemp -d --tmpdir=$BASEDIR`
+echo "Testing in $DIR"
+
+# the files are appended to in turn, 1MB at a time and synced, so that their
+# blocks end up interleaved on disk
+mkdir -p $DIR/src
+for ((j = 1; j <= NUM_APPENDS; j++))
+do
+  for ((i = 1; i <= NUM_FILES; i++))
+  do
+    dd if=/dev/urandom of=$DIR/src/f$i bs=1M count=1 oflag=append \
+      conv=notrunc,fsync 2> /dev/null
+  done
+done
+sync
+if which filefrag > /dev/null; then
+  filefrag $DIR/src/f1
+fi
+echo "done with setup"
+
+drop_caches() {
+  sync
+  if [ -w /proc/sys/vm/drop_caches ]; then
+    echo 3 > /proc/sys/vm/drop_caches
+  else
+    echo "Can't drop the page cache, results are from memory"
+  fi
+}
+
+run() {
+  NAME=$1
+  shift
+  drop_caches
+  CMD="$WDTBIN $@ -directory $DIR/dst_$NAME 2> $DIR/server_$NAME.log | \
+      head -1 | xargs -I URL /usr/bin/time -f 'CLIENT_PROFILE %U %S %e' \
+      $WDTBIN $@ -directory $DIR/src -connection_url URL > \
+      $DIR/client_$NAME.log 2>&1"
+  echo "$NAME: $CMD"
+  eval $CMD
+  THROUGHPUT=`awk 'match($0, /.*Total sender throughput = ([0-9.]+)/, res) \
+  {print res[1]} END {}' $DIR/client_$NAME.log`
+  PROFILE=`grep CLIENT_PROFILE $DIR/client_$NAME.log`
+  echo "$NAME THROUGHPUT $THROUGHPUT $PROFILE"
+  grep -E "^File" $DIR/client_$NAME.log | \
+    sed -e "s/^/$NAME sender   /" | cut -c1-120
+  rm -rf $DIR/dst_$NAME
+}
+
+for physical in false true
+do
+  run physical_order_$physical -physical_block_order=$physical
+done
+
+echo "Deleting $DIR"
+rm -rf $DIR
@@ -0,0 +1,61 @@
+#! /bin/bash
+
+# Directory discovery speed on a large synthetic tree (5M empty files by
+# default), for a few numbers of discovery threads. The receiver skips writes
+# and the sender discovers the whole tree before sending (-two_phases), so the
+# reported dir entries/sec is the speed of the walk alone.
+# Usage: wdt_discovery_benchmark.sh [path to wdt binary]
+# Environment: NUM_FILES, FILES_PER_DIR, BASEDIR, and DROP_CACHES=1 (as root)
+# to walk a cold tree each time
+
+echo "Run from the cmake build dir (or ~/fbcode - or fbmake runtests)"
+
+if [ -z "$1" ]; then
+  WDT="_bin/wdt/wdt"
+else
+  WDT="$1"
+fi
+WDTBIN_OPTS="-minloglevel=0 -num_ports=8 -enable_checksum=false"
+WDTBIN="$WDT $WDTBIN_OPTS"
+if [ -z "$NUM_FILES" ]; then
+  NUM_FILES=5000000
+fi
+if [ -z "$FILES_PER_DIR" ]; then
+  FILES_PER_DIR=5000
+fi
+if [ -z "$BASEDIR" ]; then
+  BASEDIR=/tmp/wdtTest
+fi
+mkdir -p $BASEDIR
+DIR=`mktemp -d --tmpdir=$BASEDIR`
+echo "Testing in $DIR"
+
+# 2 levels of directories, FILES_PER_DIR files in each leaf
+NUM_DIRS=$(((NUM_FILES + FILES_PER_DIR - 1) / FILES_PER_DIR))
+for ((d = 0; d < NUM_DIRS; d++))
+do
+  LEAF=$DIR/src/d$((d / 100))/d$d
+  mkdir -p $LEAF
+  (cd $LEAF && seq -f "f%g" 1 $FILES_PER_DIR | xargs touch)
+done
+echo "done with setup, $((NUM_DIRS * FILES_PER_DIR)) files"
+
+for threads in 1 4 16
+do
+  if [ "$DROP_CACHES" = "1" ]; then
+    sync
+    echo 3 > /proc/sys/vm/drop_caches
+  fi
+  NAME=threads_$threads
+  $WDTBIN -skip_writes -directory $DIR/dst 2> $DIR/server_$NAME.log | \
+    head -1 | xargs -I URL $WDTBIN -two_phases \
+    -num_discovery_threads=$threads -directory $DIR/src \
+    -connection_url URL > $DIR/client_$NAME.log 2>&1
+  RATE=`sed -n 's/.*dirTime, \([0-9.e+-]*\) dir entries\/sec.*/\1/p' \
+    $DIR/client_$NAME.log`
+  DIRTIME=`sed -n 's/.*(\([0-9.e+-]*\) dirTime.*/\1/p' $DIR/client_$NAME.log`
+  echo "$NAME DIR_ENTRIES_PER_SEC $RATE DIR_TIME $DIRTIME"
+done
+
+echo "Deleting $DIR"
+rm -rf $DIR
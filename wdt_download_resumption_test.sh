@@ -60,23 +60,28 @@ usage="
 The possible options to this script are
 -s sender protocol version
 -r receiver protocol version
+-c durability commit interval in milliseconds (group commit), 0 to fsync
+   every block
 "
 
 #protocol versions, used to check version verification
 #version 0 represents default version
 SENDER_PROTOCOL_VERSION=0
 RECEIVER_PROTOCOL_VERSION=0
+DURABILITY_COMMIT_INTERVAL_MS=0
 
 if [ "$1" == "-h" ]; then
   echo "$usage"
   exit 0
 fi
-while getopts ":s:r:" opt; do
+while getopts ":s:r:c:" opt; do
   case $opt in
     s) SENDER_PROTOCOL_VERSION="$OPTARG"
     ;;
     r) RECEIVER_PROTOCOL_VERSION="$OPTARG"
     ;;
+    c) DURABILITY_COMMIT_INTERVAL_MS="$OPTARG"
+    ;;
     h) echo "$usage"
        exit
     ;;
@@ -86,7 +91,8 @@ while getopts ":s:r:" opt; do
 done
 
 echo "sender protocol version $SENDER_PROTOCOL_VERSION, receiver protocol \
-version $RECEIVER_PROTOCOL_VERSION"
+version $RECEIVER_PROTOCOL_VERSION, durability commit interval \
+$DURABILITY_COMMIT_INTERVAL_MS ms"
 
 threads=4
 STARTING_PORT=22500
@@ -99,7 +105,8 @@ RECEIVER_ID="123456"
 WDTBIN_OPTS="-ipv4 -num_ports=$threads \
 -avg_mbytes_per_sec=40 -max_mbytes_per_sec=50 -run_as_daemon=false \
 -full_reporting -read_timeout_millis=500 -write_timeout_millis=500 \
--enable_download_resumption -keep_transfer_log=false"
+-enable_download_resumption -keep_transfer_log=false \
+-durability_commit_interval_ms=$DURABILITY_COMMIT_INTERVAL_MS"
 WDTBIN="_bin/wdt/wdt $WDTBIN_OPTS"
 WDTBIN_CLIENT="$WDTBIN -recovery_id=abcdef"
 WDTBIN_SERVER=$WDTBIN
@@ -0,0 +1,67 @@
+#! /bin/bash
+
+# Side by side comparison of the i/o engines: regular read/write system calls,
+# zero copy (sendfile) and io_uring. Uses a mix of many small files and
+# a few large ones, so the per syscall overhead shows.
+# Usage: wdt_io_engine_benchmark.sh [path to wdt binary]
+
+echo "Run from the cmake build dir (or ~/fbcode - or fbmake runtests)"
+
+if [ -z "$1" ]; then
+  WDT="_bin/wdt/wdt"
+else
+  WDT="$1"
+fi
+WDTBIN_OPTS="-minloglevel=0 -num_ports=4 -enable_perf_stat_collection"
+WDTBIN="$WDT $WDTBIN_OPTS"
+if [ -z "$NUM_SMALL_FILES" ]; then
+  NUM_SMALL_FILES=10000
+fi
+
+BASEDIR=/dev/shm/tmpWDT
+mkdir -p $BASEDIR
+DIR=`mktemp -d --tmpdir=$BASEDIR`
+echo "Testing in $DIR"
+
+mkdir -p $DIR/src/small
+for ((i = 1; i <= NUM_SMALL_FILES; i++))
+do
+  head -c 4096 /dev/urandom > $DIR/src/small/f$i
+done
+for size in 16M 256M
+do
+  dd if=/dev/urandom of=$DIR/src/inp$size bs=$size count=1
+done
+echo "done with setup"
+
+run() {
+  NAME=$1
+  shift
+  CMD="$WDTBIN $@ -directory $DIR/dst_$NAME 2> $DIR/server_$NAME.log | \
+      head -1 | xargs -I URL /usr/bin/time -f 'CLIENT_PROFILE %U %S %e' \
+      $WDTBIN $@ -directory $DIR/src -connection_url URL > \
+      $DIR/client_$NAME.log 2>&1"
+  echo "$NAME: $CMD"
+  eval $CMD
+  THROUGHPUT=`awk 'match($0, /.*Total sender throughput = ([0-9.]+)/, res) \
+  {print res[1]} END {}' $DIR/client_$NAME.log`
+  PROFILE=`grep CLIENT_PROFILE $DIR/client_$NAME.log`
+  echo "$NAME THROUGHPUT $THROUGHPUT $PROFILE"
+  grep -E "^(Socket|File|Io Uring)" $DIR/client_$NAME.log | \
+    sed -e "s/^/$NAME sender   /" | cut -c1-120
+  grep -E "^(Socket|File|Io Uring)" $DIR/server_$NAME.log | \
+    sed -e "s/^/$NAME receiver /" | cut -c1-120
+  rm -rf $DIR/dst_$NAME
+}
+
+for checksum in true false
+do
+  run sync_checksum_$checksum -enable_checksum=$checksum
+  run zerocopy_checksum_$checksum -enable_checksum=$checksum \
+    -enable_zero_copy_send
+  run io_uring_checksum_$checksum -enable_checksum=$checksum \
+    -enable_io_uring
+done
+
+echo "Deleting $DIR"
+rm -rf $DIR
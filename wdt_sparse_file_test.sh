@@ -0,0 +1,81 @@
+#! /bin/bash
+
+#
+# Sends sparse files over existing destination files, to a receiver
+# supporting sparse files and to one older than the sparse protocol version
+# (which must get the holes as zeros)
+#
+
+echo "Run from the cmake build dir (or ~/fbcode - or fbmake runtests)"
+
+WDTBIN_OPTS="-minloglevel=0 -sleep_millis 1 -max_retries 999 -full_reporting "\
+"-num_ports=4 -enable_checksum=true -block_size_mbytes=1"
+WDTBIN="_bin/wdt/wdt $WDTBIN_OPTS"
+# last protocol version without sparse files
+OLD_PROTOCOL_VERSION=19
+MD5SUM=`which md5sum`
+STATUS=$?
+if [ $STATUS -ne 0 ] ; then
+  MD5SUM=`which md5`
+fi
+
+BASEDIR=/tmp/wdtTest
+mkdir -p $BASEDIR
+DIR=`mktemp -d $BASEDIR/XXXXXX`
+echo "Testing in $DIR"
+
+mkdir $DIR/src
+# data at the start, in the middle and at the end, holes in between
+for i in {1..4}
+do
+  truncate -s 8M $DIR/src/sparse$i
+  dd if=/dev/urandom of=$DIR/src/sparse$i bs=65536 count=3 conv=notrunc
+  dd if=/dev/urandom of=$DIR/src/sparse$i bs=65536 count=5 seek=50 \
+    conv=notrunc
+  dd if=/dev/urandom of=$DIR/src/sparse$i bs=65536 count=1 seek=127 \
+    conv=notrunc
+done
+# no data at all
+truncate -s 4M $DIR/src/empty
+
+for version in 0 $OLD_PROTOCOL_VERSION
+do
+  DST=$DIR/dst$version
+  mkdir $DST
+  # existing destination files full of data, which must not show through
+  # the holes
+  for file in `ls $DIR/src`
+  do
+    dd if=/dev/urandom of=$DST/$file bs=1048576 count=8
+  done
+  CMD="$WDTBIN -directory $DST -protocol_version=$version \
+    2> $DIR/server$version.log | head -1 | xargs -I URL $WDTBIN \
+    -enable_sparse_files -directory $DIR/src -connection_url URL 2>&1 | \
+    tee $DIR/client$version.log"
+  echo "Transfer with receiver protocol version $version: $CMD"
+  eval $CMD
+done
+
+(cd $DIR/src ; ( find . -type f -print0 | xargs -0 $MD5SUM | sort ) \
+    > ../src.md5s )
+STATUS=0
+for version in 0 $OLD_PROTOCOL_VERSION
+do
+  (cd $DIR/dst$version ; ( find . -type f -print0 | xargs -0 $MD5SUM | \
+      sort ) > ../dst$version.md5s )
+  echo "Should be no diff for receiver protocol version $version"
+  (cd $DIR; diff -u src.md5s dst$version.md5s)
+  CUR_STATUS=$?
+  if [ $STATUS -eq 0 ] ; then
+    STATUS=$CUR_STATUS
+  fi
+done
+
+if [ $STATUS -eq 0 ] ; then
+  echo "Good run, deleting logs in $DIR"
+  rm -rf $DIR
+else
+  echo "Bad run ($STATUS) - keeping full logs and partial transfer in $DIR"
+fi
+
+exit $STATUS